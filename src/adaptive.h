@@ -0,0 +1,239 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "IlmBase/Half/half.h"
+
+#include "resampler.h"
+#include "threadpool.h"
+
+// Variance-adaptive filtering. Where the input is nearly constant, the filtered
+// resamplers give the same result as a bilinear lookup at a fraction of the taps. The
+// input is split into blocks of kVariationBlockSize texels, and a block counts as flat
+// if no channel of its texels varies by more than ResampleSettings::adaptiveTolerance
+// times its magnitude. Output pixels whose filter footprint only covers flat blocks are
+// resampled bilinearly, all others with the full filter kernel. Since both results lie
+// within the range of the footprint, up to the negative lobes of the filter, they
+// differ by about the tolerance times the magnitude of the input at most.
+
+// Side length in texels of the blocks the variation of the input is measured on.
+const int kVariationBlockSize = 8;
+
+// Which output pixels take the full filter kernel. Built per input image by
+// buildKernelMask.
+struct KernelMask {
+    int width = 0;
+    int height = 0;
+    // one flag per output pixel, row by row.
+    std::vector<uint8_t> fullKernel;
+    uint64_t numFullKernelPixels = 0;
+    uint64_t numBilinearPixels = 0;
+};
+
+// Returns true if no channel of the texels varies by more than tolerance times its
+// magnitude. NaNs and infinities never count as flat.
+template <class InputT>
+bool isFlatBlock(const InputT* input, int numChannels, int width, int xBegin, int xEnd, int yBegin, int yEnd,
+                 float tolerance) {
+    const size_t stride = size_t(width) * numChannels;
+    for (int c = 0; c < numChannels; c++) {
+        float low = float(input[yBegin * stride + size_t(xBegin) * numChannels + c]);
+        float high = low;
+        for (int y = yBegin; y < yEnd; y++) {
+            const InputT* row = input + y * stride;
+            for (int x = xBegin; x < xEnd; x++) {
+                const float value = float(row[size_t(x) * numChannels + c]);
+                low = std::min(low, value);
+                high = std::max(high, value);
+            }
+        }
+        if (!(high - low <= tolerance * std::max(std::abs(low), std::abs(high))))
+            return false;
+    }
+    return true;
+}
+
+// Wraps the full and the bilinear resampler of a filtered resampling and picks one of
+// them per output pixel as given by a KernelMask. Unlike all other resamplers, its
+// taps depend on the input image the mask was built from.
+template <class FullResampler, class CheapResampler>
+class AdaptiveResampler {
+ public:
+  AdaptiveResampler(const FullResampler& full, const CheapResampler& bilinear,
+                    std::shared_ptr<const KernelMask> mask)
+      : full_(full), bilinear_(bilinear), mask_(std::move(mask)) {}
+
+  int inputWidth() const { return full_.inputWidth(); }
+  int inputHeight() const { return full_.inputHeight(); }
+  int outputWidth() const { return full_.outputWidth(); }
+  int outputHeight() const { return full_.outputHeight(); }
+
+  int sampleCount() const { return full_.sampleCount(); }
+
+  template <typename TapFunc>
+  void operator()(int x, int y, TapFunc&& tap) const {
+    if (mask_->fullKernel[size_t(y) * mask_->width + x])
+      full_(x, y, tap);
+    else
+      bilinear_(x, y, tap);
+  }
+
+ private:
+  FullResampler full_;
+  CheapResampler bilinear_;
+  std::shared_ptr<const KernelMask> mask_;
+};
+
+// The bilinear resampler of the same direction as a filtered resampler, void for all
+// other resamplers.
+template <class Resampler>
+struct BilinearCounterpart { typedef void type; };
+template <class FilterType>
+struct BilinearCounterpart<FilteredResampler<FilterType>> { typedef BilinearResampler type; };
+template <class FilterType>
+struct BilinearCounterpart<CubeMapFilteredResampler<FilterType>> { typedef CubeMapBilinearResampler type; };
+
+// Same as withResampler, but if kernelMask is set, filtered resamplers are wrapped in an
+// AdaptiveResampler that follows the mask. Tiled input is not supported with a mask.
+template <typename Func>
+void withResampler(const ResampleSettings& settings, int faceSize, int octMapSize,
+                   std::shared_ptr<const KernelMask> kernelMask, Func&& func) {
+    if (!kernelMask) {
+        withResampler(settings, faceSize, octMapSize, func);
+        return;
+    }
+    withRowMajorResampler(settings, faceSize, octMapSize, [&](const auto& resampler) {
+        typedef std::decay_t<decltype(resampler)> Resampler;
+        typedef typename BilinearCounterpart<Resampler>::type Bilinear;
+        if constexpr (std::is_void_v<Bilinear>) {
+            func(resampler);
+        } else {
+            func(AdaptiveResampler<Resampler, Bilinear>(resampler, Bilinear{faceSize, octMapSize}, kernelMask));
+        }
+    });
+}
+
+// Builds the kernel mask of settings for an input image of numChannels interleaved
+// channels, stored packed row by row as half or float. faceSize and octMapSize are
+// the sizes of the cubemap and the octmap as for withResampler.
+template <class InputT>
+std::shared_ptr<const KernelMask> buildKernelMask(
+    const InputT* input,
+    int numChannels,
+    const ResampleSettings& settings,
+    int faceSize,
+    int octMapSize,
+    ThreadPool& threadPool)
+{
+    const bool toCubeMap = settings.direction == OCTMAP_TO_CUBEMAP;
+    const int width = toCubeMap ? octMapSize : 6 * faceSize;
+    const int height = toCubeMap ? octMapSize : faceSize;
+    // taps do not continue across the edges of a segment in the input, the cube faces
+    // or the octmap as a whole.
+    const int segmentWidth = toCubeMap ? octMapSize : faceSize;
+    const int numBlocksX = (width + kVariationBlockSize - 1) / kVariationBlockSize;
+    const int numBlocksY = (height + kVariationBlockSize - 1) / kVariationBlockSize;
+    const float tolerance = settings.adaptiveTolerance;
+
+    std::vector<uint8_t> flat(size_t(numBlocksX) * numBlocksY);
+    threadPool.ParallelFor(0, numBlocksY, 1, [&](int blockYBegin, int blockYEnd) {
+        for (int by = blockYBegin; by < blockYEnd; by++) {
+            const int yBegin = by * kVariationBlockSize;
+            const int yEnd = std::min(height, yBegin + kVariationBlockSize);
+            for (int bx = 0; bx < numBlocksX; bx++) {
+                const int xBegin = bx * kVariationBlockSize;
+                const int xEnd = std::min(width, xBegin + kVariationBlockSize);
+                flat[size_t(by) * numBlocksX + bx] =
+                    isFlatBlock(input, numChannels, width, xBegin, xEnd, yBegin, yEnd, tolerance);
+            }
+        }
+    });
+
+    // a block is usable if all blocks within the reach of the filter are flat and the
+    // reach stays within its segment, so that no tap can wrap to elsewhere.
+    const int reach = filterReach(settings, faceSize, octMapSize);
+    const int reachBlocks = (reach + kVariationBlockSize - 1) / kVariationBlockSize;
+    std::vector<uint8_t> usable(flat.size());
+    threadPool.ParallelFor(0, numBlocksY, 8, [&](int blockYBegin, int blockYEnd) {
+        for (int by = blockYBegin; by < blockYEnd; by++) {
+            const int yBegin = by * kVariationBlockSize;
+            const int yEnd = std::min(height, yBegin + kVariationBlockSize);
+            if (yBegin - reach < 0 || yEnd + reach > height)
+                continue;
+            for (int bx = 0; bx < numBlocksX; bx++) {
+                const int xBegin = bx * kVariationBlockSize;
+                const int xEnd = std::min(width, xBegin + kVariationBlockSize);
+                const int segmentBegin = xBegin / segmentWidth * segmentWidth;
+                if (xBegin - reach < segmentBegin || xEnd + reach > segmentBegin + segmentWidth)
+                    continue;
+                bool allFlat = true;
+                for (int ny = by - reachBlocks; ny <= by + reachBlocks && allFlat; ny++) {
+                    for (int nx = bx - reachBlocks; nx <= bx + reachBlocks && allFlat; nx++) {
+                        allFlat = flat[size_t(ny) * numBlocksX + nx] != 0;
+                    }
+                }
+                usable[size_t(by) * numBlocksX + bx] = allFlat;
+            }
+        }
+    });
+
+    // an output pixel is resampled bilinearly if all of its bilinear taps are in usable
+    // blocks.
+    auto mask = std::make_shared<KernelMask>();
+    withRowMajorResampler(settings, faceSize, octMapSize, [&](const auto& resampler) {
+        typedef typename BilinearCounterpart<std::decay_t<decltype(resampler)>>::type Bilinear;
+        mask->width = resampler.outputWidth();
+        mask->height = resampler.outputHeight();
+        mask->fullKernel.assign(size_t(mask->width) * mask->height, 1);
+        if constexpr (!std::is_void_v<Bilinear>) {
+            const Bilinear bilinear{faceSize, octMapSize};
+            std::atomic<uint64_t> numBilinearPixels(0);
+            threadPool.ParallelFor(0, mask->height, 8, [&](int yBegin, int yEnd) {
+                uint64_t numPixels = 0;
+                for (int y = yBegin; y < yEnd; y++) {
+                    uint8_t* row = mask->fullKernel.data() + size_t(y) * mask->width;
+                    for (int x = 0; x < mask->width; x++) {
+                        bool full = false;
+                        bilinear(x, y, [&](int inputPixX, int inputPixY, float) {
+                            full = full || !usable[size_t(inputPixY / kVariationBlockSize) * numBlocksX +
+                                                   inputPixX / kVariationBlockSize];
+                        });
+                        row[x] = full;
+                        numPixels += !full;
+                    }
+                }
+                numBilinearPixels += numPixels;
+            });
+            mask->numBilinearPixels = numBilinearPixels;
+        }
+        mask->numFullKernelPixels = mask->fullKernel.size() - mask->numBilinearPixels;
+    });
+    return mask;
+}
+
+inline std::shared_ptr<const KernelMask> buildKernelMask(
+    const void* input,
+    bool halfInput,
+    int numChannels,
+    const ResampleSettings& settings,
+    int faceSize,
+    int octMapSize,
+    ThreadPool& threadPool)
+{
+    if (halfInput)
+        return buildKernelMask(static_cast<const half*>(input), numChannels, settings, faceSize, octMapSize, threadPool);
+    return buildKernelMask(static_cast<const float*>(input), numChannels, settings, faceSize, octMapSize, threadPool);
+}
+
+#endif  // ADAPTIVE_H
@@ -0,0 +1,214 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "adaptive.h"
+#include "convert.h"
+#include "octmap.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kFaceSize = 64;
+const int kOctMapSize = 64;
+const int kNumChannels = 3;
+
+// An image that is flat within a few percent, with slight waves, except for a small
+// disk that is 50 times brighter. The channels differ by a constant factor.
+std::vector<float> testImage(int width, int height, float diskX, float diskY) {
+  std::vector<float> image(size_t(width) * height * kNumChannels);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const float dx = x - diskX;
+      const float dy = y - diskY;
+      const float value = dx * dx + dy * dy < 9.0f ? 50.0f : 1.0f + 0.01f * std::sin(0.2f * x) * std::cos(0.3f * y);
+      for (int c = 0; c < kNumChannels; c++)
+        image[(size_t(y) * width + x) * kNumChannels + c] = value * (c + 1);
+    }
+  }
+  return image;
+}
+
+// Resamples input with the resampler withResampler picks for kernelMask, the full
+// kernel if it is null.
+std::vector<float> resample(const std::vector<float>& input, const ResampleSettings& settings,
+                            std::shared_ptr<const KernelMask> kernelMask) {
+  std::vector<float> output;
+  withResampler(settings, kFaceSize, kOctMapSize, kernelMask, [&](const auto& resampler) {
+    const int inputWidth = resampler.inputWidth();
+    const int outputWidth = resampler.outputWidth();
+    output.assign(size_t(outputWidth) * resampler.outputHeight() * kNumChannels, 0.0f);
+    for (int y = 0; y < resampler.outputHeight(); y++) {
+      for (int x = 0; x < outputWidth; x++) {
+        float* pixel = &output[(size_t(y) * outputWidth + x) * kNumChannels];
+        resampler(x, y, [&](int inputPixX, int inputPixY, float weight) {
+          const float* texel = &input[(size_t(inputPixY) * inputWidth + inputPixX) * kNumChannels];
+          for (int c = 0; c < kNumChannels; c++)
+            pixel[c] += weight * texel[c];
+        });
+      }
+    }
+  });
+  return output;
+}
+
+struct AdaptiveCase {
+  ResampleType type;
+  MappingDirection direction;
+};
+
+class AdaptiveResamplerTest : public ::testing::TestWithParam<AdaptiveCase> {};
+
+TEST_P(AdaptiveResamplerTest, StaysWithinToleranceOfFullKernel) {
+  ThreadPool threadPool(4);
+  ResampleSettings full;
+  full.type = GetParam().type;
+  full.direction = GetParam().direction;
+  ResampleSettings adaptive = full;
+  adaptive.adaptiveTolerance = 0.05f;
+
+  const bool toCubeMap = full.direction == OCTMAP_TO_CUBEMAP;
+  const int width = toCubeMap ? kOctMapSize : 6 * kFaceSize;
+  const int height = toCubeMap ? kOctMapSize : kFaceSize;
+  // the disk lies on the top face, or in the middle of the octmap.
+  const std::vector<float> input =
+      testImage(width, height, toCubeMap ? 0.5f * kOctMapSize : 2.5f * kFaceSize, 0.5f * height);
+
+  std::shared_ptr<const KernelMask> mask =
+      buildKernelMask(input.data(), kNumChannels, adaptive, kFaceSize, kOctMapSize, threadPool);
+  const std::vector<float> fullOutput = resample(input, full, nullptr);
+  const std::vector<float> adaptiveOutput = resample(input, adaptive, mask);
+  ASSERT_EQ(adaptiveOutput.size(), fullOutput.size());
+  ASSERT_EQ(mask->fullKernel.size() * kNumChannels, fullOutput.size());
+
+  EXPECT_EQ(mask->numFullKernelPixels + mask->numBilinearPixels, uint64_t(mask->width) * mask->height);
+  // both paths are taken, around the disk and on the flat sky.
+  EXPECT_GT(mask->numFullKernelPixels, 0u);
+  EXPECT_GT(mask->numBilinearPixels, 0u);
+
+  for (size_t i = 0; i < mask->fullKernel.size(); i++) {
+    for (int c = 0; c < kNumChannels; c++) {
+      const size_t index = i * kNumChannels + c;
+      if (mask->fullKernel[i]) {
+        EXPECT_EQ(adaptiveOutput[index], fullOutput[index]) << "pixel " << i << " channel " << c;
+      } else {
+        EXPECT_LE(std::abs(adaptiveOutput[index] - fullOutput[index]),
+                  adaptive.adaptiveTolerance * std::abs(fullOutput[index]))
+            << "pixel " << i << " channel " << c;
+      }
+    }
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    FilteredResamplers, AdaptiveResamplerTest,
+    ::testing::Values(AdaptiveCase{ MITCHELL, CUBEMAP_TO_OCTMAP }, AdaptiveCase{ GAUSSIAN, CUBEMAP_TO_OCTMAP },
+                      AdaptiveCase{ MITCHELL, OCTMAP_TO_CUBEMAP }, AdaptiveCase{ GAUSSIAN, OCTMAP_TO_CUBEMAP }));
+
+TEST(KernelMaskTest, TakesFullKernelOnVaryingInput) {
+  ThreadPool threadPool(2);
+  ResampleSettings adaptive;
+  adaptive.adaptiveTolerance = 0.05f;
+  // a checkerboard varies in every block.
+  std::vector<float> input(size_t(6) * kFaceSize * kFaceSize * kNumChannels);
+  for (size_t i = 0; i < input.size(); i++)
+    input[i] = (i / kNumChannels) % 2 ? 1.0f : 2.0f;
+  std::shared_ptr<const KernelMask> mask =
+      buildKernelMask(input.data(), kNumChannels, adaptive, kFaceSize, kOctMapSize, threadPool);
+  EXPECT_EQ(mask->numFullKernelPixels, uint64_t(kOctMapSize) * kOctMapSize);
+  EXPECT_EQ(mask->numBilinearPixels, 0u);
+}
+
+ImageBuffer floatBuffer(std::vector<float>* pixels, int width, int height) {
+  ImageBuffer buffer;
+  buffer.data = pixels->data();
+  buffer.width = width;
+  buffer.height = height;
+  buffer.numChannels = kNumChannels;
+  return buffer;
+}
+
+// Converts the strip the way a job of the server mode does, with the tables of
+// jobMatrixUse from the cache the converter shares with the other jobs.
+std::vector<float> convertAsJob(OctMapConverter& converter, const std::vector<float>& strip,
+                                const ConversionSettings& settings, ConversionTables* tables) {
+  std::vector<float> input = strip;
+  std::vector<float> output(size_t(kOctMapSize) * kOctMapSize * kNumChannels);
+  const ImageBuffer inputBuffer = floatBuffer(&input, 6 * kFaceSize, kFaceSize);
+  *tables = converter.PrepareTables(inputBuffer, settings.resample, kFaceSize, kOctMapSize,
+                                    jobMatrixUse(false, false));
+  converter.Convert(inputBuffer, floatBuffer(&output, kOctMapSize, kOctMapSize), settings, tables->matrix,
+                    tables->kernelMask);
+  return output;
+}
+
+float largestRelativeDifference(const std::vector<float>& a, const std::vector<float>& b) {
+  float difference = 0.0f;
+  for (size_t i = 0; i < a.size(); i++)
+    difference = std::max(difference, std::abs(a[i] - b[i]) / std::max(1.0f, std::abs(b[i])));
+  return difference;
+}
+
+TEST(AdaptiveJobTest, KeepsAdaptiveFilteringWithSharedMatrices) {
+  ThreadPool threadPool(4);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  const std::vector<float> strip = testImage(6 * kFaceSize, kFaceSize, 2.5f * kFaceSize, 0.5f * kFaceSize);
+  ConversionSettings full;
+  full.resample.type = MITCHELL;
+  ConversionSettings adaptive = full;
+  adaptive.resample.adaptiveTolerance = 0.05f;
+
+  // the full kernel job leaves its matrix in the cache before the adaptive job runs.
+  ConversionTables fullTables;
+  const std::vector<float> fullOutput = convertAsJob(converter, strip, full, &fullTables);
+  ASSERT_NE(fullTables.matrix, nullptr);
+  EXPECT_EQ(fullTables.kernelMask, nullptr);
+  EXPECT_EQ(cache.GetNumEntries(), 1u);
+  ConversionTables adaptiveTables;
+  const std::vector<float> adaptiveOutput = convertAsJob(converter, strip, adaptive, &adaptiveTables);
+  EXPECT_EQ(adaptiveTables.matrix, nullptr);
+  ASSERT_NE(adaptiveTables.kernelMask, nullptr);
+  EXPECT_EQ(cache.GetNumEntries(), 1u);
+
+  // both follow their own kernels, up to the order the taps are summed in.
+  EXPECT_LE(largestRelativeDifference(fullOutput, resample(strip, full.resample, nullptr)), 1e-5f);
+  EXPECT_LE(largestRelativeDifference(adaptiveOutput, resample(strip, adaptive.resample, adaptiveTables.kernelMask)),
+            1e-5f);
+  EXPECT_GT(largestRelativeDifference(adaptiveOutput, fullOutput), 1e-5f);
+}
+
+TEST(AdaptiveJobTest, RejectsMatrixTogetherWithKernelMask) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  std::vector<float> strip = testImage(6 * kFaceSize, kFaceSize, 2.5f * kFaceSize, 0.5f * kFaceSize);
+  std::vector<float> output(size_t(kOctMapSize) * kOctMapSize * kNumChannels);
+  ConversionSettings full;
+  ConversionSettings adaptive;
+  adaptive.resample.adaptiveTolerance = 0.05f;
+  const ImageBuffer input = floatBuffer(&strip, 6 * kFaceSize, kFaceSize);
+  EXPECT_THROW(converter.PrepareTables(input, adaptive.resample, kFaceSize, kOctMapSize, MATRIX_PRECOMPUTED),
+               std::invalid_argument);
+  std::shared_ptr<const ResamplingMatrix> matrix = converter.GetMatrix(full.resample, kFaceSize, kOctMapSize);
+  std::shared_ptr<const KernelMask> kernelMask =
+      converter.BuildKernelMask(input, adaptive.resample, kFaceSize, kOctMapSize);
+  // the matrix would silently win over the mask in the kernels shared by several outputs.
+  EXPECT_THROW(makeRowConverter(full, kFaceSize, kOctMapSize, matrix, kernelMask), std::invalid_argument);
+  EXPECT_THROW(makeChannelRowConverter(full.resample, false, kNumChannels, kFaceSize, kOctMapSize, matrix, kernelMask),
+               std::invalid_argument);
+  EXPECT_THROW(converter.Convert(input, floatBuffer(&output, kOctMapSize, kOctMapSize), adaptive, matrix, kernelMask),
+               std::invalid_argument);
+}
+
+}  // namespace
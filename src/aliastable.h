@@ -0,0 +1,274 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "octmaputil.h"
+#include "threadpool.h"
+
+// Importance sampling tables of octmaps for environment lighting. Texels are picked with
+// a probability proportional to their luminance times their solid angle, in two steps:
+// a row by the summed weights of the rows, then a texel within the row, both with an
+// alias table so that a sample takes two uniform numbers and two lookups.
+
+// One slot of an alias table of n slots. A uniform number u picks slot i = int(u * n),
+// which stands for itself if the fraction u * n - i is below threshold and for alias
+// otherwise. pdf is the probability of the row for row slots and the density with
+// respect to solid angle of directions within the texel for texel slots.
+struct AliasEntry {
+    float threshold;
+    uint32_t alias;
+    float pdf;
+};
+
+static const char kSamplingTableMagic[8] = { 'O', 'C', 'T', 'A', 'L', 'I', 'A', 'S' };
+const uint32_t kSamplingTableVersion = 1;
+
+// Header of sampling table files. The header is followed by height AliasEntries of the
+// rows and width * height AliasEntries of the texels, row by row. All fields are little
+// endian and naturally aligned, so that the file can be mapped into memory and used as
+// is through SamplingTableView.
+struct SamplingTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+    // the sum of luminance times solid angle over all texels, the irradiance-like
+    // normalization constant of the map.
+    double integral;
+};
+static_assert(sizeof(SamplingTableHeader) == 32, "the header is part of the file format");
+static_assert(sizeof(AliasEntry) == 12, "the entries are part of the file format");
+
+// A sampling table as built by buildSamplingTable.
+struct SamplingTable {
+    SamplingTableHeader header;
+    std::vector<AliasEntry> rows;
+    std::vector<AliasEntry> texels;
+
+    size_t fileSize() const {
+        return sizeof(SamplingTableHeader) + (rows.size() + texels.size()) * sizeof(AliasEntry);
+    }
+};
+
+// Returns the size in bytes of the sampling table of an octmap of size x size texels.
+inline size_t samplingTableSize(int size) {
+    return sizeof(SamplingTableHeader) + (size_t(size) + size_t(size) * size) * sizeof(AliasEntry);
+}
+
+// Relative luminance of linear Rec. 709 RGB. Negative and NaN luminance counts as 0.
+inline float samplingLuminance(float r, float g, float b) {
+    const float luminance = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+    return luminance > 0.0f && std::isfinite(luminance) ? luminance : 0.0f;
+}
+
+// Scratch space of buildAliasTable, kept across the tables a thread builds.
+struct AliasTableScratch {
+    std::vector<double> scaled;
+    std::vector<uint32_t> small;
+    std::vector<uint32_t> large;
+};
+
+// Builds the alias table of the n weights into entries with Vose's method. Weights that
+// sum up to 0 give a uniform table.
+inline void buildAliasTable(const double* weights, int n, AliasEntry* entries, AliasTableScratch& scratch) {
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+        sum += weights[i];
+    std::vector<double>& scaled = scratch.scaled;
+    std::vector<uint32_t>& small = scratch.small;
+    std::vector<uint32_t>& large = scratch.large;
+    scaled.resize(n);
+    small.clear();
+    large.clear();
+    for (int i = 0; i < n; i++) {
+        scaled[i] = sum > 0.0 ? weights[i] * n / sum : 1.0;
+        entries[i].alias = uint32_t(i);
+        (scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+    }
+    while (!small.empty() && !large.empty()) {
+        const uint32_t less = small.back();
+        small.pop_back();
+        const uint32_t more = large.back();
+        entries[less].threshold = float(scaled[less]);
+        entries[less].alias = more;
+        scaled[more] -= 1.0 - scaled[less];
+        if (scaled[more] < 1.0) {
+            large.pop_back();
+            small.push_back(more);
+        }
+    }
+    // what remains is 1 up to rounding.
+    for (uint32_t i : large)
+        entries[i].threshold = 1.0f;
+    for (uint32_t i : small)
+        entries[i].threshold = 1.0f;
+}
+
+// Builds the sampling table of a size x size octmap. rowLuminance(y, luminance) fills in
+// the samplingLuminance of the size texels of row y. The rows are built in parallel on
+// threadPool. A map without any light gets a table proportional to the solid angle, i.e.
+// uniform over the sphere.
+template <class RowLuminance>
+SamplingTable buildSamplingTable(int size, RowLuminance&& rowLuminance, ThreadPool& threadPool) {
+    SamplingTable table;
+    std::memcpy(table.header.magic, kSamplingTableMagic, sizeof(kSamplingTableMagic));
+    table.header.version = kSamplingTableVersion;
+    table.header.width = uint32_t(size);
+    table.header.height = uint32_t(size);
+    table.header.reserved = 0;
+    table.rows.resize(size);
+    table.texels.resize(size_t(size) * size);
+
+    std::vector<float> solidAngles(size_t(size) * size);
+    std::vector<double> rowWeights(size);
+    auto buildRows = [&](bool uniform) {
+        threadPool.ParallelFor(0, size, 8, [&](int yBegin, int yEnd) {
+            std::vector<float> luminance(size);
+            std::vector<double> weights(size);
+            AliasTableScratch scratch;
+            for (int y = yBegin; y < yEnd; y++) {
+                float* rowSolidAngles = solidAngles.data() + size_t(y) * size;
+                if (uniform) {
+                    std::fill(luminance.begin(), luminance.end(), 1.0f);
+                } else {
+                    rowLuminance(y, luminance.data());
+                    for (int x = 0; x < size; x++)
+                        rowSolidAngles[x] = octMapTexelSolidAngle(x, y, size);
+                }
+                double rowWeight = 0.0;
+                for (int x = 0; x < size; x++) {
+                    weights[x] = double(luminance[x]) * rowSolidAngles[x];
+                    rowWeight += weights[x];
+                }
+                rowWeights[y] = rowWeight;
+                AliasEntry* row = table.texels.data() + size_t(y) * size;
+                buildAliasTable(weights.data(), size, row, scratch);
+                // the density within the texel, up to the division by the integral.
+                for (int x = 0; x < size; x++)
+                    row[x].pdf = luminance[x];
+            }
+        });
+    };
+    buildRows(false);
+    double integral = 0.0;
+    for (int y = 0; y < size; y++)
+        integral += rowWeights[y];
+    const bool uniform = !(integral > 0.0) || !std::isfinite(integral);
+    if (uniform) {
+        buildRows(true);
+        integral = 0.0;
+        for (int y = 0; y < size; y++)
+            integral += rowWeights[y];
+    }
+    table.header.integral = integral;
+
+    AliasTableScratch scratch;
+    buildAliasTable(rowWeights.data(), size, table.rows.data(), scratch);
+    for (int y = 0; y < size; y++)
+        table.rows[y].pdf = float(rowWeights[y] / integral);
+    const float invIntegral = float(1.0 / integral);
+    threadPool.ParallelFor(0, size, 64, [&](int yBegin, int yEnd) {
+        for (size_t i = size_t(yBegin) * size; i < size_t(yEnd) * size; i++)
+            table.texels[i].pdf *= invIntegral;
+    });
+    return table;
+}
+
+// Writes table to path. Like the matrix cache, it goes to a temporary file first, so that
+// renderers never map partial tables. Returns false if the file can not be written.
+inline bool saveSamplingTable(const std::string& path, const SamplingTable& table) {
+    std::string tmpPath = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file(tmpPath, std::ios::binary);
+        if (!file)
+            return false;
+        file.write((const char*)&table.header, sizeof(table.header));
+        file.write((const char*)table.rows.data(), table.rows.size() * sizeof(AliasEntry));
+        file.write((const char*)table.texels.data(), table.texels.size() * sizeof(AliasEntry));
+        if (!file)
+            return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    if (error) {
+        std::filesystem::remove(tmpPath, error);
+        return false;
+    }
+    return true;
+}
+
+// A sampling table in memory owned by someone else, typically a mapped file.
+struct SamplingTableView {
+    const SamplingTableHeader* header = nullptr;
+    const AliasEntry* rows = nullptr;
+    const AliasEntry* texels = nullptr;
+};
+
+// Sets up view for the size bytes of a sampling table file at data, which has to be
+// aligned to 8 bytes, as mapped files are. Returns false if they do not hold a table of
+// this version.
+inline bool viewSamplingTable(const void* data, size_t size, SamplingTableView* view) {
+    if (size < sizeof(SamplingTableHeader))
+        return false;
+    const SamplingTableHeader* header = static_cast<const SamplingTableHeader*>(data);
+    if (!std::equal(header->magic, header->magic + sizeof(header->magic), kSamplingTableMagic) ||
+        header->version != kSamplingTableVersion || header->width == 0 || header->height == 0)
+        return false;
+    const size_t numRows = header->height;
+    const size_t numTexels = size_t(header->width) * header->height;
+    if (size != sizeof(SamplingTableHeader) + (numRows + numTexels) * sizeof(AliasEntry))
+        return false;
+    view->header = header;
+    view->rows = reinterpret_cast<const AliasEntry*>(header + 1);
+    view->texels = view->rows + numRows;
+    return true;
+}
+
+// Picks slot i of an alias table of n slots with the uniform number u in [0, 1) and
+// returns the fraction left of u, uniform in [0, 1) again.
+inline uint32_t sampleAliasTable(const AliasEntry* entries, uint32_t n, float u, float* remainder) {
+    const float scaled = u * n;
+    const uint32_t slot = std::min(uint32_t(scaled), n - 1);
+    const float fraction = std::min(scaled - slot, 1.0f);
+    const AliasEntry& entry = entries[slot];
+    if (fraction < entry.threshold) {
+        *remainder = entry.threshold > 0.0f ? fraction / entry.threshold : 0.0f;
+        return slot;
+    }
+    *remainder = entry.threshold < 1.0f ? (fraction - entry.threshold) / (1.0f - entry.threshold) : 0.0f;
+    return entry.alias;
+}
+
+// Picks a texel of the octmap of view with the uniform numbers u1 and u2 in [0, 1).
+// Returns the density with respect to solid angle of directions within the texel, the
+// texel is at (*x, *y) and (*uOffset, *vOffset) is a uniform position within it, taken
+// from what is left of u1 and u2.
+inline float sampleOctMapTexel(const SamplingTableView& view, float u1, float u2, uint32_t* x, uint32_t* y,
+                               float* uOffset, float* vOffset) {
+    *y = sampleAliasTable(view.rows, view.header->height, u1, vOffset);
+    *x = sampleAliasTable(view.texels + size_t(*y) * view.header->width, view.header->width, u2, uOffset);
+    return view.texels[size_t(*y) * view.header->width + *x].pdf;
+}
+
+// Returns the density with respect to solid angle with which sampleOctMapTexel picks
+// directions within texel (x, y), for weighting light samples against other strategies.
+inline float octMapTexelPdf(const SamplingTableView& view, uint32_t x, uint32_t y) {
+    return view.texels[size_t(y) * view.header->width + x].pdf;
+}
+
+#endif  // ALIAS_TABLE_H
@@ -0,0 +1,214 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "aliastable.h"
+#include "octmap.h"
+#include "octmaputil.h"
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kSize = 8;
+const double kPi = 3.14159265358979323846;
+
+// Side length of the stratified grid of uniform numbers the tables are sampled with. The
+// grid resolves the probabilities of the rows and of the texels within them to about
+// 1 / kGridSize each.
+const int kGridSize = 2048;
+const double kFrequencyTolerance = 0.5 / kGridSize;
+
+// An octmap of kSize with random RGB texels, a few of them black.
+std::vector<float> randomOctMap() {
+  std::mt19937 random(5);
+  std::uniform_real_distribution<float> uniform(0.0f, 4.0f);
+  std::vector<float> pixels(size_t(kSize) * kSize * 3);
+  for (size_t i = 0; i < pixels.size(); i++)
+    pixels[i] = i % 7 == 0 ? 0.0f : uniform(random);
+  return pixels;
+}
+
+SamplingTable buildTable(std::vector<float>* pixels, bool mono = false) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  ImageBuffer octmap;
+  octmap.data = pixels->data();
+  octmap.width = kSize;
+  octmap.height = kSize;
+  return converter.BuildSamplingTable(octmap, mono);
+}
+
+// The bytes of table as saveSamplingTable writes them, in memory aligned like a mapped file.
+std::vector<uint64_t> tableFile(const SamplingTable& table, size_t* size) {
+  const std::string path = (std::filesystem::temp_directory_path() /
+                            ("aliastable_test_" + std::string(::testing::UnitTest::GetInstance()
+                                                                 ->current_test_info()->name()) + ".alias")).string();
+  EXPECT_TRUE(saveSamplingTable(path, table));
+  std::ifstream file(path, std::ios::binary);
+  const std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::error_code error;
+  std::filesystem::remove(path, error);
+  *size = bytes.size();
+  std::vector<uint64_t> aligned((bytes.size() + 7) / 8);
+  std::memcpy(aligned.data(), bytes.data(), bytes.size());
+  return aligned;
+}
+
+// Returns how often sampleOctMapTexel picks every texel for a stratified grid of
+// n x n pairs of uniform numbers, and checks the density it returns along the way.
+std::vector<double> sampleFrequencies(const SamplingTableView& view, int n) {
+  std::vector<double> frequencies(size_t(kSize) * kSize, 0.0);
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      uint32_t x, y;
+      float uOffset, vOffset;
+      const float pdf = sampleOctMapTexel(view, (i + 0.5f) / n, (j + 0.5f) / n, &x, &y, &uOffset, &vOffset);
+      EXPECT_LT(x, uint32_t(kSize));
+      EXPECT_LT(y, uint32_t(kSize));
+      EXPECT_GE(uOffset, 0.0f);
+      EXPECT_LT(uOffset, 1.0f);
+      EXPECT_GE(vOffset, 0.0f);
+      EXPECT_LT(vOffset, 1.0f);
+      EXPECT_EQ(pdf, octMapTexelPdf(view, x, y));
+      frequencies[size_t(y) * kSize + x] += 1.0 / (double(n) * n);
+    }
+  }
+  return frequencies;
+}
+
+TEST(SamplingTableTest, SamplesLuminanceTimesSolidAngle) {
+  std::vector<float> pixels = randomOctMap();
+  const SamplingTable table = buildTable(&pixels);
+  size_t size;
+  const std::vector<uint64_t> file = tableFile(table, &size);
+  SamplingTableView view;
+  ASSERT_TRUE(viewSamplingTable(file.data(), size, &view));
+  EXPECT_EQ(view.header->width, uint32_t(kSize));
+  EXPECT_EQ(view.header->height, uint32_t(kSize));
+
+  double integral = 0.0;
+  std::vector<double> weights(size_t(kSize) * kSize);
+  for (int y = 0; y < kSize; y++) {
+    for (int x = 0; x < kSize; x++) {
+      const float* pixel = &pixels[(size_t(y) * kSize + x) * 3];
+      const double luminance = samplingLuminance(pixel[0], pixel[1], pixel[2]);
+      weights[size_t(y) * kSize + x] = luminance * octMapTexelSolidAngle(x, y, kSize);
+      integral += weights[size_t(y) * kSize + x];
+    }
+  }
+  EXPECT_NEAR(view.header->integral, integral, 1e-9 * integral);
+
+  const std::vector<double> frequencies = sampleFrequencies(view, kGridSize);
+  for (int y = 0; y < kSize; y++) {
+    for (int x = 0; x < kSize; x++) {
+      const size_t i = size_t(y) * kSize + x;
+      EXPECT_NEAR(frequencies[i], weights[i] / integral, kFrequencyTolerance) << "texel " << x << ", " << y;
+      // the density times the solid angle is the probability of the texel.
+      EXPECT_NEAR(octMapTexelPdf(view, x, y) * octMapTexelSolidAngle(x, y, kSize), weights[i] / integral, 1e-6)
+          << "texel " << x << ", " << y;
+    }
+  }
+}
+
+TEST(SamplingTableTest, SamplesBlackMapUniformly) {
+  std::vector<float> pixels(size_t(kSize) * kSize * 3, 0.0f);
+  const SamplingTable table = buildTable(&pixels);
+  size_t size;
+  const std::vector<uint64_t> file = tableFile(table, &size);
+  SamplingTableView view;
+  ASSERT_TRUE(viewSamplingTable(file.data(), size, &view));
+  // uniform over the sphere, so the texels are picked by their solid angle. The texel
+  // solid angles of a map this small add up to 4 pi within 1e-3.
+  double sphere = 0.0;
+  for (int y = 0; y < kSize; y++) {
+    for (int x = 0; x < kSize; x++)
+      sphere += octMapTexelSolidAngle(x, y, kSize);
+  }
+  EXPECT_NEAR(view.header->integral, sphere, 1e-9);
+  EXPECT_NEAR(sphere, 4.0 * kPi, 1e-3);
+  const std::vector<double> frequencies = sampleFrequencies(view, kGridSize);
+  for (int y = 0; y < kSize; y++) {
+    for (int x = 0; x < kSize; x++) {
+      const double solidAngle = octMapTexelSolidAngle(x, y, kSize);
+      EXPECT_NEAR(frequencies[size_t(y) * kSize + x], solidAngle / sphere, kFrequencyTolerance);
+      EXPECT_NEAR(octMapTexelPdf(view, x, y), 1.0 / sphere, 1e-6);
+    }
+  }
+}
+
+TEST(SamplingTableTest, ViewRejectsDamagedFiles) {
+  std::vector<float> pixels = randomOctMap();
+  const SamplingTable table = buildTable(&pixels);
+  size_t size;
+  std::vector<uint64_t> file = tableFile(table, &size);
+  ASSERT_EQ(size, samplingTableSize(kSize));
+  SamplingTableView view;
+  EXPECT_TRUE(viewSamplingTable(file.data(), size, &view));
+  EXPECT_FALSE(viewSamplingTable(file.data(), size - sizeof(AliasEntry), &view));
+  EXPECT_FALSE(viewSamplingTable(file.data(), sizeof(SamplingTableHeader) - 1, &view));
+  EXPECT_FALSE(viewSamplingTable(file.data(), 0, &view));
+
+  SamplingTableHeader* header = reinterpret_cast<SamplingTableHeader*>(file.data());
+  header->magic[0] = 'X';
+  EXPECT_FALSE(viewSamplingTable(file.data(), size, &view));
+  header->magic[0] = kSamplingTableMagic[0];
+  header->version = kSamplingTableVersion + 1;
+  EXPECT_FALSE(viewSamplingTable(file.data(), size, &view));
+  header->version = kSamplingTableVersion;
+  // a header for a larger map than the file holds.
+  header->width = kSize * 2;
+  EXPECT_FALSE(viewSamplingTable(file.data(), size, &view));
+  header->width = 0;
+  EXPECT_FALSE(viewSamplingTable(file.data(), sizeof(SamplingTableHeader) + kSize * sizeof(AliasEntry), &view));
+  header->width = kSize;
+  EXPECT_TRUE(viewSamplingTable(file.data(), size, &view));
+}
+
+TEST(SamplingTableTest, MonoTableFollowsWrittenChannel) {
+  // the first texel is red, the second green, all others black.
+  std::vector<float> pixels(size_t(kSize) * kSize * 3, 0.0f);
+  pixels[0] = 1.0f;
+  pixels[3 + 1] = 1.0f;
+  const SamplingTable rgb = buildTable(&pixels);
+  const SamplingTable mono = buildTable(&pixels, true);
+  SamplingTableView rgbView = { &rgb.header, rgb.rows.data(), rgb.texels.data() };
+  SamplingTableView monoView = { &mono.header, mono.rows.data(), mono.texels.data() };
+  EXPECT_GT(octMapTexelPdf(rgbView, 0, 0), 0.0f);
+  EXPECT_GT(octMapTexelPdf(rgbView, 1, 0), 0.0f);
+  // only the red channel is written as Z, so green light is never sampled.
+  EXPECT_NEAR(mono.header.integral, octMapTexelSolidAngle(0, 0, kSize), 1e-7);
+  EXPECT_EQ(octMapTexelPdf(monoView, 1, 0), 0.0f);
+  const std::vector<double> frequencies = sampleFrequencies(monoView, 256);
+  EXPECT_NEAR(frequencies[0], 1.0, 1e-9);
+
+  // a single channel is enough for mono tables.
+  std::vector<float> z(size_t(kSize) * kSize, 0.0f);
+  z[0] = 1.0f;
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  ImageBuffer octmap;
+  octmap.data = z.data();
+  octmap.width = kSize;
+  octmap.height = kSize;
+  octmap.numChannels = 1;
+  EXPECT_EQ(converter.BuildSamplingTable(octmap, true).header.integral, mono.header.integral);
+  EXPECT_THROW(converter.BuildSamplingTable(octmap), std::invalid_argument);
+}
+
+}  // namespace
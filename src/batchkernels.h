@@ -0,0 +1,257 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef BATCH_KERNELS_H
+#define BATCH_KERNELS_H
+
+// Batched structure-of-arrays versions of octDecode, octEncode, cubeEncode and
+// cubeFaceEncode.
+// Besides the scalar reference, SSE4.1, AVX2 and AVX-512 implementations are compiled
+// into the same binary and the best one supported by the CPU is picked at runtime.
+// The SIMD implementations are branchless and perform the same IEEE operations in the
+// same order as the scalar functions, so the results are bit-identical to the scalar
+// reference. AVX-512 implies FMA, so contraction is disabled for that path; compilers
+// that ignore this may fuse multiply-adds there, which bounds the difference by 1 ULP.
+
+#include <cmath>
+
+#include "IlmBase/Imath/ImathVec.h"
+
+#include "cubemaputil.h"
+#include "octmaputil.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BATCH_KERNELS_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE4,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SIMD_SCALAR: return "scalar";
+        case SIMD_SSE4: return "sse4";
+        case SIMD_AVX2: return "avx2";
+        case SIMD_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+namespace batch_scalar {
+
+inline void octDecodeBatch(const float* u, const float* v, float* x, float* y, float* z, int n) {
+    for (int i = 0; i < n; i++) {
+        Imath::V3f d = octDecode(Imath::V2f(u[i], v[i]));
+        x[i] = d.x;
+        y[i] = d.y;
+        z[i] = d.z;
+    }
+}
+
+inline void octEncodeBatch(const float* x, const float* y, const float* z, float* u, float* v, int n) {
+    for (int i = 0; i < n; i++) {
+        Imath::V2f o = octEncode(Imath::V3f(x[i], y[i], z[i]));
+        u[i] = o.x;
+        v[i] = o.y;
+    }
+}
+
+inline void cubeEncodeBatch(const float* x, const float* y, const float* z, float* u, float* v, int* face, int n) {
+    for (int i = 0; i < n; i++) {
+        Imath::V2f uv = cubeEncode(Imath::V3f(x[i], y[i], z[i]), &face[i]);
+        u[i] = uv.x;
+        v[i] = uv.y;
+    }
+}
+
+inline void cubeFaceEncodeBatch(int face, const float* x, const float* y, const float* z, float* u, float* v, int n) {
+    for (int i = 0; i < n; i++) {
+        Imath::V2f uv = cubeFaceEncode(face, Imath::V3f(x[i], y[i], z[i]));
+        u[i] = uv.x;
+        v[i] = uv.y;
+    }
+}
+
+}  // namespace batch_scalar
+
+#ifdef BATCH_KERNELS_X86
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define BATCH_TARGET_SSE4
+#define BATCH_TARGET_AVX2
+#define BATCH_TARGET_AVX512
+#else
+#define BATCH_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define BATCH_TARGET_AVX2 __attribute__((target("avx2")))
+#define BATCH_TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+
+namespace batch_sse4 {
+
+#define BATCH_TARGET BATCH_TARGET_SSE4
+typedef __m128 Vec;
+typedef __m128 Mask;
+const int kWidth = 4;
+BATCH_TARGET inline Vec load(const float* p) { return _mm_loadu_ps(p); }
+BATCH_TARGET inline void store(float* p, Vec a) { _mm_storeu_ps(p, a); }
+BATCH_TARGET inline void storeInt(int* p, Vec a) { _mm_storeu_si128((__m128i*)p, _mm_cvttps_epi32(a)); }
+BATCH_TARGET inline Vec set1(float f) { return _mm_set1_ps(f); }
+BATCH_TARGET inline Vec add(Vec a, Vec b) { return _mm_add_ps(a, b); }
+BATCH_TARGET inline Vec sub(Vec a, Vec b) { return _mm_sub_ps(a, b); }
+BATCH_TARGET inline Vec mul(Vec a, Vec b) { return _mm_mul_ps(a, b); }
+BATCH_TARGET inline Vec div(Vec a, Vec b) { return _mm_div_ps(a, b); }
+BATCH_TARGET inline Vec sqrt(Vec a) { return _mm_sqrt_ps(a); }
+BATCH_TARGET inline Vec min(Vec a, Vec b) { return _mm_min_ps(a, b); }
+BATCH_TARGET inline Vec max(Vec a, Vec b) { return _mm_max_ps(a, b); }
+BATCH_TARGET inline Vec abs(Vec a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+BATCH_TARGET inline Vec neg(Vec a) { return _mm_xor_ps(_mm_set1_ps(-0.0f), a); }
+BATCH_TARGET inline Mask lt(Vec a, Vec b) { return _mm_cmplt_ps(a, b); }
+BATCH_TARGET inline Mask ge(Vec a, Vec b) { return _mm_cmpge_ps(a, b); }
+BATCH_TARGET inline Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+// Returns a & ~b.
+BATCH_TARGET inline Mask maskAndNot(Mask a, Mask b) { return _mm_andnot_ps(b, a); }
+// Returns m ? a : b per lane.
+BATCH_TARGET inline Vec select(Mask m, Vec a, Vec b) { return _mm_blendv_ps(b, a, m); }
+#include "batchkernels_impl.h"
+#undef BATCH_TARGET
+
+}  // namespace batch_sse4
+
+namespace batch_avx2 {
+
+#define BATCH_TARGET BATCH_TARGET_AVX2
+typedef __m256 Vec;
+typedef __m256 Mask;
+const int kWidth = 8;
+BATCH_TARGET inline Vec load(const float* p) { return _mm256_loadu_ps(p); }
+BATCH_TARGET inline void store(float* p, Vec a) { _mm256_storeu_ps(p, a); }
+BATCH_TARGET inline void storeInt(int* p, Vec a) { _mm256_storeu_si256((__m256i*)p, _mm256_cvttps_epi32(a)); }
+BATCH_TARGET inline Vec set1(float f) { return _mm256_set1_ps(f); }
+BATCH_TARGET inline Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+BATCH_TARGET inline Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+BATCH_TARGET inline Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+BATCH_TARGET inline Vec div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+BATCH_TARGET inline Vec sqrt(Vec a) { return _mm256_sqrt_ps(a); }
+BATCH_TARGET inline Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+BATCH_TARGET inline Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+BATCH_TARGET inline Vec abs(Vec a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+BATCH_TARGET inline Vec neg(Vec a) { return _mm256_xor_ps(_mm256_set1_ps(-0.0f), a); }
+BATCH_TARGET inline Mask lt(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+BATCH_TARGET inline Mask ge(Vec a, Vec b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+BATCH_TARGET inline Mask maskAnd(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+BATCH_TARGET inline Mask maskAndNot(Mask a, Mask b) { return _mm256_andnot_ps(b, a); }
+BATCH_TARGET inline Vec select(Mask m, Vec a, Vec b) { return _mm256_blendv_ps(b, a, m); }
+#include "batchkernels_impl.h"
+#undef BATCH_TARGET
+
+}  // namespace batch_avx2
+
+namespace batch_avx512 {
+
+#define BATCH_TARGET BATCH_TARGET_AVX512
+typedef __m512 Vec;
+typedef __mmask16 Mask;
+const int kWidth = 16;
+BATCH_TARGET inline Vec load(const float* p) { return _mm512_loadu_ps(p); }
+BATCH_TARGET inline void store(float* p, Vec a) { _mm512_storeu_ps(p, a); }
+BATCH_TARGET inline void storeInt(int* p, Vec a) { _mm512_storeu_si512((void*)p, _mm512_cvttps_epi32(a)); }
+BATCH_TARGET inline Vec set1(float f) { return _mm512_set1_ps(f); }
+BATCH_TARGET inline Vec add(Vec a, Vec b) { return _mm512_add_ps(a, b); }
+BATCH_TARGET inline Vec sub(Vec a, Vec b) { return _mm512_sub_ps(a, b); }
+BATCH_TARGET inline Vec mul(Vec a, Vec b) { return _mm512_mul_ps(a, b); }
+BATCH_TARGET inline Vec div(Vec a, Vec b) { return _mm512_div_ps(a, b); }
+BATCH_TARGET inline Vec sqrt(Vec a) { return _mm512_sqrt_ps(a); }
+BATCH_TARGET inline Vec min(Vec a, Vec b) { return _mm512_min_ps(a, b); }
+BATCH_TARGET inline Vec max(Vec a, Vec b) { return _mm512_max_ps(a, b); }
+BATCH_TARGET inline Vec abs(Vec a) { return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x7fffffff))); }
+BATCH_TARGET inline Vec neg(Vec a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(int(0x80000000u)))); }
+BATCH_TARGET inline Mask lt(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+BATCH_TARGET inline Mask ge(Vec a, Vec b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+BATCH_TARGET inline Mask maskAnd(Mask a, Mask b) { return Mask(a & b); }
+BATCH_TARGET inline Mask maskAndNot(Mask a, Mask b) { return Mask(a & ~b); }
+BATCH_TARGET inline Vec select(Mask m, Vec a, Vec b) { return _mm512_mask_blend_ps(m, b, a); }
+#include "batchkernels_impl.h"
+#undef BATCH_TARGET
+
+}  // namespace batch_avx512
+
+#endif  // BATCH_KERNELS_X86
+
+// Returns the best instruction set supported by the CPU and the operating system.
+inline SimdLevel detectSimdLevel() {
+#ifdef BATCH_KERNELS_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx2 = false;
+    bool avx512 = false;
+    if (osxsave && maxLeaf >= 7) {
+        const unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        avx2 = (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+        avx512 = (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+    }
+    if (avx512) return SIMD_AVX512;
+    if (avx2) return SIMD_AVX2;
+    if (sse41) return SIMD_SSE4;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE4;
+#endif
+#endif
+    return SIMD_SCALAR;
+}
+
+// Table of batch kernels for one instruction set.
+struct BatchKernels {
+    SimdLevel level;
+    void (*octDecode)(const float* u, const float* v, float* x, float* y, float* z, int n);
+    void (*octEncode)(const float* x, const float* y, const float* z, float* u, float* v, int n);
+    void (*cubeEncode)(const float* x, const float* y, const float* z, float* u, float* v, int* face, int n);
+    void (*cubeFaceEncode)(int face, const float* x, const float* y, const float* z, float* u, float* v, int n);
+};
+
+// Returns the kernels for the given instruction set. The caller must make sure the
+// CPU supports it.
+inline const BatchKernels& batchKernels(SimdLevel level) {
+    static const BatchKernels scalar = { SIMD_SCALAR, batch_scalar::octDecodeBatch, batch_scalar::octEncodeBatch, batch_scalar::cubeEncodeBatch,
+        batch_scalar::cubeFaceEncodeBatch };
+#ifdef BATCH_KERNELS_X86
+    static const BatchKernels sse4 = { SIMD_SSE4, batch_sse4::octDecodeBatch, batch_sse4::octEncodeBatch, batch_sse4::cubeEncodeBatch,
+        batch_sse4::cubeFaceEncodeBatch };
+    static const BatchKernels avx2 = { SIMD_AVX2, batch_avx2::octDecodeBatch, batch_avx2::octEncodeBatch, batch_avx2::cubeEncodeBatch,
+        batch_avx2::cubeFaceEncodeBatch };
+    static const BatchKernels avx512 = { SIMD_AVX512, batch_avx512::octDecodeBatch, batch_avx512::octEncodeBatch, batch_avx512::cubeEncodeBatch,
+        batch_avx512::cubeFaceEncodeBatch };
+    switch (level) {
+        case SIMD_SSE4: return sse4;
+        case SIMD_AVX2: return avx2;
+        case SIMD_AVX512: return avx512;
+        default: break;
+    }
+#endif
+    return scalar;
+}
+
+// Returns the kernels for the best instruction set of this CPU.
+inline const BatchKernels& batchKernels() {
+    static const SimdLevel level = detectSimdLevel();
+    return batchKernels(level);
+}
+
+#endif  // BATCH_KERNELS_H
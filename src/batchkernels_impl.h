@@ -0,0 +1,195 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+// Batch kernels shared by all SIMD instruction sets.
+// This file is intentionally not include guarded: batchkernels.h includes it once per
+// instruction set, inside a namespace that defines BATCH_TARGET, the vector type Vec,
+// the mask type Mask, kWidth and the primitive operations used below.
+// The operations are performed in the same order as in the scalar reference
+// implementations in octmaputil.h and cubemaputil.h, so the results are identical.
+
+BATCH_TARGET inline Vec signNotZero(Vec k) {
+    return select(ge(k, set1(0.0f)), set1(1.0f), set1(-1.0f));
+}
+
+// Processes kWidth lanes starting at the given pointers.
+BATCH_TARGET inline void octDecodeLanes(
+    const float* u, const float* v, float* x, float* y, float* z)
+{
+    const Vec one = set1(1.0f);
+    const Vec zero = set1(0.0f);
+    Vec ou = load(u);
+    Vec ov = load(v);
+    Vec au = abs(ou);
+    Vec av = abs(ov);
+    Vec vz = sub(sub(one, au), av);
+    Mask lowerHemisphere = lt(vz, zero);
+    Vec vx = select(lowerHemisphere, mul(sub(one, av), signNotZero(ou)), ou);
+    Vec vy = select(lowerHemisphere, mul(sub(one, au), signNotZero(ov)), ov);
+    // the l1 norm of the unnormalized vector is 1, so its length is never zero.
+    Vec len = sqrt(add(add(mul(vx, vx), mul(vy, vy)), mul(vz, vz)));
+    store(x, div(vx, len));
+    store(y, div(vy, len));
+    store(z, div(vz, len));
+}
+
+BATCH_TARGET inline void octEncodeLanes(
+    const float* x, const float* y, const float* z, float* u, float* v)
+{
+    const Vec one = set1(1.0f);
+    const Vec zero = set1(0.0f);
+    Vec vx = load(x);
+    Vec vy = load(y);
+    Vec vz = load(z);
+    Vec invL1norm = div(one, add(add(abs(vx), abs(vy)), abs(vz)));
+    Vec rx = mul(vx, invL1norm);
+    Vec ry = mul(vy, invL1norm);
+    Mask lowerHemisphere = lt(vz, zero);
+    store(u, select(lowerHemisphere, mul(sub(one, abs(ry)), signNotZero(rx)), rx));
+    store(v, select(lowerHemisphere, mul(sub(one, abs(rx)), signNotZero(ry)), ry));
+}
+
+BATCH_TARGET inline void cubeEncodeLanes(
+    const float* x, const float* y, const float* z, float* u, float* v, int* face)
+{
+    const Vec zero = set1(0.0f);
+    const Vec one = set1(1.0f);
+    const Vec half = set1(0.5f);
+    Vec vx = load(x);
+    Vec vy = load(y);
+    Vec vz = load(z);
+    Vec ax = abs(vx);
+    Vec ay = abs(vy);
+    Vec az = abs(vz);
+    Mask negX = lt(vx, zero);
+    Mask negY = lt(vy, zero);
+    Mask negZ = lt(vz, zero);
+    // face selection, see sampleCube.
+    Mask zMajor = maskAnd(ge(az, ax), ge(az, ay));
+    Mask yMajor = maskAndNot(ge(ay, ax), zMajor);
+
+    Vec uvxZ = select(negZ, vx, neg(vx));
+    Vec uvyY = select(negY, neg(vz), vz);
+    Vec uvxX = select(negX, neg(vz), vz);
+#ifdef MIRROR_FACES
+    uvxZ = neg(uvxZ);
+    uvyY = neg(uvyY);
+    uvxX = neg(uvxX);
+#endif
+    Vec uvx = select(zMajor, uvxZ, select(yMajor, vx, uvxX));
+    Vec uvy = select(zMajor, vy, select(yMajor, uvyY, vy));
+    Vec ma = div(half, select(zMajor, az, select(yMajor, ay, ax)));
+    Vec faceIndex = select(zMajor, select(negZ, set1(5.0f), set1(4.0f)),
+                    select(yMajor, select(negY, set1(3.0f), set1(2.0f)),
+                                   select(negX, set1(1.0f), set1(0.0f))));
+
+    store(u, min(max(add(mul(uvx, ma), half), zero), one));
+    store(v, min(max(add(mul(uvy, ma), half), zero), one));
+    storeInt(face, faceIndex);
+}
+
+BATCH_TARGET inline void cubeFaceEncodeLanes(
+    const Imath::V3f& normal, const Imath::V3f& uAxis, const Imath::V3f& vAxis,
+    const float* x, const float* y, const float* z, float* u, float* v)
+{
+    const Vec one = set1(1.0f);
+    Vec vx = load(x);
+    Vec vy = load(y);
+    Vec vz = load(z);
+    // the dot products with the axes of the face, see cubeFaceEncode.
+    Vec scale = div(one, add(add(mul(set1(normal.x), vx), mul(set1(normal.y), vy)), mul(set1(normal.z), vz)));
+    store(u, mul(add(add(mul(set1(uAxis.x), vx), mul(set1(uAxis.y), vy)), mul(set1(uAxis.z), vz)), scale));
+    store(v, mul(add(add(mul(set1(vAxis.x), vx), mul(set1(vAxis.y), vy)), mul(set1(vAxis.z), vz)), scale));
+}
+
+// The batch functions process full vectors in place and the remaining elements in a
+// padded vector, so that short batches don't fall back to the scalar code.
+
+BATCH_TARGET inline void octDecodeBatch(
+    const float* u, const float* v, float* x, float* y, float* z, int n)
+{
+    int i = 0;
+    for (; i + kWidth <= n; i += kWidth)
+        octDecodeLanes(u + i, v + i, x + i, y + i, z + i);
+    if (i < n) {
+        float tu[kWidth], tv[kWidth], tx[kWidth], ty[kWidth], tz[kWidth];
+        for (int j = 0; j < kWidth; j++) {
+            tu[j] = i + j < n ? u[i + j] : 0.0f;
+            tv[j] = i + j < n ? v[i + j] : 0.0f;
+        }
+        octDecodeLanes(tu, tv, tx, ty, tz);
+        for (int j = 0; i + j < n; j++) {
+            x[i + j] = tx[j];
+            y[i + j] = ty[j];
+            z[i + j] = tz[j];
+        }
+    }
+}
+
+BATCH_TARGET inline void octEncodeBatch(
+    const float* x, const float* y, const float* z, float* u, float* v, int n)
+{
+    int i = 0;
+    for (; i + kWidth <= n; i += kWidth)
+        octEncodeLanes(x + i, y + i, z + i, u + i, v + i);
+    if (i < n) {
+        float tx[kWidth], ty[kWidth], tz[kWidth], tu[kWidth], tv[kWidth];
+        for (int j = 0; j < kWidth; j++) {
+            tx[j] = i + j < n ? x[i + j] : 0.0f;
+            ty[j] = i + j < n ? y[i + j] : 0.0f;
+            tz[j] = i + j < n ? z[i + j] : 1.0f;
+        }
+        octEncodeLanes(tx, ty, tz, tu, tv);
+        for (int j = 0; i + j < n; j++) {
+            u[i + j] = tu[j];
+            v[i + j] = tv[j];
+        }
+    }
+}
+
+BATCH_TARGET inline void cubeEncodeBatch(
+    const float* x, const float* y, const float* z, float* u, float* v, int* face, int n)
+{
+    int i = 0;
+    for (; i + kWidth <= n; i += kWidth)
+        cubeEncodeLanes(x + i, y + i, z + i, u + i, v + i, face + i);
+    if (i < n) {
+        float tx[kWidth], ty[kWidth], tz[kWidth], tu[kWidth], tv[kWidth];
+        int tface[kWidth];
+        for (int j = 0; j < kWidth; j++) {
+            tx[j] = i + j < n ? x[i + j] : 0.0f;
+            ty[j] = i + j < n ? y[i + j] : 0.0f;
+            tz[j] = i + j < n ? z[i + j] : 1.0f;
+        }
+        cubeEncodeLanes(tx, ty, tz, tu, tv, tface);
+        for (int j = 0; i + j < n; j++) {
+            u[i + j] = tu[j];
+            v[i + j] = tv[j];
+            face[i + j] = tface[j];
+        }
+    }
+}
+
+BATCH_TARGET inline void cubeFaceEncodeBatch(
+    int face, const float* x, const float* y, const float* z, float* u, float* v, int n)
+{
+    Imath::V3f normal, uAxis, vAxis;
+    cubeFaceAxes(face, &normal, &uAxis, &vAxis);
+    int i = 0;
+    for (; i + kWidth <= n; i += kWidth)
+        cubeFaceEncodeLanes(normal, uAxis, vAxis, x + i, y + i, z + i, u + i, v + i);
+    if (i < n) {
+        float tx[kWidth], ty[kWidth], tz[kWidth], tu[kWidth], tv[kWidth];
+        for (int j = 0; j < kWidth; j++) {
+            tx[j] = i + j < n ? x[i + j] : normal.x;
+            ty[j] = i + j < n ? y[i + j] : normal.y;
+            tz[j] = i + j < n ? z[i + j] : normal.z;
+        }
+        cubeFaceEncodeLanes(normal, uAxis, vAxis, tx, ty, tz, tu, tv);
+        for (int j = 0; i + j < n; j++) {
+            u[i + j] = tu[j];
+            v[i + j] = tv[j];
+        }
+    }
+}
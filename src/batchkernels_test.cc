@@ -0,0 +1,225 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "batchkernels.h"
+#include "cubemaputil.h"
+#include "octmaputil.h"
+
+namespace {
+
+// The SIMD kernels are bit-identical to the scalar reference, except for AVX-512 with
+// compilers that contract multiply-adds despite fp-contract=off, see batchkernels.h.
+int maxUlps(SimdLevel level) {
+  return level == SIMD_AVX512 ? 1 : 0;
+}
+
+// Returns the distance of a and b in units in the last place. +0 and -0 are one apart,
+// so that a lost sign of zero is caught as well.
+int64_t ulpDistance(float a, float b) {
+  auto ordered = [](float f) {
+    int32_t i;
+    std::memcpy(&i, &f, sizeof(i));
+    return i < 0 ? -int64_t(i & 0x7fffffff) - 1 : int64_t(i);
+  };
+  return std::llabs(ordered(a) - ordered(b));
+}
+
+// The instruction sets this CPU supports, the scalar one included.
+std::vector<SimdLevel> supportedLevels() {
+  std::vector<SimdLevel> levels;
+  for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++)
+    levels.push_back(SimdLevel(level));
+  return levels;
+}
+
+// Batch sizes covering a single element, tails below every vector width and full vectors
+// followed by tails.
+const int kBatchSizes[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 33, 1021 };
+
+struct Directions {
+  std::vector<float> x, y, z;
+
+  void Add(float vx, float vy, float vz) {
+    x.push_back(vx);
+    y.push_back(vy);
+    z.push_back(vz);
+  }
+};
+
+// Axis-aligned directions with either sign of zero, directions on the edges and corners
+// of the cube and on the equator of the octahedron, followed by random unit vectors.
+Directions testDirections(int numRandom) {
+  Directions d;
+  const float s = 1.0f / std::sqrt(3.0f);
+  const float t = 1.0f / std::sqrt(2.0f);
+  const float zeros[] = { 0.0f, -0.0f };
+  for (float zero : zeros) {
+    d.Add(1.0f, zero, zero);
+    d.Add(-1.0f, zero, zero);
+    d.Add(zero, 1.0f, zero);
+    d.Add(zero, -1.0f, zero);
+    d.Add(zero, zero, 1.0f);
+    d.Add(zero, zero, -1.0f);
+    d.Add(t, -t, zero);
+    d.Add(-t, zero, t);
+  }
+  for (int signs = 0; signs < 8; signs++) {
+    const float sx = signs & 1 ? -1.0f : 1.0f;
+    const float sy = signs & 2 ? -1.0f : 1.0f;
+    const float sz = signs & 4 ? -1.0f : 1.0f;
+    d.Add(sx * s, sy * s, sz * s);
+    d.Add(sx * t, sy * t, 0.0f);
+    d.Add(sx * t, 0.0f, sz * t);
+    d.Add(0.0f, sy * t, sz * t);
+  }
+  std::mt19937 random(17);
+  std::normal_distribution<float> normal;
+  for (int i = 0; i < numRandom; i++) {
+    Imath::V3f v(normal(random), normal(random), normal(random));
+    v.normalize();
+    d.Add(v.x, v.y, v.z);
+  }
+  return d;
+}
+
+// Octmap coordinates: the center, the corners and edge midpoints of the square with
+// either sign of zero, the inner diamond, followed by random points on the square.
+void testCoordinates(int numRandom, std::vector<float>* u, std::vector<float>* v) {
+  const float values[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f };
+  for (float a : values) {
+    for (float b : values) {
+      u->push_back(a);
+      v->push_back(b);
+    }
+  }
+  std::mt19937 random(23);
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  for (int i = 0; i < numRandom; i++) {
+    u->push_back(uniform(random));
+    v->push_back(uniform(random));
+  }
+}
+
+void expectClose(float expected, float actual, SimdLevel level, const std::string& what, int i) {
+  EXPECT_LE(ulpDistance(expected, actual), maxUlps(level))
+      << simdLevelName(level) << " " << what << "[" << i << "]: " << actual << " instead of " << expected;
+}
+
+TEST(BatchKernelsTest, OctDecodeMatchesScalar) {
+  std::vector<float> u, v;
+  testCoordinates(1021, &u, &v);
+  for (SimdLevel level : supportedLevels()) {
+    const BatchKernels& kernels = batchKernels(level);
+    ASSERT_EQ(kernels.level, level);
+    for (int n : kBatchSizes) {
+      const int count = std::min(n, int(u.size()));
+      std::vector<float> x(count), y(count), z(count);
+      kernels.octDecode(u.data(), v.data(), x.data(), y.data(), z.data(), count);
+      for (int i = 0; i < count; i++) {
+        const Imath::V3f expected = octDecode(Imath::V2f(u[i], v[i]));
+        expectClose(expected.x, x[i], level, "x", i);
+        expectClose(expected.y, y[i], level, "y", i);
+        expectClose(expected.z, z[i], level, "z", i);
+      }
+    }
+  }
+}
+
+TEST(BatchKernelsTest, OctEncodeMatchesScalar) {
+  const Directions d = testDirections(1021);
+  for (SimdLevel level : supportedLevels()) {
+    const BatchKernels& kernels = batchKernels(level);
+    for (int n : kBatchSizes) {
+      const int count = std::min(n, int(d.x.size()));
+      std::vector<float> u(count), v(count);
+      kernels.octEncode(d.x.data(), d.y.data(), d.z.data(), u.data(), v.data(), count);
+      for (int i = 0; i < count; i++) {
+        const Imath::V2f expected = octEncode(Imath::V3f(d.x[i], d.y[i], d.z[i]));
+        expectClose(expected.x, u[i], level, "u", i);
+        expectClose(expected.y, v[i], level, "v", i);
+      }
+    }
+  }
+}
+
+TEST(BatchKernelsTest, CubeEncodeMatchesScalar) {
+  const Directions d = testDirections(1021);
+  for (SimdLevel level : supportedLevels()) {
+    const BatchKernels& kernels = batchKernels(level);
+    for (int n : kBatchSizes) {
+      const int count = std::min(n, int(d.x.size()));
+      std::vector<float> u(count), v(count);
+      std::vector<int> face(count);
+      kernels.cubeEncode(d.x.data(), d.y.data(), d.z.data(), u.data(), v.data(), face.data(), count);
+      for (int i = 0; i < count; i++) {
+        int expectedFace = -1;
+        const Imath::V2f expected = cubeEncode(Imath::V3f(d.x[i], d.y[i], d.z[i]), &expectedFace);
+        EXPECT_EQ(expectedFace, face[i]) << simdLevelName(level) << " face[" << i << "]";
+        expectClose(expected.x, u[i], level, "u", i);
+        expectClose(expected.y, v[i], level, "v", i);
+      }
+    }
+  }
+}
+
+TEST(BatchKernelsTest, CubeFaceEncodeMatchesScalar) {
+  const Directions all = testDirections(1021);
+  for (int face = 0; face < 6; face++) {
+    // only directions in front of the plane of the face have a coordinate on it.
+    Directions d;
+    for (size_t i = 0; i < all.x.size(); i++) {
+      Imath::V3f normal, uAxis, vAxis;
+      cubeFaceAxes(face, &normal, &uAxis, &vAxis);
+      if (normal.dot(Imath::V3f(all.x[i], all.y[i], all.z[i])) > 0.0f)
+        d.Add(all.x[i], all.y[i], all.z[i]);
+    }
+    for (SimdLevel level : supportedLevels()) {
+      const BatchKernels& kernels = batchKernels(level);
+      for (int n : kBatchSizes) {
+        const int count = std::min(n, int(d.x.size()));
+        std::vector<float> u(count), v(count);
+        kernels.cubeFaceEncode(face, d.x.data(), d.y.data(), d.z.data(), u.data(), v.data(), count);
+        for (int i = 0; i < count; i++) {
+          const Imath::V2f expected = cubeFaceEncode(face, Imath::V3f(d.x[i], d.y[i], d.z[i]));
+          expectClose(expected.x, u[i], level, "u of face " + std::to_string(face), i);
+          expectClose(expected.y, v[i], level, "v of face " + std::to_string(face), i);
+        }
+      }
+    }
+  }
+}
+
+TEST(BatchKernelsTest, RoundTripsDirections) {
+  // the tests above compare every level, batch_scalar included, against the reference
+  // functions. This checks that the reference itself is consistent.
+  const Directions d = testDirections(64);
+  const int count = int(d.x.size());
+  std::vector<float> u(count), v(count);
+  std::vector<int> face(count);
+  batch_scalar::cubeEncodeBatch(d.x.data(), d.y.data(), d.z.data(), u.data(), v.data(), face.data(), count);
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(cubeFace(Imath::V3f(d.x[i], d.y[i], d.z[i])), face[i]) << "face[" << i << "]";
+  }
+  batch_scalar::octEncodeBatch(d.x.data(), d.y.data(), d.z.data(), u.data(), v.data(), count);
+  std::vector<float> x(count), y(count), z(count);
+  batch_scalar::octDecodeBatch(u.data(), v.data(), x.data(), y.data(), z.data(), count);
+  for (int i = 0; i < count; i++) {
+    EXPECT_NEAR(d.x[i], x[i], 2e-6f) << "x[" << i << "]";
+    EXPECT_NEAR(d.y[i], y[i], 2e-6f) << "y[" << i << "]";
+    EXPECT_NEAR(d.z[i], z[i], 2e-6f) << "z[" << i << "]";
+  }
+}
+
+}  // namespace
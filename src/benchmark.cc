@@ -0,0 +1,625 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+// Benchmarks of the conversion kernels and of full read, convert and write runs on
+// synthetic cubemaps. Results are written as JSON, so that they can be tracked over
+// compiler, library and code changes.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "OpenEXR/IlmImf/ImfArray.h"
+#include "OpenEXR/IlmImf/ImfChannelList.h"
+#include "OpenEXR/IlmImf/ImfOutputFile.h"
+#include "OpenEXR/IlmImf/ImfInputFile.h"
+#include "OpenEXR/IlmImf/ImfThreading.h"
+#include "IlmBase/Half/half.h"
+#include "IlmBase/Imath/ImathMatrix.h"
+#include "OpenEXR/IlmImf/ImfNamespace.h"
+
+#include "batchkernels.h"
+#include "convert.h"
+#include "cubemaputil.h"
+#include "ggxprefilter.h"
+#include "json.h"
+#include "octmap.h"
+#include "octmaputil.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+#include "stringutils.h"
+
+using namespace std;
+
+namespace IMF = OPENEXR_IMF_NAMESPACE;
+using namespace OPENEXR_IMF_NAMESPACE;
+using namespace IMATH_NAMESPACE;
+
+const int kRowsPerTask = 8;
+
+void displayHelp() {
+    cout << "Arguments:.\n";
+    cout << "-h --help\n";
+    cout << "--sizes N,N,...  : face sizes of the synthetic cubemaps. default is 128,512,1024.\n";
+    cout << "--repetitions N  : number of timed runs of every benchmark. default is 5.\n";
+    cout << "-j --threads N  : number of threads to use. default is the number of hardware threads.\n";
+    cout << "--filter text  : only runs the benchmarks whose name contains text.\n";
+    cout << "--temp-dir directory  : directory for the files of the read, convert and write benchmarks. default is the system temp directory.\n";
+    cout << "-o --output file  : writes the JSON results to file instead of stdout.\n";
+    cout << "on linux, the median last level cache misses of the calling thread are reported as well, where the hardware counters are accessible. run with -j 1 to count the misses of all work.\n";
+}
+
+// Timings of one benchmark. items is the number of pixels or vectors processed per run.
+// cacheMisses holds the last level cache misses of every run, if they can be counted.
+struct BenchmarkResult {
+    string name;
+    int faceSize = 0;
+    size_t items = 0;
+    vector<double> seconds;
+    vector<uint64_t> cacheMisses;
+};
+
+// Counts the last level cache misses of the calling thread through the Linux perf
+// events. Work that the thread pool hands to other threads is not counted, so run with
+// -j 1 to count all misses. Available() is false where the counter can not be opened,
+// e.g. on other systems or in containers without access to the hardware counters.
+class CacheMissCounter {
+ public:
+  CacheMissCounter() {
+#ifdef __linux__
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd_ >= 0)
+      close(fd_);
+#endif
+  }
+
+  CacheMissCounter(const CacheMissCounter&) = delete;
+  CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+  bool Available() const { return fd_ >= 0; }
+
+  void Start() {
+#ifdef __linux__
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+
+  uint64_t Stop() {
+    uint64_t count = 0;
+#ifdef __linux__
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd_, &count, sizeof(count)) != sizeof(count))
+      count = 0;
+#endif
+    return count;
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+// Calls run repetitions times after one untimed warm up run and records the time and
+// the cache misses of each call.
+BenchmarkResult
+runBenchmark(const string &name,
+    int faceSize,
+    size_t items,
+    int repetitions,
+    CacheMissCounter &cacheMissCounter,
+    const function<void()> &run)
+{
+    BenchmarkResult result;
+    result.name = name;
+    result.faceSize = faceSize;
+    result.items = items;
+    run();
+    for (int i = 0; i < repetitions; i++) {
+        if (cacheMissCounter.Available())
+            cacheMissCounter.Start();
+        const auto start = chrono::steady_clock::now();
+        run();
+        result.seconds.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        if (cacheMissCounter.Available())
+            result.cacheMisses.push_back(cacheMissCounter.Stop());
+    }
+    return result;
+}
+
+// Fills a 6:1 strip cubemap with a smooth sky-like gradient, a small very bright sun
+// and some deterministic noise, so that the filters see both flat and sharp regions.
+void
+makeSyntheticCubemap(int faceSize,
+    vector<float> &pixels)
+{
+    const int width = faceSize * 6;
+    pixels.resize(size_t(width) * faceSize * 3);
+    const V3f sun = V3f(0.3f, 0.8f, -0.5f).normalized();
+    uint32_t state = 0x12345678u;
+    for (int y = 0; y < faceSize; y++) {
+        for (int x = 0; x < width; x++) {
+            const V3f direction = cubeDecode(V2f((x + 0.5f) / width, 1.0f - (y + 0.5f) / faceSize));
+            // xorshift32
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            const float noise = (state & 0xffff) / 65535.0f * 0.05f;
+            const float sky = std::max(0.0f, direction.y) * 0.5f + 0.2f;
+            const float sunIntensity = direction.dot(sun) > 0.999f ? 1000.0f : 0.0f;
+            float* pixel = &pixels[(size_t(y) * width + x) * 3];
+            pixel[0] = sky * 0.6f + noise + sunIntensity;
+            pixel[1] = sky * 0.8f + noise + sunIntensity;
+            pixel[2] = sky + noise + sunIntensity;
+        }
+    }
+}
+
+void
+insertRGBSlices(FrameBuffer &frameBuffer,
+    float *rgbPixels,
+    int width)
+{
+    const char* channelNames[] = { "R", "G", "B" };
+    for (int c = 0; c < 3; c++) {
+        frameBuffer.insert(channelNames[c],
+            Slice(IMF::FLOAT, (char *)(rgbPixels + c), sizeof(float) * 3, sizeof(float) * 3 * width));
+    }
+}
+
+void
+writeRGB(const string &fileName,
+    float *rgbPixels,
+    int width,
+    int height,
+    Compression compression)
+{
+    Header header(width, height);
+    header.channels().insert("R", Channel(IMF::FLOAT));
+    header.channels().insert("G", Channel(IMF::FLOAT));
+    header.channels().insert("B", Channel(IMF::FLOAT));
+    header.compression() = compression;
+    OutputFile file(fileName.c_str(), header, globalThreadCount());
+    FrameBuffer frameBuffer;
+    insertRGBSlices(frameBuffer, rgbPixels, width);
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(height);
+}
+
+void
+readRGB(const string &fileName,
+    vector<float> &rgbPixels,
+    int &width,
+    int &height)
+{
+    InputFile file(fileName.c_str(), globalThreadCount());
+    const Box2i dw = file.header().dataWindow();
+    width = dw.max.x - dw.min.x + 1;
+    height = dw.max.y - dw.min.y + 1;
+    rgbPixels.resize(size_t(width) * height * 3);
+    FrameBuffer frameBuffer;
+    insertRGBSlices(frameBuffer, rgbPixels.data() - (dw.min.x + ptrdiff_t(dw.min.y) * width) * 3, width);
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y, dw.max.y);
+}
+
+// Converts the packed RGB cubemap input to an octmap of the face size through the
+// in-memory API.
+void
+convertImage(OctMapConverter &converter,
+    const ConversionSettings &settings,
+    vector<float> &input,
+    int faceSize,
+    vector<float> &output,
+    shared_ptr<const ResamplingMatrix> matrix = nullptr)
+{
+    output.resize(size_t(faceSize) * faceSize * 3);
+    ImageBuffer cubemap;
+    cubemap.data = input.data();
+    cubemap.width = faceSize * 6;
+    cubemap.height = faceSize;
+    ImageBuffer octmap;
+    octmap.data = output.data();
+    octmap.width = faceSize;
+    octmap.height = faceSize;
+    converter.Convert(cubemap, octmap, settings, matrix);
+}
+
+void
+writeJson(ostream &out,
+    const vector<BenchmarkResult> &results,
+    int numThreads)
+{
+    out << "{\n";
+    out << "  \"threads\": " << numThreads << ",\n";
+    out << "  \"simd\": " << jsonQuote(simdLevelName(batchKernels().level)) << ",\n";
+    out << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        vector<double> sorted = result.seconds;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = 0.0;
+        for (double seconds : sorted)
+            mean += seconds;
+        mean /= sorted.size();
+        const double median = sorted[sorted.size() / 2];
+        vector<uint64_t> sortedMisses = result.cacheMisses;
+        std::sort(sortedMisses.begin(), sortedMisses.end());
+        out << "    {\"name\": " << jsonQuote(result.name)
+            << ", \"face_size\": " << result.faceSize
+            << ", \"repetitions\": " << sorted.size()
+            << ", \"min_seconds\": " << sorted.front()
+            << ", \"median_seconds\": " << median
+            << ", \"mean_seconds\": " << mean
+            << ", \"max_seconds\": " << sorted.back()
+            << ", \"items_per_second\": " << result.items / median;
+        if (!sortedMisses.empty())
+            out << ", \"median_cache_misses\": " << sortedMisses[sortedMisses.size() / 2];
+        out << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+int main( int argc, char *argv[] ) {
+    vector<string> args(argv + 1, argv + argc);
+    vector<int> faceSizes = { 128, 512, 1024 };
+    int repetitions = 5;
+    int numThreads = 0;
+    string filter = "";
+    string tempDirectory = filesystem::temp_directory_path().string();
+    string outputFile = "";
+
+    try {
+        for (vector<string>::iterator i = args.begin(); i != args.end(); ++i) {
+            const bool hasValue = i + 1 != args.end();
+            if (*i == "-h" || *i == "--help") {
+                displayHelp();
+                return 0;
+            } else if (*i == "--sizes" && hasValue) {
+                faceSizes.clear();
+                for (const string& size : split(*++i, ","))
+                    faceSizes.push_back(stoi(size));
+            }
+            else if (*i == "--repetitions" && hasValue) {
+                repetitions = std::max(1, stoi(*++i));
+            }
+            else if ((*i == "-j" || *i == "--threads") && hasValue) {
+                numThreads = stoi(*++i);
+            }
+            else if (*i == "--filter" && hasValue) {
+                filter = *++i;
+            }
+            else if (*i == "--temp-dir" && hasValue) {
+                tempDirectory = *++i;
+            }
+            else if ((*i == "-o" || *i == "--output") && hasValue) {
+                outputFile = *++i;
+            } else {
+                cout << "unknown argument " << *i << "\n";
+                displayHelp();
+                return 1;
+            }
+        }
+    } catch (const logic_error&) {
+        cout << "invalid number in arguments\n";
+        displayHelp();
+        return 1;
+    }
+
+    ThreadPool threadPool(numThreads);
+    setGlobalThreadCount(threadPool.GetNumThreads());
+    ResamplingMatrixCache matrixCache;
+    OctMapConverter converter(threadPool, matrixCache);
+
+    CacheMissCounter cacheMissCounter;
+    if (!cacheMissCounter.Available())
+        cerr << "cache misses can not be counted on this system\n";
+    vector<BenchmarkResult> results;
+    auto run = [&](const string& name, int faceSize, size_t items, const function<void()>& body) {
+        if (name.find(filter) == string::npos)
+            return;
+        cerr << name << " " << faceSize << "\n";
+        results.push_back(runBenchmark(name, faceSize, items, repetitions, cacheMissCounter, body));
+    };
+
+    for (int faceSize : faceSizes) {
+        vector<float> cubemap;
+        makeSyntheticCubemap(faceSize, cubemap);
+        const int outputSize = faceSize;
+        const size_t numPixels = size_t(outputSize) * outputSize;
+
+        // the mapping functions on one direction per output pixel, single threaded.
+        vector<float> u(numPixels), v(numPixels), x(numPixels), y(numPixels), z(numPixels);
+        vector<int> face(numPixels);
+        for (int py = 0; py < outputSize; py++) {
+            for (int px = 0; px < outputSize; px++) {
+                const V2f coord = octMapPixelCenter(px, py, outputSize);
+                u[size_t(py) * outputSize + px] = coord.x;
+                v[size_t(py) * outputSize + px] = coord.y;
+            }
+        }
+        batchKernels().octDecode(u.data(), v.data(), x.data(), y.data(), z.data(), int(numPixels));
+        float checksum = 0.0f;
+        run("octDecode", faceSize, numPixels, [&] {
+            for (size_t i = 0; i < numPixels; i++)
+                checksum += octDecode(V2f(u[i], v[i])).x;
+        });
+        run("octEncode", faceSize, numPixels, [&] {
+            for (size_t i = 0; i < numPixels; i++)
+                checksum += octEncode(V3f(x[i], y[i], z[i])).x;
+        });
+        run("cubeEncode", faceSize, numPixels, [&] {
+            int faceIndex;
+            for (size_t i = 0; i < numPixels; i++)
+                checksum += cubeEncode(V3f(x[i], y[i], z[i]), &faceIndex).x;
+        });
+        vector<float> u2(numPixels), v2(numPixels);
+        run("octDecodeBatch", faceSize, numPixels, [&] {
+            batchKernels().octDecode(u.data(), v.data(), x.data(), y.data(), z.data(), int(numPixels));
+        });
+        run("octEncodeBatch", faceSize, numPixels, [&] {
+            batchKernels().octEncode(x.data(), y.data(), z.data(), u2.data(), v2.data(), int(numPixels));
+        });
+        run("cubeEncodeBatch", faceSize, numPixels, [&] {
+            batchKernels().cubeEncode(x.data(), y.data(), z.data(), u2.data(), v2.data(), face.data(), int(numPixels));
+        });
+        // all directions onto one face, as the padded resamplers project the taps of a pixel.
+        run("cubeFaceEncodeBatch", faceSize, numPixels, [&] {
+            batchKernels().cubeFaceEncode(4, x.data(), y.data(), z.data(), u2.data(), v2.data(), int(numPixels));
+        });
+        // keeps the scalar loops from being optimized away.
+        if (checksum == 12345.0f)
+            cerr << checksum << "\n";
+
+        // the conversion kernels on all threads.
+        vector<float> octmap;
+        const ResampleType resampleTypes[] = { NEAREST, BILINEAR, GAUSSIAN, MITCHELL };
+        for (ResampleType type : resampleTypes) {
+            ConversionSettings settings;
+            settings.resample.type = type;
+            run(string("convert_") + resampleTypeName(type), faceSize, numPixels, [&] {
+                convertImage(converter, settings, cubemap, faceSize, octmap);
+            });
+        }
+        // the reverse mapping, from the octmap of the last run back to the cubemap.
+        vector<float> cubemapBack(cubemap.size());
+        for (ResampleType type : resampleTypes) {
+            ConversionSettings settings;
+            settings.resample.type = type;
+            settings.resample.direction = OCTMAP_TO_CUBEMAP;
+            run(string("convert_to_cubemap_") + resampleTypeName(type), faceSize, cubemap.size() / 3, [&] {
+                ImageBuffer input;
+                input.data = octmap.data();
+                input.width = faceSize;
+                input.height = faceSize;
+                ImageBuffer output;
+                output.data = cubemapBack.data();
+                output.width = faceSize * 6;
+                output.height = faceSize;
+                converter.Convert(input, output, settings);
+            });
+        }
+        ConversionSettings transformSettings;
+        transformSettings.transform = true;
+        transformSettings.transformMatrix = M44f(0.8f, 0.1f, 0.1f, 0.0f,
+                                                 0.1f, 0.8f, 0.1f, 0.0f,
+                                                 0.1f, 0.1f, 0.8f, 0.0f,
+                                                 0.0f, 0.0f, 0.0f, 1.0f);
+        run("convert_mitchell_transform", faceSize, numPixels, [&] {
+            convertImage(converter, transformSettings, cubemap, faceSize, octmap);
+        });
+        ConversionSettings encodeSettings(transformSettings);
+        encodeSettings.encodeColor = true;
+        run("convert_mitchell_transform_encode", faceSize, numPixels, [&] {
+            convertImage(converter, encodeSettings, cubemap, faceSize, octmap);
+        });
+        // the packed encodings, transformed and encoded in a separate batched pass per band.
+        vector<half> halfCodes(numPixels * 2);
+        vector<uint32_t> uintCodes(numPixels * 2);
+        for (EncodeFormat format : { ENCODE_HALF2, ENCODE_UINT16 }) {
+            ConversionSettings packedSettings(encodeSettings);
+            packedSettings.encodeFormat = format;
+            run(string("convert_mitchell_transform_encode_") + encodeFormatName(format), faceSize, numPixels, [&] {
+                ImageBuffer input;
+                input.data = cubemap.data();
+                input.width = faceSize * 6;
+                input.height = faceSize;
+                ImageBuffer output;
+                output.data = format == ENCODE_HALF2 ? (void*)halfCodes.data() : (void*)uintCodes.data();
+                output.format = format == ENCODE_HALF2 ? BUFFER_HALF : BUFFER_UINT;
+                output.width = faceSize;
+                output.height = faceSize;
+                output.numChannels = 2;
+                converter.Convert(input, output, packedSettings);
+            });
+        }
+        ConversionSettings halfSettings;
+        halfSettings.halfOutput = true;
+        vector<half> halfOctmap(numPixels * 3);
+        run("convert_mitchell_half_output", faceSize, numPixels, [&] {
+            RowConverter converter = makeRowConverter(halfSettings, faceSize, outputSize);
+            threadPool.ParallelFor(0, outputSize, kRowsPerTask, [&](int yBegin, int yEnd) {
+                converter(cubemap.data(), halfOctmap.data() + size_t(yBegin) * outputSize * 3, yBegin, yEnd);
+            });
+        });
+        // the noise of the synthetic sky is up to a quarter of the sky color, so about a
+        // third of the pixels are resampled bilinearly at this tolerance.
+        ConversionSettings adaptiveSettings;
+        adaptiveSettings.resample.adaptiveTolerance = 0.25f;
+        run("convert_mitchell_adaptive", faceSize, numPixels, [&] {
+            convertImage(converter, adaptiveSettings, cubemap, faceSize, octmap);
+        });
+        // the conversion with the spherical harmonics projection of --sh-order 3 gathered
+        // band by band.
+        run("convert_mitchell_sh3", faceSize, numPixels, [&] {
+            ImageBuffer input;
+            input.data = cubemap.data();
+            input.width = faceSize * 6;
+            input.height = faceSize;
+            octmap.resize(numPixels * 3);
+            ImageBuffer output;
+            output.data = octmap.data();
+            output.width = outputSize;
+            output.height = outputSize;
+            SHAccumulator sh(3, outputSize, 3, kConvertRowsPerBand);
+            converter.Convert(input, output, ConversionSettings(), nullptr, nullptr, &sh);
+        });
+        // the importance sampling table of --sampling-table, from the octmap of the last run.
+        ImageBuffer samplingOctmap;
+        samplingOctmap.data = octmap.data();
+        samplingOctmap.width = outputSize;
+        samplingOctmap.height = outputSize;
+        SamplingTable samplingTable;
+        run("build_sampling_table", faceSize, numPixels, [&] {
+            samplingTable = converter.BuildSamplingTable(samplingOctmap);
+        });
+        // the GGX prefiltered chain of --ggx with the default number of taps.
+        vector<vector<float>> ggxMips;
+        run("build_ggx_mips", faceSize, numPixels, [&] {
+            ggxMips = buildGGXOctMapMips(octmap.data(), outputSize, 3, kDefaultGGXSamples, threadPool);
+        });
+        ConversionSettings defaultSettings;
+        if (string("build_matrix_mitchell").find(filter) != string::npos ||
+            string("convert_mitchell_precomputed").find(filter) != string::npos) {
+            shared_ptr<const ResamplingMatrix> matrix;
+            run("build_matrix_mitchell", faceSize, numPixels, [&] {
+                withResampler(defaultSettings.resample, faceSize, outputSize, [&](const auto& resampler) {
+                    matrix = buildResamplingMatrix(resampler, threadPool);
+                });
+            });
+            if (!matrix) {
+                withResampler(defaultSettings.resample, faceSize, outputSize, [&](const auto& resampler) {
+                    matrix = buildResamplingMatrix(resampler, threadPool);
+                });
+            }
+            run("convert_mitchell_precomputed", faceSize, numPixels, [&] {
+                convertImage(converter, defaultSettings, cubemap, faceSize, octmap, matrix);
+            });
+        }
+
+        // the tiled input layout. the input is tiled once up front, as the command line
+        // does for all outputs of a file, and the tiling is measured on its own.
+        ImageBuffer cubemapRows;
+        cubemapRows.data = cubemap.data();
+        cubemapRows.width = faceSize * 6;
+        cubemapRows.height = faceSize;
+        vector<char> tiledStorage;
+        ImageBuffer tiledCubemap;
+        run("tile_input", faceSize, cubemap.size() / 3, [&] {
+            tiledCubemap = converter.TileImage(cubemapRows, &tiledStorage);
+        });
+        if (!tiledCubemap.data)
+            tiledCubemap = converter.TileImage(cubemapRows, &tiledStorage);
+        ImageBuffer tiledOctmap;
+        tiledOctmap.data = octmap.data();
+        tiledOctmap.width = faceSize;
+        tiledOctmap.height = faceSize;
+        for (ResampleType type : { BILINEAR, MITCHELL }) {
+            ConversionSettings settings;
+            settings.resample.type = type;
+            settings.resample.tiledInput = true;
+            run(string("convert_") + resampleTypeName(type) + "_tiled", faceSize, numPixels, [&] {
+                converter.Convert(tiledCubemap, tiledOctmap, settings);
+            });
+        }
+        if (string("convert_mitchell_precomputed_tiled").find(filter) != string::npos) {
+            ConversionSettings settings;
+            settings.resample.tiledInput = true;
+            shared_ptr<const ResamplingMatrix> matrix = converter.GetMatrix(settings.resample, faceSize, outputSize);
+            run("convert_mitchell_precomputed_tiled", faceSize, numPixels, [&] {
+                converter.Convert(tiledCubemap, tiledOctmap, settings, matrix);
+            });
+        }
+
+        // the padded input layout, padded once up front like the tiled one, with the
+        // border of each resampling.
+        for (ResampleType type : { BILINEAR, MITCHELL }) {
+            ConversionSettings settings;
+            settings.resample.type = type;
+            settings.resample.paddedInput = true;
+            const int border = paddedFaceBorder(settings.resample, faceSize, outputSize);
+            vector<char> paddedStorage;
+            ImageBuffer paddedCubemap;
+            run(string("pad_input_") + resampleTypeName(type), faceSize, cubemap.size() / 3, [&] {
+                paddedCubemap = converter.PadImage(cubemapRows, border, &paddedStorage);
+            });
+            if (!paddedCubemap.data)
+                paddedCubemap = converter.PadImage(cubemapRows, border, &paddedStorage);
+            run(string("convert_") + resampleTypeName(type) + "_padded", faceSize, numPixels, [&] {
+                converter.Convert(paddedCubemap, tiledOctmap, settings);
+            });
+        }
+
+        // read, convert and write through files, once per compression. the input is
+        // written with the same compression as the output.
+        const pair<const char*, Compression> compressions[] = {
+            { "none", NO_COMPRESSION }, { "rle", RLE_COMPRESSION }, { "zips", ZIPS_COMPRESSION },
+            { "zip", ZIP_COMPRESSION }, { "piz", PIZ_COMPRESSION }, { "pxr24", PXR24_COMPRESSION },
+            { "b44", B44_COMPRESSION }, { "b44a", B44A_COMPRESSION }, { "dwaa", DWAA_COMPRESSION },
+            { "dwab", DWAB_COMPRESSION } };
+        for (const auto& compression : compressions) {
+            const string name = string("read_convert_write_") + compression.first;
+            if (name.find(filter) == string::npos)
+                continue;
+            const string inputPath = (filesystem::path(tempDirectory) / ("octmap_benchmark_in_" + to_string(faceSize) + ".exr")).string();
+            const string outputPath = (filesystem::path(tempDirectory) / ("octmap_benchmark_out_" + to_string(faceSize) + ".exr")).string();
+            try {
+                writeRGB(inputPath, cubemap.data(), faceSize * 6, faceSize, compression.second);
+                run(name, faceSize, numPixels, [&] {
+                    vector<float> input;
+                    int width, height;
+                    readRGB(inputPath, input, width, height);
+                    convertImage(converter, defaultSettings, input, height, octmap);
+                    writeRGB(outputPath, octmap.data(), height, height, compression.second);
+                });
+            } catch (const std::exception& e) {
+                cerr << "error: " << e.what() << "\n";
+            }
+            std::error_code error;
+            filesystem::remove(inputPath, error);
+            filesystem::remove(outputPath, error);
+        }
+    }
+
+    if (outputFile.empty()) {
+        writeJson(cout, results, threadPool.GetNumThreads());
+    } else {
+        ofstream out(outputFile);
+        writeJson(out, results, threadPool.GetNumThreads());
+        if (!out) {
+            cerr << "error: could not write " << outputFile << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
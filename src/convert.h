@@ -0,0 +1,500 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+#include "IlmBase/Half/half.h"
+#include "IlmBase/Imath/ImathMatrix.h"
+#include "IlmBase/Imath/ImathVec.h"
+
+#include "adaptive.h"
+#include "encode.h"
+#include "octmaputil.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+
+// Everything that determines how the color of an output pixel is computed.
+struct ConversionSettings {
+    ResampleSettings resample;
+
+    // transforms the resampled colors by transformMatrix.
+    bool transform = false;
+    Imath::Matrix44<float> transformMatrix;
+
+    // treats the (already transformed) color as direction vector and encodes it as
+    // octmap uv coordinate in RG.
+    bool encodeColor = false;
+    // how encodeColor stores the uv. The packed formats are produced by
+    // makeRowPostProcessor, in two channels.
+    EncodeFormat encodeFormat = ENCODE_RGB;
+
+    // storage type of the input and output pixels in memory. half input is widened
+    // to float when a texel is loaded, all filtering is done in float.
+    bool halfInput = false;
+    bool halfOutput = false;
+};
+
+// Converts the output rows [yBegin, yEnd). input and output are the interleaved RGB
+// 6:1 cubemap strip and octmap, in the order given by the mapping direction of the
+// resample settings, each stored as half or float as given by ConversionSettings.
+// input holds the whole image, output points to row yBegin, so that a band can be
+// converted into a buffer of its own rows. The face and octmap sizes are bound when
+// the converter is created.
+typedef std::function<void(const void* input, void* output, int yBegin, int yEnd)> RowConverter;
+
+template <class T>
+Imath::V3f loadTexel(const T* texel) {
+    return Imath::V3f(float(texel[0]), float(texel[1]), float(texel[2]));
+}
+
+// Applies the color transformation and direction encoding to a resampled color.
+template <bool Transform, bool Encode>
+struct ColorPostProcess {
+    Imath::Matrix44<float> transformMatrix;
+
+    Imath::V3f operator()(Imath::V3f col) const {
+        if constexpr (Transform) {
+            Imath::V3f transformedCol;
+            transformMatrix.multVecMatrix(col, transformedCol);
+            col = transformedCol;
+        }
+        if constexpr (Encode) {
+            col = col * 2 - Imath::V3f(1, 1, 1);
+            Imath::V2f uv = octEncode(col);
+            col[0] = (uv[0] + 1) * 0.5f;
+            col[1] = (uv[1] + 1) * 0.5f;
+            col[2] = 0;
+        }
+        return col;
+    }
+};
+
+// Number of columns of the tiles the resampling kernels walk the rows of a task in.
+// Neighbouring output pixels share most of their input texels, so finishing a tile
+// before moving on keeps the texels of all rows of the task in the cache, instead of
+// reloading them for every row.
+const int kOutputTileWidth = 16;
+
+// The conversion body. It is instantiated for every combination of resampler, post
+// process and storage types, so that no per-pixel decision has to be made at runtime.
+template <class Resampler, class PostProcess, class InputT, class OutputT>
+void convertRows(
+    const Resampler& resampler,
+    const PostProcess& postProcess,
+    const InputT* input,
+    OutputT* output,
+    int yBegin,
+    int yEnd)
+{
+    const size_t inputStride = size_t(resampler.inputWidth()) * 3;
+    const size_t outputStride = size_t(resampler.outputWidth()) * 3;
+    const int outputWidth = resampler.outputWidth();
+    for (int xBegin = 0; xBegin < outputWidth; xBegin += kOutputTileWidth) {
+        const int xEnd = std::min(outputWidth, xBegin + kOutputTileWidth);
+        for (int y = yBegin; y < yEnd; y++) {
+            OutputT* outputRow = output + size_t(y - yBegin) * outputStride;
+            for (int x = xBegin; x < xEnd; x++) {
+                Imath::V3f col(0, 0, 0);
+                resampler(x, y, [&](int inputPixX, int inputPixY, float w) {
+                    col += loadTexel(input + inputPixY * inputStride + size_t(inputPixX) * 3) * w;
+                });
+                col = postProcess(col);
+                for (int c = 0; c < 3; c++) {
+                    outputRow[x * 3 + c] = col[c];
+                }
+            }
+        }
+    }
+}
+
+// Same as convertRows, but gathers the input through a precomputed resampling matrix.
+// The pixels are visited row by row, so that the matrix is read sequentially.
+template <class PostProcess, class InputT, class OutputT>
+void gatherRows(
+    const ResamplingMatrix& matrix,
+    const PostProcess& postProcess,
+    const InputT* input,
+    OutputT* output,
+    int yBegin,
+    int yEnd)
+{
+    const size_t outputStride = size_t(matrix.outputWidth) * 3;
+    for (int y = yBegin; y < yEnd; y++) {
+        OutputT* outputRow = output + size_t(y - yBegin) * outputStride;
+        for (int x = 0; x < matrix.outputWidth; x++) {
+            Imath::V3f col(0, 0, 0);
+            size_t row = size_t(y) * matrix.outputWidth + x;
+            for (uint64_t t = matrix.rowStart[row]; t < matrix.rowStart[row + 1]; t++) {
+                col += loadTexel(input + size_t(matrix.inputIndex[t]) * 3) * matrix.weight[t];
+            }
+            col = postProcess(col);
+            for (int c = 0; c < 3; c++) {
+                outputRow[x * 3 + c] = col[c];
+            }
+        }
+    }
+}
+
+template <bool Transform, bool Encode, class InputT, class OutputT>
+RowConverter makeRowConverter(
+    const ConversionSettings& settings,
+    int faceSize,
+    int octMapSize,
+    std::shared_ptr<const ResamplingMatrix> matrix,
+    std::shared_ptr<const KernelMask> kernelMask)
+{
+    ColorPostProcess<Transform, Encode> postProcess{settings.transformMatrix};
+    if (matrix) {
+        return [=](const void* input, void* output, int yBegin, int yEnd) {
+            gatherRows(*matrix, postProcess, static_cast<const InputT*>(input),
+                       static_cast<OutputT*>(output), yBegin, yEnd);
+        };
+    }
+    RowConverter converter;
+    withResampler(settings.resample, faceSize, octMapSize, kernelMask, [&](const auto& resampler) {
+        converter = [=](const void* input, void* output, int yBegin, int yEnd) {
+            convertRows(resampler, postProcess, static_cast<const InputT*>(input),
+                        static_cast<OutputT*>(output), yBegin, yEnd);
+        };
+    });
+    return converter;
+}
+
+template <class InputT, class OutputT>
+RowConverter makeRowConverter(
+    const ConversionSettings& settings,
+    int faceSize,
+    int octMapSize,
+    std::shared_ptr<const ResamplingMatrix> matrix,
+    std::shared_ptr<const KernelMask> kernelMask)
+{
+    if (settings.transform) {
+        if (settings.encodeColor)
+            return makeRowConverter<true, true, InputT, OutputT>(settings, faceSize, octMapSize, matrix, kernelMask);
+        return makeRowConverter<true, false, InputT, OutputT>(settings, faceSize, octMapSize, matrix, kernelMask);
+    }
+    if (settings.encodeColor)
+        return makeRowConverter<false, true, InputT, OutputT>(settings, faceSize, octMapSize, matrix, kernelMask);
+    return makeRowConverter<false, false, InputT, OutputT>(settings, faceSize, octMapSize, matrix, kernelMask);
+}
+
+// Picks the conversion kernel instantiation for the given settings and sizes. If matrix
+// is set, the kernel gathers through it instead of resampling. If kernelMask is set,
+// filtered resampling is adaptive as given by the mask, which has to be built from the
+// input the converter is called with. Throws std::invalid_argument if both are set.
+inline RowConverter makeRowConverter(
+    const ConversionSettings& settings,
+    int faceSize,
+    int octMapSize,
+    std::shared_ptr<const ResamplingMatrix> matrix = nullptr,
+    std::shared_ptr<const KernelMask> kernelMask = nullptr)
+{
+    if (matrix && kernelMask) {
+        throw std::invalid_argument("adaptive resampling can not be gathered through a resampling matrix");
+    }
+    if (settings.halfInput) {
+        if (settings.halfOutput)
+            return makeRowConverter<half, half>(settings, faceSize, octMapSize, matrix, kernelMask);
+        return makeRowConverter<half, float>(settings, faceSize, octMapSize, matrix, kernelMask);
+    }
+    if (settings.halfOutput)
+        return makeRowConverter<float, half>(settings, faceSize, octMapSize, matrix, kernelMask);
+    return makeRowConverter<float, float>(settings, faceSize, octMapSize, matrix, kernelMask);
+}
+
+// Applies the color post process of a ConversionSettings to the resampled float rows
+// [yBegin, yEnd) of input and stores them in output, as half or float as given by
+// settings.halfOutput, or as the two channels of a packed settings.encodeFormat. The
+// rows are width pixels wide, input and output point to row yBegin. Used when several outputs share one resampling pass, and
+// for packed encodings.
+typedef std::function<void(const float* input, void* output, int yBegin, int yEnd)> RowPostProcessor;
+
+template <class PostProcess, class OutputT>
+void postProcessRows(const PostProcess& postProcess, int width, const float* input, OutputT* output, int yBegin, int yEnd) {
+    const size_t stride = size_t(width) * 3;
+    for (int y = yBegin; y < yEnd; y++) {
+        const float* inputRow = input + size_t(y - yBegin) * stride;
+        OutputT* outputRow = output + size_t(y - yBegin) * stride;
+        for (int x = 0; x < width; x++) {
+            Imath::V3f col = postProcess(loadTexel(inputRow + x * 3));
+            for (int c = 0; c < 3; c++) {
+                outputRow[x * 3 + c] = col[c];
+            }
+        }
+    }
+}
+
+template <bool Transform, bool Encode>
+RowPostProcessor makeRowPostProcessor(const ConversionSettings& settings, int width) {
+    ColorPostProcess<Transform, Encode> postProcess{settings.transformMatrix};
+    if (settings.halfOutput) {
+        return [=](const float* input, void* output, int yBegin, int yEnd) {
+            postProcessRows(postProcess, width, input, static_cast<half*>(output), yBegin, yEnd);
+        };
+    }
+    return [=](const float* input, void* output, int yBegin, int yEnd) {
+        postProcessRows(postProcess, width, input, static_cast<float*>(output), yBegin, yEnd);
+    };
+}
+
+inline RowPostProcessor makeRowPostProcessor(const ConversionSettings& settings, int width) {
+    if (settings.encodeColor && settings.encodeFormat != ENCODE_RGB) {
+        const bool transform = settings.transform;
+        const Imath::Matrix44<float> transformMatrix = settings.transformMatrix;
+        if (settings.encodeFormat == ENCODE_HALF2) {
+            return [=](const float* input, void* output, int yBegin, int yEnd) {
+                encodeRows(transform ? &transformMatrix : nullptr, width, input, static_cast<half*>(output), yBegin, yEnd);
+            };
+        }
+        return [=](const float* input, void* output, int yBegin, int yEnd) {
+            encodeRows(transform ? &transformMatrix : nullptr, width, input, static_cast<uint32_t*>(output), yBegin, yEnd);
+        };
+    }
+    if (settings.transform) {
+        if (settings.encodeColor)
+            return makeRowPostProcessor<true, true>(settings, width);
+        return makeRowPostProcessor<true, false>(settings, width);
+    }
+    if (settings.encodeColor)
+        return makeRowPostProcessor<false, true>(settings, width);
+    return makeRowPostProcessor<false, false>(settings, width);
+}
+
+// Converts the output rows [yBegin, yEnd) of an image with numChannels interleaved
+// channels, e.g. all layers of a multi-layer file. Every channel goes through the same
+// taps, so the mapping is computed once per pixel no matter how many channels there
+// are. There is no color post process, since the channels are not known to be colors.
+// input is stored as half or float as given by the converter, output is float and
+// points to row yBegin.
+typedef std::function<void(const void* input, float* output, int yBegin, int yEnd)> ChannelRowConverter;
+
+template <class Resampler, class InputT>
+void convertChannelRows(
+    const Resampler& resampler,
+    int numChannels,
+    const InputT* input,
+    float* output,
+    int yBegin,
+    int yEnd)
+{
+    const size_t inputStride = size_t(resampler.inputWidth()) * numChannels;
+    const size_t outputStride = size_t(resampler.outputWidth()) * numChannels;
+    const int outputWidth = resampler.outputWidth();
+    for (int xBegin = 0; xBegin < outputWidth; xBegin += kOutputTileWidth) {
+        const int xEnd = std::min(outputWidth, xBegin + kOutputTileWidth);
+        for (int y = yBegin; y < yEnd; y++) {
+            float* outputRow = output + size_t(y - yBegin) * outputStride;
+            for (int x = xBegin; x < xEnd; x++) {
+                float* col = outputRow + x * numChannels;
+                std::fill(col, col + numChannels, 0.0f);
+                resampler(x, y, [&](int inputPixX, int inputPixY, float w) {
+                    const InputT* texel = input + inputPixY * inputStride + size_t(inputPixX) * numChannels;
+                    for (int c = 0; c < numChannels; c++) {
+                        col[c] += float(texel[c]) * w;
+                    }
+                });
+            }
+        }
+    }
+}
+
+template <class InputT>
+void gatherChannelRows(
+    const ResamplingMatrix& matrix,
+    int numChannels,
+    const InputT* input,
+    float* output,
+    int yBegin,
+    int yEnd)
+{
+    const size_t outputStride = size_t(matrix.outputWidth) * numChannels;
+    for (int y = yBegin; y < yEnd; y++) {
+        float* outputRow = output + size_t(y - yBegin) * outputStride;
+        for (int x = 0; x < matrix.outputWidth; x++) {
+            float* col = outputRow + x * numChannels;
+            std::fill(col, col + numChannels, 0.0f);
+            size_t row = size_t(y) * matrix.outputWidth + x;
+            for (uint64_t t = matrix.rowStart[row]; t < matrix.rowStart[row + 1]; t++) {
+                const InputT* texel = input + size_t(matrix.inputIndex[t]) * numChannels;
+                for (int c = 0; c < numChannels; c++) {
+                    col[c] += float(texel[c]) * matrix.weight[t];
+                }
+            }
+        }
+    }
+}
+
+template <class InputT>
+ChannelRowConverter makeChannelRowConverter(
+    const ResampleSettings& resample,
+    int numChannels,
+    int faceSize,
+    int octMapSize,
+    std::shared_ptr<const ResamplingMatrix> matrix,
+    std::shared_ptr<const KernelMask> kernelMask)
+{
+    if (matrix) {
+        return [=](const void* input, float* output, int yBegin, int yEnd) {
+            gatherChannelRows(*matrix, numChannels, static_cast<const InputT*>(input), output, yBegin, yEnd);
+        };
+    }
+    ChannelRowConverter converter;
+    withResampler(resample, faceSize, octMapSize, kernelMask, [&](const auto& resampler) {
+        converter = [=](const void* input, float* output, int yBegin, int yEnd) {
+            convertChannelRows(resampler, numChannels, static_cast<const InputT*>(input), output, yBegin, yEnd);
+        };
+    });
+    return converter;
+}
+
+inline ChannelRowConverter makeChannelRowConverter(
+    const ResampleSettings& resample,
+    bool halfInput,
+    int numChannels,
+    int faceSize,
+    int octMapSize,
+    std::shared_ptr<const ResamplingMatrix> matrix = nullptr,
+    std::shared_ptr<const KernelMask> kernelMask = nullptr)
+{
+    if (matrix && kernelMask) {
+        throw std::invalid_argument("adaptive resampling can not be gathered through a resampling matrix");
+    }
+    if (halfInput)
+        return makeChannelRowConverter<half>(resample, numChannels, faceSize, octMapSize, matrix, kernelMask);
+    return makeChannelRowConverter<float>(resample, numChannels, faceSize, octMapSize, matrix, kernelMask);
+}
+
+// Streaming conversion. Instead of converting rows from a fully loaded input, the
+// output is produced in bands, each accumulated from one or more input row ranges.
+// Since the resampling weights are normalized, the weighted sums of several partial
+// input ranges add up to the same result, and the post process is applied once the
+// band has seen all of its input rows.
+// The taps of a single pixel lie within a few rows of the input, except for pixels
+// next to the seams of the faces, so the input rows of every pixel are determined once
+// per band and each input range only resamples the pixels it has taps of. That keeps
+// the resampling work at about twice that of a conversion in memory, no matter in how
+// many ranges the input is read. The rows a whole band needs can still span nearly the
+// whole input, the rows near the top of an octmap take in the whole top face.
+// Every buffer holds only the rows passed with it and points to the first of them: input
+// to row inputYBegin, output and ranges to row yBegin. The input is stored as given by
+// ConversionSettings::halfInput, the output bands are always float, so that the partial
+// sums keep their precision.
+struct StreamingConverter {
+    // Stores the input rows [ranges[2 * i], ranges[2 * i + 1]) the taps of pixel
+    // i = (y - yBegin) * outputWidth + x read from, for every pixel of the output rows
+    // [yBegin, yEnd).
+    std::function<void(int32_t* ranges, int yBegin, int yEnd)> inputRows;
+
+    // Adds the contribution of the input rows [inputYBegin, inputYEnd) to the output
+    // rows [yBegin, yEnd). Only pixels whose ranges, as stored by inputRows, overlap the
+    // input rows are resampled.
+    std::function<void(const void* input, int inputYBegin, int inputYEnd, const int32_t* ranges,
+                       float* output, int yBegin, int yEnd)> accumulate;
+
+    // Applies the color post process to the fully accumulated output rows [yBegin, yEnd).
+    std::function<void(float* output, int yBegin, int yEnd)> finish;
+};
+
+template <class Resampler>
+void inputRowRanges(const Resampler& resampler, int32_t* ranges, int yBegin, int yEnd) {
+    const int outputWidth = resampler.outputWidth();
+    for (int y = yBegin; y < yEnd; y++) {
+        int32_t* rowRanges = ranges + ptrdiff_t(y - yBegin) * outputWidth * 2;
+        for (int x = 0; x < outputWidth; x++) {
+            int yMin = resampler.inputHeight();
+            int yMax = -1;
+            resampler(x, y, [&](int, int inputPixY, float) {
+                yMin = std::min(yMin, inputPixY);
+                yMax = std::max(yMax, inputPixY);
+            });
+            rowRanges[x * 2] = yMin;
+            rowRanges[x * 2 + 1] = yMax + 1;
+        }
+    }
+}
+
+template <class Resampler, class InputT>
+void accumulateRows(
+    const Resampler& resampler,
+    const InputT* input,
+    int inputYBegin,
+    int inputYEnd,
+    const int32_t* ranges,
+    float* output,
+    int yBegin,
+    int yEnd)
+{
+    const ptrdiff_t inputStride = ptrdiff_t(resampler.inputWidth()) * 3;
+    const ptrdiff_t outputStride = ptrdiff_t(resampler.outputWidth()) * 3;
+    for (int y = yBegin; y < yEnd; y++) {
+        float* outputRow = output + (y - yBegin) * outputStride;
+        const int32_t* rowRanges = ranges + ptrdiff_t(y - yBegin) * resampler.outputWidth() * 2;
+        for (int x = 0; x < resampler.outputWidth(); x++) {
+            if (rowRanges[x * 2 + 1] <= inputYBegin || rowRanges[x * 2] >= inputYEnd)
+                continue;
+            Imath::V3f col(0, 0, 0);
+            resampler(x, y, [&](int inputPixX, int inputPixY, float w) {
+                if (inputPixY < inputYBegin || inputPixY >= inputYEnd)
+                    return;
+                col += loadTexel(input + (inputPixY - inputYBegin) * inputStride + inputPixX * 3) * w;
+            });
+            for (int c = 0; c < 3; c++) {
+                outputRow[x * 3 + c] += col[c];
+            }
+        }
+    }
+}
+
+template <bool Transform, bool Encode, class InputT>
+StreamingConverter makeStreamingConverter(const ConversionSettings& settings, int faceSize, int octMapSize) {
+    ColorPostProcess<Transform, Encode> postProcess{settings.transformMatrix};
+    StreamingConverter converter;
+    withResampler(settings.resample, faceSize, octMapSize, [&](const auto& resampler) {
+        // shared, so that the tabulated taps of filtered resamplers are not copied.
+        auto sharedResampler = std::make_shared<const std::decay_t<decltype(resampler)>>(resampler);
+        converter.inputRows = [=](int32_t* ranges, int yBegin, int yEnd) {
+            inputRowRanges(*sharedResampler, ranges, yBegin, yEnd);
+        };
+        converter.accumulate = [=](const void* input, int inputYBegin, int inputYEnd, const int32_t* ranges,
+                                   float* output, int yBegin, int yEnd) {
+            accumulateRows(*sharedResampler, static_cast<const InputT*>(input), inputYBegin, inputYEnd,
+                           ranges, output, yBegin, yEnd);
+        };
+        const int outputWidth = resampler.outputWidth();
+        converter.finish = [=](float* output, int yBegin, int yEnd) {
+            postProcessRows(postProcess, outputWidth, output, output, yBegin, yEnd);
+        };
+    });
+    return converter;
+}
+
+template <class InputT>
+StreamingConverter makeStreamingConverter(const ConversionSettings& settings, int faceSize, int octMapSize) {
+    if (settings.transform) {
+        if (settings.encodeColor)
+            return makeStreamingConverter<true, true, InputT>(settings, faceSize, octMapSize);
+        return makeStreamingConverter<true, false, InputT>(settings, faceSize, octMapSize);
+    }
+    if (settings.encodeColor)
+        return makeStreamingConverter<false, true, InputT>(settings, faceSize, octMapSize);
+    return makeStreamingConverter<false, false, InputT>(settings, faceSize, octMapSize);
+}
+
+// Picks the streaming kernel instantiation for the given settings and sizes.
+inline StreamingConverter makeStreamingConverter(const ConversionSettings& settings, int faceSize, int octMapSize) {
+    if (settings.halfInput)
+        return makeStreamingConverter<half>(settings, faceSize, octMapSize);
+    return makeStreamingConverter<float>(settings, faceSize, octMapSize);
+}
+
+#endif  // CONVERT_H
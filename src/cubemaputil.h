@@ -5,6 +5,7 @@
 #ifndef CUBEMAP_UTIL_H
 #define CUBEMAP_UTIL_H
 
+#include <algorithm>
 #include <cmath>
 
 #include "IlmBase/Imath/ImathVec.h"
@@ -24,7 +25,7 @@
 // if this is defined, each face of the cubemap is teated as horizontally mirrored (except for top and bottom, which are vertically mirrored),
 // which again is how V-Ray and Keyshot output their cubemaps.
 
-Imath::V2f sampleCube(
+inline Imath::V2f sampleCube(
     const Imath::V3f& v,
     int* faceIndex)
 {
@@ -61,84 +62,161 @@ Imath::V2f sampleCube(
     return (uv * ma) + Imath::V2f(0.5f,0.5f);
 }
 
+/** Returns the index of the face v points to, the face sampleCube picks. v does not
+    have to be normalized. */
+inline int cubeFace(const Imath::V3f& v) {
+    const Imath::V3f vAbs(std::abs(v.x), std::abs(v.y), std::abs(v.z));
+    if (vAbs.z >= vAbs.x && vAbs.z >= vAbs.y)
+        return v.z < 0 ? 5 : 4;
+    if (vAbs.y >= vAbs.x)
+        return v.y < 0 ? 3 : 2;
+    return v.x < 0 ? 1 : 0;
+}
+
 /** Assumes that v is a unit vector. The result is a cubemap vector on the [0, 1] square. */
-Imath::V2f cubeEncode(const Imath::V3f& v, int* face_out) {
+inline Imath::V2f cubeEncode(const Imath::V3f& v, int* face_out) {
     Imath::V2f uv = sampleCube(v, face_out);
     uv.x = std::clamp(uv.x, 0.0f, 1.0f);
     uv.y = std::clamp(uv.y, 0.0f, 1.0f);
     return uv;
 }
 
-/** Returns a unit vector. Argument o is an cubemap vector packed via cubeEncode,
-    on the [0, +1] square*/
-Imath::V3f cubeDecode(const Imath::V2f& o) {
-    float tmp;
-    float u = std::modf(o.x, &tmp);
-    if (u < 0)
-        u = 1.0f + u;
-    float v = std::modf(o.y, &tmp);
-    if (v < 0)
-        v = 1.0f + u;
-
+/** Returns a unit vector. face is the index of a face in the order above and (u, v) a
+    coordinate on it, on the [-1, +1] square. Coordinates outside of the square extend the
+    plane of the face, so they map to the directions across its edges. */
+inline Imath::V3f cubeFaceDecode(int face, float u, float v) {
     Imath::V3f res;
-
-    v = v * 2.0f - 1.0f;
-    u *= 6.0f;
-    if (u < 1.0f) { // Right, +X
-        u = (u-0.5) * 2.0f;
+    switch (face) {
+    case 0: // Right, +X
 #ifdef MIRROR_FACES
         u = -u;
 #endif
-       res.x = 1.0f;
-       res.y = v;
-       res.z = u;
-    }
-    else if (u < 2.0f) { // Left, -X
-        u = (u-1.5f) * 2.0f;
+        res.x = 1.0f;
+        res.y = v;
+        res.z = u;
+        break;
+    case 1: // Left, -X
 #ifdef MIRROR_FACES
         u = -u;
 #endif
         res.x = -1.0f;
         res.y = v;
         res.z = -u;
-    }
-    else if (u < 3.0f) { // Top, +Y
-        u = (u-2.5f) * 2.0f;
+        break;
+    case 2: // Top, +Y
 #ifdef MIRROR_FACES
         v = -v;
 #endif
         res.x = u;
         res.y = 1.0f;
         res.z = v;
-    }
-    else if (u < 4.0f) { // Bottom, -Y
-        u = (u-3.5f) * 2.0f;
+        break;
+    case 3: // Bottom, -Y
 #ifdef MIRROR_FACES
         v = -v;
 #endif
         res.x = u;
         res.y = -1.0f;
         res.z = -v;
-    }
-    else if (u < 5.0f) { // Back, +Z
-        u = (u-4.5f) * 2.0f;
+        break;
+    case 4: // Back, +Z
 #ifdef MIRROR_FACES
         u = -u;
 #endif
         res.x = -u;
         res.y = v;
         res.z = 1.0f;
-    }
-    else { // Front, -Z
-        u = (u-5.5f) * 2.0f;
+        break;
+    default: // Front, -Z
 #ifdef MIRROR_FACES
         u = -u;
 #endif
         res.x = u;
         res.y = v;
         res.z = -1.0f;
+        break;
     }
     return res.normalized();
 }
 
+/** Returns the normal of face and the directions in which its coordinates u and v grow,
+    so that cubeFaceDecode(face, u, v) is the normalized normal + u * uAxis + v * vAxis. */
+inline void cubeFaceAxes(int face, Imath::V3f* normal, Imath::V3f* uAxis, Imath::V3f* vAxis) {
+    switch (face) {
+    case 0: // Right, +X
+        *normal = Imath::V3f(1.0f, 0.0f, 0.0f);
+        *uAxis = Imath::V3f(0.0f, 0.0f, 1.0f);
+        *vAxis = Imath::V3f(0.0f, 1.0f, 0.0f);
+        break;
+    case 1: // Left, -X
+        *normal = Imath::V3f(-1.0f, 0.0f, 0.0f);
+        *uAxis = Imath::V3f(0.0f, 0.0f, -1.0f);
+        *vAxis = Imath::V3f(0.0f, 1.0f, 0.0f);
+        break;
+    case 2: // Top, +Y
+        *normal = Imath::V3f(0.0f, 1.0f, 0.0f);
+        *uAxis = Imath::V3f(1.0f, 0.0f, 0.0f);
+        *vAxis = Imath::V3f(0.0f, 0.0f, 1.0f);
+        break;
+    case 3: // Bottom, -Y
+        *normal = Imath::V3f(0.0f, -1.0f, 0.0f);
+        *uAxis = Imath::V3f(1.0f, 0.0f, 0.0f);
+        *vAxis = Imath::V3f(0.0f, 0.0f, -1.0f);
+        break;
+    case 4: // Back, +Z
+        *normal = Imath::V3f(0.0f, 0.0f, 1.0f);
+        *uAxis = Imath::V3f(-1.0f, 0.0f, 0.0f);
+        *vAxis = Imath::V3f(0.0f, 1.0f, 0.0f);
+        break;
+    default: // Front, -Z
+        *normal = Imath::V3f(0.0f, 0.0f, -1.0f);
+        *uAxis = Imath::V3f(1.0f, 0.0f, 0.0f);
+        *vAxis = Imath::V3f(0.0f, 1.0f, 0.0f);
+        break;
+    }
+#ifdef MIRROR_FACES
+    if (face == 2 || face == 3)
+        *vAxis = -*vAxis;
+    else
+        *uAxis = -*uAxis;
+#endif
+}
+
+/** The inverse of cubeFaceDecode: returns the coordinate of direction v on face, on the
+    [-1, +1] square if v points to the face. Directions that point to a neighbouring face
+    but lie in front of the plane of face give coordinates outside of the square, on the
+    extension of the plane. */
+inline Imath::V2f cubeFaceEncode(int face, const Imath::V3f& v) {
+    Imath::V3f normal, uAxis, vAxis;
+    cubeFaceAxes(face, &normal, &uAxis, &vAxis);
+    const float scale = 1.0f / normal.dot(v);
+    return Imath::V2f(uAxis.dot(v) * scale, vAxis.dot(v) * scale);
+}
+
+/** Returns a unit vector. Argument o is an cubemap vector packed via cubeEncode,
+    on the [0, +1] square*/
+inline Imath::V3f cubeDecode(const Imath::V2f& o) {
+    float tmp;
+    float u = std::modf(o.x, &tmp);
+    if (u < 0)
+        u = 1.0f + u;
+    float v = std::modf(o.y, &tmp);
+    if (v < 0)
+        v = 1.0f + u;
+
+    v = v * 2.0f - 1.0f;
+    u *= 6.0f;
+    const int face = std::min(5, int(u));
+    u = (u - (face + 0.5f)) * 2.0f;
+    return cubeFaceDecode(face, u, v);
+}
+
+// Returns the face of the center of pixel (x, y) of a 6:1 strip with faces of faceSize
+// x faceSize pixels in *face, and its coordinate on the face on the [-1, +1] square.
+inline Imath::V2f cubeMapPixelCenter(int x, int y, int faceSize, int* face) {
+    *face = std::min(5, x / faceSize);
+    const int faceX = x - *face * faceSize;
+    return Imath::V2f(((faceX + 0.5f) / faceSize) * 2.0f - 1.0f, 1.0f - ((y + 0.5f) / faceSize) * 2.0f);
+}
+
 #endif  // CUBEMAP_UTIL_H
\ No newline at end of file
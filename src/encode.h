@@ -0,0 +1,162 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "IlmBase/Half/half.h"
+#include "IlmBase/Imath/ImathMatrix.h"
+
+#include "batchkernels.h"
+
+// Storage of the octmap uv coordinates of encoded directions. All formats store the
+// [-1, +1] uv mapped to [0, 1].
+enum EncodeFormat {
+    // R and G, plus a constant B = 0, in the pixel type of the output.
+    ENCODE_RGB,
+    // R and G as half.
+    ENCODE_HALF2,
+    // R and G as 16 bit unsigned normalized codes, 0 to 65535 for [0, 1], held in 32 bit
+    // unsigned int channels, since OpenEXR has no 16 bit integer type.
+    ENCODE_UINT16
+};
+
+inline const char* encodeFormatName(EncodeFormat format) {
+    switch (format) {
+        case ENCODE_RGB: return "rgb";
+        case ENCODE_HALF2: return "half2";
+        case ENCODE_UINT16: return "uint16";
+    }
+    return "unknown";
+}
+
+// The codes of a packed encoding. For the uv value t of a pixel, bracket returns the two
+// neighbouring codes lo <= t <= hi, value maps a code back to [0, 1].
+template <class CodeT>
+struct UVQuantizer;
+
+template <>
+struct UVQuantizer<half> {
+    static void bracket(float t, half* lo, half* hi) {
+        const half nearest(t);
+        // the uv lies in [0, 1], where consecutive bit patterns are consecutive values.
+        half neighbour;
+        if (float(nearest) <= t) {
+            neighbour.setBits(nearest.bits() + (nearest < half(1.0f) ? 1 : 0));
+            *lo = nearest;
+            *hi = neighbour;
+        } else {
+            neighbour.setBits(nearest.bits() - (nearest.bits() > 0 ? 1 : 0));
+            *lo = neighbour;
+            *hi = nearest;
+        }
+    }
+    static float value(half code) { return float(code); }
+};
+
+template <>
+struct UVQuantizer<uint32_t> {
+    static void bracket(float t, uint32_t* lo, uint32_t* hi) {
+        const float scaled = std::clamp(t, 0.0f, 1.0f) * 65535.0f;
+        *lo = uint32_t(scaled);
+        *hi = std::min<uint32_t>(*lo + 1, 65535);
+    }
+    static float value(uint32_t code) { return code * (1.0f / 65535.0f); }
+};
+
+// Encodes the resampled colors of the rows [yBegin, yEnd) of input, width interleaved
+// RGB pixels per row, as octmap uv in two channels of output. input and output point to
+// row yBegin. The color transform, if
+// transform is set, and the direction encoding run in batches over structure-of-arrays
+// buffers, with the SIMD octEncode of batchKernels. Instead of rounding u and v on their
+// own, every pixel takes the combination of the codes around them whose decoded
+// direction is closest to the encoded one, which lowers the angular error of the
+// quantization.
+template <class CodeT>
+void encodeRows(const Imath::Matrix44<float>* transform, int width, const float* input, CodeT* output,
+                int yBegin, int yEnd) {
+    const BatchKernels& kernels = batchKernels();
+    const int kBatchSize = 64;
+    float dirX[kBatchSize], dirY[kBatchSize], dirZ[kBatchSize];
+    float u[kBatchSize], v[kBatchSize];
+    // the four code combinations of every pixel of a batch, candidate k of pixel i at
+    // 4 * i + k.
+    CodeT codeU[4 * kBatchSize], codeV[4 * kBatchSize];
+    float candidateU[4 * kBatchSize], candidateV[4 * kBatchSize];
+    float candidateX[4 * kBatchSize], candidateY[4 * kBatchSize], candidateZ[4 * kBatchSize];
+    for (int y = yBegin; y < yEnd; y++) {
+        const float* inputRow = input + size_t(y - yBegin) * width * 3;
+        CodeT* outputRow = output + size_t(y - yBegin) * width * 2;
+        for (int batchBegin = 0; batchBegin < width; batchBegin += kBatchSize) {
+            const int batchSize = std::min(kBatchSize, width - batchBegin);
+            const float* colors = inputRow + size_t(batchBegin) * 3;
+            for (int i = 0; i < batchSize; i++) {
+                dirX[i] = colors[i * 3];
+                dirY[i] = colors[i * 3 + 1];
+                dirZ[i] = colors[i * 3 + 2];
+            }
+            if (transform) {
+                // the operations of Matrix44::multVecMatrix, including the division by w.
+                const float (*m)[4] = transform->x;
+                for (int i = 0; i < batchSize; i++) {
+                    const float a = dirX[i] * m[0][0] + dirY[i] * m[1][0] + dirZ[i] * m[2][0] + m[3][0];
+                    const float b = dirX[i] * m[0][1] + dirY[i] * m[1][1] + dirZ[i] * m[2][1] + m[3][1];
+                    const float c = dirX[i] * m[0][2] + dirY[i] * m[1][2] + dirZ[i] * m[2][2] + m[3][2];
+                    const float w = dirX[i] * m[0][3] + dirY[i] * m[1][3] + dirZ[i] * m[2][3] + m[3][3];
+                    dirX[i] = a / w;
+                    dirY[i] = b / w;
+                    dirZ[i] = c / w;
+                }
+            }
+            for (int i = 0; i < batchSize; i++) {
+                dirX[i] = dirX[i] * 2 - 1;
+                dirY[i] = dirY[i] * 2 - 1;
+                dirZ[i] = dirZ[i] * 2 - 1;
+            }
+            kernels.octEncode(dirX, dirY, dirZ, u, v, batchSize);
+
+            for (int i = 0; i < batchSize; i++) {
+                CodeT uLo, uHi, vLo, vHi;
+                UVQuantizer<CodeT>::bracket((u[i] + 1) * 0.5f, &uLo, &uHi);
+                UVQuantizer<CodeT>::bracket((v[i] + 1) * 0.5f, &vLo, &vHi);
+                const CodeT candidates[4][2] = { { uLo, vLo }, { uHi, vLo }, { uLo, vHi }, { uHi, vHi } };
+                for (int k = 0; k < 4; k++) {
+                    codeU[4 * i + k] = candidates[k][0];
+                    codeV[4 * i + k] = candidates[k][1];
+                    candidateU[4 * i + k] = UVQuantizer<CodeT>::value(candidates[k][0]) * 2 - 1;
+                    candidateV[4 * i + k] = UVQuantizer<CodeT>::value(candidates[k][1]) * 2 - 1;
+                }
+            }
+            kernels.octDecode(candidateU, candidateV, candidateX, candidateY, candidateZ, 4 * batchSize);
+            for (int i = 0; i < batchSize; i++) {
+                // the squared distance between unit vectors, which unlike their dot
+                // product keeps its precision for the tiny angles between the candidates.
+                const float invLength = 1.0f / std::sqrt(dirX[i] * dirX[i] + dirY[i] * dirY[i] + dirZ[i] * dirZ[i]);
+                auto distance = [&](int k) {
+                    const float dx = candidateX[4 * i + k] - dirX[i] * invLength;
+                    const float dy = candidateY[4 * i + k] - dirY[i] * invLength;
+                    const float dz = candidateZ[4 * i + k] - dirZ[i] * invLength;
+                    return dx * dx + dy * dy + dz * dz;
+                };
+                int best = 0;
+                float bestDistance = distance(0);
+                for (int k = 1; k < 4; k++) {
+                    const float candidateDistance = distance(k);
+                    if (candidateDistance < bestDistance) {
+                        bestDistance = candidateDistance;
+                        best = k;
+                    }
+                }
+                outputRow[(batchBegin + i) * 2] = codeU[4 * i + best];
+                outputRow[(batchBegin + i) * 2 + 1] = codeV[4 * i + best];
+            }
+        }
+    }
+}
+
+#endif  // ENCODE_H
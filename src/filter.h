@@ -5,19 +5,27 @@
 #ifndef IMAGE_FILTER_H
 #define IMAGE_FILTER_H
 
+#include <cmath>
+#include <string>
+
 #include "IlmBase/Imath/ImathVec.h"
 
 class Filter {
  public:
+  virtual ~Filter() = default;
+
   // Evaluate the filter for the given position relative to it's center.
   virtual float Eval(const Imath::V2f& position) const = 0;
 
   // Return the radius of the filter. This is a bounding circle around the
   // support of the filter.
   virtual float GetRadius() const = 0;
+
+  // Returns a string identifying the filter and its parameters.
+  virtual std::string GetDescription() const = 0;
 };
 
-class MitchellFilter : public Filter {
+class MitchellFilter final : public Filter {
  public:
   // Constructs a Mitchell filter with the given parameters B and C.
   // B = 0, C = 1 is the cubic B-spline.
@@ -52,20 +60,25 @@ class MitchellFilter : public Filter {
 
   float GetRadius() const override { return 2.0f; }
 
+  std::string GetDescription() const override {
+    return "mitchell_b" + std::to_string(b_) + "_c" + std::to_string(c_);
+  }
+
  private:
   // The two constants B and C defining the filter's shape.
   const float b_;
   const float c_;
 };
 
-class GaussianFilter : public Filter {
+class GaussianFilter final : public Filter {
  public:
   // Constructs a gaussian filter with the given standard deviation sigma and
   // radius. The gaussian is truncated at distance radius and shifted such
   // that f(radius) = 0. As a rule of thumb, radius = 3 * sigma is a reasonable
   // choice for the cut-off.
   GaussianFilter(float sigma, float radius)
-      : radius_(radius),
+      : sigma_(sigma),
+        radius_(radius),
         a_(1.0f / (std::sqrt(2 * M_PI) * sigma)),
         b_(-1.0f / (2.0f * sigma * sigma)),
         c_(-a_ * std::exp(radius * radius * b_)) {}
@@ -84,7 +97,12 @@ class GaussianFilter : public Filter {
 
   float GetRadius() const override { return radius_; }
 
+  std::string GetDescription() const override {
+    return "gaussian_sigma" + std::to_string(sigma_) + "_r" + std::to_string(radius_);
+  }
+
  private:
+  const float sigma_;
   const float radius_;
   const float a_;
   const float b_;
@@ -0,0 +1,211 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef GGX_PREFILTER_H
+#define GGX_PREFILTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "batchkernels.h"
+#include "octmapmips.h"
+#include "octmaputil.h"
+#include "resampler.h"
+#include "threadpool.h"
+
+// Mip chains of octmaps prefiltered for specular image based lighting. Level l of n is
+// the radiance convolved with the GGX lobe of roughness l / (n - 1) around the normal,
+// with the view direction taken along the normal, as in the split sum approximation.
+// Level 0 is the unfiltered map. Every lobe is estimated with a fixed number of
+// importance sampled taps, and every tap reads a level of the box filtered mip chain of
+// the source whose texels have about the solid angle the tap stands for (filtered
+// importance sampling), which keeps the estimate smooth at low tap counts.
+
+const int kDefaultGGXSamples = 64;
+
+// Side length in pixels of the tiles the output levels are filtered in.
+const int kPrefilterTileSize = 16;
+
+// One tap of a GGX lobe: the direction in the frame of the normal, with the normal along
+// z, its weight and the fractional level of the source mip chain it is read from where
+// the source texels are smallest, at the center of the octmap (+z).
+struct GGXSample {
+    float x, y, z;
+    float weight;
+    float level;
+};
+
+// Returns the i-th of n points of the Hammersley set on the unit square.
+inline void hammersley(uint32_t i, uint32_t n, float* u1, float* u2) {
+    uint32_t bits = i;
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xAAAAAAAAu) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xCCCCCCCCu) >> 2);
+    bits = ((bits & 0x0F0F0F0Fu) << 4) | ((bits & 0xF0F0F0F0u) >> 4);
+    bits = ((bits & 0x00FF00FFu) << 8) | ((bits & 0xFF00FF00u) >> 8);
+    *u1 = (i + 0.5f) / n;
+    *u2 = float(bits) * 2.3283064365386963e-10f;
+}
+
+// Builds the numSamples taps of the GGX lobe of roughness for a source octmap of
+// sourceSize. The taps follow the distribution of the lobe, those below the horizon are
+// dropped. Each tap reads the source level whose texels cover the solid angle
+// 1 / (numSamples * pdf) of the tap.
+inline std::vector<GGXSample> buildGGXSampleTable(float roughness, int numSamples, int sourceSize) {
+    const float alpha = std::max(roughness * roughness, 1e-4f);
+    const float alpha2 = alpha * alpha;
+    const float kPi = 3.14159265f;
+    // the solid angle of source texels at the center of the map, see octMapTexelSolidAngle.
+    const float texelSolidAngle = 4.0f / (float(sourceSize) * sourceSize);
+    std::vector<GGXSample> samples;
+    for (int i = 0; i < numSamples; i++) {
+        float u1, u2;
+        hammersley(uint32_t(i), uint32_t(numSamples), &u1, &u2);
+        const float phi = 2.0f * kPi * u2;
+        const float cosTheta = std::sqrt((1.0f - u1) / (1.0f + (alpha2 - 1.0f) * u1));
+        const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        // the half vector, and the direction it reflects the normal to.
+        const float hx = sinTheta * std::cos(phi);
+        const float hy = sinTheta * std::sin(phi);
+        const float hz = cosTheta;
+        GGXSample sample;
+        sample.x = 2.0f * hz * hx;
+        sample.y = 2.0f * hz * hy;
+        sample.z = 2.0f * hz * hz - 1.0f;
+        if (sample.z <= 0.0f)
+            continue;
+        sample.weight = sample.z;
+        // with the view along the normal, the pdf of the direction is D / 4.
+        const float d = (alpha2 - 1.0f) * hz * hz + 1.0f;
+        const float pdf = alpha2 / (kPi * d * d) / 4.0f;
+        const float sampleSolidAngle = 1.0f / (numSamples * pdf);
+        sample.level = 0.5f * std::log2(sampleSolidAngle / texelSolidAngle);
+        samples.push_back(sample);
+    }
+    return samples;
+}
+
+// Adds weight times the bilinear lookup of the octmap coordinate (u, v) in the size x
+// size level with channels interleaved channels to color.
+inline void addOctMapBilinear(const float* level, int size, int channels, float u, float v, float weight,
+                              float* color) {
+    const Imath::V2f position = octMapPixelPosition(Imath::V2f(u, v), size);
+    const float xCoord = position.x - 0.5f;
+    const float yCoord = position.y - 0.5f;
+    const int x0 = int(std::floor(xCoord));
+    const int y0 = int(std::floor(yCoord));
+    const float fx = xCoord - x0;
+    const float fy = yCoord - y0;
+    const float tapWeights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+    for (int t = 0; t < 4; t++) {
+        int px = x0 + (t & 1);
+        int py = y0 + (t >> 1);
+        wrapOctMapPixel(size, &px, &py);
+        const float* texel = level + (size_t(py) * size + px) * channels;
+        const float w = tapWeights[t] * weight;
+        for (int c = 0; c < channels; c++)
+            color[c] += texel[c] * w;
+    }
+}
+
+// Filters the dstSize x dstSize level of the prefiltered chain with the taps of table
+// from the source levels, sourceLevels[0] being sourceSize x sourceSize and every
+// further level half the size of the one above. The output is filtered tile by tile in
+// parallel, neighbouring pixels read neighbouring source texels.
+inline void prefilterOctMapLevel(
+    const std::vector<const float*>& sourceLevels,
+    int sourceSize,
+    int channels,
+    const std::vector<GGXSample>& table,
+    float* dst,
+    int dstSize,
+    ThreadPool& threadPool)
+{
+    const int numSamples = int(table.size());
+    const float maxLevel = float(sourceLevels.size() - 1);
+    const int tilesPerSide = (dstSize + kPrefilterTileSize - 1) / kPrefilterTileSize;
+    threadPool.ParallelFor(0, tilesPerSide * tilesPerSide, 1, [&](int tileBegin, int tileEnd) {
+        std::vector<float> dirX(numSamples), dirY(numSamples), dirZ(numSamples);
+        std::vector<float> u(numSamples), v(numSamples);
+        std::vector<float> color(channels);
+        for (int tile = tileBegin; tile < tileEnd; tile++) {
+            const int xBegin = (tile % tilesPerSide) * kPrefilterTileSize;
+            const int yBegin = (tile / tilesPerSide) * kPrefilterTileSize;
+            const int xEnd = std::min(dstSize, xBegin + kPrefilterTileSize);
+            const int yEnd = std::min(dstSize, yBegin + kPrefilterTileSize);
+            for (int y = yBegin; y < yEnd; y++) {
+                for (int x = xBegin; x < xEnd; x++) {
+                    const Imath::V3f n = octDecode(octMapPixelCenter(x, y, dstSize));
+                    // orthonormal frame around the normal, after Duff et al. 2017.
+                    const float sign = std::copysign(1.0f, n.z);
+                    const float a = -1.0f / (sign + n.z);
+                    const float b = n.x * n.y * a;
+                    const Imath::V3f tangent(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+                    const Imath::V3f bitangent(b, sign + n.y * n.y * a, -n.y);
+                    for (int i = 0; i < numSamples; i++) {
+                        const GGXSample& sample = table[i];
+                        dirX[i] = tangent.x * sample.x + bitangent.x * sample.y + n.x * sample.z;
+                        dirY[i] = tangent.y * sample.x + bitangent.y * sample.y + n.y * sample.z;
+                        dirZ[i] = tangent.z * sample.x + bitangent.z * sample.y + n.z * sample.z;
+                    }
+                    batchKernels().octEncode(dirX.data(), dirY.data(), dirZ.data(), u.data(), v.data(), numSamples);
+                    std::fill(color.begin(), color.end(), 0.0f);
+                    float weightSum = 0.0f;
+                    for (int i = 0; i < numSamples; i++) {
+                        const GGXSample& sample = table[i];
+                        // source texels grow by |L|_1^3 from the center of the map, the L1
+                        // norm of a unit direction, so taps away from it read finer levels.
+                        const float l1Norm = std::abs(dirX[i]) + std::abs(dirY[i]) + std::abs(dirZ[i]);
+                        const float level = std::min(maxLevel, std::max(0.0f, sample.level - 1.5f * std::log2(l1Norm)));
+                        // trilinear between the two source levels around the level of the tap.
+                        const int lower = int(level);
+                        const float fraction = level - lower;
+                        const int lowerSize = std::max(1, sourceSize >> lower);
+                        addOctMapBilinear(sourceLevels[lower], lowerSize, channels, u[i], v[i],
+                                          sample.weight * (1.0f - fraction), color.data());
+                        if (fraction > 0.0f) {
+                            addOctMapBilinear(sourceLevels[lower + 1], std::max(1, lowerSize >> 1), channels, u[i],
+                                              v[i], sample.weight * fraction, color.data());
+                        }
+                        weightSum += sample.weight;
+                    }
+                    float* out = dst + (size_t(y) * dstSize + x) * channels;
+                    for (int c = 0; c < channels; c++)
+                        out[c] = color[c] / weightSum;
+                }
+            }
+        }
+    });
+}
+
+// Computes the levels 1 .. numMipLevels(size) - 1 of the GGX prefiltered chain of an
+// octmap whose level 0 is given, with numSamples taps per pixel. The levels are filtered
+// from the box filtered mip chain of level 0, each with its own sample table.
+inline std::vector<std::vector<float>> buildGGXOctMapMips(
+    const float* level0,
+    int size,
+    int channels,
+    int numSamples,
+    ThreadPool& threadPool)
+{
+    const int numLevels = numMipLevels(size);
+    const std::vector<std::vector<float>> sourceMips = buildOctMapMips(level0, size, channels, threadPool);
+    std::vector<const float*> sourceLevels(1, level0);
+    for (const std::vector<float>& mip : sourceMips)
+        sourceLevels.push_back(mip.data());
+
+    std::vector<std::vector<float>> levels;
+    for (int level = 1; level < numLevels; level++) {
+        const int dstSize = std::max(1, size >> level);
+        const float roughness = float(level) / (numLevels - 1);
+        const std::vector<GGXSample> table = buildGGXSampleTable(roughness, numSamples, size);
+        levels.emplace_back(size_t(dstSize) * dstSize * channels);
+        prefilterOctMapLevel(sourceLevels, size, channels, table, levels.back().data(), dstSize, threadPool);
+    }
+    return levels;
+}
+
+#endif  // GGX_PREFILTER_H
@@ -0,0 +1,167 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "ggxprefilter.h"
+#include "octmapmips.h"
+#include "octmaputil.h"
+#include "resampler.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kOctMapSize = 32;
+const int kNumChannels = 3;
+const double kPi = 3.14159265358979323846;
+
+typedef std::function<float(float x, float y, float z, int channel)> SphereFunction;
+
+// A smooth map with a different gradient in every channel.
+float smoothRadiance(float x, float y, float z, int channel) {
+  switch (channel) {
+    case 0: return 1.0f + 0.5f * x - 0.3f * y + 0.2f * z;
+    case 1: return 1.0f + 0.8f * z * z;
+    default: return 2.0f + std::sin(2.0f * x) * std::cos(y);
+  }
+}
+
+// Samples f at the pixel centers of a kOctMapSize octmap.
+std::vector<float> octMapOf(const SphereFunction& f) {
+  std::vector<float> pixels(size_t(kOctMapSize) * kOctMapSize * kNumChannels);
+  for (int y = 0; y < kOctMapSize; y++) {
+    for (int x = 0; x < kOctMapSize; x++) {
+      const Imath::V3f d = octDecode(octMapPixelCenter(x, y, kOctMapSize));
+      for (int c = 0; c < kNumChannels; c++)
+        pixels[(size_t(y) * kOctMapSize + x) * kNumChannels + c] = f(d.x, d.y, d.z, c);
+    }
+  }
+  return pixels;
+}
+
+// Directions on a dense grid over polar and azimuth angle around the z axis, with the
+// solid angle of their cell and the radiance of f in them, for the midpoint rule.
+struct Quadrature {
+  std::vector<Imath::V3f> directions;
+  std::vector<double> solidAngles;
+  std::vector<double> radiance;
+};
+
+Quadrature quadratureOf(const SphereFunction& f) {
+  const int numTheta = 256;
+  const int numPhi = 512;
+  Quadrature quadrature;
+  for (int i = 0; i < numTheta; i++) {
+    const double theta = (i + 0.5) * kPi / numTheta;
+    const double solidAngle = std::sin(theta) * (kPi / numTheta) * (2.0 * kPi / numPhi);
+    for (int j = 0; j < numPhi; j++) {
+      const double phi = (j + 0.5) * 2.0 * kPi / numPhi;
+      const Imath::V3f l(float(std::sin(theta) * std::cos(phi)), float(std::sin(theta) * std::sin(phi)),
+                         float(std::cos(theta)));
+      quadrature.directions.push_back(l);
+      quadrature.solidAngles.push_back(solidAngle);
+      for (int c = 0; c < kNumChannels; c++)
+        quadrature.radiance.push_back(f(l.x, l.y, l.z, c));
+    }
+  }
+  return quadrature;
+}
+
+// The radiance convolved with the GGX lobe of roughness around n with the view along n,
+// as the prefiltered levels estimate it: the integral of L(l) D(h) (n . l) over the
+// hemisphere around n, divided by the integral of D(h) (n . l).
+void ggxIntegral(const Quadrature& quadrature, float roughness, const Imath::V3f& n, double* result) {
+  const double alpha = std::max(double(roughness) * roughness, 1e-4);
+  const double alpha2 = alpha * alpha;
+  double weightSum = 0.0;
+  std::fill(result, result + kNumChannels, 0.0);
+  for (size_t i = 0; i < quadrature.directions.size(); i++) {
+    const Imath::V3f& l = quadrature.directions[i];
+    const double nDotL = n.dot(l);
+    if (nDotL <= 0.0)
+      continue;
+    // the half vector between view and light, with the view along the normal.
+    const double nDotH = n.dot((n + l).normalized());
+    const double d = (alpha2 - 1.0) * nDotH * nDotH + 1.0;
+    const double weight = alpha2 / (kPi * d * d) * nDotL * quadrature.solidAngles[i];
+    for (int c = 0; c < kNumChannels; c++)
+      result[c] += quadrature.radiance[i * kNumChannels + c] * weight;
+    weightSum += weight;
+  }
+  for (int c = 0; c < kNumChannels; c++)
+    result[c] /= weightSum;
+}
+
+TEST(GGXPrefilterTest, KeepsConstantMapConstant) {
+  ThreadPool threadPool(4);
+  const std::vector<float> pixels(size_t(kOctMapSize) * kOctMapSize * kNumChannels, 3.0f);
+  const std::vector<std::vector<float>> levels =
+      buildGGXOctMapMips(pixels.data(), kOctMapSize, kNumChannels, kDefaultGGXSamples, threadPool);
+  ASSERT_EQ(int(levels.size()), numMipLevels(kOctMapSize) - 1);
+  for (size_t level = 0; level < levels.size(); level++) {
+    const int size = std::max(1, kOctMapSize >> (level + 1));
+    ASSERT_EQ(levels[level].size(), size_t(size) * size * kNumChannels);
+    // the taps of every pixel are normalized by the sum of their weights.
+    for (size_t i = 0; i < levels[level].size(); i++)
+      ASSERT_NEAR(levels[level][i], 3.0f, 3e-6f) << "level " << level + 1 << ", value " << i;
+  }
+}
+
+TEST(GGXPrefilterTest, RoughnessZeroReproducesSource) {
+  ThreadPool threadPool(4);
+  const std::vector<GGXSample> table = buildGGXSampleTable(0.0f, kDefaultGGXSamples, kOctMapSize);
+  ASSERT_EQ(int(table.size()), kDefaultGGXSamples);
+  // every tap of the smooth surface reflects along the normal from level 0.
+  for (const GGXSample& sample : table) {
+    EXPECT_NEAR(sample.z, 1.0f, 1e-6f);
+    EXPECT_LT(sample.level, 0.0f);
+  }
+
+  const std::vector<float> pixels = octMapOf(smoothRadiance);
+  const std::vector<std::vector<float>> sourceMips =
+      buildOctMapMips(pixels.data(), kOctMapSize, kNumChannels, threadPool);
+  std::vector<const float*> sourceLevels(1, pixels.data());
+  for (const std::vector<float>& mip : sourceMips)
+    sourceLevels.push_back(mip.data());
+  std::vector<float> output(pixels.size());
+  prefilterOctMapLevel(sourceLevels, kOctMapSize, kNumChannels, table, output.data(), kOctMapSize, threadPool);
+  for (size_t i = 0; i < pixels.size(); i++)
+    EXPECT_NEAR(output[i], pixels[i], 1e-5f * std::abs(pixels[i])) << "value " << i;
+}
+
+// The default 64 taps read from the box filtered mips stay within 3.6% of the integral
+// on smoothRadiance at kOctMapSize, the most on the single pixel of the roughest level.
+const double kRelativeTolerance = 0.05;
+
+TEST(GGXPrefilterTest, MatchesBruteForceIntegral) {
+  ThreadPool threadPool(4);
+  const std::vector<float> pixels = octMapOf(smoothRadiance);
+  const std::vector<std::vector<float>> levels =
+      buildGGXOctMapMips(pixels.data(), kOctMapSize, kNumChannels, kDefaultGGXSamples, threadPool);
+  const Quadrature quadrature = quadratureOf(smoothRadiance);
+  const int numLevels = numMipLevels(kOctMapSize);
+  for (int level = 1; level < numLevels; level++) {
+    const int size = std::max(1, kOctMapSize >> level);
+    const float roughness = float(level) / (numLevels - 1);
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        const Imath::V3f n = octDecode(octMapPixelCenter(x, y, size));
+        double reference[kNumChannels];
+        ggxIntegral(quadrature, roughness, n, reference);
+        for (int c = 0; c < kNumChannels; c++) {
+          EXPECT_NEAR(levels[level - 1][(size_t(y) * size + x) * kNumChannels + c], reference[c],
+                      kRelativeTolerance * reference[c])
+              << "level " << level << ", pixel " << x << ", " << y << ", channel " << c;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
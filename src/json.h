@@ -0,0 +1,259 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef JSON_H
+#define JSON_H
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A minimal JSON document model, enough for the line-delimited job protocol of the
+// server mode. Objects keep their members in document order.
+struct JsonValue {
+    enum Type { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT };
+
+    Type type = JSON_NULL;
+    bool boolean = false;
+    double number = 0.0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    // Returns the member called key, or nullptr if this is not an object or has no such member.
+    const JsonValue* find(const std::string& key) const {
+        for (const auto& member : object) {
+            if (member.first == key)
+                return &member.second;
+        }
+        return nullptr;
+    }
+};
+
+namespace json_internal {
+
+inline void skipWhitespace(const std::string& text, size_t* pos) {
+    while (*pos < text.size() && std::isspace((unsigned char)text[*pos]))
+        (*pos)++;
+}
+
+inline void appendUtf8(unsigned int codePoint, std::string* out) {
+    if (codePoint < 0x80) {
+        out->push_back(char(codePoint));
+    } else if (codePoint < 0x800) {
+        out->push_back(char(0xC0 | (codePoint >> 6)));
+        out->push_back(char(0x80 | (codePoint & 0x3F)));
+    } else if (codePoint < 0x10000) {
+        out->push_back(char(0xE0 | (codePoint >> 12)));
+        out->push_back(char(0x80 | ((codePoint >> 6) & 0x3F)));
+        out->push_back(char(0x80 | (codePoint & 0x3F)));
+    } else {
+        out->push_back(char(0xF0 | (codePoint >> 18)));
+        out->push_back(char(0x80 | ((codePoint >> 12) & 0x3F)));
+        out->push_back(char(0x80 | ((codePoint >> 6) & 0x3F)));
+        out->push_back(char(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+inline bool parseHex4(const std::string& text, size_t pos, unsigned int* value) {
+    if (pos + 4 > text.size())
+        return false;
+    *value = 0;
+    for (size_t i = pos; i < pos + 4; i++) {
+        char c = text[i];
+        *value <<= 4;
+        if (c >= '0' && c <= '9')
+            *value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *value |= c - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+inline bool parseString(const std::string& text, size_t* pos, std::string* out) {
+    if (*pos >= text.size() || text[*pos] != '"')
+        return false;
+    (*pos)++;
+    while (*pos < text.size()) {
+        char c = text[(*pos)++];
+        if (c == '"')
+            return true;
+        if (c != '\\') {
+            out->push_back(c);
+            continue;
+        }
+        if (*pos >= text.size())
+            return false;
+        c = text[(*pos)++];
+        switch (c) {
+            case '"': out->push_back('"'); break;
+            case '\\': out->push_back('\\'); break;
+            case '/': out->push_back('/'); break;
+            case 'b': out->push_back('\b'); break;
+            case 'f': out->push_back('\f'); break;
+            case 'n': out->push_back('\n'); break;
+            case 'r': out->push_back('\r'); break;
+            case 't': out->push_back('\t'); break;
+            case 'u': {
+                unsigned int codePoint;
+                if (!parseHex4(text, *pos, &codePoint))
+                    return false;
+                *pos += 4;
+                // surrogate pair
+                if (codePoint >= 0xD800 && codePoint < 0xDC00 && text.compare(*pos, 2, "\\u") == 0) {
+                    unsigned int low;
+                    if (parseHex4(text, *pos + 2, &low) && low >= 0xDC00 && low < 0xE000) {
+                        codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                        *pos += 6;
+                    }
+                }
+                appendUtf8(codePoint, out);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+inline bool parseValue(const std::string& text, size_t* pos, JsonValue* value, int depth) {
+    if (depth > 64)
+        return false;
+    skipWhitespace(text, pos);
+    if (*pos >= text.size())
+        return false;
+    const char c = text[*pos];
+    if (c == '{') {
+        value->type = JsonValue::JSON_OBJECT;
+        (*pos)++;
+        skipWhitespace(text, pos);
+        if (*pos < text.size() && text[*pos] == '}') {
+            (*pos)++;
+            return true;
+        }
+        while (true) {
+            skipWhitespace(text, pos);
+            std::pair<std::string, JsonValue> member;
+            if (!parseString(text, pos, &member.first))
+                return false;
+            skipWhitespace(text, pos);
+            if (*pos >= text.size() || text[*pos] != ':')
+                return false;
+            (*pos)++;
+            if (!parseValue(text, pos, &member.second, depth + 1))
+                return false;
+            value->object.push_back(std::move(member));
+            skipWhitespace(text, pos);
+            if (*pos < text.size() && text[*pos] == ',') {
+                (*pos)++;
+                continue;
+            }
+            if (*pos < text.size() && text[*pos] == '}') {
+                (*pos)++;
+                return true;
+            }
+            return false;
+        }
+    }
+    if (c == '[') {
+        value->type = JsonValue::JSON_ARRAY;
+        (*pos)++;
+        skipWhitespace(text, pos);
+        if (*pos < text.size() && text[*pos] == ']') {
+            (*pos)++;
+            return true;
+        }
+        while (true) {
+            JsonValue element;
+            if (!parseValue(text, pos, &element, depth + 1))
+                return false;
+            value->array.push_back(std::move(element));
+            skipWhitespace(text, pos);
+            if (*pos < text.size() && text[*pos] == ',') {
+                (*pos)++;
+                continue;
+            }
+            if (*pos < text.size() && text[*pos] == ']') {
+                (*pos)++;
+                return true;
+            }
+            return false;
+        }
+    }
+    if (c == '"') {
+        value->type = JsonValue::JSON_STRING;
+        return parseString(text, pos, &value->string);
+    }
+    if (text.compare(*pos, 4, "true") == 0) {
+        value->type = JsonValue::JSON_BOOL;
+        value->boolean = true;
+        *pos += 4;
+        return true;
+    }
+    if (text.compare(*pos, 5, "false") == 0) {
+        value->type = JsonValue::JSON_BOOL;
+        *pos += 5;
+        return true;
+    }
+    if (text.compare(*pos, 4, "null") == 0) {
+        *pos += 4;
+        return true;
+    }
+    const char* begin = text.c_str() + *pos;
+    char* end;
+    value->type = JsonValue::JSON_NUMBER;
+    value->number = std::strtod(begin, &end);
+    if (end == begin)
+        return false;
+    *pos += end - begin;
+    return true;
+}
+
+}  // namespace json_internal
+
+// Parses text as a single JSON value. Returns false if text is not valid JSON.
+inline bool parseJson(const std::string& text, JsonValue* value) {
+    size_t pos = 0;
+    *value = JsonValue();
+    if (!json_internal::parseValue(text, &pos, value, 0))
+        return false;
+    json_internal::skipWhitespace(text, &pos);
+    return pos == text.size();
+}
+
+// Returns s as quoted and escaped JSON string.
+inline std::string jsonQuote(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out.push_back(c);
+                }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+#endif  // JSON_H
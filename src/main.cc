@@ -4,26 +4,49 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
-#include <execution>
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <functional>
 #include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
 
 #include "OpenEXR/IlmImf/ImfArray.h"
 #include "OpenEXR/IlmImf/ImfChannelList.h"
 #include "OpenEXR/IlmImf/ImfOutputFile.h"
 #include "OpenEXR/IlmImf/ImfInputFile.h"
+#include "OpenEXR/IlmImf/ImfTiledOutputFile.h"
+#include "OpenEXR/IlmImf/ImfThreading.h"
+#include "IlmBase/Half/half.h"
 #include "IlmBase/Imath/ImathMatrix.h"
 #include "OpenEXR/IlmImf/ImfNamespace.h"
 
+#include "boundedqueue.h"
 #include "cubemaputil.h"
 #include "octmaputil.h"
+#include "convert.h"
 #include "filter.h"
+#include "ggxprefilter.h"
+#include "json.h"
+#include "manifest.h"
+#include "memorybudget.h"
+#include "octmap.h"
+#include "octmapmips.h"
+#include "progresslog.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+#include "runreport.h"
+#include "server.h"
+#include "threadpool.h"
 
 #include "stringutils.h"
 
@@ -37,48 +60,350 @@ using namespace IMATH_NAMESPACE;
 void displayHelp() {
     cout << "Arguments:.\n";
     cout << "-h --help\n";
-    cout << "-i --input inputfile  : input cubemap exr file.\n";
-    cout << "-o --output outputfile  : output cubemap exr file.\n";
+    cout << "-i --input inputfile  : input cubemap exr file, or octmap exr file with --to-cubemap.\n";
+    cout << "-o --output outputfile  : output octmap exr file, or cubemap exr file with --to-cubemap.\n";
+    cout << "-O --output-spec spec  : an additional output, given as comma separated list of file=outputfile, size=N, resample=type, compression=type, pixel-type=type, transform=16 floats separated by :, mono, encode, encode-format=format, mips, ggx, ggx-samples=N, sh-order=N and sampling-table. options not in the list are taken from the command line. can be given multiple times, the input is read once for all outputs and outputs of the same size and resampling share the resampling.\n";
     cout << "-c --compression [rle/piz/zip/pxr24/b44/b44a/dwaa/dwab]  : OpenEXR compression schemes. default is zip.\n";
     cout << "-t --transform transformationmatrix ... : 16 floats defining transformation matrix to transform input colors by.\n";
     cout << "-e --encode  : treats the (altready transformed) color as direction vector and encodes it as octmap uv coordinate and writes it to RG.\n";
+    cout << "--encode-format [rgb/half2/uint16]  : how -e stores the uv. rgb writes RGB with B = 0 in the pixel type of the output, half2 writes RG as half, uint16 writes RG as 16 bit unsigned normalized codes in uint channels. half2 and uint16 pick the code closest to the encoded direction and can not be used with --mips and --stream. default is rgb.\n";
     cout << "-m --mono  : write monochromatic output.\n";
+    cout << "--channels [all/list]  : converts the given channels instead of RGB, e.g. all or A,diffuse.*,specular.* for all channels of the diffuse and specular layers. every channel keeps its name and pixel type. can not be used with -t, -e, -m and --stream.\n";
     cout << "-r --resample [nearest/bilinear/gaussian/mitchell]  : resampling type. default is mitchell.\n";
+    cout << "--pixel-type [half/float]  : pixel type of the output file. with half, the output is also kept as half in memory. default is float.\n";
+    cout << "-s --size N  : size of the output octmap. default is the face size of the input cubemap.\n";
+    cout << "--to-cubemap  : converts octmaps back to 6:1 cubemap strips, with the face order and orientation of the input cubemaps. -s gives the face size, default is the size of the octmap. all other options apply the same way, except --mips.\n";
+    cout << "--mips  : writes a tiled exr with the full octahedral mip chain. each level is reduced from the level above.\n";
+    cout << "--ggx  : writes the mip chain of --mips prefiltered for specular lighting instead. level l of n is convolved with the GGX lobe of roughness l / (n - 1), level 0 stays unfiltered. implies --mips.\n";
+    cout << "--ggx-samples N  : number of importance sampled taps per pixel of --ggx. every tap reads the level of the box filtered source chain that matches its solid angle, so few taps are needed. default is 64. implies --ggx.\n";
+    cout << "--sh-order N  : also writes outputfile.sh.json with the spherical harmonics projection of every channel of the octmap, N bands from 1 to 5, e.g. 3 for the 9 coefficients used for irradiance. the projection is gathered while the octmap is converted. can not be used with --to-cubemap, -e and --stream.\n";
+    cout << "--sampling-table  : also writes outputfile.alias, a luminance times solid angle weighted alias table of the octmap for importance sampling it as environment light. with -m, the table is weighted by the one written channel instead of luminance. the file can be memory mapped and used as is, see aliastable.h. can not be used with --to-cubemap, -e, --channels and --stream.\n";
+    cout << "-j --threads N  : number of threads to use for the conversion. default is the number of hardware threads.\n";
+    cout << "--read-threads N  : number of threads decompressing input files. default is the number of conversion threads.\n";
+    cout << "--write-threads N  : number of threads compressing output files. default is the number of conversion threads.\n";
+    cout << "--queue-depth N  : number of decoded and of converted files that may wait for the next stage. default is 2.\n";
+    cout << "--max-memory MB  : only starts reading a file when the estimated memory of all files in flight stays below MB. files larger than MB run alone. default is no limit.\n";
+    cout << "--adaptive tolerance  : resamples bilinearly where the input varies by less than tolerance times its magnitude, e.g. 0.01, and with the full gaussian or mitchell kernel only around edges and small bright sources. the result differs from the full kernel by about tolerance times the magnitude at most. can not be used with -p, --matrix-cache, --tiled-input and --stream.\n";
+    cout << "--tiled-input  : copies the decoded input into tiles of 16x16 texels before resampling, so that the texels under a filter footprint share cache lines. pays off with -p and the gaussian and mitchell resampling, where the copy takes less than the saved cache misses. can not be used with --stream.\n";
+    cout << "--padded-input  : copies the decoded cubemap into six faces with borders filled from their neighbouring faces, as wide as the filter reaches, so that bilinear taps interpolate across the edges of the faces instead of stopping at them, and filter taps need not pick their face. can not be used with --to-cubemap, --tiled-input, --adaptive and --stream.\n";
+    cout << "-p --precompute  : precomputes the input to output mapping as sparse weight table once and reuses it for all files of the same size.\n";
+    cout << "--matrix-cache directory  : persists precomputed weight tables in directory and reuses them across runs. implies -p.\n";
+    cout << "--matrix-memory MB  : memory for precomputed weight tables. beyond it, the least recently used tables are dropped and built again when needed. default is no limit, and 2048 with --serve.\n";
+    cout << "--stream  : converts in bands of output rows and reads only the input rows they need, so memory use does not grow with the image size. files are converted one after the other. if the decoded input fits into --stream-memory next to a band of 64 output rows, it is read once and kept. otherwise half of the ceiling holds input rows, and since the rows of a band need most of the input, the input is read and decompressed about once per band, less the rows still held from the band before. resampling takes about twice as long as without --stream.\n";
+    cout << "--stream-memory MB  : memory ceiling for the pixel data of --stream. ceilings below the size of the decoded input make more and narrower bands and read the input more often. default is 512. implies --stream.\n";
+    cout << "--input-list file  : converts the input files listed in file, one per line, instead of -i. a line may give the output files after the input, separated by tabs. otherwise the # in the output file names is replaced by the input file name without extension.\n";
+    cout << "--incremental manifest  : skips files whose outputs were built from an input of the same size and modification time with the same options, as recorded in the manifest file. the .sh.json and .alias files next to the outputs count as outputs. the manifest is updated with every converted file.\n";
+    cout << "--shard K/N  : converts only shard K of N (K from 0 to N-1) of the batch. every node computing the same shard count splits the batch the same way, balanced by the estimated cost of the files. use a separate --incremental manifest per shard.\n";
+    cout << "--summary file  : writes a JSON summary of the shard with the status of each of its files, to check for missing or failed files after all shards are done.\n";
+    cout << "-q --quiet  : only prints errors.\n";
+    cout << "-v --verbose  : prints the time each file spent in every stage.\n";
+    cout << "--report file  : writes a JSON report with the read, mapping, resample, post process, mips and write times of every file and of the whole run, the pixels produced, filter taps, pixels per path of --adaptive, bytes read and written and the peak memory. with --stream, read and write times are part of the resample time.\n";
+    cout << "--serve  : runs as server reading one JSON job per line from stdin, e.g. {\"id\": 1, \"args\": [\"-i\", \"in.exr\", \"-o\", \"out.exr\"]}, and writing one JSON response per finished job to stdout. jobs share the threads and the precomputed weight tables of the server, so -j, --matrix-cache and --matrix-memory of a job have no effect. jobs that don't give --read-threads, --write-threads or --max-memory take them from the server's command line, all other options have their defaults. jobs take precomputed weight tables from the shared cache without -p, except with --stream or --adaptive, or if a table would not fit into --matrix-memory.\n";
+    cout << "--serve-socket path  : like --serve, but accepts connections on a unix domain socket at path.\n";
+    cout << "--max-jobs N  : number of jobs the server runs at the same time. default is 2.\n";
+    cout << "--client path  : sends the job lines read from stdin to the server at path and prints its responses.\n";
 }
 
+// Returns the OpenEXR pixel type of a value type used for pixel storage in memory.
+template <class T> PixelType pixelTypeOf();
+template <> PixelType pixelTypeOf<float>() { return IMF::FLOAT; }
+template <> PixelType pixelTypeOf<half>() { return IMF::HALF; }
+template <> PixelType pixelTypeOf<unsigned int>() { return IMF::UINT; }
+
+bool parseResampleType(const string &name, ResampleType *type) {
+    const string resampleName = toLower(name);
+    if (resampleName == "nearest")
+        *type = NEAREST;
+    else if (resampleName == "bilinear")
+        *type = BILINEAR;
+    else if (resampleName == "gaussian")
+        *type = GAUSSIAN;
+    else if (resampleName == "mitchell")
+        *type = MITCHELL;
+    else
+        return false;
+    return true;
+}
+
+bool parseCompression(const string &name, Compression *compression) {
+    const string compressionString = toLower(name);
+    if (compressionString == "no") {
+        *compression = NO_COMPRESSION;
+    }
+    else if (compressionString == "rle") {
+        *compression = RLE_COMPRESSION;
+    }
+    else if (compressionString == "zip_single") {
+        *compression = ZIPS_COMPRESSION;
+    }
+    else if (compressionString == "zip") {
+        *compression = ZIP_COMPRESSION;
+    }
+    else if (compressionString == "piz") {
+        *compression = PIZ_COMPRESSION;
+    }
+    else if (compressionString == "pxr24") {
+        *compression = PXR24_COMPRESSION;
+    }
+    else if (compressionString == "b44") {
+        *compression = B44_COMPRESSION;
+    }
+    else if (compressionString == "b44a") {
+        *compression = B44A_COMPRESSION;
+    }
+    else if (compressionString == "dwaa") {
+        *compression = DWAA_COMPRESSION;
+    }
+    else if (compressionString == "dwab") {
+        *compression = DWAB_COMPRESSION;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+bool parsePixelType(const string &name, PixelType *pixelType) {
+    const string pixelTypeName = toLower(name);
+    if (pixelTypeName == "half")
+        *pixelType = IMF::HALF;
+    else if (pixelTypeName == "float")
+        *pixelType = IMF::FLOAT;
+    else
+        return false;
+    return true;
+}
+
+bool parseEncodeFormat(const string &name, EncodeFormat *format) {
+    const string formatName = toLower(name);
+    if (formatName == "rgb")
+        *format = ENCODE_RGB;
+    else if (formatName == "half2")
+        *format = ENCODE_HALF2;
+    else if (formatName == "uint16")
+        *format = ENCODE_UINT16;
+    else
+        return false;
+    return true;
+}
+
+// Sets the transformation matrix of settings from 16 values in row-major order.
+void setTransform(ConversionSettings &settings, const vector<float> &values) {
+    assert(values.size() == 16);
+    settings.transform = true;
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            settings.transformMatrix[y][x] = values[y * 4 + x];
+        }
+    }
+    // matrix vector multiplication is implemented as row-vector multiplication, hence transpose the matrix.
+    settings.transformMatrix.transpose();
+}
+
+// One output of a conversion. All outputs of an invocation are produced from the same
+// decoded input. file may contain a # wildcard.
+struct OutputSpec {
+    explicit OutputSpec(const ConversionSettings& settings) : settings(settings) {}
+
+    string file;
+    ConversionSettings settings;
+    int size = 0;
+    bool mono = false;
+    bool mips = false;
+    // taps per pixel of the GGX prefiltered mip chain, 0 for the box filtered one.
+    int ggxSamples = 0;
+    int shOrder = 0;
+    bool samplingTable = false;
+    PixelType pixelType = IMF::FLOAT;
+    Compression compression = ZIP_COMPRESSION;
+
+    // true if the uv of -e is written in two channels instead of RGB.
+    bool packedEncoding() const { return settings.encodeColor && settings.encodeFormat != ENCODE_RGB; }
+};
+
+// Overrides the fields of spec that are given in text, a comma separated list of
+// key=value pairs and flags as described in displayHelp.
+bool parseOutputSpec(const string &text, OutputSpec *spec, string *error) {
+    for (const string& entry : split(text, ",")) {
+        const size_t equalsPos = entry.find('=');
+        const string key = toLower(entry.substr(0, equalsPos));
+        const string value = equalsPos == string::npos ? "" : entry.substr(equalsPos + 1);
+        if (key == "file") {
+            spec->file = value;
+        }
+        else if (key == "size") {
+            spec->size = atoi(value.c_str());
+            if (spec->size < 1) {
+                *error = "output size must be at least 1";
+                return false;
+            }
+        }
+        else if (key == "resample") {
+            if (!parseResampleType(value, &spec->settings.resample.type)) {
+                *error = "unknown resampling method: " + value;
+                return false;
+            }
+        }
+        else if (key == "compression") {
+            if (!parseCompression(value, &spec->compression)) {
+                *error = "unknown compression method: " + value;
+                return false;
+            }
+        }
+        else if (key == "pixel-type") {
+            if (!parsePixelType(value, &spec->pixelType)) {
+                *error = "unknown pixel type: " + value;
+                return false;
+            }
+        }
+        else if (key == "transform") {
+            vector<float> values;
+            for (const string& number : split(value, ":"))
+                values.push_back(float(atof(number.c_str())));
+            if (values.size() != 16) {
+                *error = "transform needs 16 values: " + value;
+                return false;
+            }
+            setTransform(spec->settings, values);
+        }
+        else if (key == "mono") {
+            spec->mono = true;
+        }
+        else if (key == "encode") {
+            spec->settings.encodeColor = true;
+        }
+        else if (key == "encode-format") {
+            if (!parseEncodeFormat(value, &spec->settings.encodeFormat)) {
+                *error = "unknown encode format: " + value;
+                return false;
+            }
+        }
+        else if (key == "mips") {
+            spec->mips = true;
+        }
+        else if (key == "ggx") {
+            spec->mips = true;
+            spec->ggxSamples = spec->ggxSamples > 0 ? spec->ggxSamples : kDefaultGGXSamples;
+        }
+        else if (key == "ggx-samples") {
+            spec->mips = true;
+            spec->ggxSamples = atoi(value.c_str());
+            if (spec->ggxSamples < 1) {
+                *error = "ggx samples must be at least 1";
+                return false;
+            }
+        }
+        else if (key == "sh-order") {
+            spec->shOrder = atoi(value.c_str());
+            if (spec->shOrder < 1 || spec->shOrder > kMaxSHOrder) {
+                *error = "sh order must be between 1 and " + to_string(kMaxSHOrder);
+                return false;
+            }
+        }
+        else if (key == "sampling-table") {
+            spec->samplingTable = true;
+        }
+        else {
+            *error = "unknown output spec entry: " + entry;
+            return false;
+        }
+    }
+    if (spec->file.empty()) {
+        *error = "output spec without file: " + text;
+        return false;
+    }
+    return true;
+}
+
+// Returns the size of the octmap, or with --to-cubemap the face size of the cubemap,
+// written for spec from an input of height inputSize.
+int outputSizeOf(const OutputSpec &spec, int inputSize) {
+    return spec.size > 0 ? spec.size : inputSize;
+}
+
+// Returns the width of the image written with settings and the given output size.
+int outputWidthOf(const ConversionSettings &settings, int size) {
+    return settings.resample.direction == OCTMAP_TO_CUBEMAP ? 6 * size : size;
+}
+
+// Returns the face size of the cubemap and the size of the octmap of a conversion from
+// an input of height inputSize to an output of height size, as taken by the resampling
+// functions.
+void mappingSizes(const ResampleSettings &resample, int inputSize, int size, int *faceSize, int *octMapSize) {
+    const bool toCubeMap = resample.direction == OCTMAP_TO_CUBEMAP;
+    *faceSize = toCubeMap ? size : inputSize;
+    *octMapSize = toCubeMap ? inputSize : size;
+}
+
+// Groups the indices of the outputs that share one resampling pass, i.e. have the same
+// size and resampling, when converting an input of height inputSize.
+vector<vector<int>> groupOutputs(const vector<OutputSpec> &outputs, int inputSize) {
+    map<pair<int, string>, vector<int>> groups;
+    vector<pair<int, string>> order;
+    for (int outputIndex = 0; outputIndex < int(outputs.size()); outputIndex++) {
+        const OutputSpec& spec = outputs[outputIndex];
+        pair<int, string> key(outputSizeOf(spec, inputSize), spec.settings.resample.description());
+        if (groups.find(key) == groups.end())
+            order.push_back(key);
+        groups[key].push_back(outputIndex);
+    }
+    vector<vector<int>> result;
+    for (const auto& key : order)
+        result.push_back(groups[key]);
+    return result;
+}
+
+// Returns whether the R, G and B channels of a file are all stored as half.
+bool
+hasHalfChannels(const Header &header)
+{
+    const ChannelList& channels = header.channels();
+    for (const char* name : { "R", "G", "B" }) {
+        const Channel* channel = channels.findChannel(name);
+        if (!channel || channel->type != IMF::HALF)
+            return false;
+    }
+    return true;
+}
+
+// Writes the interleaved RGB image rgbPixels, stored as T, with channels of type
+// pixelType. OpenEXR converts between the two if they differ.
+template <class T>
 void
 writeRGB(const char fileName[],
-    const float *rgbPixels,
+    const T *rgbPixels,
     int width,
     int height,
-    Compression compression = ZIP_COMPRESSION)
+    PixelType pixelType = IMF::FLOAT,
+    Compression compression = ZIP_COMPRESSION,
+    int numThreads = globalThreadCount())
 {
 
     Header header(width, height);
-    header.channels().insert("R", Channel(IMF::FLOAT));
-    header.channels().insert("G", Channel(IMF::FLOAT));
-    header.channels().insert("B", Channel(IMF::FLOAT));
+    header.channels().insert("R", Channel(pixelType));
+    header.channels().insert("G", Channel(pixelType));
+    header.channels().insert("B", Channel(pixelType));
 
     header.compression() = compression;
 
-    OutputFile file(fileName, header);
+    OutputFile file(fileName, header, numThreads);
 
     FrameBuffer frameBuffer;
 
     frameBuffer.insert("R",					// name
-        Slice(IMF::FLOAT,					// type
+        Slice(pixelTypeOf<T>(),				// type
         (char *)rgbPixels,					// base
             sizeof(*rgbPixels) * 3,				// xStride
             sizeof(*rgbPixels) * 3 * width));	// yStride
 
     frameBuffer.insert("G",					// name
-        Slice(IMF::FLOAT,					// type
+        Slice(pixelTypeOf<T>(),				// type
         (char *)(rgbPixels + 1),				// base
             sizeof(*rgbPixels) * 3,				// xStride
             sizeof(*rgbPixels) * 3 * width));	// yStride
 
     frameBuffer.insert("B",					// name
-        Slice(IMF::FLOAT,					// type
+        Slice(pixelTypeOf<T>(),				// type
         (char *)(rgbPixels + 2),			// base
             sizeof(*rgbPixels) * 3,				// xStride
             sizeof(*rgbPixels) * 3 * width));	// yStride
@@ -87,24 +412,27 @@ writeRGB(const char fileName[],
     file.writePixels(height);
 }
 
+template <class T>
 void
 writeZ(const char fileName[],
-    const float *rgbPixels,
+    const T *rgbPixels,
     int width,
     int height,
-    Compression compression = ZIP_COMPRESSION)
+    PixelType pixelType = IMF::FLOAT,
+    Compression compression = ZIP_COMPRESSION,
+    int numThreads = globalThreadCount())
 {
     Header header(width, height);
-    header.channels().insert("Z", Channel(IMF::FLOAT));
+    header.channels().insert("Z", Channel(pixelType));
 
     header.compression() = compression;
 
-    OutputFile file(fileName, header);
+    OutputFile file(fileName, header, numThreads);
 
     FrameBuffer frameBuffer;
 
     frameBuffer.insert("Z",					// name
-        Slice(IMF::FLOAT,					// type
+        Slice(pixelTypeOf<T>(),				// type
         (char *)rgbPixels,					// base
             sizeof(*rgbPixels) * 3,				// xStride
             sizeof(*rgbPixels) * 3 * width));	// yStride
@@ -113,12 +441,129 @@ writeZ(const char fileName[],
     file.writePixels(height);
 }
 
+// Writes the interleaved two channel image rgPixels, stored as T, to R and G channels
+// of the same type.
+template <class T>
+void
+writeRG(const char fileName[],
+    const T *rgPixels,
+    int width,
+    int height,
+    Compression compression = ZIP_COMPRESSION,
+    int numThreads = globalThreadCount())
+{
+    Header header(width, height);
+    header.channels().insert("R", Channel(pixelTypeOf<T>()));
+    header.channels().insert("G", Channel(pixelTypeOf<T>()));
+
+    header.compression() = compression;
+
+    OutputFile file(fileName, header, numThreads);
+
+    FrameBuffer frameBuffer;
+
+    frameBuffer.insert("R",					// name
+        Slice(pixelTypeOf<T>(),				// type
+        (char *)rgPixels,					// base
+            sizeof(*rgPixels) * 2,				// xStride
+            sizeof(*rgPixels) * 2 * width));	// yStride
+
+    frameBuffer.insert("G",					// name
+        Slice(pixelTypeOf<T>(),				// type
+        (char *)(rgPixels + 1),				// base
+            sizeof(*rgPixels) * 2,				// xStride
+            sizeof(*rgPixels) * 2 * width));	// yStride
+
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(height);
+}
+
+// Writes a tiled, mipmapped file. levels[0] points to the octmap of size x size
+// pixels with stride interleaved channels, each further level to one of half the size
+// of the previous (ROUND_DOWN). Channel c is read from offset c and written as
+// channelNames[c] with type pixelTypes[c].
+void
+writeMipmapped(const char fileName[],
+    const vector<const float*>& levels,
+    int size,
+    const vector<string>& channelNames,
+    const vector<PixelType>& pixelTypes,
+    int stride,
+    Compression compression = ZIP_COMPRESSION,
+    int numThreads = globalThreadCount())
+{
+    const int numChannels = int(channelNames.size());
+
+    Header header(size, size);
+    for (int c = 0; c < numChannels; c++)
+        header.channels().insert(channelNames[c], Channel(pixelTypes[c]));
+    header.setTileDescription(TileDescription(64, 64, MIPMAP_LEVELS, ROUND_DOWN));
+    header.compression() = compression;
+
+    TiledOutputFile file(fileName, header, numThreads);
+
+    assert(int(levels.size()) == file.numLevels());
+    for (int level = 0; level < file.numLevels(); level++) {
+        const int levelSize = file.levelWidth(level);
+        const float* pixels = levels[level];
+
+        FrameBuffer frameBuffer;
+        for (int c = 0; c < numChannels; c++) {
+            frameBuffer.insert(channelNames[c],		// name
+                Slice(IMF::FLOAT,					// type
+                (char *)(pixels + c),				// base
+                    sizeof(*pixels) * stride,			// xStride
+                    sizeof(*pixels) * stride * levelSize));	// yStride
+        }
+
+        file.setFrameBuffer(frameBuffer);
+        file.writeTiles(0, file.numXTiles(level) - 1, 0, file.numYTiles(level) - 1, level);
+    }
+}
+
+// Writes the pixels of width x height pixels with the interleaved channels
+// channelNames. Channel c is written with type pixelTypes[c].
+void
+writeChannels(const char fileName[],
+    const vector<string>& channelNames,
+    const vector<PixelType>& pixelTypes,
+    const float *pixels,
+    int width,
+    int height,
+    Compression compression = ZIP_COMPRESSION,
+    int numThreads = globalThreadCount())
+{
+    const int numChannels = int(channelNames.size());
+
+    Header header(width, height);
+    for (int c = 0; c < numChannels; c++)
+        header.channels().insert(channelNames[c], Channel(pixelTypes[c]));
+    header.compression() = compression;
+
+    OutputFile file(fileName, header, numThreads);
+
+    FrameBuffer frameBuffer;
+    for (int c = 0; c < numChannels; c++) {
+        frameBuffer.insert(channelNames[c],			// name
+            Slice(IMF::FLOAT,						// type
+            (char *)(pixels + c),					// base
+                sizeof(*pixels) * numChannels,			// xStride
+                sizeof(*pixels) * numChannels * width));	// yStride
+    }
+
+    file.setFrameBuffer(frameBuffer);
+    file.writePixels(height);
+}
+
+// Reads the RGB channels of fileName into the interleaved image rgbPixels, stored as T.
+template <class T>
 void
 readRGB(const char fileName[],
-    Array2D<float> &rgbPixels,
-    int &width, int &height)
+    Array2D<T> &rgbPixels,
+    int &width, int &height,
+    int numThreads = globalThreadCount())
 {
-    InputFile file(fileName);
+    InputFile file(fileName, numThreads);
 
     Header header = file.header();
     Box2i dw = header.dataWindow();
@@ -130,7 +575,7 @@ readRGB(const char fileName[],
     FrameBuffer frameBuffer;
 
     frameBuffer.insert("R",							// name
-        Slice(IMF::FLOAT,							// type
+        Slice(pixelTypeOf<T>(),						// type
             (char *)(&rgbPixels[0][0] -				// base
             dw.min.x * 3 -
             dw.min.y * 3 * width),
@@ -138,7 +583,7 @@ readRGB(const char fileName[],
             sizeof(rgbPixels[0][0]) * 3 * width));	// yStride
 
     frameBuffer.insert("G",							// name
-        Slice(IMF::FLOAT,							// type
+        Slice(pixelTypeOf<T>(),						// type
             (char *)(&rgbPixels[0][1] -				// base
             dw.min.x * 3 -
             dw.min.y * 3 * width),
@@ -146,7 +591,7 @@ readRGB(const char fileName[],
             sizeof(rgbPixels[0][0]) * 3 * width));	// yStride
 
     frameBuffer.insert("B",							// name
-        Slice(IMF::FLOAT,							// type
+        Slice(pixelTypeOf<T>(),						// type
             (char *)(&rgbPixels[0][2] -				// base
             dw.min.x * 3 -
             dw.min.y * 3 * width),
@@ -157,288 +602,1783 @@ readRGB(const char fileName[],
     file.readPixels(dw.min.y, dw.max.y);
 }
 
-enum ResampleType {
-    NEAREST,
-    BILINEAR,
-    GAUSSIAN,
-    MITCHELL
+// Reads the channels channelNames of fileName into the interleaved image pixels,
+// stored as T.
+template <class T>
+void
+readChannels(const char fileName[],
+    const vector<string>& channelNames,
+    Array2D<T> &pixels,
+    int &width, int &height,
+    int numThreads = globalThreadCount())
+{
+    InputFile file(fileName, numThreads);
+
+    const Box2i dw = file.header().dataWindow();
+    width = dw.max.x - dw.min.x + 1;
+    height = dw.max.y - dw.min.y + 1;
+    const int numChannels = int(channelNames.size());
+
+    pixels.resizeErase(height, size_t(width) * numChannels);
+
+    FrameBuffer frameBuffer;
+    for (int c = 0; c < numChannels; c++) {
+        frameBuffer.insert(channelNames[c],			// name
+            Slice(pixelTypeOf<T>(),					// type
+                (char *)(&pixels[0][c] -			// base
+                ptrdiff_t(dw.min.x) * numChannels -
+                ptrdiff_t(dw.min.y) * numChannels * width),
+                sizeof(pixels[0][0]) * numChannels,			// xStride
+                sizeof(pixels[0][0]) * numChannels * width));	// yStride
+    }
+
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y, dw.max.y);
+}
+
+// Selects the channels of header matched by selection, which is either "all" or a comma
+// separated list of channel names and layer patterns like "diffuse.*". The channels are
+// returned in the order of the channel list of the file.
+void
+selectChannels(const Header &header,
+    const string &selection,
+    vector<string> &channelNames,
+    vector<PixelType> &pixelTypes)
+{
+    const vector<string> patterns = split(selection, ",");
+    const ChannelList& channels = header.channels();
+    channelNames.clear();
+    pixelTypes.clear();
+    for (ChannelList::ConstIterator i = channels.begin(); i != channels.end(); ++i) {
+        const string name = i.name();
+        bool selected = false;
+        for (const string& pattern : patterns) {
+            if (pattern == "all" || pattern == name ||
+                (pattern.size() > 1 && pattern.back() == '*' &&
+                 name.compare(0, pattern.size() - 1, pattern, 0, pattern.size() - 1) == 0))
+                selected = true;
+        }
+        if (!selected)
+            continue;
+        if (i.channel().xSampling != 1 || i.channel().ySampling != 1)
+            throw runtime_error("subsampled channel " + name + " can not be converted");
+        channelNames.push_back(name);
+        pixelTypes.push_back(i.channel().type);
+    }
+    if (channelNames.empty())
+        throw runtime_error("no channel matches " + selection);
+}
+
+// Number of output rows processed by one task of the thread pool.
+const int kRowsPerTask = 8;
+
+// The fewest output rows per band --stream keeps the whole input in memory for, enough
+// for 8 threads to take a task each.
+const int kStreamMinBandRows = 8 * kRowsPerTask;
+
+// A file of a batch. The memory its conversion needs is estimated from the header
+// before any pixels are read.
+// inputBytes covers the decoded input and the buffers shared by several outputs, which
+// are released once the file is converted.
+// channelNames is empty when RGB is converted, otherwise it lists the channels selected
+// by --channels.
+struct BatchItem {
+    string inputPath;
+    vector<string> outputPaths;
+    bool halfInput = false;
+    vector<string> channelNames;
+    vector<PixelType> channelTypes;
+    // the height of the input, the face size of a cubemap or the size of an octmap.
+    int inputSize = 0;
+    size_t inputBytes = 0;
+    size_t outputBytes = 0;
+    // the manifest keys of the outputs, only set for incremental batches.
+    vector<string> outputKeys;
+
+    int numChannels() const { return channelNames.empty() ? 3 : int(channelNames.size()); }
 };
 
-int main( int argc, char *argv[], char *envp[] ) {
+// Fills in the header dependent fields of item. channelSelection is the argument of
+// --channels, or empty to convert RGB.
+void
+estimateBatchItem(BatchItem &item,
+    const vector<OutputSpec> &outputs,
+    const string &channelSelection)
+{
+    InputFile file(item.inputPath.c_str());
+    const Header& header = file.header();
+    const Box2i dw = header.dataWindow();
+    const size_t width = dw.max.x - dw.min.x + 1;
+    const size_t height = dw.max.y - dw.min.y + 1;
+    if (channelSelection.empty()) {
+        item.halfInput = hasHalfChannels(header);
+    }
+    else {
+        selectChannels(header, channelSelection, item.channelNames, item.channelTypes);
+        item.halfInput = std::all_of(item.channelTypes.begin(), item.channelTypes.end(),
+            [](PixelType type) { return type == IMF::HALF; });
+    }
+    const size_t numChannels = item.numChannels();
+    item.inputSize = int(height);
+    item.inputBytes = width * height * numChannels * (item.halfInput ? sizeof(half) : sizeof(float));
+    item.outputBytes = 0;
+    for (const OutputSpec& spec : outputs) {
+        const size_t size = outputSizeOf(spec, int(height));
+        size_t bytes = outputWidthOf(spec.settings, int(size)) * size * numChannels * (spec.settings.halfOutput ? sizeof(half) : sizeof(float));
+        if (spec.packedEncoding())
+            bytes = outputWidthOf(spec.settings, int(size)) * size * 2 * (spec.settings.encodeFormat == ENCODE_HALF2 ? sizeof(half) : sizeof(unsigned int));
+        // the levels of a mip chain add up to less than a third of level 0.
+        if (spec.mips)
+            bytes += bytes / 3;
+        // the box filtered chain the GGX levels are filtered from, in float.
+        if (spec.ggxSamples > 0)
+            bytes += outputWidthOf(spec.settings, int(size)) * size * numChannels * sizeof(float) / 3;
+        if (spec.samplingTable)
+            bytes += samplingTableSize(int(size));
+        item.outputBytes += bytes;
+    }
+    for (const vector<int>& group : groupOutputs(outputs, int(height))) {
+        if (group.size() > 1) {
+            const size_t size = outputSizeOf(outputs[group[0]], int(height));
+            item.inputBytes += outputWidthOf(outputs[group[0]].settings, int(size)) * size * numChannels * sizeof(float);
+        }
+    }
+    // the tiled copy of the input lives as long as the decoded input.
+    if (outputs[0].settings.resample.tiledInput)
+        item.inputBytes += tiledTexelCount(int(width), int(height)) * numChannels * (item.halfInput ? sizeof(half) : sizeof(float));
+    // so does the padded copy, with the widest border any group of outputs needs.
+    if (outputs[0].settings.resample.paddedInput) {
+        int border = 0;
+        for (const vector<int>& group : groupOutputs(outputs, int(height))) {
+            const OutputSpec& first = outputs[group[0]];
+            int faceSize, octMapSize;
+            mappingSizes(first.settings.resample, int(height), outputSizeOf(first, int(height)), &faceSize, &octMapSize);
+            border = std::max(border, paddedFaceBorder(first.settings.resample, faceSize, octMapSize));
+        }
+        const size_t paddedSize = paddedFaceSize(int(height), border);
+        item.inputBytes += 6 * paddedSize * paddedSize * numChannels * (item.halfInput ? sizeof(half) : sizeof(float));
+    }
+}
 
-    if(argc < 2) {
-        displayHelp();
-        return 0;
+// Describes the packed interleaved image pixels for OctMapConverter.
+ImageBuffer
+imageBuffer(const void *pixels,
+    bool isHalf,
+    int width,
+    int height,
+    int numChannels)
+{
+    ImageBuffer buffer;
+    buffer.data = const_cast<void*>(pixels);
+    buffer.format = isHalf ? BUFFER_HALF : BUFFER_FLOAT;
+    buffer.width = width;
+    buffer.height = height;
+    buffer.numChannels = numChannels;
+    return buffer;
+}
+
+// Describes the RGB or packed encoding output pixels of spec for OctMapConverter.
+ImageBuffer
+outputBuffer(const OutputSpec &spec,
+    void *pixels,
+    int width,
+    int height)
+{
+    if (!spec.packedEncoding())
+        return imageBuffer(pixels, spec.settings.halfOutput, width, height, 3);
+    ImageBuffer buffer = imageBuffer(pixels, spec.settings.encodeFormat == ENCODE_HALF2, width, height, 2);
+    if (spec.settings.encodeFormat == ENCODE_UINT16)
+        buffer.format = BUFFER_UINT;
+    return buffer;
+}
+
+// Returns the size of the file at path, or 0 if it can not be read.
+uint64_t
+fileSizeOf(const string &path)
+{
+    std::error_code error;
+    const uintmax_t size = filesystem::file_size(path, error);
+    return error ? 0 : uint64_t(size);
+}
+
+// Returns the path of the spherical harmonics written next to the output at outputPath.
+string
+shPath(const string &outputPath)
+{
+    return outputPath + ".sh.json";
+}
+
+// Returns the path of the sampling table written next to the output at outputPath.
+string
+samplingTablePath(const string &outputPath)
+{
+    return outputPath + ".alias";
+}
+
+// Returns the paths of the files written for the output of spec at outputPath: the
+// output itself, followed by the sidecars of --sh-order and --sampling-table.
+vector<string>
+writtenFiles(const OutputSpec &spec,
+    const string &outputPath)
+{
+    vector<string> files(1, outputPath);
+    if (spec.shOrder > 0)
+        files.push_back(shPath(outputPath));
+    if (spec.samplingTable)
+        files.push_back(samplingTablePath(outputPath));
+    return files;
+}
+
+// Bump when a change alters the files written for existing options, so that incremental
+// batches convert everything again.
+const char* const kToolVersion = "cubemap_to_octmap 2";
+
+// Returns a description of everything besides the input that determines the files
+// written for spec, its sidecars included.
+string
+describeOutput(const OutputSpec &spec,
+    const string &channelSelection)
+{
+    ostringstream description;
+    description.precision(9);
+    description << kToolVersion
+                << "|size=" << spec.size
+                << "|resample=" << spec.settings.resample.description()
+                << "|pixel-type=" << int(spec.pixelType)
+                << "|compression=" << int(spec.compression)
+                << "|mono=" << spec.mono
+                << "|mips=" << spec.mips
+                << "|encode=" << spec.settings.encodeColor
+                << "|encode-format=" << encodeFormatName(spec.settings.encodeFormat)
+                << "|channels=" << channelSelection;
+    if (spec.settings.transform) {
+        description << "|transform=";
+        for (int y = 0; y < 4; y++) {
+            for (int x = 0; x < 4; x++)
+                description << spec.settings.transformMatrix[y][x] << ":";
+        }
+    }
+    if (spec.ggxSamples > 0)
+        description << "|ggx-samples=" << spec.ggxSamples;
+    if (spec.shOrder > 0)
+        description << "|sh-order=" << spec.shOrder;
+    if (spec.samplingTable)
+        description << "|sampling-table";
+    return description.str();
+}
+
+// Reads the items of --input-list. Every line names an input file, optionally followed
+// by one output file per output, separated by tabs. Without them, the # in the output
+// file names is replaced by the input file name without extension. Empty lines are
+// skipped.
+bool
+readInputList(const string &listPath,
+    const vector<OutputSpec> &outputs,
+    vector<BatchItem> &items,
+    string &error)
+{
+    ifstream list(listPath);
+    if (!list) {
+        error = "could not read " + listPath;
+        return false;
     }
+    string line;
+    int lineNumber = 0;
+    while (getline(list, line)) {
+        lineNumber++;
+        // split and trim by hand, trim() does not accept blank strings.
+        vector<string> fields;
+        size_t fieldBegin = 0;
+        while (fieldBegin <= line.size()) {
+            size_t fieldEnd = line.find('\t', fieldBegin);
+            if (fieldEnd == string::npos)
+                fieldEnd = line.size();
+            const string field = line.substr(fieldBegin, fieldEnd - fieldBegin);
+            const size_t first = field.find_first_not_of(" \r");
+            if (first != string::npos)
+                fields.push_back(field.substr(first, field.find_last_not_of(" \r") - first + 1));
+            fieldBegin = fieldEnd + 1;
+        }
+        if (fields.empty())
+            continue;
+        BatchItem item;
+        item.inputPath = fields[0];
+        if (fields.size() == 1) {
+            const string stem = filesystem::path(item.inputPath).stem().string();
+            for (const OutputSpec& spec : outputs) {
+                string outputPath = spec.file;
+                size_t hashPos = outputPath.find("#");
+                if (hashPos == string::npos) {
+                    error = "output file names need a # for input list lines without outputs: " + spec.file;
+                    return false;
+                }
+                outputPath.replace(hashPos, 1, stem);
+                item.outputPaths.push_back(outputPath);
+            }
+        }
+        else if (fields.size() == outputs.size() + 1) {
+            item.outputPaths.assign(fields.begin() + 1, fields.end());
+        }
+        else {
+            error = listPath + ":" + to_string(lineNumber) + ": expected the input file and " +
+                to_string(outputs.size()) + " output file(s)";
+            return false;
+        }
+        items.push_back(item);
+    }
+    return true;
+}
 
-    vector<string> args(argv + 1, argv + argc);
+// Splits items deterministically into numShards shards of about the same estimated cost
+// and returns the items of shard shardIndex. Items are taken by decreasing cost, ties
+// broken by input path, and each one goes to the shard with the least cost so far, so
+// every node computes the same split from the same files without coordination.
+vector<BatchItem>
+selectShard(const vector<BatchItem> &items,
+    int shardIndex,
+    int numShards)
+{
+    vector<size_t> order(items.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    auto cost = [&](size_t i) { return items[i].inputBytes + items[i].outputBytes; };
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (cost(a) != cost(b))
+            return cost(a) > cost(b);
+        return items[a].inputPath < items[b].inputPath;
+    });
+    vector<size_t> shardCosts(numShards, 0);
+    vector<BatchItem> shard;
+    for (size_t i : order) {
+        const int leastLoaded = int(std::min_element(shardCosts.begin(), shardCosts.end()) - shardCosts.begin());
+        shardCosts[leastLoaded] += cost(i);
+        if (leastLoaded == shardIndex)
+            shard.push_back(items[i]);
+    }
+    return shard;
+}
+
+// An input file decoded by the read stage of the batch pipeline. Only one of image
+// and halfImage is used, depending on settings.halfInput.
+struct DecodedFile {
+    explicit DecodedFile(const ConversionSettings& settings) : settings(settings) {}
+
+    int index = 0;
+    const BatchItem* item = nullptr;
+    ConversionSettings settings;
+    int width = 0;
+    int height = 0;
+    Array2D<float> image;
+    Array2D<half> halfImage;
+};
+
+// One octmap or cubemap converted by the compute stage. Only one of image and halfImage
+// is used, depending on the halfOutput setting of its spec. Packed encodings are held
+// with two channels per pixel in halfImage for half2 and in codeImage for uint16. size
+// is the height. sh and samplingTable are only filled in for specs that ask for them.
+struct ConvertedOutput {
+    int width = 0;
+    int size = 0;
+    Array2D<float> image;
+    Array2D<half> halfImage;
+    Array2D<unsigned int> codeImage;
+    vector<vector<float>> mips;
+    SHCoefficients sh;
+    SamplingTable samplingTable;
+};
+
+// The outputs of a file, waiting to be encoded by the write stage. outputs holds one
+// entry per OutputSpec.
+struct ConvertedFile {
+    int index = 0;
+    const BatchItem* item = nullptr;
+    vector<unique_ptr<ConvertedOutput>> outputs;
+};
+
+// Writes output of item as described by spec to path. Selected channels keep their
+// names and pixel types, RGB is written with the pixel type of spec.
+void
+writeOutput(const OutputSpec &spec,
+    const BatchItem &item,
+    const ConvertedOutput &output,
+    const string &path,
+    int numThreads)
+{
+    const int width = output.width;
+    const int size = output.size;
+    if (spec.mips) {
+        vector<const float*> levels(1, output.image[0]);
+        for (const vector<float>& mip : output.mips)
+            levels.push_back(mip.data());
+        if (!item.channelNames.empty()) {
+            writeMipmapped(path.c_str(), levels, size, item.channelNames, item.channelTypes,
+                item.numChannels(), spec.compression, numThreads);
+            return;
+        }
+        const vector<string> channelNames = spec.mono ? vector<string>{ "Z" } : vector<string>{ "R", "G", "B" };
+        writeMipmapped(path.c_str(), levels, size, channelNames,
+            vector<PixelType>(channelNames.size(), spec.pixelType), 3, spec.compression, numThreads);
+    }
+    else if (!item.channelNames.empty()) {
+        writeChannels(path.c_str(), item.channelNames, item.channelTypes, output.image[0], width, size,
+            spec.compression, numThreads);
+    }
+    else if (spec.packedEncoding()) {
+        if (spec.settings.encodeFormat == ENCODE_HALF2)
+            writeRG(path.c_str(), output.halfImage[0], width, size, spec.compression, numThreads);
+        else
+            writeRG(path.c_str(), output.codeImage[0], width, size, spec.compression, numThreads);
+    }
+    else if (spec.settings.halfOutput) {
+        if (spec.mono)
+            writeZ(path.c_str(), output.halfImage[0], width, size, spec.pixelType, spec.compression, numThreads);
+        else
+            writeRGB(path.c_str(), output.halfImage[0], width, size, spec.pixelType, spec.compression, numThreads);
+    }
+    else if (spec.mono) {
+        writeZ(path.c_str(), output.image[0], width, size, spec.pixelType, spec.compression, numThreads);
+    }
+    else {
+        writeRGB(path.c_str(), output.image[0], width, size, spec.pixelType, spec.compression, numThreads);
+    }
+}
+
+// Writes the spherical harmonics sh of the output of item to path as JSON, with one
+// array of the channel values per coefficient.
+void
+writeSH(const string &path,
+    const BatchItem &item,
+    const SHCoefficients &sh)
+{
+    const vector<string> channelNames = item.channelNames.empty() ? vector<string>{ "R", "G", "B" } : item.channelNames;
+    const string temporaryPath = path + ".tmp";
+    {
+        ofstream out(temporaryPath, ios::trunc);
+        out.precision(9);
+        out << "{\n";
+        out << "  \"order\": " << sh.order << ",\n";
+        out << "  \"channels\": [";
+        for (size_t c = 0; c < channelNames.size(); c++)
+            out << (c > 0 ? ", " : "") << jsonQuote(channelNames[c]);
+        out << "],\n";
+        out << "  \"coefficients\": [\n";
+        for (int k = 0; k < sh.order * sh.order; k++) {
+            out << "    [";
+            for (int c = 0; c < sh.numChannels; c++)
+                out << (c > 0 ? ", " : "") << sh.values[size_t(k) * sh.numChannels + c];
+            out << (k + 1 < sh.order * sh.order ? "],\n" : "]\n");
+        }
+        out << "  ]\n}\n";
+        if (!out)
+            throw runtime_error("could not write " + temporaryPath);
+    }
+    filesystem::rename(temporaryPath, path);
+}
+
+// Returns the base of a slice whose pixel (xMin, yMin) is stored at pixels. OpenEXR
+// addresses slices by absolute pixel coordinates, so the base of a slice holding a band
+// of rows lies before the buffer. It is computed on integers, as Slice::Make of later
+// OpenEXR versions does, since pointer arithmetic must stay within the buffer.
+char *
+sliceBase(const void *pixels,
+    int xMin,
+    int yMin,
+    size_t xStride,
+    size_t yStride)
+{
+    return reinterpret_cast<char *>(reinterpret_cast<intptr_t>(pixels) -
+        intptr_t(xMin) * intptr_t(xStride) - intptr_t(yMin) * intptr_t(yStride));
+}
+
+// Reads the rows [yBegin, yEnd) of the data window of file. rgbPixels points to row
+// yBegin of the interleaved RGB image, width pixels per row.
+template <class T>
+void
+readRGBRows(InputFile &file,
+    T *rgbPixels,
+    int width,
+    int yBegin,
+    int yEnd)
+{
+    const Box2i dw = file.header().dataWindow();
+    const char* channelNames[] = { "R", "G", "B" };
+
+    FrameBuffer frameBuffer;
+    for (int c = 0; c < 3; c++) {
+        frameBuffer.insert(channelNames[c],			// name
+            Slice(pixelTypeOf<T>(),					// type
+                sliceBase(rgbPixels + c, dw.min.x, dw.min.y + yBegin,	// base
+                    sizeof(*rgbPixels) * 3, sizeof(*rgbPixels) * 3 * width),
+                sizeof(*rgbPixels) * 3,				// xStride
+                sizeof(*rgbPixels) * 3 * width));	// yStride
+    }
+
+    file.setFrameBuffer(frameBuffer);
+    file.readPixels(dw.min.y + yBegin, dw.min.y + yEnd - 1);
+}
+
+// Converts inputFileName band by band while holding at most about memoryLimit bytes of
+// pixel data, storing the input rows as T. If the whole input fits into the limit next
+// to a band of kStreamMinBandRows output rows, it is read once and kept, and the rest
+// of the limit goes to the bands. Otherwise half of the limit is used for a band of
+// output rows together with the input row ranges of its pixels, the other half for a
+// chunk of input rows. The input rows of a band are then read in as many chunks as
+// needed, skipping rows no pixel of the band reads from, and the chunk read last stays
+// for the next band, which walks the input in the opposite direction so that it starts
+// with the rows it already holds. Since the rows of a band together cover most of the
+// input, such inputs are still read about once per band less one chunk. Every band is
+// written as soon as it is finished.
+template <class T>
+void
+convertStreaming(const string &inputFileName,
+    const string &outputFileName,
+    const ConversionSettings &settings,
+    int outputSize,
+    bool mono,
+    PixelType pixelType,
+    Compression compression,
+    size_t memoryLimit,
+    ThreadPool &threadPool)
+{
+    InputFile inputFile(inputFileName.c_str());
+    const Box2i dw = inputFile.header().dataWindow();
+    const int width = dw.max.x - dw.min.x + 1;
+    const int height = dw.max.y - dw.min.y + 1;
+    const int size = outputSize > 0 ? outputSize : height;
+    const int outputWidth = outputWidthOf(settings, size);
+    int faceSize, octMapSize;
+    mappingSizes(settings.resample, height, size, &faceSize, &octMapSize);
+
+    StreamingConverter converter = makeStreamingConverter(settings, faceSize, octMapSize);
+
+    const size_t outputRowBytes = size_t(outputWidth) * (3 * sizeof(float) + 2 * sizeof(int32_t));
+    const size_t inputRowBytes = size_t(width) * 3 * sizeof(T);
+    const bool keepInput = inputRowBytes * height + outputRowBytes * kStreamMinBandRows <= memoryLimit;
+    const size_t bandBytes = keepInput ? memoryLimit - inputRowBytes * height : memoryLimit / 2;
+    const int bandRows = int(std::clamp<size_t>(bandBytes / outputRowBytes, 1, size));
+    const int chunkRows = keepInput ? height : int(std::clamp<size_t>(memoryLimit / 2 / inputRowBytes, 1, height));
+    vector<float> band(size_t(bandRows) * outputWidth * 3);
+    // the input rows of every pixel of the band, see StreamingConverter::inputRows.
+    vector<int32_t> bandRanges(size_t(bandRows) * outputWidth * 2);
+    // the number of pixel ranges of the band covering each input row, after summing up.
+    vector<int> rowCoverage(height + 1);
+    vector<T> chunk(size_t(chunkRows) * width * 3);
+
+    const char* channelNames[] = { "R", "G", "B" };
+    const int numChannels = mono ? 1 : 3;
+    Header header(outputWidth, size);
+    if (mono) {
+        header.channels().insert("Z", Channel(pixelType));
+    }
+    else {
+        for (int c = 0; c < numChannels; c++)
+            header.channels().insert(channelNames[c], Channel(pixelType));
+    }
+    header.compression() = compression;
+
+    OutputFile outputFile(outputFileName.c_str(), header);
+
+    // the input rows [chunkBegin, chunkEnd) held in chunk.
+    int chunkBegin = 0;
+    int chunkEnd = 0;
+    bool walkDown = true;
+    for (int bandBegin = 0; bandBegin < size; bandBegin += bandRows) {
+        const int bandEnd = std::min(size, bandBegin + bandRows);
+        // the rows of the band from y on.
+        auto bandPixels = [&](int y) { return band.data() + size_t(y - bandBegin) * outputWidth * 3; };
+        auto ranges = [&](int y) { return bandRanges.data() + size_t(y - bandBegin) * outputWidth * 2; };
+        std::fill(band.begin(), band.end(), 0.0f);
+        threadPool.ParallelFor(bandBegin, bandEnd, kRowsPerTask, [&](int yBegin, int yEnd) {
+            converter.inputRows(ranges(yBegin), yBegin, yEnd);
+        });
+        std::fill(rowCoverage.begin(), rowCoverage.end(), 0);
+        for (size_t i = 0; i < size_t(bandEnd - bandBegin) * outputWidth; i++) {
+            if (bandRanges[i * 2] < bandRanges[i * 2 + 1]) {
+                rowCoverage[bandRanges[i * 2]]++;
+                rowCoverage[bandRanges[i * 2 + 1]]--;
+            }
+        }
+        for (int y = 1; y < height; y++)
+            rowCoverage[y] += rowCoverage[y - 1];
+        // returns the first row from y on that a pixel of the band reads from.
+        auto nextNeededRow = [&](int y) {
+            while (y < height && rowCoverage[y] == 0)
+                y++;
+            return y;
+        };
+        // returns the end of the last row before y that a pixel of the band reads from.
+        auto previousNeededRowEnd = [&](int y) {
+            while (y > 0 && rowCoverage[y - 1] == 0)
+                y--;
+            return y;
+        };
+        auto accumulateChunk = [&]() {
+            threadPool.ParallelFor(bandBegin, bandEnd, kRowsPerTask, [&](int yBegin, int yEnd) {
+                converter.accumulate(chunk.data(), chunkBegin, chunkEnd, ranges(yBegin), bandPixels(yBegin), yBegin, yEnd);
+            });
+        };
+        auto readChunk = [&](int begin, int end) {
+            chunkBegin = begin;
+            chunkEnd = end;
+            readRGBRows(inputFile, chunk.data(), width, chunkBegin, chunkEnd);
+            accumulateChunk();
+        };
+
+        if (keepInput) {
+            if (chunkEnd == 0)
+                readChunk(0, height);
+            else
+                accumulateChunk();
+        }
+        else {
+            // the rows still held from the previous band are taken first, then the
+            // remaining ones are read around them.
+            const int doneBegin = chunkBegin;
+            const int doneEnd = chunkEnd;
+            if (doneBegin < doneEnd)
+                accumulateChunk();
+            if (walkDown) {
+                for (int y = nextNeededRow(0); y < height; ) {
+                    if (y >= doneBegin && y < doneEnd) {
+                        y = nextNeededRow(doneEnd);
+                        continue;
+                    }
+                    const int end = std::min(y < doneBegin ? doneBegin : height, y + chunkRows);
+                    readChunk(y, end);
+                    y = nextNeededRow(end);
+                }
+            }
+            else {
+                for (int y = previousNeededRowEnd(height); y > 0; ) {
+                    if (y > doneBegin && y <= doneEnd) {
+                        y = previousNeededRowEnd(doneBegin);
+                        continue;
+                    }
+                    const int begin = std::max(y > doneEnd ? doneEnd : 0, y - chunkRows);
+                    readChunk(begin, y);
+                    y = previousNeededRowEnd(begin);
+                }
+            }
+            walkDown = !walkDown;
+        }
+        threadPool.ParallelFor(bandBegin, bandEnd, kRowsPerTask, [&](int yBegin, int yEnd) {
+            converter.finish(bandPixels(yBegin), yBegin, yEnd);
+        });
+
+        FrameBuffer frameBuffer;
+        for (int c = 0; c < numChannels; c++) {
+            frameBuffer.insert(mono ? "Z" : channelNames[c],	// name
+                Slice(IMF::FLOAT,					// type
+                sliceBase(band.data() + c, 0, bandBegin,	// base
+                    sizeof(float) * 3, sizeof(float) * 3 * outputWidth),
+                    sizeof(float) * 3,				// xStride
+                    sizeof(float) * 3 * outputWidth));	// yStride
+        }
+        outputFile.setFrameBuffer(frameBuffer);
+        outputFile.writePixels(bandEnd - bandBegin);
+    }
+}
+
+// The options of one conversion, as given on the command line or by a job of the
+// server mode.
+struct Options {
     string inputFile = "";
     string outputFile = "";
     Compression compression = ZIP_COMPRESSION;
     bool writeMono = false;
 
-    bool transform = false;
-    Imath::Matrix44<float> transformMatrix;
+    ConversionSettings settings;
 
-    bool encodeColor = false;
+    int outputSize = 0;
+    PixelType pixelType = IMF::FLOAT;
+    bool writeMips = false;
+    int ggxSamples = 0;
+    int shOrder = 0;
+    bool samplingTable = false;
 
-    ResampleType resample = MITCHELL;
-    MitchellFilter mitchellFilter;
-    GaussianFilter gaussianFilter;
-    Filter* filter = &mitchellFilter;
+    int numThreads = 0;
+    int readThreads = 0;
+    int writeThreads = 0;
+    int queueDepth = 2;
+    size_t maxMemory = 0;
 
-    // Loop over remaining command-line args
-    for (vector<string>::iterator i = args.begin(); i != args.end(); ++i) {
-        if (*i == "-h" || *i == "--help") {
-            displayHelp();
-            return 0;
-        } else if (*i == "-i" || *i == "--input") {
-            inputFile = *++i;
-        }
-        else if (*i == "-o" || *i == "--output") {
-            outputFile = *++i;
-        }
-        else if (*i == "-r" || *i == "--resample") {
-            string resampleName = toLower(*++i);
-            if (resampleName == "nearest")
-                resample = NEAREST;
-            else if (resampleName == "bilinear")
-                resample = BILINEAR;
-            else if (resampleName == "gaussian") {
-                filter = &gaussianFilter;
-                resample = GAUSSIAN;
-            }
-            else if (resampleName == "mitchell") {
-                resample = MITCHELL;
-                filter = &mitchellFilter;
+    bool precompute = false;
+    string matrixCacheDirectory = "";
+    // bytes of weight tables kept in memory, 0 if not given.
+    size_t matrixMemory = 0;
+    // MATRIX_PRECOMPUTED with -p, jobs of the server take jobMatrixUse.
+    MatrixUse matrixUse = MATRIX_NONE;
+
+    bool stream = false;
+    size_t streamMemory = size_t(512) << 20;
+
+    vector<string> outputSpecs;
+
+    string channelSelection = "";
+
+    string inputList = "";
+    string manifestPath = "";
+
+    int shardIndex = 0;
+    int numShards = 1;
+    string summaryPath = "";
+
+    LogLevel logLevel = LOG_NORMAL;
+    string reportPath = "";
+
+    bool serve = false;
+    string serveSocket = "";
+    int maxJobs = 0;
+    string clientSocket = "";
+
+    // the outputs given by -o and -O, filled in by parseOptions.
+    vector<OutputSpec> outputs;
+};
+
+enum ParseResult {
+    PARSE_OK,
+    PARSE_HELP,
+    PARSE_ERROR
+};
+
+// Parses the command-line arguments args into options. On PARSE_ERROR, error describes
+// the problem. The outputs are only required when not running as server or client.
+ParseResult
+parseOptions(const vector<string> &args,
+    Options &options,
+    string &error)
+{
+    // returns the value of the option at i and advances i to it.
+    auto nextArg = [&](vector<string>::const_iterator &i) -> const string& {
+        if (i + 1 == args.end())
+            throw invalid_argument("missing value for " + *i);
+        return *++i;
+    };
+
+    try {
+        for (vector<string>::const_iterator i = args.begin(); i != args.end(); ++i) {
+            if (*i == "-h" || *i == "--help") {
+                return PARSE_HELP;
+            } else if (*i == "-i" || *i == "--input") {
+                options.inputFile = nextArg(i);
             }
-            else {
-                cout << "unknown resampling method: " << *i << "\n";
-                displayHelp();
-                return 1;
+            else if (*i == "-o" || *i == "--output") {
+                options.outputFile = nextArg(i);
             }
-        }
-        else if (*i == "-m" || *i == "--mono") {
-            writeMono = true;
-        }
-        else if (*i == "-t" || *i == "--transform") {
-            transform = true;
-            for (int y = 0; y < 4; y++) {
-                for (int x = 0; x < 4; x++) {
-                    transformMatrix[y][x] = stof(*++i);
+            else if (*i == "-O" || *i == "--output-spec") {
+                options.outputSpecs.push_back(nextArg(i));
+            }
+            else if (*i == "-r" || *i == "--resample") {
+                if (!parseResampleType(nextArg(i), &options.settings.resample.type)) {
+                    error = string("unknown resampling method: ") + *i;
+                    return PARSE_ERROR;
                 }
             }
-            // matrix vector multiplication is implemented as row-vector multiplication, hence transpose the matrix.
-            transformMatrix.transpose();
-        }
-        else if (*i == "-e" || *i == "--encode") {
-            encodeColor = true;
-        }
-        else if (*i == "-c" || *i == "--compression") {
-            string compressionString = toLower(*++i);
-            if (compressionString == "no") {
-                compression = NO_COMPRESSION;
+            else if (*i == "--adaptive") {
+                options.settings.resample.adaptiveTolerance = stof(nextArg(i));
+                if (!(options.settings.resample.adaptiveTolerance > 0.0f)) {
+                    error = "adaptive tolerance must be above 0";
+                    return PARSE_ERROR;
+                }
             }
-            else if (compressionString == "rle") {
-                compression = RLE_COMPRESSION;
+            else if (*i == "--channels") {
+                options.channelSelection = nextArg(i);
             }
-            else if (compressionString == "zip_single") {
-                compression = ZIPS_COMPRESSION;
+            else if (*i == "-m" || *i == "--mono") {
+                options.writeMono = true;
             }
-            else if (compressionString == "zip") {
-                compression = ZIP_COMPRESSION;
+            else if (*i == "-t" || *i == "--transform") {
+                vector<float> values;
+                for (int n = 0; n < 16; n++)
+                    values.push_back(stof(nextArg(i)));
+                setTransform(options.settings, values);
             }
-            else if (compressionString == "piz") {
-                compression = PIZ_COMPRESSION;
+            else if (*i == "-s" || *i == "--size") {
+                options.outputSize = stoi(nextArg(i));
+                if (options.outputSize < 1) {
+                    error = "output size must be at least 1";
+                    return PARSE_ERROR;
+                }
             }
-            else if (compressionString == "pxr24") {
-                compression = PXR24_COMPRESSION;
+            else if (*i == "--pixel-type") {
+                if (!parsePixelType(nextArg(i), &options.pixelType)) {
+                    error = string("unknown pixel type: ") + *i;
+                    return PARSE_ERROR;
+                }
             }
-            else if (compressionString == "b44") {
-                compression = B44_COMPRESSION;
+            else if (*i == "--mips") {
+                options.writeMips = true;
             }
-            else if (compressionString == "b44a") {
-                compression = B44A_COMPRESSION;
+            else if (*i == "--ggx") {
+                options.writeMips = true;
+                options.ggxSamples = options.ggxSamples > 0 ? options.ggxSamples : kDefaultGGXSamples;
             }
-            else if (compressionString == "dwaa") {
-                compression = DWAA_COMPRESSION;
+            else if (*i == "--ggx-samples") {
+                options.writeMips = true;
+                options.ggxSamples = stoi(nextArg(i));
+                if (options.ggxSamples < 1) {
+                    error = "ggx samples must be at least 1";
+                    return PARSE_ERROR;
+                }
             }
-            else if (compressionString == "dwab") {
-                compression = DWAB_COMPRESSION;
+            else if (*i == "--sh-order") {
+                options.shOrder = stoi(nextArg(i));
+                if (options.shOrder < 1 || options.shOrder > kMaxSHOrder) {
+                    error = "sh order must be between 1 and " + to_string(kMaxSHOrder);
+                    return PARSE_ERROR;
+                }
             }
-            else {
-                cout << "unknown compression method: " << *i << "\n";
-                displayHelp();
-                return 1;
+            else if (*i == "--sampling-table") {
+                options.samplingTable = true;
+            }
+            else if (*i == "--to-cubemap") {
+                options.settings.resample.direction = OCTMAP_TO_CUBEMAP;
+            }
+            else if (*i == "--tiled-input") {
+                options.settings.resample.tiledInput = true;
+            }
+            else if (*i == "--padded-input") {
+                options.settings.resample.paddedInput = true;
+            }
+            else if (*i == "-j" || *i == "--threads") {
+                options.numThreads = stoi(nextArg(i));
+                if (options.numThreads < 1) {
+                    error = "number of threads must be at least 1";
+                    return PARSE_ERROR;
+                }
+            }
+            else if (*i == "--read-threads" || *i == "--write-threads" || *i == "--queue-depth") {
+                const string& option = *i;
+                int value = stoi(nextArg(i));
+                if (value < 1) {
+                    error = option + " must be at least 1";
+                    return PARSE_ERROR;
+                }
+                if (option == "--read-threads")
+                    options.readThreads = value;
+                else if (option == "--write-threads")
+                    options.writeThreads = value;
+                else
+                    options.queueDepth = value;
+            }
+            else if (*i == "--max-memory") {
+                int megabytes = stoi(nextArg(i));
+                if (megabytes < 1) {
+                    error = "max memory must be at least 1 MB";
+                    return PARSE_ERROR;
+                }
+                options.maxMemory = size_t(megabytes) << 20;
+            }
+            else if (*i == "-p" || *i == "--precompute") {
+                options.precompute = true;
+                options.matrixUse = MATRIX_PRECOMPUTED;
+            }
+            else if (*i == "--matrix-cache") {
+                options.precompute = true;
+                options.matrixUse = MATRIX_PRECOMPUTED;
+                options.matrixCacheDirectory = nextArg(i);
+            }
+            else if (*i == "--matrix-memory") {
+                int megabytes = stoi(nextArg(i));
+                if (megabytes < 1) {
+                    error = "matrix memory must be at least 1 MB";
+                    return PARSE_ERROR;
+                }
+                options.matrixMemory = size_t(megabytes) << 20;
+            }
+            else if (*i == "--stream") {
+                options.stream = true;
+            }
+            else if (*i == "--stream-memory") {
+                options.stream = true;
+                int megabytes = stoi(nextArg(i));
+                if (megabytes < 1) {
+                    error = "stream memory must be at least 1 MB";
+                    return PARSE_ERROR;
+                }
+                options.streamMemory = size_t(megabytes) << 20;
+            }
+            else if (*i == "-e" || *i == "--encode") {
+                options.settings.encodeColor = true;
+            }
+            else if (*i == "--encode-format") {
+                if (!parseEncodeFormat(nextArg(i), &options.settings.encodeFormat)) {
+                    error = string("unknown encode format: ") + *i;
+                    return PARSE_ERROR;
+                }
+            }
+            else if (*i == "--input-list") {
+                options.inputList = nextArg(i);
+            }
+            else if (*i == "--incremental") {
+                options.manifestPath = nextArg(i);
+            }
+            else if (*i == "--shard") {
+                vector<string> shard = split(nextArg(i), "/");
+                if (shard.size() != 2) {
+                    error = "shard must be given as K/N: " + *i;
+                    return PARSE_ERROR;
+                }
+                options.shardIndex = stoi(shard[0]);
+                options.numShards = stoi(shard[1]);
+                if (options.numShards < 1 || options.shardIndex < 0 || options.shardIndex >= options.numShards) {
+                    error = "shard K/N needs 0 <= K < N: " + *i;
+                    return PARSE_ERROR;
+                }
+            }
+            else if (*i == "--summary") {
+                options.summaryPath = nextArg(i);
+            }
+            else if (*i == "-q" || *i == "--quiet") {
+                options.logLevel = LOG_QUIET;
+            }
+            else if (*i == "-v" || *i == "--verbose") {
+                options.logLevel = LOG_VERBOSE;
+            }
+            else if (*i == "--report") {
+                options.reportPath = nextArg(i);
+            }
+            else if (*i == "--serve") {
+                options.serve = true;
+            }
+            else if (*i == "--serve-socket") {
+                options.serve = true;
+                options.serveSocket = nextArg(i);
+            }
+            else if (*i == "--max-jobs") {
+                options.maxJobs = stoi(nextArg(i));
+                if (options.maxJobs < 1) {
+                    error = "max jobs must be at least 1";
+                    return PARSE_ERROR;
+                }
+            }
+            else if (*i == "--client") {
+                options.clientSocket = nextArg(i);
+            }
+            else if (*i == "-c" || *i == "--compression") {
+                if (!parseCompression(nextArg(i), &options.compression)) {
+                    error = string("unknown compression method: ") + *i;
+                    return PARSE_ERROR;
+                }
+            } else {
+                error = "unknown argument " + *i;
+                return PARSE_ERROR;
             }
-        } else {
-            cout << "unknown argument " <<  *i << "\n";
-            displayHelp();
-            return 1;
         }
+    } catch (const logic_error& e) {
+        // thrown by nextArg and by stoi and stof for values that are not numbers.
+        error = string("invalid argument: ") + e.what();
+        return PARSE_ERROR;
     }
 
-    if (encodeColor && writeMono) {
-        cout << "-e and -m cannot be used together\n";
-        displayHelp();
-        return 1;
+    if (options.serve || !options.clientSocket.empty())
+        return PARSE_OK;
+
+    if (!options.inputList.empty() && !options.inputFile.empty()) {
+        error = "-i and --input-list cannot be used together";
+        return PARSE_ERROR;
     }
 
-    cout << "input file: " << inputFile << " output file: " << outputFile << "\n";
+    // the options given on the command line are the defaults of all output specs.
+    OutputSpec defaultSpec(options.settings);
+    defaultSpec.size = options.outputSize;
+    defaultSpec.mono = options.writeMono;
+    defaultSpec.mips = options.writeMips;
+    defaultSpec.ggxSamples = options.ggxSamples;
+    defaultSpec.shOrder = options.shOrder;
+    defaultSpec.samplingTable = options.samplingTable;
+    defaultSpec.pixelType = options.pixelType;
+    defaultSpec.compression = options.compression;
+    if (!options.outputFile.empty()) {
+        options.outputs.push_back(defaultSpec);
+        options.outputs.back().file = options.outputFile;
+    }
+    for (const string& text : options.outputSpecs) {
+        OutputSpec spec(defaultSpec);
+        if (!parseOutputSpec(text, &spec, &error)) {
+            return PARSE_ERROR;
+        }
+        options.outputs.push_back(spec);
+    }
+    if (options.outputs.empty()) {
+        error = "no output file given";
+        return PARSE_ERROR;
+    }
+    for (OutputSpec& spec : options.outputs) {
+        if (spec.settings.encodeColor && spec.mono) {
+            error = "-e and -m cannot be used together";
+            return PARSE_ERROR;
+        }
+        if (spec.mips && spec.settings.resample.direction == OCTMAP_TO_CUBEMAP) {
+            error = "--mips cannot be used together with --to-cubemap";
+            return PARSE_ERROR;
+        }
+        if (!options.channelSelection.empty() && (spec.settings.transform || spec.settings.encodeColor || spec.mono)) {
+            error = "--channels cannot be used together with -t, -e or -m";
+            return PARSE_ERROR;
+        }
+        if (spec.samplingTable && (spec.settings.resample.direction == OCTMAP_TO_CUBEMAP || spec.settings.encodeColor ||
+                                   !options.channelSelection.empty())) {
+            error = "--sampling-table cannot be used together with --to-cubemap, -e or --channels";
+            return PARSE_ERROR;
+        }
+        if (spec.shOrder > 0 && (spec.settings.resample.direction == OCTMAP_TO_CUBEMAP || spec.settings.encodeColor)) {
+            error = "--sh-order cannot be used together with --to-cubemap or -e";
+            return PARSE_ERROR;
+        }
+        if (spec.packedEncoding() && spec.mips) {
+            error = "--mips cannot be used together with --encode-format half2 or uint16";
+            return PARSE_ERROR;
+        }
+        // mip chains are reduced in float, selected channels are kept in float and
+        // converted to their own type when written. packed encodings have their own.
+        spec.settings.halfOutput = spec.pixelType == IMF::HALF && !spec.mips && options.channelSelection.empty() &&
+            !spec.packedEncoding();
+    }
 
-    set<std::string> patches;
-    filesystem::path filePath(inputFile);
-    filesystem::path folderPath = filePath.parent_path();
-    filesystem::path fileName = filePath.filename();
-    string fileNameString = fileName.string();
-    size_t numWildcards = std::count(fileNameString.begin(), fileNameString.end(), '#');
-    if (numWildcards > 1) {
-        cout << "error: multiple # in " << filePath.string() << "\n";
-        cout << "use maximally one # wildcard per filename.\n";
-        return 1;
+    if (options.settings.resample.adaptiveTolerance > 0.0f && (options.precompute || options.settings.resample.tiledInput ||
+                                                               options.settings.resample.paddedInput)) {
+        error = "--adaptive cannot be used together with -p, --matrix-cache, --tiled-input or --padded-input";
+        return PARSE_ERROR;
     }
-    else if (numWildcards == 1) {
-        if (std::count(outputFile.begin(), outputFile.end(), '#') != 1) {
-            cout << "error: if using a # wildcard in the input file name, there must be a # in the output file name as well.\n";
-            return 1;
+
+    if (options.settings.resample.paddedInput && (options.settings.resample.direction == OCTMAP_TO_CUBEMAP ||
+                                                  options.settings.resample.tiledInput)) {
+        error = "--padded-input cannot be used together with --to-cubemap or --tiled-input";
+        return PARSE_ERROR;
+    }
+
+    if (options.stream && (options.outputs.size() > 1 || options.outputs[0].mips || options.precompute || !options.channelSelection.empty() ||
+                           options.settings.resample.tiledInput || options.settings.resample.paddedInput ||
+                           options.settings.resample.adaptiveTolerance > 0.0f ||
+                           options.outputs[0].packedEncoding() || options.outputs[0].shOrder > 0 ||
+                           options.outputs[0].samplingTable)) {
+        error = "--stream cannot be used together with multiple outputs, --mips, --channels, -p, --matrix-cache, --tiled-input, --padded-input, --adaptive, --encode-format half2 or uint16, --sh-order or --sampling-table";
+        return PARSE_ERROR;
+    }
+
+    return PARSE_OK;
+}
+
+// Writes the JSON summary of a batch shard, listing every item of the shard with its
+// status: converted, up_to_date or failed. A merge step can check that the summaries of
+// all shards together cover totalItems items and that none of them failed.
+bool
+writeBatchSummary(const string &summaryPath,
+    const Options &options,
+    size_t totalItems,
+    const vector<BatchItem> &items,
+    const vector<bool> &converted,
+    const vector<BatchItem> &skippedItems,
+    const string &batchError,
+    string *error)
+{
+    auto writeItem = [](ostream& out, const BatchItem& item, const char* status) {
+        out << "    {\"input\": " << jsonQuote(item.inputPath) << ", \"outputs\": [";
+        for (size_t outputIndex = 0; outputIndex < item.outputPaths.size(); outputIndex++)
+            out << (outputIndex > 0 ? ", " : "") << jsonQuote(item.outputPaths[outputIndex]);
+        out << "], \"cost\": " << item.inputBytes + item.outputBytes << ", \"status\": \"" << status << "\"}";
+    };
+
+    const string temporaryPath = summaryPath + ".tmp";
+    {
+        ofstream out(temporaryPath, ios::trunc);
+        out << "{\n";
+        out << "  \"shard\": " << options.shardIndex << ",\n";
+        out << "  \"num_shards\": " << options.numShards << ",\n";
+        out << "  \"total_items\": " << totalItems << ",\n";
+        out << "  \"status\": " << (batchError.empty() ? "\"ok\"" : "\"error\"") << ",\n";
+        if (!batchError.empty())
+            out << "  \"error\": " << jsonQuote(batchError) << ",\n";
+        out << "  \"items\": [\n";
+        bool first = true;
+        for (size_t itemIndex = 0; itemIndex < items.size(); itemIndex++) {
+            out << (first ? "" : ",\n");
+            writeItem(out, items[itemIndex], converted[itemIndex] ? "converted" : "failed");
+            first = false;
         }
-        vector<string> nameSplit = split(toLower(fileNameString), "#");
-        assert(nameSplit.size() == 2);
-        for (const auto & entry : filesystem::directory_iterator(folderPath)) {
-            std::string otherFileName = toLower(entry.path().filename().string());
-            size_t prefixPos = otherFileName.find(nameSplit[0]);
-            size_t postfixPos = otherFileName.find(nameSplit[1]);
-            if (prefixPos == 0 && postfixPos != string::npos) {
-                string patch = otherFileName.substr(nameSplit[0].size(),
-                    otherFileName.size() - nameSplit[0].size() - nameSplit[1].size());
-                patches.insert(patch);
-            }
+        for (const BatchItem& item : skippedItems) {
+            out << (first ? "" : ",\n");
+            writeItem(out, item, "up_to_date");
+            first = false;
+        }
+        out << "\n  ]\n}\n";
+        if (!out) {
+            *error = "could not write " + temporaryPath;
+            return false;
+        }
+    }
+    std::error_code renameError;
+    filesystem::rename(temporaryPath, summaryPath, renameError);
+    if (renameError) {
+        *error = "could not replace " + summaryPath + ": " + renameError.message();
+        return false;
+    }
+    return true;
+}
+
+// Runs the conversion described by options. Progress and errors are written to log.
+// Returns the exit code.
+int
+convert(const Options &options,
+    ThreadPool &threadPool,
+    ResamplingMatrixCache &matrixCache,
+    ostream &out)
+{
+    const auto startTime = chrono::steady_clock::now();
+    Log log(out, options.logLevel);
+    const vector<OutputSpec>& outputs = options.outputs;
+    const int readThreads = options.readThreads > 0 ? options.readThreads : threadPool.GetNumThreads();
+    const int writeThreads = options.writeThreads > 0 ? options.writeThreads : threadPool.GetNumThreads();
+
+    if (options.inputList.empty())
+        log.Write(LOG_NORMAL, "input file: " + options.inputFile);
+    else
+        log.Write(LOG_NORMAL, "input list: " + options.inputList);
+    for (const OutputSpec& spec : outputs)
+        log.Write(LOG_NORMAL, "output file: " + spec.file);
+
+    vector<BatchItem> items;
+    if (!options.inputList.empty()) {
+        string error;
+        if (!readInputList(options.inputList, outputs, items, error)) {
+            log.Error(error);
+            return 1;
         }
     }
     else {
-        if (!filesystem::exists(filePath)) {
-            cout << "error: " << filePath.string() << " does not exist.\n";
+        set<std::string> patches;
+        filesystem::path filePath(options.inputFile);
+        filesystem::path folderPath = filePath.parent_path();
+        filesystem::path fileName = filePath.filename();
+        string fileNameString = fileName.string();
+        size_t numWildcards = std::count(fileNameString.begin(), fileNameString.end(), '#');
+        if (numWildcards > 1) {
+            log.Error("multiple # in " + filePath.string());
+            log.Write(LOG_QUIET, "use maximally one # wildcard per filename.");
             return 1;
         }
-        patches.insert("");
+        else if (numWildcards == 1) {
+            for (const OutputSpec& spec : outputs) {
+                if (std::count(spec.file.begin(), spec.file.end(), '#') != 1) {
+                    log.Error("if using a # wildcard in the input file name, there must be a # in the output file name as well.");
+                    return 1;
+                }
+            }
+            vector<string> nameSplit = split(toLower(fileNameString), "#");
+            assert(nameSplit.size() == 2);
+            for (const auto & entry : filesystem::directory_iterator(folderPath)) {
+                std::string otherFileName = toLower(entry.path().filename().string());
+                size_t prefixPos = otherFileName.find(nameSplit[0]);
+                size_t postfixPos = otherFileName.find(nameSplit[1]);
+                if (prefixPos == 0 && postfixPos != string::npos) {
+                    string patch = otherFileName.substr(nameSplit[0].size(),
+                        otherFileName.size() - nameSplit[0].size() - nameSplit[1].size());
+                    patches.insert(patch);
+                }
+            }
+        }
+        else {
+            if (!filesystem::exists(filePath)) {
+                log.Error(filePath.string() + " does not exist.");
+                return 1;
+            }
+            patches.insert("");
+        }
+
+        for (const string& patch : patches) {
+            BatchItem item;
+            item.inputPath = options.inputFile;
+            size_t hashPos = item.inputPath.find("#");
+            if (hashPos != string::npos)
+                item.inputPath.replace(hashPos, 1, patch);
+            for (const OutputSpec& spec : outputs) {
+                string outputPath = spec.file;
+                hashPos = outputPath.find("#");
+                if (hashPos != string::npos)
+                    outputPath.replace(hashPos, 1, patch);
+                item.outputPaths.push_back(outputPath);
+            }
+            items.push_back(item);
+        }
     }
 
-    std::for_each(
-        std::execution::par_unseq,
-        patches.begin(),
-        patches.end(),
-        [&](const string& patch)
-    {
-        int width, height;
-        Array2D<float> inputImage;
-        string actualInputFilePath = inputFile;
-        size_t hashPos = actualInputFilePath.find("#");
-        if (hashPos != string::npos)
-            actualInputFilePath.replace(hashPos, 1, patch);
-        cout << "reading " << actualInputFilePath << "\n";
-        readRGB(actualInputFilePath.c_str(), inputImage, width, height);
-
-        Array2D<float> outputImage;
-        outputImage.resizeErase(height, height * 3);
+    // the headers are read up front, so that the files can be ordered and admitted by
+    // their size. the largest files go first, so that they don't end up as a long tail.
+    auto estimateItems = [&]() {
+        threadPool.ParallelFor(0, int(items.size()), 1, [&](int itemBegin, int itemEnd) {
+            for (int itemIndex = itemBegin; itemIndex < itemEnd; itemIndex++)
+                estimateBatchItem(items[itemIndex], outputs, options.channelSelection);
+        });
+    };
+
+    // shards are balanced by the estimated cost of their files, so every shard reads
+    // the headers of the whole batch before picking its part.
+    const size_t totalItems = items.size();
+    const bool sharded = options.numShards > 1;
+    vector<BatchItem> skippedItems;
+    unique_ptr<BuildManifest> manifest;
+    string batchError;
+    try {
+        if (sharded) {
+            estimateItems();
+            items = selectShard(items, options.shardIndex, options.numShards);
+            log.Write(LOG_NORMAL, "shard " + to_string(options.shardIndex) + "/" + to_string(options.numShards) + ": " +
+                to_string(items.size()) + " of " + to_string(totalItems) + " file(s)");
+        }
+
+        // incremental batches skip items whose outputs were all built from an input of the
+        // same size and modification time, with the same options and tool version.
+        if (!options.manifestPath.empty()) {
+            manifest = make_unique<BuildManifest>(options.manifestPath);
+            vector<BatchItem> outdatedItems;
+            for (BatchItem& item : items) {
+                const string inputKey = "|" + item.inputPath + "|" + fileStamp(item.inputPath);
+                bool upToDate = true;
+                for (size_t outputIndex = 0; outputIndex < outputs.size(); outputIndex++) {
+                    item.outputKeys.push_back(hashKey(describeOutput(outputs[outputIndex], options.channelSelection) + inputKey));
+                    // the sidecars are recorded with the key of their output, so a missing
+                    // one converts the item again.
+                    for (const string& file : writtenFiles(outputs[outputIndex], item.outputPaths[outputIndex]))
+                        upToDate = upToDate && manifest->IsUpToDate(file, item.outputKeys.back());
+                }
+                if (upToDate)
+                    skippedItems.push_back(item);
+                else
+                    outdatedItems.push_back(item);
+            }
+            log.Write(LOG_NORMAL, "skipping " + to_string(skippedItems.size()) + " up to date file(s)");
+            items.swap(outdatedItems);
+        }
+
+        if (!sharded)
+            estimateItems();
+    } catch (const std::exception& e) {
+        batchError = e.what();
+    }
+    std::stable_sort(items.begin(), items.end(), [](const BatchItem& a, const BatchItem& b) {
+        return a.inputBytes + a.outputBytes > b.inputBytes + b.outputBytes;
+    });
+
+    // records the written outputs of an item, so that the next run can skip them.
+    vector<bool> converted(items.size(), false);
+    std::mutex convertedMutex;
+    auto recordOutputs = [&](int itemIndex) {
+        const BatchItem& item = items[itemIndex];
+        {
+            std::lock_guard<std::mutex> lock(convertedMutex);
+            converted[itemIndex] = true;
+        }
+        if (!manifest)
+            return;
+        for (size_t outputIndex = 0; outputIndex < item.outputPaths.size(); outputIndex++) {
+            for (const string& file : writtenFiles(outputs[outputIndex], item.outputPaths[outputIndex]))
+                manifest->Record(file, item.outputKeys[outputIndex]);
+        }
+    };
+    vector<FileReport> reports(items.size());
+    for (size_t itemIndex = 0; itemIndex < items.size(); itemIndex++) {
+        reports[itemIndex].input = items[itemIndex].inputPath;
+        reports[itemIndex].outputs = items[itemIndex].outputPaths;
+    }
+    uint64_t peakEstimatedBytes = 0;
+    // the manifest, summary and report are also written after errors, to keep the items
+    // finished before them. returns the exit code.
+    auto finishBatch = [&]() {
+        string error;
+        if (!batchError.empty())
+            log.Error(batchError);
+        if (manifest && !manifest->Save(&error)) {
+            log.Error(error);
+            batchError = error;
+        }
+        if (!options.summaryPath.empty() &&
+            !writeBatchSummary(options.summaryPath, options, totalItems, items, converted, skippedItems, batchError, &error)) {
+            log.Error(error);
+            batchError = error;
+        }
+        const double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        if (!options.reportPath.empty() &&
+            !writeRunReport(options.reportPath, reports, wallSeconds, peakEstimatedBytes, &error)) {
+            log.Error(error);
+            batchError = error;
+        }
+        return batchError.empty() ? 0 : 1;
+    };
+    if (!batchError.empty())
+        return finishBatch();
+
+    ProgressLog progress(log, int(items.size()));
+
+    if (options.stream) {
+        // one file at a time, so that the stream memory bounds the whole process.
+        const OutputSpec& spec = outputs[0];
+        try {
+            for (size_t itemIndex = 0; itemIndex < items.size(); itemIndex++) {
+                const BatchItem& item = items[itemIndex];
+                FileReport& report = reports[itemIndex];
+                ConversionSettings fileSettings(spec.settings);
+                fileSettings.halfInput = item.halfInput;
+                {
+                    ScopedTimer timer(&report.resampleSeconds);
+                    if (fileSettings.halfInput)
+                        convertStreaming<half>(item.inputPath, item.outputPaths[0], fileSettings, spec.size,
+                            spec.mono, spec.pixelType, spec.compression, options.streamMemory, threadPool);
+                    else
+                        convertStreaming<float>(item.inputPath, item.outputPaths[0], fileSettings, spec.size,
+                            spec.mono, spec.pixelType, spec.compression, options.streamMemory, threadPool);
+                }
+                const int size = outputSizeOf(spec, item.inputSize);
+                int faceSize, octMapSize;
+                mappingSizes(spec.settings.resample, item.inputSize, size, &faceSize, &octMapSize);
+                report.pixelsProduced = uint64_t(outputWidthOf(spec.settings, size)) * size;
+                report.filterTaps = report.pixelsProduced * resamplerSampleCount(spec.settings.resample, faceSize, octMapSize);
+                report.bytesRead = fileSizeOf(item.inputPath);
+                report.bytesWritten = fileSizeOf(item.outputPaths[0]);
+                recordOutputs(int(itemIndex));
+                progress.Finish(int(itemIndex), "streamed " + item.inputPath + " to " + item.outputPaths[0] +
+                    (log.Enabled(LOG_VERBOSE) ? " (" + to_string(report.resampleSeconds) + "s)" : ""));
+            }
+        } catch (const std::exception& e) {
+            batchError = e.what();
+        }
+        return finishBatch();
+    }
+
+    // Batches run as a pipeline of three stages connected by bounded queues: a read
+    // stage decoding the upcoming inputs, the compute stage converting one file at a
+    // time with all threads of the pool, and a write stage encoding the finished
+    // octmaps. While one file is converted, the next is decoded and the previous one
+    // encoded, so the wall-clock time approaches that of the slowest stage.
+    // The read stage only starts a file once its estimated memory fits into the memory limit.
+    // The input part is returned when the file is converted, the output part when it
+    // is written.
+    BoundedQueue<unique_ptr<DecodedFile>> decodedFiles(options.queueDepth);
+    BoundedQueue<unique_ptr<ConvertedFile>> convertedFiles(options.queueDepth);
+    MemoryBudget memoryBudget(options.maxMemory);
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    // stops all stages after the first error.
+    auto fail = [&](std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error)
+                error = e;
+        }
+        memoryBudget.Close();
+        decodedFiles.Close();
+        convertedFiles.Close();
+    };
+
+    std::thread readStage([&] {
+        try {
+            for (size_t itemIndex = 0; itemIndex < items.size(); itemIndex++) {
+                const BatchItem& item = items[itemIndex];
+                if (!memoryBudget.Acquire(item.inputBytes + item.outputBytes))
+                    break;
+                auto file = make_unique<DecodedFile>(options.settings);
+                file->index = int(itemIndex);
+                file->item = &item;
+                // half sources are kept as half, widening them happens when texels are loaded.
+                file->settings.halfInput = item.halfInput;
+                reports[itemIndex].bytesRead = fileSizeOf(item.inputPath);
+                {
+                    ScopedTimer timer(&reports[itemIndex].readSeconds);
+                    if (!item.channelNames.empty()) {
+                        if (file->settings.halfInput)
+                            readChannels(item.inputPath.c_str(), item.channelNames, file->halfImage, file->width, file->height, readThreads);
+                        else
+                            readChannels(item.inputPath.c_str(), item.channelNames, file->image, file->width, file->height, readThreads);
+                    }
+                    else if (file->settings.halfInput)
+                        readRGB(item.inputPath.c_str(), file->halfImage, file->width, file->height, readThreads);
+                    else
+                        readRGB(item.inputPath.c_str(), file->image, file->width, file->height, readThreads);
+                }
+                if (!decodedFiles.Push(std::move(file)))
+                    break;
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        decodedFiles.Close();
+    });
+
+    std::thread writeStage([&] {
+        try {
+            unique_ptr<ConvertedFile> file;
+            while (convertedFiles.Pop(&file)) {
+                const BatchItem& item = *file->item;
+                FileReport& report = reports[file->index];
+                {
+                    ScopedTimer timer(&report.writeSeconds);
+                    for (size_t outputIndex = 0; outputIndex < outputs.size(); outputIndex++) {
+                        writeOutput(outputs[outputIndex], item, *file->outputs[outputIndex],
+                            item.outputPaths[outputIndex], writeThreads);
+                        if (outputs[outputIndex].shOrder > 0)
+                            writeSH(shPath(item.outputPaths[outputIndex]), item, file->outputs[outputIndex]->sh);
+                        if (outputs[outputIndex].samplingTable &&
+                            !saveSamplingTable(samplingTablePath(item.outputPaths[outputIndex]),
+                                file->outputs[outputIndex]->samplingTable))
+                            throw runtime_error("could not write " + samplingTablePath(item.outputPaths[outputIndex]));
+                    }
+                }
+                for (size_t outputIndex = 0; outputIndex < outputs.size(); outputIndex++) {
+                    report.bytesWritten += fileSizeOf(item.outputPaths[outputIndex]);
+                    if (outputs[outputIndex].shOrder > 0)
+                        report.bytesWritten += fileSizeOf(shPath(item.outputPaths[outputIndex]));
+                    if (outputs[outputIndex].samplingTable)
+                        report.bytesWritten += fileSizeOf(samplingTablePath(item.outputPaths[outputIndex]));
+                }
+                const int index = file->index;
+                recordOutputs(index);
+                file.reset();
+                memoryBudget.Release(item.outputBytes);
+                string line = "converted " + item.inputPath + " to ";
+                for (size_t outputIndex = 0; outputIndex < outputs.size(); outputIndex++)
+                    line += (outputIndex > 0 ? ", " : "") + item.outputPaths[outputIndex];
+                if (log.Enabled(LOG_VERBOSE)) {
+                    line += " (" + describeTimings(report);
+                    if (report.fullKernelPixels + report.bilinearPixels > 0)
+                        line += ", " + to_string(report.fullKernelPixels) + " pixels full kernel, " +
+                            to_string(report.bilinearPixels) + " bilinear";
+                    line += ")";
+                }
+                progress.Finish(index, line);
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+
+    OctMapConverter converter(threadPool, matrixCache);
+    try {
         static float debug_colors[6][3] = { {1,0,0},{0,1,0},{0,0,1},{1,0.5f,0.5f},{0.5f,1,0.5f},{0.5f,0.5f,1} };
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < height; x++) {
-                Imath::V2f octMapCoord(((x+0.5f) / height) * 2.0f - 1.0f, 1.0f - ((y+0.5f) / height) * 2.0f);
-                int face;
-                Imath::V2f cubeMapCoord = cubeEncode(octDecode(octMapCoord), &face);
-                Imath::V3f col(0,0,0);
-                if (resample == NEAREST) {
-                    int inputPixX = std::min(height-1, int(cubeMapCoord.x * height));
-                    inputPixX += height * face;
-                    int inputPixY = std::min(height-1, int((1.0f - cubeMapCoord.y) * height));
-                    col = Imath::V3f(inputImage[inputPixY][inputPixX * 3 + 0],
-                                     inputImage[inputPixY][inputPixX * 3 + 1],
-                                     inputImage[inputPixY][inputPixX * 3 + 2]);
-                }
-                else if (resample == BILINEAR) { // BILINEAR
-                    float xCoord = cubeMapCoord.x * height;
-                    float yCoord = (1.0f - cubeMapCoord.y) * height;
-                    int lowX = std::max(0, int(xCoord - 0.5f));
-                    int lowY = std::max(0, int(yCoord - 0.5f));
-                    int highX = std::min(height-1, lowX + 1);
-                    int highY = std::min(height-1, lowY + 1);
-                    float hFrac = xCoord - (lowX + 0.5f);
-                    float vFrac = yCoord - (lowY + 0.5f);
-                    lowX += height * face;
-                    highX += height * face;
-                    for (int c = 0; c < 3; c++) {
-                        float topleft = inputImage[lowY][lowX * 3 + c];
-                        float topright = inputImage[lowY][highX * 3 + c];
-                        float bottomleft = inputImage[highY][lowX * 3 + c];
-                        float bottomright = inputImage[highY][highX * 3 + c];
-                        col[c] = (topleft * (1 - hFrac) + topright * hFrac) * (1 - vFrac) + (bottomleft * (1 - hFrac) + bottomright * hFrac) * vFrac;
+        unique_ptr<DecodedFile> decoded;
+        while (decodedFiles.Pop(&decoded)) {
+            const BatchItem& item = *decoded->item;
+            const int height = decoded->height;
+            const void* inputPixels = item.halfInput ? (const void*)decoded->halfImage[0] : decoded->image[0];
+            const int numChannels = item.numChannels();
+            ImageBuffer input = imageBuffer(inputPixels, item.halfInput, decoded->width, height, numChannels);
+
+            FileReport& report = reports[decoded->index];
+            // tiled once for all outputs, instead of once per conversion.
+            vector<char> tiledInput;
+            if (outputs[0].settings.resample.tiledInput) {
+                ScopedTimer timer(&report.resampleSeconds);
+                input = converter.TileImage(input, &tiledInput);
+            }
+            // padded with the border of the first group that needs it, and again only
+            // for groups that need another one.
+            vector<char> paddedStorage;
+            ImageBuffer paddedInput;
+            auto converted = make_unique<ConvertedFile>();
+            converted->index = decoded->index;
+            converted->item = &item;
+            vector<void*> outputPixels;
+            for (const OutputSpec& spec : outputs) {
+                auto output = make_unique<ConvertedOutput>();
+                output->size = outputSizeOf(spec, height);
+                output->width = outputWidthOf(spec.settings, output->size);
+                report.pixelsProduced += uint64_t(output->width) * output->size;
+                if (spec.packedEncoding() && spec.settings.encodeFormat == ENCODE_UINT16) {
+                    output->codeImage.resizeErase(output->size, output->width * 2);
+                    outputPixels.push_back(output->codeImage[0]);
+                }
+                else if (spec.packedEncoding()) {
+                    output->halfImage.resizeErase(output->size, output->width * 2);
+                    outputPixels.push_back(output->halfImage[0]);
+                }
+                else if (spec.settings.halfOutput) {
+                    output->halfImage.resizeErase(output->size, output->width * numChannels);
+                    outputPixels.push_back(output->halfImage[0]);
+                }
+                else {
+                    output->image.resizeErase(output->size, output->width * numChannels);
+                    outputPixels.push_back(output->image[0]);
+                }
+                converted->outputs.push_back(std::move(output));
+            }
+
+            // the resampling, which is where the time goes, runs once per group of
+            // outputs with the same size and resampling, only the color post process
+            // runs per output.
+            for (const vector<int>& group : groupOutputs(outputs, height)) {
+                const OutputSpec& first = outputs[group[0]];
+                const int size = outputSizeOf(first, height);
+                const int width = outputWidthOf(first.settings, size);
+                int faceSize, octMapSize;
+                mappingSizes(first.settings.resample, height, size, &faceSize, &octMapSize);
+                ImageBuffer groupInput = input;
+                if (first.settings.resample.paddedInput) {
+                    const int border = paddedFaceBorder(first.settings.resample, faceSize, octMapSize);
+                    if (paddedInput.faceBorder != border) {
+                        ScopedTimer timer(&report.resampleSeconds);
+                        paddedInput = converter.PadImage(input, border, &paddedStorage);
                     }
-                } else {
-                    float radius = filter->GetRadius();
-                    float tmp;
-                    const int supportExtent = 3;
-                    const int sampleCount = (2 * supportExtent + 1) * (2 * supportExtent + 1);
-                    float weight = 0.0;
-                    for(float xOfst = -supportExtent; xOfst <= supportExtent; xOfst++) {
-                        for(float yOfst = -supportExtent; yOfst <= supportExtent; yOfst++) {
-                            Imath::V2f pixelOfst = Imath::V2f(xOfst,yOfst) * radius / (supportExtent + 1);
-                            Imath::V2f octCoordOfst = pixelOfst * (2.0f / height);
-                            Imath::V2f octMapSampleCoord = octMapCoord + octCoordOfst;
-                            // compute wrapover
-                            if(abs(octMapSampleCoord.x) > 1.0f) {
-                              float overlap = abs(octMapSampleCoord.x) - 1.0f;
-                              octMapSampleCoord.x = sign(octMapSampleCoord.x) - overlap;
-                              octMapSampleCoord.y = -octMapSampleCoord.y;
-                            }
-                            if(abs(octMapSampleCoord.y) > 1.0f) {
-                              float overlap = abs(octMapSampleCoord.y) - 1.0f;
-                              octMapSampleCoord.y = sign(octMapSampleCoord.y) - overlap;
-                              octMapSampleCoord.x = -octMapSampleCoord.x;
-                            }
-                            int sampleFace;
-                            Imath::V2f cubeMapSampleCoord = cubeEncode(octDecode(octMapSampleCoord), &sampleFace);
-                            int inputPixX = std::min(height-1, int(cubeMapSampleCoord.x * height));
-                            inputPixX += height * sampleFace;
-                            int inputPixY = std::min(height-1, int((1.0f - cubeMapSampleCoord.y) * height));
-                            Imath::V3f sampleCol = Imath::V3f(inputImage[inputPixY][inputPixX * 3 + 0],
-                                                              inputImage[inputPixY][inputPixX * 3 + 1],
-                                                              inputImage[inputPixY][inputPixX * 3 + 2]);
-                            float filterWeight = filter->Eval(pixelOfst);
-                            weight += filterWeight;
-                            col = col + sampleCol * filterWeight;
-                        }                        
+                    groupInput = paddedInput;
+                }
+                // the mask depends on the input, it is built once for all outputs of the group.
+                ConversionTables tables;
+                {
+                    ScopedTimer timer(&report.mappingSeconds);
+                    tables = converter.PrepareTables(input, first.settings.resample, faceSize, octMapSize,
+                                                     options.matrixUse);
+                }
+                const std::shared_ptr<const ResamplingMatrix>& matrix = tables.matrix;
+                const std::shared_ptr<const KernelMask>& kernelMask = tables.kernelMask;
+                if (kernelMask) {
+                    report.fullKernelPixels += kernelMask->numFullKernelPixels;
+                    report.bilinearPixels += kernelMask->numBilinearPixels;
+                }
+                if (matrix)
+                    report.filterTaps += uint64_t(matrix->weight.size());
+                else if (kernelMask)
+                    report.filterTaps += kernelMask->numFullKernelPixels *
+                        resamplerSampleCount(first.settings.resample, faceSize, octMapSize) + kernelMask->numBilinearPixels * 4;
+                else
+                    report.filterTaps += uint64_t(width) * size * resamplerSampleCount(first.settings.resample, faceSize, octMapSize);
+                // the outputs of a group that share their pixels also share the
+                // projection, taken with the highest order any of them asks for.
+                int shOrder = 0;
+                for (int outputIndex : group)
+                    shOrder = std::max(shOrder, outputs[outputIndex].shOrder);
+                unique_ptr<SHAccumulator> sh;
+                if (shOrder > 0 && (!item.channelNames.empty() || group.size() == 1))
+                    sh = make_unique<SHAccumulator>(shOrder, size, numChannels, kConvertRowsPerBand);
+                auto shareProjection = [&] {
+                    if (!sh)
+                        return;
+                    const SHCoefficients coefficients = sh->Result();
+                    for (int outputIndex : group) {
+                        if (outputs[outputIndex].shOrder > 0)
+                            converted->outputs[outputIndex]->sh = coefficients.truncated(outputs[outputIndex].shOrder);
                     }
-                    col /= weight;
+                };
+                if (!item.channelNames.empty()) {
+                    // all selected channels in one traversal. the outputs of a group
+                    // only differ in how they are written.
+                    float* pixels = static_cast<float*>(outputPixels[group[0]]);
+                    ScopedTimer timer(&report.resampleSeconds);
+                    converter.Convert(groupInput, imageBuffer(pixels, false, width, size, numChannels), first.settings, matrix,
+                        kernelMask, sh.get());
+                    for (size_t k = 1; k < group.size(); k++) {
+                        std::copy(pixels, pixels + size_t(width) * size * numChannels,
+                            static_cast<float*>(outputPixels[group[k]]));
+                    }
+                    shareProjection();
+                    continue;
+                }
+                if (group.size() == 1) {
+                    ScopedTimer timer(&report.resampleSeconds);
+                    converter.Convert(groupInput, outputBuffer(first, outputPixels[group[0]], width, size), first.settings, matrix,
+                        kernelMask, sh.get());
+                    shareProjection();
+                    continue;
+                }
+                ConversionSettings resampleSettings(first.settings);
+                resampleSettings.transform = false;
+                resampleSettings.encodeColor = false;
+                resampleSettings.halfInput = item.halfInput;
+                resampleSettings.halfOutput = false;
+                RowConverter resampleRows;
+                vector<RowPostProcessor> postProcessors;
+                {
+                    ScopedTimer timer(&report.mappingSeconds);
+                    resampleRows = makeRowConverter(resampleSettings, faceSize, octMapSize, matrix, kernelMask);
+                    for (int outputIndex : group)
+                        postProcessors.push_back(makeRowPostProcessor(outputs[outputIndex].settings, width));
                 }
-                if (transform) {
-                    Imath::V3f transformedCol;
-                    transformMatrix.multVecMatrix(col, transformedCol);
-                    col = transformedCol;
+                // the outputs differ in their color transform, each is projected on its
+                // own, right after its post process. the bands of the projections are
+                // the chunks of the pass below.
+                vector<unique_ptr<SHAccumulator>> projections(group.size());
+                for (size_t k = 0; k < group.size(); k++) {
+                    if (outputs[group[k]].shOrder > 0)
+                        projections[k] = make_unique<SHAccumulator>(outputs[group[k]].shOrder, size, 3, kConvertRowsPerBand);
                 }
-                if (encodeColor) {
-                    col = col * 2 - Imath::V3f(1, 1, 1);
-                    Imath::V2f uv = octEncode(col);
-                    col[0] = (uv[0] + 1) * 0.5f;
-                    col[1] = (uv[1] + 1) * 0.5f;
-                    col[2] = 0;
+                Array2D<float> resampled(size, width * 3);
+                // the kernels take the rows of a band, the outputs are passed from its first row on.
+                vector<size_t> outputRowStrides;
+                for (int outputIndex : group)
+                    outputRowStrides.push_back(outputBuffer(outputs[outputIndex], outputPixels[outputIndex], width, size).packedRowStride());
+                // both run band by band, the wall-clock time of the pass is split between
+                // them by the thread time they took.
+                double resampleThreadSeconds = 0.0;
+                double postProcessThreadSeconds = 0.0;
+                std::mutex timesMutex;
+                double passSeconds = 0.0;
+                {
+                    ScopedTimer timer(&passSeconds);
+                    threadPool.ParallelFor(0, size, kConvertRowsPerBand, [&](int yBegin, int yEnd) {
+                        double resampleSeconds = 0.0;
+                        double postProcessSeconds = 0.0;
+                        {
+                            ScopedTimer timer(&resampleSeconds);
+                            resampleRows(groupInput.data, resampled[yBegin], yBegin, yEnd);
+                        }
+                        {
+                            ScopedTimer timer(&postProcessSeconds);
+                            for (size_t k = 0; k < group.size(); k++) {
+                                void* outputRows = static_cast<char*>(outputPixels[group[k]]) + yBegin * outputRowStrides[k];
+                                postProcessors[k](resampled[yBegin], outputRows, yBegin, yEnd);
+                                if (!projections[k])
+                                    continue;
+                                if (outputs[group[k]].settings.halfOutput)
+                                    projections[k]->AddRows(static_cast<const half*>(outputRows), yBegin, yEnd);
+                                else
+                                    projections[k]->AddRows(static_cast<const float*>(outputRows), yBegin, yEnd);
+                            }
+                        }
+                        std::lock_guard<std::mutex> lock(timesMutex);
+                        resampleThreadSeconds += resampleSeconds;
+                        postProcessThreadSeconds += postProcessSeconds;
+                    });
+                }
+                const double threadSeconds = resampleThreadSeconds + postProcessThreadSeconds;
+                const double resampleShare = threadSeconds > 0.0 ? resampleThreadSeconds / threadSeconds : 1.0;
+                report.resampleSeconds += passSeconds * resampleShare;
+                report.postProcessSeconds += passSeconds * (1.0 - resampleShare);
+                for (size_t k = 0; k < group.size(); k++) {
+                    if (projections[k])
+                        converted->outputs[group[k]]->sh = projections[k]->Result();
+                }
+            }
+            // the input is not needed anymore, release it before waiting for the write stage.
+            decoded.reset();
+            memoryBudget.Release(item.inputBytes);
+
+            for (size_t outputIndex = 0; outputIndex < outputs.size(); outputIndex++) {
+                ConvertedOutput& output = *converted->outputs[outputIndex];
+                if (outputs[outputIndex].mips) {
+                    ScopedTimer timer(&report.mipsSeconds);
+                    if (outputs[outputIndex].ggxSamples > 0)
+                        output.mips = buildGGXOctMapMips(output.image[0], output.size, numChannels,
+                            outputs[outputIndex].ggxSamples, threadPool);
+                    else
+                        output.mips = buildOctMapMips(output.image[0], output.size, numChannels, threadPool);
                 }
-                for (int c = 0; c < 3; c++) {
-                    outputImage[y][x * 3 + c] = col[c];
+                if (outputs[outputIndex].samplingTable) {
+                    ScopedTimer timer(&report.postProcessSeconds);
+                    const bool halfOutput = outputs[outputIndex].settings.halfOutput;
+                    output.samplingTable = converter.BuildSamplingTable(imageBuffer(
+                        halfOutput ? (const void*)output.halfImage[0] : output.image[0], halfOutput, output.width,
+                        output.size, numChannels), outputs[outputIndex].mono);
                 }
             }
+            if (!convertedFiles.Push(std::move(converted)))
+                break;
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    convertedFiles.Close();
+    readStage.join();
+    writeStage.join();
+    peakEstimatedBytes = memoryBudget.GetPeak();
+
+    if (error) {
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            batchError = e.what();
         }
+    }
+    return finishBatch();
+}
+
+// Runs one job of the server mode, see answerJobRequest for the protocol. The read and
+// write threads and the memory limit not given by the job are taken from the server's
+// command line.
+int
+runJob(const vector<string> &args,
+    const Options &serverOptions,
+    ThreadPool &threadPool,
+    ResamplingMatrixCache &matrixCache,
+    ostream &log,
+    string *error)
+{
+    Options options;
+    ParseResult result = parseOptions(args, options, *error);
+    if (result == PARSE_HELP) {
+        *error = "-h can not be used in jobs";
+        return 1;
+    }
+    if (result == PARSE_OK && (options.serve || options.maxJobs > 0 || !options.clientSocket.empty())) {
+        *error = "--serve, --serve-socket, --max-jobs and --client can not be used in jobs";
+        return 1;
+    }
+    if (result != PARSE_OK)
+        return 1;
+    if (options.readThreads <= 0)
+        options.readThreads = serverOptions.readThreads;
+    if (options.writeThreads <= 0)
+        options.writeThreads = serverOptions.writeThreads;
+    if (options.maxMemory == 0)
+        options.maxMemory = serverOptions.maxMemory;
+    options.matrixUse = jobMatrixUse(options.precompute, options.stream);
+    return convert(options, threadPool, matrixCache, log);
+}
+
+int main( int argc, char *argv[], char *envp[] ) {
 
-        string actualOutputFilePath = outputFile;
-        hashPos = actualOutputFilePath.find("#");
+    if(argc < 2) {
+        displayHelp();
+        return 0;
+    }
+
+    vector<string> args(argv + 1, argv + argc);
+    Options options;
+    string error;
+    ParseResult result = parseOptions(args, options, error);
+    if (result == PARSE_HELP) {
+        displayHelp();
+        return 0;
+    }
+    if (result == PARSE_ERROR) {
+        cout << error << "\n";
+        displayHelp();
+        return 1;
+    }
 
-        if (hashPos != string::npos)
-            actualOutputFilePath.replace(hashPos, 1, patch);
-        cout << "writing file: " << actualOutputFilePath << "\n";
-        if (writeMono) {
-            writeZ(actualOutputFilePath.c_str(), outputImage[0], height, height, compression);
+    if (!options.clientSocket.empty()) {
+        if (!runJobClient(options.clientSocket, cin, cout, &error)) {
+            cout << "error: " << error << "\n";
+            return 1;
         }
-        else {
-            writeRGB(actualOutputFilePath.c_str(), outputImage[0], height, height, compression);
+        return 0;
+    }
+
+    ThreadPool threadPool(options.numThreads);
+    // a server runs for long, so it only keeps a bounded amount of weight tables.
+    const size_t matrixMemory = options.matrixMemory > 0 ? options.matrixMemory : options.serve ? size_t(2048) << 20 : 0;
+    ResamplingMatrixCache matrixCache(options.matrixCacheDirectory, matrixMemory);
+
+    // OpenEXR compresses and decompresses line blocks on its own global pool, which is
+    // shared by the read and write stages. Each file uses at most its stage's budget.
+    const int readThreads = options.readThreads > 0 ? options.readThreads : threadPool.GetNumThreads();
+    const int writeThreads = options.writeThreads > 0 ? options.writeThreads : threadPool.GetNumThreads();
+    setGlobalThreadCount(readThreads + writeThreads);
+
+    if (options.serve) {
+        // all jobs share the thread pool, the matrix cache and the OpenEXR threads, so
+        // that neither threads nor precomputed matrices are set up per job.
+        JobServer server([&](const string& request) {
+            return answerJobRequest(request, [&](const vector<string>& args, ostream& log, string* jobError) {
+                return runJob(args, options, threadPool, matrixCache, log, jobError);
+            });
+        }, options.maxJobs > 0 ? options.maxJobs : 2);
+        if (options.serveSocket.empty()) {
+            server.ServeStream(cin, cout);
+            return 0;
         }
-    });
-}
\ No newline at end of file
+        cout << "serving on " << options.serveSocket << "\n";
+        cout.flush();
+        server.ServeSocket(options.serveSocket, &error);
+        cout << "error: " << error << "\n";
+        return 1;
+    }
+
+    return convert(options, threadPool, matrixCache, cout);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+
+// Returns the size and modification time of the file at path as "size:mtime", or an
+// empty string if there is no such file.
+inline std::string fileStamp(const std::string& path) {
+    std::error_code error;
+    const uintmax_t size = std::filesystem::file_size(path, error);
+    if (error)
+        return "";
+    const auto modified = std::filesystem::last_write_time(path, error);
+    if (error)
+        return "";
+    return std::to_string(size) + ":" + std::to_string(modified.time_since_epoch().count());
+}
+
+// Returns the 64 bit FNV-1a hash of text as 16 hex digits.
+inline std::string hashKey(const std::string& text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+    return hex;
+}
+
+// Records the key every output file was built with, so that incremental batches can
+// skip outputs whose key did not change. The manifest is a text file with one
+// "key<TAB>output path" line per output. Record may be called from several threads.
+class BuildManifest {
+ public:
+  // Loads the manifest at path. A missing file gives an empty manifest.
+  explicit BuildManifest(const std::string& path) : path_(path) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      const size_t tab = line.find('\t');
+      if (tab != std::string::npos) {
+        entries_[line.substr(tab + 1)] = line.substr(0, tab);
+      }
+    }
+  }
+
+  BuildManifest(const BuildManifest&) = delete;
+  BuildManifest& operator=(const BuildManifest&) = delete;
+
+  // Returns true if output exists and was last built with key.
+  bool IsUpToDate(const std::string& output, const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(output);
+    return it != entries_.end() && it->second == key && std::filesystem::exists(output);
+  }
+
+  void Record(const std::string& output, const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[output] = key;
+  }
+
+  // Writes the manifest next to its path and renames it into place, so that an
+  // interrupted run never leaves a truncated manifest behind.
+  bool Save(std::string* error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::string temporaryPath = path_ + ".tmp";
+    {
+      std::ofstream file(temporaryPath, std::ios::trunc);
+      for (const auto& entry : entries_) {
+        file << entry.second << "\t" << entry.first << "\n";
+      }
+      if (!file) {
+        *error = "could not write " + temporaryPath;
+        return false;
+      }
+    }
+    std::error_code renameError;
+    std::filesystem::rename(temporaryPath, path_, renameError);
+    if (renameError) {
+      *error = "could not replace " + path_ + ": " + renameError.message();
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const std::string path_;
+  // output path -> key
+  std::map<std::string, std::string> entries_;
+  std::mutex mutex_;
+};
+
+#endif  // MANIFEST_H
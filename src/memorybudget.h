@@ -0,0 +1,70 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Admits work under a memory limit. Acquire blocks until the requested bytes fit into
+// the limit together with everything acquired and not yet released. Work larger than
+// the whole limit is admitted once nothing else is in flight, so it runs alone instead
+// of never. A limit of 0 admits everything.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(size_t limit) : limit_(limit), inUse_(0), peak_(0), closed_(false) {}
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  // Returns false if the budget was closed while waiting.
+  bool Acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    released_.wait(lock, [&] {
+      return closed_ || limit_ == 0 || inUse_ == 0 || inUse_ + bytes <= limit_;
+    });
+    if (closed_) {
+      return false;
+    }
+    inUse_ += bytes;
+    peak_ = std::max(peak_, inUse_);
+    return true;
+  }
+
+  void Release(size_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      inUse_ -= std::min(bytes, inUse_);
+    }
+    released_.notify_all();
+  }
+
+  // Wakes and fails all pending and future Acquire calls.
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    released_.notify_all();
+  }
+
+  // Returns the highest number of bytes that were acquired at the same time.
+  size_t GetPeak() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+  }
+
+ private:
+  const size_t limit_;
+  size_t inUse_;
+  size_t peak_;
+  bool closed_;
+  mutable std::mutex mutex_;
+  std::condition_variable released_;
+};
+
+#endif  // MEMORY_BUDGET_H
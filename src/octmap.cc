@@ -0,0 +1,404 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include "octmap.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+const int kRowsPerTask = kConvertRowsPerBand;
+
+float loadElement(const char* element, BufferFormat format) {
+    if (format == BUFFER_HALF)
+        return float(*reinterpret_cast<const half*>(element));
+    return *reinterpret_cast<const float*>(element);
+}
+
+void storeElement(float value, char* element, BufferFormat format) {
+    if (format == BUFFER_HALF)
+        *reinterpret_cast<half*>(element) = half(value);
+    else
+        *reinterpret_cast<float*>(element) = value;
+}
+
+// Returns the rows [yBegin, yEnd) of image as an image of their own, which the row
+// kernels take as a buffer pointing to row yBegin.
+ImageBuffer imageRows(const ImageBuffer& image, int yBegin, int yEnd) {
+    ImageBuffer rows = image;
+    rows.data = static_cast<char*>(image.data) + yBegin * image.getRowStride();
+    rows.height = yEnd - yBegin;
+    return rows;
+}
+
+// Copies the rows [yBegin, yEnd) of source to destination, converting the elements
+// if the formats differ. Both have the same width and number of channels.
+void copyRows(const ImageBuffer& source, const ImageBuffer& destination, int yBegin, int yEnd) {
+    const size_t sourcePixelStride = source.getPixelStride();
+    const size_t destinationPixelStride = destination.getPixelStride();
+    for (int y = yBegin; y < yEnd; y++) {
+        const char* sourceRow = static_cast<const char*>(source.data) + y * source.getRowStride();
+        char* destinationRow = static_cast<char*>(destination.data) + y * destination.getRowStride();
+        if (source.isPacked() && destination.isPacked() && source.format == destination.format) {
+            std::copy(sourceRow, sourceRow + source.packedRowStride(), destinationRow);
+            continue;
+        }
+        for (int x = 0; x < source.width; x++) {
+            const char* sourcePixel = sourceRow + x * sourcePixelStride;
+            char* destinationPixel = destinationRow + x * destinationPixelStride;
+            for (int c = 0; c < source.numChannels; c++) {
+                storeElement(loadElement(sourcePixel + c * source.elementSize(), source.format),
+                             destinationPixel + c * destination.elementSize(), destination.format);
+            }
+        }
+    }
+}
+
+// Copies the rows [yBegin, yEnd) of source to the tiled layout at destination. Both
+// have the same format. Every row of a tile is a contiguous run in both.
+void tileRows(const ImageBuffer& source, char* destination, int yBegin, int yEnd) {
+    const size_t pixelSize = source.packedPixelStride();
+    const size_t pixelStride = source.getPixelStride();
+    const int numTilesPerRow = tilesPerRow(source.width);
+    for (int y = yBegin; y < yEnd; y++) {
+        const char* sourceRow = static_cast<const char*>(source.data) + y * source.getRowStride();
+        for (int xBegin = 0; xBegin < source.width; xBegin += kInputTileSize) {
+            const int xEnd = std::min(source.width, xBegin + kInputTileSize);
+            char* run = destination + tiledTexelIndex(xBegin, y, numTilesPerRow) * pixelSize;
+            if (pixelStride == pixelSize) {
+                std::copy(sourceRow + xBegin * pixelSize, sourceRow + xEnd * pixelSize, run);
+                continue;
+            }
+            for (int x = xBegin; x < xEnd; x++) {
+                const char* sourcePixel = sourceRow + x * pixelStride;
+                std::copy(sourcePixel, sourcePixel + pixelSize, run + (x - xBegin) * pixelSize);
+            }
+        }
+    }
+}
+
+// Fills the rows [yBegin, yEnd) of the padded layout of the cubemap strip source at
+// destination, with the same format, packed. The faces are copied, the border texels
+// take the bilinear lookup of the face their direction points to.
+void padRows(const ImageBuffer& source, int border, char* destination, int yBegin, int yEnd) {
+    const int faceSize = source.height;
+    const int paddedSize = paddedFaceSize(faceSize, border);
+    const size_t pixelSize = source.packedPixelStride();
+    const size_t pixelStride = source.getPixelStride();
+    const size_t elementSize = source.elementSize();
+    std::vector<float> color(source.numChannels);
+    auto sourcePixel = [&](int x, int y) {
+        return static_cast<const char*>(source.data) + y * source.getRowStride() + x * pixelStride;
+    };
+    for (int y = yBegin; y < yEnd; y++) {
+        const int faceY = y - border;
+        char* row = destination + size_t(y) * 6 * paddedSize * pixelSize;
+        for (int face = 0; face < 6; face++) {
+            char* faceRow = row + size_t(face) * paddedSize * pixelSize;
+            for (int x = 0; x < paddedSize; x++) {
+                const int faceX = x - border;
+                char* pixel = faceRow + x * pixelSize;
+                if (faceX >= 0 && faceX < faceSize && faceY >= 0 && faceY < faceSize) {
+                    const char* facePixel = sourcePixel(face * faceSize + faceX, faceY);
+                    std::copy(facePixel, facePixel + pixelSize, pixel);
+                    continue;
+                }
+                // the texel center on the plane of the face, looked up like BilinearResampler.
+                const Imath::V3f direction = cubeFaceDecode(face, ((faceX + 0.5f) / faceSize) * 2.0f - 1.0f,
+                                                            1.0f - ((faceY + 0.5f) / faceSize) * 2.0f);
+                int sourceFace;
+                const Imath::V2f cubeMapCoord = cubeEncode(direction, &sourceFace);
+                const float xCoord = cubeMapCoord.x * faceSize;
+                const float yCoord = (1.0f - cubeMapCoord.y) * faceSize;
+                const int lowX = std::max(0, int(xCoord - 0.5f));
+                const int lowY = std::max(0, int(yCoord - 0.5f));
+                const int highX = std::min(faceSize - 1, lowX + 1);
+                const int highY = std::min(faceSize - 1, lowY + 1);
+                const float hFrac = xCoord - (lowX + 0.5f);
+                const float vFrac = yCoord - (lowY + 0.5f);
+                const int taps[4][2] = { { lowX, lowY }, { highX, lowY }, { lowX, highY }, { highX, highY } };
+                const float weights[4] = { (1 - hFrac) * (1 - vFrac), hFrac * (1 - vFrac), (1 - hFrac) * vFrac,
+                                           hFrac * vFrac };
+                std::fill(color.begin(), color.end(), 0.0f);
+                for (int t = 0; t < 4; t++) {
+                    const char* tapPixel = sourcePixel(sourceFace * faceSize + taps[t][0], taps[t][1]);
+                    for (int c = 0; c < source.numChannels; c++)
+                        color[c] += weights[t] * loadElement(tapPixel + c * elementSize, source.format);
+                }
+                for (int c = 0; c < source.numChannels; c++)
+                    storeElement(color[c], pixel + c * elementSize, source.format);
+            }
+        }
+    }
+}
+
+}  // namespace
+
+ImageBuffer OctMapConverter::TileImage(const ImageBuffer& image, std::vector<char>* storage) {
+  if (image.tiled) {
+    return image;
+  }
+  if (tiledTexelCount(image.width, image.height) > kMaxTiledTexelCount) {
+    throw std::invalid_argument("the image has more texels than tiled input can address");
+  }
+  storage->assign(tiledTexelCount(image.width, image.height) * image.packedPixelStride(), 0);
+  threadPool_.ParallelFor(0, image.height, kRowsPerTask, [&](int yBegin, int yEnd) {
+    tileRows(image, storage->data(), yBegin, yEnd);
+  });
+  ImageBuffer tiled = image;
+  tiled.data = storage->data();
+  tiled.pixelStride = 0;
+  tiled.rowStride = 0;
+  tiled.tiled = true;
+  return tiled;
+}
+
+ImageBuffer OctMapConverter::PadImage(const ImageBuffer& image, int border, std::vector<char>* storage) {
+  if (image.faceBorder == border) {
+    return image;
+  }
+  if (image.tiled || image.faceBorder != 0) {
+    throw std::invalid_argument("only cubemap strips that are neither tiled nor padded can be padded");
+  }
+  if (border < 1 || image.height < 1 || image.width != 6 * image.height) {
+    throw std::invalid_argument("the cubemap must be a 6:1 strip of faces");
+  }
+  const int paddedSize = paddedFaceSize(image.height, border);
+  storage->resize(size_t(6) * paddedSize * paddedSize * image.packedPixelStride());
+  threadPool_.ParallelFor(0, paddedSize, kRowsPerTask, [&](int yBegin, int yEnd) {
+    padRows(image, border, storage->data(), yBegin, yEnd);
+  });
+  ImageBuffer padded = image;
+  padded.data = storage->data();
+  padded.pixelStride = 0;
+  padded.rowStride = 0;
+  padded.faceBorder = border;
+  return padded;
+}
+
+std::shared_ptr<const ResamplingMatrix> OctMapConverter::GetMatrix(
+    const ResampleSettings& resample, int faceSize, int octMapSize) {
+  return matrixCache_.Get(resample, faceSize, octMapSize, threadPool_);
+}
+
+std::shared_ptr<const KernelMask> OctMapConverter::BuildKernelMask(
+    const ImageBuffer& input, const ResampleSettings& resample, int faceSize, int octMapSize) {
+  if (!input.isPacked() || input.tiled) {
+    throw std::invalid_argument("kernel masks can only be built from packed input");
+  }
+  return buildKernelMask(input.data, input.format == BUFFER_HALF, input.numChannels, resample, faceSize,
+                         octMapSize, threadPool_);
+}
+
+ConversionTables OctMapConverter::PrepareTables(const ImageBuffer& input, const ResampleSettings& resample,
+                                                int faceSize, int octMapSize, MatrixUse use) {
+  ConversionTables tables;
+  if (resample.isAdaptive()) {
+    if (use == MATRIX_PRECOMPUTED) {
+      throw std::invalid_argument("adaptive resampling can not be gathered through a resampling matrix");
+    }
+    tables.kernelMask = BuildKernelMask(input, resample, faceSize, octMapSize);
+    return tables;
+  }
+  if (use == MATRIX_PRECOMPUTED || (use == MATRIX_SHARED && matrixCache_.Shares(resample, faceSize, octMapSize))) {
+    tables.matrix = GetMatrix(resample, faceSize, octMapSize);
+  }
+  return tables;
+}
+
+SamplingTable OctMapConverter::BuildSamplingTable(const ImageBuffer& octmap, bool mono) {
+  if (!octmap.data || octmap.width < 1 || octmap.height != octmap.width || octmap.numChannels < (mono ? 1 : 3) ||
+      octmap.format == BUFFER_UINT || octmap.tiled) {
+    throw std::invalid_argument("sampling tables need a square float or half octmap with RGB channels");
+  }
+  const size_t pixelStride = octmap.getPixelStride();
+  const size_t elementSize = octmap.elementSize();
+  auto rowLuminance = [&](int y, float* luminance) {
+    const char* row = static_cast<const char*>(octmap.data) + y * octmap.getRowStride();
+    for (int x = 0; x < octmap.width; x++) {
+      const char* pixel = row + x * pixelStride;
+      if (mono) {
+        const float value = loadElement(pixel, octmap.format);
+        luminance[x] = samplingLuminance(value, value, value);
+        continue;
+      }
+      luminance[x] = samplingLuminance(loadElement(pixel, octmap.format),
+                                       loadElement(pixel + elementSize, octmap.format),
+                                       loadElement(pixel + 2 * elementSize, octmap.format));
+    }
+  };
+  return buildSamplingTable(octmap.width, rowLuminance, threadPool_);
+}
+
+void OctMapConverter::Convert(const ImageBuffer& input,
+                              const ImageBuffer& output,
+                              const ConversionSettings& settings,
+                              std::shared_ptr<const ResamplingMatrix> matrix,
+                              std::shared_ptr<const KernelMask> kernelMask,
+                              SHAccumulator* sh) {
+  const bool toCubeMap = settings.resample.direction == OCTMAP_TO_CUBEMAP;
+  const ImageBuffer& cubemap = toCubeMap ? output : input;
+  const ImageBuffer& octmap = toCubeMap ? input : output;
+  const int faceSize = cubemap.height;
+  const int octMapSize = octmap.width;
+  const int numChannels = input.numChannels;
+  if (!input.data || !output.data || faceSize < 1 || cubemap.width != 6 * faceSize) {
+    throw std::invalid_argument("the cubemap must be a 6:1 strip of faces");
+  }
+  if (octMapSize < 1 || octmap.height != octMapSize) {
+    throw std::invalid_argument("the octmap must be square");
+  }
+  const bool packedEncoding = settings.encodeColor && settings.encodeFormat != ENCODE_RGB;
+  if (numChannels < 1 || output.numChannels != (packedEncoding ? 2 : numChannels)) {
+    throw std::invalid_argument("the cubemap and the octmap must have the same number of channels, "
+                                "except for the 2 channels of packed encodings");
+  }
+  const BufferFormat codeFormat = settings.encodeFormat == ENCODE_HALF2 ? BUFFER_HALF : BUFFER_UINT;
+  if (packedEncoding && (output.format != codeFormat || !output.isPacked())) {
+    throw std::invalid_argument(std::string("packed ") + encodeFormatName(settings.encodeFormat) +
+                                " output must be tightly packed with matching format");
+  }
+  if (input.format == BUFFER_UINT || (output.format == BUFFER_UINT && !packedEncoding)) {
+    throw std::invalid_argument("uint buffers can only hold packed encodings");
+  }
+  if ((settings.transform || settings.encodeColor) && numChannels != 3) {
+    throw std::invalid_argument("the color transform and encoding need 3 channels");
+  }
+  if (output.tiled || (input.tiled && !settings.resample.tiledInput)) {
+    throw std::invalid_argument("only the input of conversions with tiled input may be tiled");
+  }
+  const bool tiledInput = settings.resample.tiledInput;
+  const bool paddedInput = settings.resample.paddedInput;
+  if (output.faceBorder != 0 || (input.faceBorder != 0 && !paddedInput)) {
+    throw std::invalid_argument("only the input of conversions with padded input may be padded");
+  }
+  if (paddedInput && (toCubeMap || tiledInput)) {
+    throw std::invalid_argument("padded input must be a cubemap that is not tiled");
+  }
+  const int border = paddedInput ? paddedFaceBorder(settings.resample, faceSize, octMapSize) : 0;
+  if (input.faceBorder != 0 && input.faceBorder != border) {
+    throw std::invalid_argument("the input was padded for other sizes");
+  }
+  if (tiledInput && tiledTexelCount(input.width, input.height) > kMaxTiledTexelCount) {
+    throw std::invalid_argument("the input has more texels than tiled input can address");
+  }
+  // tiled input is addressed as a single row of texels.
+  const int matrixInputWidth = tiledInput ? int(tiledTexelCount(input.width, input.height))
+                               : paddedInput ? 6 * paddedFaceSize(faceSize, border) : input.width;
+  const int matrixInputHeight = tiledInput ? 1 : paddedInput ? paddedFaceSize(faceSize, border) : input.height;
+  if (matrix && (matrix->inputWidth != matrixInputWidth || matrix->inputHeight != matrixInputHeight ||
+                 matrix->outputWidth != output.width || matrix->outputHeight != output.height)) {
+    throw std::invalid_argument("the resampling matrix was built for other sizes");
+  }
+  const bool adaptive = settings.resample.isAdaptive();
+  if (adaptive && (matrix || tiledInput || paddedInput)) {
+    throw std::invalid_argument("adaptive resampling can not be combined with a matrix, tiled or padded input");
+  }
+  if (sh && (toCubeMap || packedEncoding || sh->size() != octMapSize || sh->numChannels() != numChannels)) {
+    throw std::invalid_argument("spherical harmonics are only projected from octmap output of their size and channels");
+  }
+  if (adaptive && kernelMask && (kernelMask->width != output.width || kernelMask->height != output.height)) {
+    throw std::invalid_argument("the kernel mask was built for other sizes");
+  }
+
+  // the kernels read packed input, strided input is packed once up front.
+  const void* inputPixels = input.data;
+  std::vector<char> packedInput;
+  if (tiledInput) {
+    inputPixels = TileImage(input, &packedInput).data;
+  } else if (paddedInput) {
+    inputPixels = PadImage(input, border, &packedInput).data;
+  } else if (!input.isPacked()) {
+    packedInput.resize(input.packedRowStride() * input.height);
+    ImageBuffer packed = input;
+    packed.data = packedInput.data();
+    packed.pixelStride = 0;
+    packed.rowStride = 0;
+    threadPool_.ParallelFor(0, input.height, kRowsPerTask, [&](int yBegin, int yEnd) {
+      copyRows(input, packed, yBegin, yEnd);
+    });
+    inputPixels = packedInput.data();
+  }
+  const bool halfInput = input.format == BUFFER_HALF;
+  if (!adaptive) {
+    kernelMask = nullptr;
+  } else if (!kernelMask) {
+    kernelMask = buildKernelMask(inputPixels, halfInput, numChannels, settings.resample, faceSize, octMapSize,
+                                 threadPool_);
+  }
+
+  if (packedEncoding) {
+    // resampled to float band by band, and transformed and encoded while the band is
+    // still in the cache.
+    ConversionSettings resampleSettings(settings);
+    resampleSettings.transform = false;
+    resampleSettings.encodeColor = false;
+    resampleSettings.halfInput = halfInput;
+    resampleSettings.halfOutput = false;
+    RowConverter converter = makeRowConverter(resampleSettings, faceSize, octMapSize, matrix, kernelMask);
+    RowPostProcessor encode = makeRowPostProcessor(settings, output.width);
+    const size_t rowSize = size_t(output.width) * 3;
+    threadPool_.ParallelFor(0, output.height, kRowsPerTask, [&](int yBegin, int yEnd) {
+      std::vector<float> rows(rowSize * (yEnd - yBegin));
+      converter(inputPixels, rows.data(), yBegin, yEnd);
+      encode(rows.data(), imageRows(output, yBegin, yEnd).data, yBegin, yEnd);
+    });
+    return;
+  }
+
+  // 3 channels take the color kernels, which also store half. Everything else is
+  // resampled to float. Output the kernels can not store directly is produced band by
+  // band in a temporary and copied over.
+  ImageBuffer band = output;
+  band.pixelStride = 0;
+  band.rowStride = 0;
+  std::function<void(void*, int, int)> convertBand;
+  if (numChannels == 3) {
+    ConversionSettings rowSettings(settings);
+    rowSettings.halfInput = halfInput;
+    rowSettings.halfOutput = output.format == BUFFER_HALF;
+    RowConverter converter = makeRowConverter(rowSettings, faceSize, octMapSize, matrix, kernelMask);
+    convertBand = [=](void* outputPixels, int yBegin, int yEnd) {
+      converter(inputPixels, outputPixels, yBegin, yEnd);
+    };
+  } else {
+    band.format = BUFFER_FLOAT;
+    ChannelRowConverter converter = makeChannelRowConverter(settings.resample, halfInput, numChannels, faceSize,
+                                                            octMapSize, matrix, kernelMask);
+    convertBand = [=](void* outputPixels, int yBegin, int yEnd) {
+      converter(inputPixels, static_cast<float*>(outputPixels), yBegin, yEnd);
+    };
+  }
+
+  auto project = [&](const void* rows, BufferFormat format, int yBegin, int yEnd) {
+    if (!sh) {
+      return;
+    }
+    if (format == BUFFER_HALF) {
+      sh->AddRows(static_cast<const half*>(rows), yBegin, yEnd);
+    } else {
+      sh->AddRows(static_cast<const float*>(rows), yBegin, yEnd);
+    }
+  };
+  if (output.isPacked() && output.format == band.format) {
+    threadPool_.ParallelFor(0, output.height, kRowsPerTask, [&](int yBegin, int yEnd) {
+      void* outputRows = imageRows(output, yBegin, yEnd).data;
+      convertBand(outputRows, yBegin, yEnd);
+      project(outputRows, output.format, yBegin, yEnd);
+    });
+    return;
+  }
+  threadPool_.ParallelFor(0, output.height, kRowsPerTask, [&](int yBegin, int yEnd) {
+    std::vector<char> rows(band.packedRowStride() * (yEnd - yBegin));
+    ImageBuffer bandRows = band;
+    bandRows.data = rows.data();
+    bandRows.height = yEnd - yBegin;
+    convertBand(bandRows.data, yBegin, yEnd);
+    project(bandRows.data, band.format, yBegin, yEnd);
+    copyRows(bandRows, imageRows(output, yBegin, yEnd), 0, yEnd - yBegin);
+  });
+}
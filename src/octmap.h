@@ -0,0 +1,166 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef OCTMAP_H
+#define OCTMAP_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "adaptive.h"
+#include "aliastable.h"
+#include "convert.h"
+#include "resamplingmatrix.h"
+#include "shprojection.h"
+#include "threadpool.h"
+
+// In-process conversion of images in caller-owned memory, for embedding the converter
+// into other tools without going through EXR files.
+
+enum BufferFormat {
+    BUFFER_FLOAT,
+    BUFFER_HALF,
+    // 32 bit unsigned int, only for the codes of ENCODE_UINT16 output.
+    BUFFER_UINT
+};
+
+// An image in caller-owned memory with numChannels interleaved channels. Channel c of
+// pixel (x, y) is stored at data + y * rowStride + x * pixelStride + c * elementSize().
+// Strides are given in bytes, 0 means tightly packed. If tiled is set, the pixels are
+// packed in the tiled layout of tiledTexelIndex instead and the strides are ignored.
+struct ImageBuffer {
+    void* data = nullptr;
+    BufferFormat format = BUFFER_FLOAT;
+    int width = 0;
+    int height = 0;
+    int numChannels = 3;
+    size_t pixelStride = 0;
+    size_t rowStride = 0;
+    bool tiled = false;
+    // if above zero, the cubemap is stored in the padded layout with borders of this many
+    // texels, see paddedFaceBorder. width and height remain those of the strip.
+    int faceBorder = 0;
+
+    size_t elementSize() const { return format == BUFFER_HALF ? sizeof(half) : format == BUFFER_UINT ? sizeof(uint32_t) : sizeof(float); }
+    size_t packedPixelStride() const { return elementSize() * numChannels; }
+    size_t packedRowStride() const { return packedPixelStride() * width; }
+    size_t getPixelStride() const { return pixelStride ? pixelStride : packedPixelStride(); }
+    size_t getRowStride() const { return rowStride ? rowStride : getPixelStride() * width; }
+    bool isPacked() const { return getPixelStride() == packedPixelStride() && getRowStride() == packedRowStride(); }
+};
+
+// The number of rows Convert produces at a time, see SHAccumulator.
+const int kConvertRowsPerBand = 8;
+
+// How a conversion comes to the ResamplingMatrix it gathers through.
+enum MatrixUse {
+    // resamples directly.
+    MATRIX_NONE,
+    // takes the matrix from the cache if the cache shares it, see
+    // ResamplingMatrixCache::Shares, and resamples directly otherwise.
+    MATRIX_SHARED,
+    // takes the matrix from the cache, built on first use, as asked for with -p.
+    MATRIX_PRECOMPUTED
+};
+
+// Returns the MatrixUse of a job of the server mode. Jobs keep the matrices warm in the
+// cache the server shares across them even without precompute, except streamed jobs,
+// which never gather through a matrix.
+inline MatrixUse jobMatrixUse(bool precompute, bool stream) {
+    if (stream)
+        return MATRIX_NONE;
+    return precompute ? MATRIX_PRECOMPUTED : MATRIX_SHARED;
+}
+
+// The tables a conversion of one input goes through, see OctMapConverter::PrepareTables.
+struct ConversionTables {
+    std::shared_ptr<const ResamplingMatrix> matrix;
+    std::shared_ptr<const KernelMask> kernelMask;
+};
+
+// Converts 6:1 cubemap strips to octmaps, or octmaps back to cubemap strips, on a thread pool and resampling matrix cache
+// owned by the caller, so that several converters, or a converter and the command-line
+// batch, share threads and precomputed weight tables.
+class OctMapConverter {
+ public:
+  OctMapConverter(ThreadPool& threadPool, ResamplingMatrixCache& matrixCache)
+      : threadPool_(threadPool), matrixCache_(matrixCache) {}
+
+  OctMapConverter(const OctMapConverter&) = delete;
+  OctMapConverter& operator=(const OctMapConverter&) = delete;
+
+  // Returns the precomputed weight table for the given sizes, built on first use and
+  // kept in the shared cache. faceSize is the face size of the cubemap and octMapSize
+  // the size of the octmap, whichever of the two is the input of resample.direction.
+  std::shared_ptr<const ResamplingMatrix> GetMatrix(const ResampleSettings& resample, int faceSize, int octMapSize);
+
+  // Returns image in the tiled layout, stored in storage, for conversions with
+  // ResampleSettings::tiledInput. Tiling the input once up front saves Convert from doing
+  // so on every call when several outputs are converted from the same input. Throws
+  // std::invalid_argument if the tiled layout would have more than kMaxTiledTexelCount
+  // texels.
+  ImageBuffer TileImage(const ImageBuffer& image, std::vector<char>* storage);
+
+  // Returns the cubemap strip image in the padded layout with faces bordered by border
+  // texels, stored in storage, for conversions with ResampleSettings::paddedInput. The
+  // border comes from paddedFaceBorder for the sizes of the conversion. Like TileImage,
+  // padding once up front saves Convert from doing so on every call. Throws
+  // std::invalid_argument for tiled images and images padded with another border.
+  ImageBuffer PadImage(const ImageBuffer& image, int border, std::vector<char>* storage);
+
+  // Returns which output pixels of a conversion of input with the adaptive resample
+  // settings take the full filter kernel, see adaptive.h. input has to be packed and not
+  // tiled. Convert builds the mask itself if none is passed in, building it up front
+  // gives the number of pixels per path, and saves Convert from building it again for
+  // several outputs of the same input.
+  std::shared_ptr<const KernelMask> BuildKernelMask(const ImageBuffer& input, const ResampleSettings& resample,
+                                                    int faceSize, int octMapSize);
+
+  // Returns the tables to convert input with resample: the matrix as given by use, and
+  // the kernel mask if resample is adaptive. Adaptive resampling never takes a matrix,
+  // so MATRIX_SHARED leaves it out and MATRIX_PRECOMPUTED throws std::invalid_argument.
+  ConversionTables PrepareTables(const ImageBuffer& input, const ResampleSettings& resample, int faceSize,
+                                 int octMapSize, MatrixUse use);
+
+  // Returns the importance sampling table of octmap, a square octmap with at least 3
+  // channels of which the first three are taken as linear RGB, see aliastable.h. If mono
+  // is set, the table follows the first channel alone, the one monochromatic output
+  // writes, and one channel is enough. The rows are built in parallel. Throws
+  // std::invalid_argument for other images.
+  SamplingTable BuildSamplingTable(const ImageBuffer& octmap, bool mono = false);
+
+  // Converts input into output, which must be preallocated and have the same number of
+  // channels. With CUBEMAP_TO_OCTMAP as settings.resample.direction, input is a strip
+  // of six faces of input.height x input.height pixels and output a square octmap.
+  // With OCTMAP_TO_CUBEMAP, input is a square octmap and output a strip of six faces
+  // of output.height x output.height pixels. The color transform and encoding of
+  // settings need 3 channels, its halfInput and halfOutput are taken from the buffer
+  // formats. Packed encodings of settings.encodeFormat take 3 channel input and packed 2
+  // channel output, half for ENCODE_HALF2 and uint for ENCODE_UINT16. If matrix is set, the input is gathered through it. Adaptive settings follow
+  // kernelMask, which must have been built from input, and can not be combined with a
+  // matrix, tiled or padded input. Packed 3 channel
+  // buffers are converted in place, others go through temporary copies, as does input
+  // that is not tiled for settings.resample.tiledInput or padded for
+  // settings.resample.paddedInput. Only input may be tiled, with at most
+  // kMaxTiledTexelCount texels in the tiled layout, only cubemap input may be padded
+  // and not both. If sh is
+  // set, the octmap output is also projected onto spherical harmonics into it, band by
+  // band while the rows are still in the cache. sh has to be built for the size and
+  // number of channels of output with the row band size of kConvertRowsPerBand, and can
+  // not be combined with packed encodings. Throws std::invalid_argument if the buffers
+  // do not fit together.
+  void Convert(const ImageBuffer& input,
+               const ImageBuffer& output,
+               const ConversionSettings& settings,
+               std::shared_ptr<const ResamplingMatrix> matrix = nullptr,
+               std::shared_ptr<const KernelMask> kernelMask = nullptr,
+               SHAccumulator* sh = nullptr);
+
+ private:
+  ThreadPool& threadPool_;
+  ResamplingMatrixCache& matrixCache_;
+};
+
+#endif  // OCTMAP_H
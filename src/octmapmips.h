@@ -0,0 +1,99 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef OCTMAP_MIPS_H
+#define OCTMAP_MIPS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "octmaputil.h"
+#include "threadpool.h"
+
+// Returns the number of levels of a mip chain with OpenEXR's ROUND_DOWN rounding mode,
+// i.e. level l has the size max(1, size >> l).
+inline int numMipLevels(int size) {
+    int levels = 1;
+    while (size > 1) {
+        size >>= 1;
+        levels++;
+    }
+    return levels;
+}
+
+// Reduces an octmap with interleaved channels from srcSize to dstSize with a tent filter
+// covering the footprint of each destination pixel. Taps falling outside of the map
+// wrap around the octahedral edges, so the levels stay seamless on the sphere.
+inline void reduceOctMap(
+    const float* src,
+    int srcSize,
+    float* dst,
+    int dstSize,
+    int channels,
+    ThreadPool& threadPool)
+{
+    const float scale = float(srcSize) / dstSize;
+    threadPool.ParallelFor(0, dstSize, 8, [&](int yBegin, int yEnd) {
+        std::vector<float> col(channels);
+        for (int y = yBegin; y < yEnd; y++) {
+            const float centerY = (y + 0.5f) * scale - 0.5f;
+            const int y0 = int(std::ceil(centerY - scale));
+            const int y1 = int(std::floor(centerY + scale));
+            for (int x = 0; x < dstSize; x++) {
+                const float centerX = (x + 0.5f) * scale - 0.5f;
+                const int x0 = int(std::ceil(centerX - scale));
+                const int x1 = int(std::floor(centerX + scale));
+                std::fill(col.begin(), col.end(), 0.0f);
+                float weightSum = 0.0f;
+                for (int sy = y0; sy <= y1; sy++) {
+                    const float wy = 1.0f - std::abs(sy - centerY) / scale;
+                    if (wy <= 0.0f)
+                        continue;
+                    for (int sx = x0; sx <= x1; sx++) {
+                        const float wx = 1.0f - std::abs(sx - centerX) / scale;
+                        if (wx <= 0.0f)
+                            continue;
+                        int px = sx;
+                        int py = sy;
+                        wrapOctMapPixel(srcSize, &px, &py);
+                        const float* texel = src + (size_t(py) * srcSize + px) * channels;
+                        const float w = wx * wy;
+                        for (int c = 0; c < channels; c++)
+                            col[c] += texel[c] * w;
+                        weightSum += w;
+                    }
+                }
+                float* out = dst + (size_t(y) * dstSize + x) * channels;
+                for (int c = 0; c < channels; c++)
+                    out[c] = col[c] / weightSum;
+            }
+        }
+    });
+}
+
+// Computes the levels 1 .. numMipLevels(size) - 1 of an octmap whose level 0 is given.
+// Each level is reduced from the level above, not from the source image.
+inline std::vector<std::vector<float>> buildOctMapMips(
+    const float* level0,
+    int size,
+    int channels,
+    ThreadPool& threadPool)
+{
+    std::vector<std::vector<float>> levels;
+    // reserved up front, so that the pointer to the previous level stays valid.
+    levels.reserve(numMipLevels(size));
+    const float* src = level0;
+    int srcSize = size;
+    for (int level = 1; level < numMipLevels(size); level++) {
+        int dstSize = std::max(1, size >> level);
+        levels.emplace_back(size_t(dstSize) * dstSize * channels);
+        reduceOctMap(src, srcSize, levels.back().data(), dstSize, channels, threadPool);
+        src = levels.back().data();
+        srcSize = dstSize;
+    }
+    return levels;
+}
+
+#endif  // OCTMAP_MIPS_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "cubemaputil.h"
+#include "octmap.h"
+#include "octmaputil.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kNumChannels = 3;
+
+typedef std::function<float(const Imath::V3f& direction, int channel)> SphereFunction;
+
+// Returns direction scaled onto the surface of the cube, the point of the face it points
+// to. The point is linear in the coordinates of the face, so bilinear lookups within a
+// face return the point they are taken at.
+Imath::V3f cubePoint(const Imath::V3f& direction) {
+  return direction / std::max(std::abs(direction.x), std::max(std::abs(direction.y), std::abs(direction.z)));
+}
+
+// A cubemap strip of faceSize whose texels hold f at their center.
+std::vector<float> cubeMapOf(const SphereFunction& f, int faceSize) {
+  std::vector<float> pixels(size_t(6) * faceSize * faceSize * kNumChannels);
+  for (int face = 0; face < 6; face++) {
+    for (int y = 0; y < faceSize; y++) {
+      for (int x = 0; x < faceSize; x++) {
+        const Imath::V3f d =
+            cubeFaceDecode(face, ((x + 0.5f) / faceSize) * 2.0f - 1.0f, 1.0f - ((y + 0.5f) / faceSize) * 2.0f);
+        for (int c = 0; c < kNumChannels; c++)
+          pixels[(size_t(y) * 6 * faceSize + face * faceSize + x) * kNumChannels + c] = f(d, c);
+      }
+    }
+  }
+  return pixels;
+}
+
+float cubePointChannel(const Imath::V3f& direction, int channel) {
+  return cubePoint(direction)[channel];
+}
+
+// A smooth map with a different gradient in every channel.
+float smoothRadiance(const Imath::V3f& d, int channel) {
+  switch (channel) {
+    case 0: return 1.0f + 0.5f * d.x - 0.3f * d.y + 0.2f * d.z;
+    case 1: return 1.0f + 0.8f * d.z * d.z;
+    default: return 2.0f + std::sin(2.0f * d.x) * std::cos(d.y);
+  }
+}
+
+ImageBuffer floatBuffer(std::vector<float>* pixels, int width, int height) {
+  ImageBuffer buffer;
+  buffer.data = pixels->data();
+  buffer.width = width;
+  buffer.height = height;
+  buffer.numChannels = kNumChannels;
+  return buffer;
+}
+
+// A padded cubemap of the cube points of the texels of a strip of faceSize.
+std::vector<float> paddedCubePoints(int faceSize, int border) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  std::vector<float> strip = cubeMapOf(cubePointChannel, faceSize);
+  std::vector<char> storage;
+  const ImageBuffer padded = converter.PadImage(floatBuffer(&strip, 6 * faceSize, faceSize), border, &storage);
+  EXPECT_EQ(padded.faceBorder, border);
+  EXPECT_EQ(padded.width, 6 * faceSize);
+  const int paddedSize = paddedFaceSize(faceSize, border);
+  std::vector<float> pixels(size_t(6) * paddedSize * paddedSize * kNumChannels);
+  EXPECT_EQ(storage.size(), pixels.size() * sizeof(float));
+  std::memcpy(pixels.data(), storage.data(), std::min(storage.size(), pixels.size() * sizeof(float)));
+  return pixels;
+}
+
+Imath::V3f paddedTexel(const std::vector<float>& pixels, int faceSize, int border, int face, int x, int y) {
+  const int paddedSize = paddedFaceSize(faceSize, border);
+  const float* texel = &pixels[(size_t(y) * 6 * paddedSize + face * paddedSize + x) * kNumChannels];
+  return Imath::V3f(texel[0], texel[1], texel[2]);
+}
+
+// Border texels next to an edge look up the neighbouring face within 1/32 of a texel of
+// the point in their direction, the clamped lookups past the last texel centers of the
+// faces included. In the corners of the border, which look up next to a corner of the
+// cube, the clamping of both coordinates moves them by up to about half a texel, those on
+// the diagonal of the corner toward the center of the corner texel of the cube.
+const float kEdgeTolerance = 1.0f / 32.0f;
+const float kCornerTolerance = 0.51f;
+
+TEST(PadImageTest, BorderHoldsNeighbouringFaces) {
+  const int faceSize = 16;
+  const int border = 3;
+  const std::vector<float> pixels = paddedCubePoints(faceSize, border);
+  const float texelSize = 2.0f / faceSize;
+  const int paddedSize = paddedFaceSize(faceSize, border);
+  for (int face = 0; face < 6; face++) {
+    Imath::V3f normal, uAxis, vAxis;
+    cubeFaceAxes(face, &normal, &uAxis, &vAxis);
+    for (int y = 0; y < paddedSize; y++) {
+      for (int x = 0; x < paddedSize; x++) {
+        // the texel center on the plane of the face, beyond its edges in the border.
+        const float u = ((x - border + 0.5f) / faceSize) * 2.0f - 1.0f;
+        const float v = 1.0f - ((y - border + 0.5f) / faceSize) * 2.0f;
+        const Imath::V3f expected = cubePoint(normal + u * uAxis + v * vAxis);
+        const float error = (paddedTexel(pixels, faceSize, border, face, x, y) - expected).length();
+        const bool outsideU = std::abs(u) > 1.0f;
+        const bool outsideV = std::abs(v) > 1.0f;
+        if (!outsideU && !outsideV) {
+          EXPECT_LT(error, 1e-6f) << "face " << face << ", texel " << x << ", " << y;
+        } else if (outsideU && outsideV) {
+          EXPECT_LT(error, kCornerTolerance * texelSize) << "face " << face << ", corner texel " << x << ", " << y;
+        } else {
+          EXPECT_LT(error, kEdgeTolerance * texelSize) << "face " << face << ", border texel " << x << ", " << y;
+        }
+      }
+    }
+  }
+}
+
+TEST(PadImageTest, BorderFollowsMirroredFaces) {
+  const int faceSize = 16;
+  const std::vector<float> pixels = paddedCubePoints(faceSize, 1);
+  // the texels of every face hold points with a coordinate of 1 along its normal, so the
+  // border left of the right face and the one above the top face tell which face they
+  // were filled from.
+  const Imath::V3f leftOfRight = paddedTexel(pixels, faceSize, 1, 0, 0, faceSize / 2);
+  const Imath::V3f aboveTop = paddedTexel(pixels, faceSize, 1, 2, faceSize / 2, 0);
+  EXPECT_LT(leftOfRight.x, 1.0f);
+  EXPECT_LT(aboveTop.y, 1.0f);
+#ifdef MIRROR_FACES
+  // the back face, and the front face.
+  EXPECT_EQ(leftOfRight.z, 1.0f);
+  EXPECT_EQ(aboveTop.z, -1.0f);
+#else
+  // the front face, and the back face.
+  EXPECT_EQ(leftOfRight.z, -1.0f);
+  EXPECT_EQ(aboveTop.z, 1.0f);
+#endif
+}
+
+// Converts strip of faceSize to an octmap of octMapSize.
+std::vector<float> convert(const std::vector<float>& strip, int faceSize, int octMapSize,
+                           const ConversionSettings& settings) {
+  ThreadPool threadPool(4);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  std::vector<float> input = strip;
+  std::vector<float> output(size_t(octMapSize) * octMapSize * kNumChannels);
+  converter.Convert(floatBuffer(&input, 6 * faceSize, faceSize), floatBuffer(&output, octMapSize, octMapSize),
+                    settings);
+  return output;
+}
+
+const int kFaceSize = 64;
+const int kOctMapSize = 128;
+
+// Returns whether the bilinear taps of octmap pixel (x, y) reach across an edge of a face.
+bool tapsCrossEdge(int x, int y) {
+  int face;
+  const Imath::V2f coord = sampleCube(octDecode(octMapPixelCenter(x, y, kOctMapSize)), &face);
+  const float pixX = coord.x * kFaceSize;
+  const float pixY = (1.0f - coord.y) * kFaceSize;
+  return pixX < 0.5f || pixX > kFaceSize - 0.5f || pixY < 0.5f || pixY > kFaceSize - 0.5f;
+}
+
+TEST(PaddedConversionTest, BilinearRemovesSeams) {
+  const std::vector<float> strip = cubeMapOf(smoothRadiance, kFaceSize);
+  ConversionSettings settings;
+  settings.resample.type = BILINEAR;
+  ConversionSettings paddedSettings = settings;
+  paddedSettings.resample.paddedInput = true;
+  const std::vector<float> output = convert(strip, kFaceSize, kOctMapSize, settings);
+  const std::vector<float> paddedOutput = convert(strip, kFaceSize, kOctMapSize, paddedSettings);
+
+  float edgeError = 0.0f, paddedEdgeError = 0.0f, interiorError = 0.0f;
+  for (int y = 0; y < kOctMapSize; y++) {
+    for (int x = 0; x < kOctMapSize; x++) {
+      const Imath::V3f d = octDecode(octMapPixelCenter(x, y, kOctMapSize));
+      const bool edge = tapsCrossEdge(x, y);
+      for (int c = 0; c < kNumChannels; c++) {
+        const size_t i = (size_t(y) * kOctMapSize + x) * kNumChannels + c;
+        const float truth = smoothRadiance(d, c);
+        if (edge) {
+          edgeError = std::max(edgeError, std::abs(output[i] - truth));
+          paddedEdgeError = std::max(paddedEdgeError, std::abs(paddedOutput[i] - truth));
+        } else {
+          // the taps within a face are the same.
+          EXPECT_NEAR(paddedOutput[i], output[i], 1e-6f * std::abs(output[i])) << "pixel " << x << ", " << y;
+          interiorError = std::max(interiorError, std::abs(output[i] - truth));
+        }
+      }
+    }
+  }
+  // the README states the edges drop 25-fold, to the error of the interiors.
+  EXPECT_LE(paddedEdgeError * 25.0f, edgeError);
+  EXPECT_LE(paddedEdgeError, interiorError);
+}
+
+// The README states that padded gaussian and mitchell conversions of smooth content match
+// those of the strip within 0.5%.
+const float kPaddedFilterTolerance = 0.005f;
+
+TEST(PaddedConversionTest, FilteredMatchesStrip) {
+  const std::vector<float> strip = cubeMapOf(smoothRadiance, kFaceSize);
+  for (ResampleType type : { GAUSSIAN, MITCHELL }) {
+    ConversionSettings settings;
+    settings.resample.type = type;
+    ConversionSettings paddedSettings = settings;
+    paddedSettings.resample.paddedInput = true;
+    const std::vector<float> output = convert(strip, kFaceSize, kOctMapSize, settings);
+    const std::vector<float> paddedOutput = convert(strip, kFaceSize, kOctMapSize, paddedSettings);
+    for (size_t i = 0; i < output.size(); i++) {
+      EXPECT_NEAR(paddedOutput[i], output[i], kPaddedFilterTolerance * std::abs(output[i]))
+          << resampleTypeName(type) << ", value " << i;
+    }
+  }
+}
+
+}  // namespace
@@ -0,0 +1,81 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef PROGRESS_LOG_H
+#define PROGRESS_LOG_H
+
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum LogLevel {
+    LOG_QUIET,    // errors only
+    LOG_NORMAL,   // progress
+    LOG_VERBOSE   // progress with per-file timings
+};
+
+// A line log shared by the threads of a batch. Lines are written whole, so lines of
+// different threads never interleave. Lines above the level of the log are dropped,
+// errors are always written.
+class Log {
+ public:
+  Log(std::ostream& out, LogLevel level) : out_(out), level_(level) {}
+
+  Log(const Log&) = delete;
+  Log& operator=(const Log&) = delete;
+
+  bool Enabled(LogLevel level) const { return level <= level_; }
+
+  void Write(LogLevel level, const std::string& line) {
+    if (!Enabled(level)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_ << line << "\n";
+    out_.flush();
+  }
+
+  void Error(const std::string& message) { Write(LOG_QUIET, "error: " + message); }
+
+ private:
+  std::ostream& out_;
+  const LogLevel level_;
+  std::mutex mutex_;
+};
+
+// Reports the progress of a batch whose items finish concurrently and in any order.
+// Each item reports one line when it is finished. Lines are printed as "[i/n] line" in
+// item order, as soon as all items before them are finished, so the output of a run
+// does not depend on thread timing.
+class ProgressLog {
+ public:
+  ProgressLog(Log& log, int numItems)
+      : log_(log), lines_(numItems), finished_(numItems, false), nextToPrint_(0) {}
+
+  ProgressLog(const ProgressLog&) = delete;
+  ProgressLog& operator=(const ProgressLog&) = delete;
+
+  void Finish(int item, const std::string& line) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    lines_[item] = line;
+    finished_[item] = true;
+    const int numItems = int(lines_.size());
+    while (nextToPrint_ < numItems && finished_[nextToPrint_]) {
+      log_.Write(LOG_NORMAL, "[" + std::to_string(nextToPrint_ + 1) + "/" + std::to_string(numItems) + "] " +
+                             lines_[nextToPrint_]);
+      lines_[nextToPrint_].clear();
+      nextToPrint_++;
+    }
+  }
+
+ private:
+  Log& log_;
+  std::vector<std::string> lines_;
+  std::vector<bool> finished_;
+  int nextToPrint_;
+  std::mutex mutex_;
+};
+
+#endif  // PROGRESS_LOG_H
@@ -0,0 +1,688 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "IlmBase/Imath/ImathFun.h"
+#include "IlmBase/Imath/ImathVec.h"
+
+#include "batchkernels.h"
+#include "cubemaputil.h"
+#include "octmaputil.h"
+#include "filter.h"
+
+enum ResampleType {
+    NEAREST,
+    BILINEAR,
+    GAUSSIAN,
+    MITCHELL
+};
+
+inline const char* resampleTypeName(ResampleType resample) {
+    switch (resample) {
+        case NEAREST: return "nearest";
+        case BILINEAR: return "bilinear";
+        case GAUSSIAN: return "gaussian";
+        case MITCHELL: return "mitchell";
+    }
+    return "unknown";
+}
+
+// Which of the two images is the input. Both directions use the same resampling
+// methods and filters.
+enum MappingDirection {
+    CUBEMAP_TO_OCTMAP,
+    OCTMAP_TO_CUBEMAP
+};
+
+// The resampling method together with the filters used by GAUSSIAN and MITCHELL.
+struct ResampleSettings {
+    ResampleType type = MITCHELL;
+    MappingDirection direction = CUBEMAP_TO_OCTMAP;
+    // addresses the input in the tiled layout of tiledTexelIndex instead of row by row.
+    bool tiledInput = false;
+    // reads cubemap input stored as six faces with borders filled from their neighbours,
+    // see paddedFaceBorder, instead of as a 6:1 strip.
+    bool paddedInput = false;
+    // if above zero, GAUSSIAN and MITCHELL fall back to bilinear resampling where the
+    // input varies by less than this fraction of its magnitude, see adaptive.h.
+    float adaptiveTolerance = 0.0f;
+    MitchellFilter mitchellFilter;
+    GaussianFilter gaussianFilter;
+
+    bool isFiltered() const { return type == GAUSSIAN || type == MITCHELL; }
+
+    bool isAdaptive() const { return isFiltered() && adaptiveTolerance > 0.0f; }
+
+    const Filter& filter() const {
+        if (type == GAUSSIAN)
+            return gaussianFilter;
+        return mitchellFilter;
+    }
+
+    // Returns a string identifying the method and its parameters.
+    std::string description() const {
+        const std::string method = isFiltered() ? filter().GetDescription() : std::string(resampleTypeName(type));
+        std::string mapping = direction == OCTMAP_TO_CUBEMAP ? method + "_to_cubemap" : method;
+        if (isAdaptive())
+            mapping += "_adaptive" + std::to_string(adaptiveTolerance);
+        if (paddedInput)
+            mapping += "_padded";
+        return tiledInput ? mapping + "_tiled" : mapping;
+    }
+};
+
+// Returns the octmap coordinate on the [-1, +1] square of the center of output pixel (x, y).
+inline Imath::V2f octMapPixelCenter(int x, int y, int outputSize) {
+    return Imath::V2f(((x + 0.5f) / outputSize) * 2.0f - 1.0f, 1.0f - ((y + 0.5f) / outputSize) * 2.0f);
+}
+
+// Returns the position in pixels of an octmap coordinate on the [-1, +1] square in an
+// octmap of size x size pixels, the inverse of octMapPixelCenter.
+inline Imath::V2f octMapPixelPosition(const Imath::V2f& octMapCoord, int size) {
+    return Imath::V2f((octMapCoord.x + 1.0f) * 0.5f * size, (1.0f - octMapCoord.y) * 0.5f * size);
+}
+
+// Folds an octmap coordinate that lies outside of the [-1, +1] square back onto it.
+inline Imath::V2f wrapOctMapCoord(Imath::V2f octMapCoord) {
+    if(std::abs(octMapCoord.x) > 1.0f) {
+      float overlap = std::abs(octMapCoord.x) - 1.0f;
+      octMapCoord.x = Imath::sign(octMapCoord.x) - overlap;
+      octMapCoord.y = -octMapCoord.y;
+    }
+    if(std::abs(octMapCoord.y) > 1.0f) {
+      float overlap = std::abs(octMapCoord.y) - 1.0f;
+      octMapCoord.y = Imath::sign(octMapCoord.y) - overlap;
+      octMapCoord.x = -octMapCoord.x;
+    }
+    return octMapCoord;
+}
+
+// Resamplers enumerate the input texels contributing to output pixel (x, y). The
+// resamplers below map a 6:1 cubemap strip with faces of size faceSize x faceSize to an
+// outputSize x outputSize octmap, the CubeMap resamplers further down the reverse. The
+// image sizes are given by inputWidth(), inputHeight(), outputWidth() and outputHeight(),
+// so that the kernels serve both directions. For every tap, tap(inputPixX, inputPixY,
+// weight) is called. The weights of a pixel sum up to one.
+// The taps only depend on the geometry and the filter, never on pixel values.
+// Resamplers are plain types, so that conversion kernels templated over them are fully
+// inlined.
+
+struct NearestResampler {
+    int faceSize;
+    int outputSize;
+
+    int inputWidth() const { return 6 * faceSize; }
+    int inputHeight() const { return faceSize; }
+    int outputWidth() const { return outputSize; }
+    int outputHeight() const { return outputSize; }
+
+    int sampleCount() const { return 1; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        const int height = faceSize;
+        int face;
+        Imath::V2f cubeMapCoord = cubeEncode(octDecode(octMapPixelCenter(x, y, outputSize)), &face);
+        int inputPixX = std::min(height-1, int(cubeMapCoord.x * height));
+        inputPixX += height * face;
+        int inputPixY = std::min(height-1, int((1.0f - cubeMapCoord.y) * height));
+        tap(inputPixX, inputPixY, 1.0f);
+    }
+};
+
+struct BilinearResampler {
+    int faceSize;
+    int outputSize;
+
+    int inputWidth() const { return 6 * faceSize; }
+    int inputHeight() const { return faceSize; }
+    int outputWidth() const { return outputSize; }
+    int outputHeight() const { return outputSize; }
+
+    int sampleCount() const { return 4; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        const int height = faceSize;
+        int face;
+        Imath::V2f cubeMapCoord = cubeEncode(octDecode(octMapPixelCenter(x, y, outputSize)), &face);
+        float xCoord = cubeMapCoord.x * height;
+        float yCoord = (1.0f - cubeMapCoord.y) * height;
+        int lowX = std::max(0, int(xCoord - 0.5f));
+        int lowY = std::max(0, int(yCoord - 0.5f));
+        int highX = std::min(height-1, lowX + 1);
+        int highY = std::min(height-1, lowY + 1);
+        float hFrac = xCoord - (lowX + 0.5f);
+        float vFrac = yCoord - (lowY + 0.5f);
+        lowX += height * face;
+        highX += height * face;
+        tap(lowX, lowY, (1 - hFrac) * (1 - vFrac));
+        tap(highX, lowY, hFrac * (1 - vFrac));
+        tap(lowX, highY, (1 - hFrac) * vFrac);
+        tap(highX, highY, hFrac * vFrac);
+    }
+};
+
+// Samples the filter on a regular lattice of (2 * supportExtent + 1)^2 taps around the
+// pixel center. The filter radius is given in output pixels. When the octmap is smaller
+// than the cube faces, the lattice is refined by the size ratio, so that the tap spacing
+// in input texels stays the same and downsampling does not alias.
+// The tap offsets and normalized filter weights are tabulated once at construction, so
+// no filter function is evaluated per pixel.
+template <class FilterType>
+class FilteredResampler {
+ public:
+  // Support extent used when the octmap and the cube faces have the same size.
+  static const int kBaseSupportExtent = 3;
+
+  FilteredResampler(const FilterType& filter, int faceSize, int outputSize)
+      : faceSize(faceSize), outputSize(outputSize) {
+    const float radius = filter.GetRadius();
+    const float downsampling = std::max(1.0f, float(faceSize) / outputSize);
+    const int supportExtent = int(std::ceil(kBaseSupportExtent * downsampling));
+    float weightSum = 0.0f;
+    for (float xOfst = -supportExtent; xOfst <= supportExtent; xOfst++) {
+      for (float yOfst = -supportExtent; yOfst <= supportExtent; yOfst++) {
+        Imath::V2f pixelOfst = Imath::V2f(xOfst, yOfst) * radius / (supportExtent + 1);
+        float weight = filter.Eval(pixelOfst);
+        if (weight == 0.0f) {
+          continue;
+        }
+        octCoordOffset_.push_back(pixelOfst * (2.0f / outputSize));
+        weight_.push_back(weight);
+        weightSum += weight;
+      }
+    }
+    for (float& weight : weight_) {
+      weight /= weightSum;
+    }
+  }
+
+  int inputWidth() const { return 6 * faceSize; }
+  int inputHeight() const { return faceSize; }
+  int outputWidth() const { return outputSize; }
+  int outputHeight() const { return outputSize; }
+
+  int sampleCount() const { return int(weight_.size()); }
+
+  template <typename TapFunc>
+  void operator()(int x, int y, TapFunc&& tap) const {
+    const int height = faceSize;
+    const Imath::V2f octMapCoord = octMapPixelCenter(x, y, outputSize);
+    const BatchKernels& kernels = batchKernels();
+    // the sample directions are mapped to the cube in batches.
+    const int kBatchSize = 64;
+    float sampleU[kBatchSize], sampleV[kBatchSize];
+    float dirX[kBatchSize], dirY[kBatchSize], dirZ[kBatchSize];
+    float cubeU[kBatchSize], cubeV[kBatchSize];
+    int sampleFace[kBatchSize];
+    const int numSamples = sampleCount();
+    for (int batchBegin = 0; batchBegin < numSamples; batchBegin += kBatchSize) {
+      const int batchSize = std::min(kBatchSize, numSamples - batchBegin);
+      for (int i = 0; i < batchSize; i++) {
+        Imath::V2f octMapSampleCoord = wrapOctMapCoord(octMapCoord + octCoordOffset_[batchBegin + i]);
+        sampleU[i] = octMapSampleCoord.x;
+        sampleV[i] = octMapSampleCoord.y;
+      }
+      kernels.octDecode(sampleU, sampleV, dirX, dirY, dirZ, batchSize);
+      kernels.cubeEncode(dirX, dirY, dirZ, cubeU, cubeV, sampleFace, batchSize);
+      for (int i = 0; i < batchSize; i++) {
+        int inputPixX = std::min(height-1, int(cubeU[i] * height));
+        inputPixX += height * sampleFace[i];
+        int inputPixY = std::min(height-1, int((1.0f - cubeV[i]) * height));
+        tap(inputPixX, inputPixY, weight_[batchBegin + i]);
+      }
+    }
+  }
+
+  int faceSize;
+  int outputSize;
+
+ protected:
+  std::vector<Imath::V2f> octCoordOffset_;
+  std::vector<float> weight_;
+};
+
+// The CubeMap resamplers map an octMapSize x octMapSize octmap to a 6:1 cubemap strip
+// with faces of size faceSize x faceSize, in the face order and orientation of
+// cubeDecode. Taps that fall outside of the octmap wrap around its edges and corners.
+
+struct CubeMapNearestResampler {
+    int faceSize;
+    int octMapSize;
+
+    int inputWidth() const { return octMapSize; }
+    int inputHeight() const { return octMapSize; }
+    int outputWidth() const { return 6 * faceSize; }
+    int outputHeight() const { return faceSize; }
+
+    int sampleCount() const { return 1; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        int face;
+        const Imath::V2f faceCoord = cubeMapPixelCenter(x, y, faceSize, &face);
+        const Imath::V2f position =
+            octMapPixelPosition(octEncode(cubeFaceDecode(face, faceCoord.x, faceCoord.y)), octMapSize);
+        const int inputPixX = std::clamp(int(position.x), 0, octMapSize - 1);
+        const int inputPixY = std::clamp(int(position.y), 0, octMapSize - 1);
+        tap(inputPixX, inputPixY, 1.0f);
+    }
+};
+
+struct CubeMapBilinearResampler {
+    int faceSize;
+    int octMapSize;
+
+    int inputWidth() const { return octMapSize; }
+    int inputHeight() const { return octMapSize; }
+    int outputWidth() const { return 6 * faceSize; }
+    int outputHeight() const { return faceSize; }
+
+    int sampleCount() const { return 4; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        int face;
+        const Imath::V2f faceCoord = cubeMapPixelCenter(x, y, faceSize, &face);
+        const Imath::V2f position =
+            octMapPixelPosition(octEncode(cubeFaceDecode(face, faceCoord.x, faceCoord.y)), octMapSize);
+        const float xCoord = position.x - 0.5f;
+        const float yCoord = position.y - 0.5f;
+        const int lowX = int(std::floor(xCoord));
+        const int lowY = int(std::floor(yCoord));
+        const float hFrac = xCoord - lowX;
+        const float vFrac = yCoord - lowY;
+        // the texels around the edges of the octmap are neighbours on the sphere.
+        auto wrappedTap = [&](int inputPixX, int inputPixY, float weight) {
+            wrapOctMapPixel(octMapSize, &inputPixX, &inputPixY);
+            tap(inputPixX, inputPixY, weight);
+        };
+        wrappedTap(lowX, lowY, (1 - hFrac) * (1 - vFrac));
+        wrappedTap(lowX + 1, lowY, hFrac * (1 - vFrac));
+        wrappedTap(lowX, lowY + 1, (1 - hFrac) * vFrac);
+        wrappedTap(lowX + 1, lowY + 1, hFrac * vFrac);
+    }
+};
+
+// Same lattice as FilteredResampler, laid out on the cube face of the output pixel.
+// Taps beyond the edge of the face extend its plane and so land on the neighbouring
+// face, which keeps the filter footprint continuous across the seams of the cubemap.
+template <class FilterType>
+class CubeMapFilteredResampler {
+ public:
+  CubeMapFilteredResampler(const FilterType& filter, int faceSize, int octMapSize)
+      : faceSize(faceSize), octMapSize(octMapSize) {
+    const float radius = filter.GetRadius();
+    const float downsampling = std::max(1.0f, float(octMapSize) / faceSize);
+    const int supportExtent = int(std::ceil(FilteredResampler<FilterType>::kBaseSupportExtent * downsampling));
+    float weightSum = 0.0f;
+    for (float xOfst = -supportExtent; xOfst <= supportExtent; xOfst++) {
+      for (float yOfst = -supportExtent; yOfst <= supportExtent; yOfst++) {
+        Imath::V2f pixelOfst = Imath::V2f(xOfst, yOfst) * radius / (supportExtent + 1);
+        float weight = filter.Eval(pixelOfst);
+        if (weight == 0.0f) {
+          continue;
+        }
+        faceCoordOffset_.push_back(pixelOfst * (2.0f / faceSize));
+        weight_.push_back(weight);
+        weightSum += weight;
+      }
+    }
+    for (float& weight : weight_) {
+      weight /= weightSum;
+    }
+  }
+
+  int inputWidth() const { return octMapSize; }
+  int inputHeight() const { return octMapSize; }
+  int outputWidth() const { return 6 * faceSize; }
+  int outputHeight() const { return faceSize; }
+
+  int sampleCount() const { return int(weight_.size()); }
+
+  template <typename TapFunc>
+  void operator()(int x, int y, TapFunc&& tap) const {
+    int face;
+    const Imath::V2f faceCoord = cubeMapPixelCenter(x, y, faceSize, &face);
+    const BatchKernels& kernels = batchKernels();
+    // the sample directions are mapped to the octmap in batches.
+    const int kBatchSize = 64;
+    float dirX[kBatchSize], dirY[kBatchSize], dirZ[kBatchSize];
+    float octU[kBatchSize], octV[kBatchSize];
+    const int numSamples = sampleCount();
+    for (int batchBegin = 0; batchBegin < numSamples; batchBegin += kBatchSize) {
+      const int batchSize = std::min(kBatchSize, numSamples - batchBegin);
+      for (int i = 0; i < batchSize; i++) {
+        const Imath::V2f sampleCoord = faceCoord + faceCoordOffset_[batchBegin + i];
+        const Imath::V3f direction = cubeFaceDecode(face, sampleCoord.x, sampleCoord.y);
+        dirX[i] = direction.x;
+        dirY[i] = direction.y;
+        dirZ[i] = direction.z;
+      }
+      kernels.octEncode(dirX, dirY, dirZ, octU, octV, batchSize);
+      for (int i = 0; i < batchSize; i++) {
+        const Imath::V2f position = octMapPixelPosition(Imath::V2f(octU[i], octV[i]), octMapSize);
+        const int inputPixX = std::clamp(int(position.x), 0, octMapSize - 1);
+        const int inputPixY = std::clamp(int(position.y), 0, octMapSize - 1);
+        tap(inputPixX, inputPixY, weight_[batchBegin + i]);
+      }
+    }
+  }
+
+  int faceSize;
+  int octMapSize;
+
+ private:
+  std::vector<Imath::V2f> faceCoordOffset_;
+  std::vector<float> weight_;
+};
+
+// Returns the distance in input texels from the bilinear taps of an output pixel within
+// which all taps of its filter kernel lie, unless they wrap around an edge of the face or
+// octmap. The octahedral mapping stretches the filter footprint by up to 6x on the cube
+// faces, the reverse by up to 1.5x, both measured over the face and octmap sizes. The
+// reach takes 6.5x and 2x: taps are truncated to whole texels, which moves them by up
+// to one texel beyond the stretched footprint, and the margin keeps them covered at
+// the smallest filter radii as well.
+inline int filterReach(const ResampleSettings& settings, int faceSize, int octMapSize) {
+    const bool toCubeMap = settings.direction == OCTMAP_TO_CUBEMAP;
+    const float stretch = toCubeMap ? 2.0f : 6.5f;
+    const float downsampling = toCubeMap ? std::max(1.0f, float(octMapSize) / faceSize)
+                                         : std::max(1.0f, float(faceSize) / octMapSize);
+    return int(std::ceil(stretch * settings.filter().GetRadius() * downsampling)) + 1;
+}
+
+// The padded input layout stores the six faces of a cubemap side by side like the strip,
+// but each with a border of texels around it that continues the face across its edges.
+// Border texels lie on the extension of the plane of the face and hold the bilinear
+// lookup of the neighbouring face in their direction, so they follow the orientation of
+// the faces, including MIRROR_FACES. Taps that fall off a face read the border instead
+// of being clamped to its edge or mapped to another face.
+
+// Returns the width in texels of the border of padded faces for settings: one texel for
+// the bilinear taps, the reach of the filter for GAUSSIAN and MITCHELL.
+inline int paddedFaceBorder(const ResampleSettings& settings, int faceSize, int octMapSize) {
+    return settings.isFiltered() ? filterReach(settings, faceSize, octMapSize) : 1;
+}
+
+// Returns the side length in texels of a face of faceSize with its border.
+inline int paddedFaceSize(int faceSize, int border) {
+    return faceSize + 2 * border;
+}
+
+// Same as NearestResampler, for padded input. Directions on the far edges of a face pick
+// the first border texel, which holds the edge.
+struct PaddedNearestResampler {
+    int faceSize;
+    int outputSize;
+    int border;
+
+    int inputWidth() const { return 6 * paddedFaceSize(faceSize, border); }
+    int inputHeight() const { return paddedFaceSize(faceSize, border); }
+    int outputWidth() const { return outputSize; }
+    int outputHeight() const { return outputSize; }
+
+    int sampleCount() const { return 1; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        const int height = faceSize;
+        int face;
+        const Imath::V2f cubeMapCoord = sampleCube(octDecode(octMapPixelCenter(x, y, outputSize)), &face);
+        const int inputPixX = int(cubeMapCoord.x * height) + border + paddedFaceSize(faceSize, border) * face;
+        const int inputPixY = int((1.0f - cubeMapCoord.y) * height) + border;
+        tap(inputPixX, inputPixY, 1.0f);
+    }
+};
+
+// Same as BilinearResampler, for padded input. The taps around the edges of a face
+// interpolate with the border, that is with the neighbouring face, so the seams between
+// the faces are not visible in the octmap.
+struct PaddedBilinearResampler {
+    int faceSize;
+    int outputSize;
+    int border;
+
+    int inputWidth() const { return 6 * paddedFaceSize(faceSize, border); }
+    int inputHeight() const { return paddedFaceSize(faceSize, border); }
+    int outputWidth() const { return outputSize; }
+    int outputHeight() const { return outputSize; }
+
+    int sampleCount() const { return 4; }
+
+    template <typename TapFunc>
+    void operator()(int x, int y, TapFunc&& tap) const {
+        const int height = faceSize;
+        int face;
+        const Imath::V2f cubeMapCoord = sampleCube(octDecode(octMapPixelCenter(x, y, outputSize)), &face);
+        const float xCoord = cubeMapCoord.x * height - 0.5f;
+        const float yCoord = (1.0f - cubeMapCoord.y) * height - 0.5f;
+        // between -1 and height - 1, the taps off the face are in the border.
+        const int lowX = int(std::floor(xCoord));
+        const int lowY = int(std::floor(yCoord));
+        const float hFrac = xCoord - lowX;
+        const float vFrac = yCoord - lowY;
+        const int inputPixX = lowX + border + paddedFaceSize(faceSize, border) * face;
+        const int inputPixY = lowY + border;
+        tap(inputPixX, inputPixY, (1 - hFrac) * (1 - vFrac));
+        tap(inputPixX + 1, inputPixY, hFrac * (1 - vFrac));
+        tap(inputPixX, inputPixY + 1, (1 - hFrac) * vFrac);
+        tap(inputPixX + 1, inputPixY + 1, hFrac * vFrac);
+    }
+};
+
+// Same lattice as FilteredResampler, for padded input. All taps of a pixel are projected
+// onto the plane of the face of its center, taps beyond the edges of the face land in
+// the border, so no tap needs to pick its face and the projection is the same few
+// multiply-adds for all of them. Footprints that reach beyond the border, which only
+// happens for faces smaller than the footprint, are clamped to it.
+template <class FilterType>
+class PaddedFilteredResampler : public FilteredResampler<FilterType> {
+ public:
+  PaddedFilteredResampler(const FilterType& filter, int faceSize, int outputSize, int border)
+      : FilteredResampler<FilterType>(filter, faceSize, outputSize), border(border) {}
+
+  int inputWidth() const { return 6 * paddedFaceSize(this->faceSize, border); }
+  int inputHeight() const { return paddedFaceSize(this->faceSize, border); }
+
+  template <typename TapFunc>
+  void operator()(int x, int y, TapFunc&& tap) const {
+    const int height = this->faceSize;
+    const int paddedSize = paddedFaceSize(height, border);
+    const Imath::V2f octMapCoord = octMapPixelCenter(x, y, this->outputSize);
+    const int face = cubeFace(octDecodeUnnormalized(octMapCoord));
+    // from face coordinates on the [-1, +1] square to padded texels.
+    const float scale = 0.5f * height;
+    const float offset = scale + border;
+    const float maxPix = float(paddedSize - 1);
+    const BatchKernels& kernels = batchKernels();
+    // the sample directions are projected onto the face in batches.
+    const int kBatchSize = 64;
+    float sampleU[kBatchSize], sampleV[kBatchSize];
+    float dirX[kBatchSize], dirY[kBatchSize], dirZ[kBatchSize];
+    float faceU[kBatchSize], faceV[kBatchSize];
+    const int numSamples = this->sampleCount();
+    for (int batchBegin = 0; batchBegin < numSamples; batchBegin += kBatchSize) {
+      const int batchSize = std::min(kBatchSize, numSamples - batchBegin);
+      for (int i = 0; i < batchSize; i++) {
+        Imath::V2f octMapSampleCoord = wrapOctMapCoord(octMapCoord + this->octCoordOffset_[batchBegin + i]);
+        sampleU[i] = octMapSampleCoord.x;
+        sampleV[i] = octMapSampleCoord.y;
+      }
+      kernels.octDecode(sampleU, sampleV, dirX, dirY, dirZ, batchSize);
+      kernels.cubeFaceEncode(face, dirX, dirY, dirZ, faceU, faceV, batchSize);
+      for (int i = 0; i < batchSize; i++) {
+        // NaNs of directions perpendicular to the face end up at 0.
+        const float pixX = std::max(0.0f, offset + faceU[i] * scale);
+        const float pixY = std::max(0.0f, offset - faceV[i] * scale);
+        const int inputPixX = int(std::min(maxPix, pixX)) + paddedSize * face;
+        const int inputPixY = int(std::min(maxPix, pixY));
+        tap(inputPixX, inputPixY, this->weight_[batchBegin + i]);
+      }
+    }
+  }
+
+  int border;
+};
+
+// Calls func with the row-major resampler selected by settings.
+template <typename Func>
+void withRowMajorResampler(const ResampleSettings& settings, int faceSize, int octMapSize, Func&& func) {
+    if (settings.direction == OCTMAP_TO_CUBEMAP) {
+        switch (settings.type) {
+            case NEAREST:
+                func(CubeMapNearestResampler{faceSize, octMapSize});
+                break;
+            case BILINEAR:
+                func(CubeMapBilinearResampler{faceSize, octMapSize});
+                break;
+            case GAUSSIAN:
+                func(CubeMapFilteredResampler<GaussianFilter>(settings.gaussianFilter, faceSize, octMapSize));
+                break;
+            case MITCHELL:
+                func(CubeMapFilteredResampler<MitchellFilter>(settings.mitchellFilter, faceSize, octMapSize));
+                break;
+        }
+        return;
+    }
+    if (settings.paddedInput) {
+        const int border = paddedFaceBorder(settings, faceSize, octMapSize);
+        switch (settings.type) {
+            case NEAREST:
+                func(PaddedNearestResampler{faceSize, octMapSize, border});
+                break;
+            case BILINEAR:
+                func(PaddedBilinearResampler{faceSize, octMapSize, border});
+                break;
+            case GAUSSIAN:
+                func(PaddedFilteredResampler<GaussianFilter>(settings.gaussianFilter, faceSize, octMapSize, border));
+                break;
+            case MITCHELL:
+                func(PaddedFilteredResampler<MitchellFilter>(settings.mitchellFilter, faceSize, octMapSize, border));
+                break;
+        }
+        return;
+    }
+    switch (settings.type) {
+        case NEAREST:
+            func(NearestResampler{faceSize, octMapSize});
+            break;
+        case BILINEAR:
+            func(BilinearResampler{faceSize, octMapSize});
+            break;
+        case GAUSSIAN:
+            func(FilteredResampler<GaussianFilter>(settings.gaussianFilter, faceSize, octMapSize));
+            break;
+        case MITCHELL:
+            func(FilteredResampler<MitchellFilter>(settings.mitchellFilter, faceSize, octMapSize));
+            break;
+    }
+}
+
+// Side length in texels of the tiles of the tiled input layout. A tile of float RGB
+// texels takes 3 KB, so the tiles under a filter footprint stay in the L1 cache.
+const int kInputTileSize = 16;
+
+// Returns the number of tiles per row of the tiled layout of an image of the given width.
+inline int tilesPerRow(int width) {
+    return (width + kInputTileSize - 1) / kInputTileSize;
+}
+
+// Returns the number of texels of the tiled layout of a width x height image,
+// including the padding of the tiles along the right and bottom edges.
+inline size_t tiledTexelCount(int width, int height) {
+    return size_t(tilesPerRow(width)) * tilesPerRow(height) * kInputTileSize * kInputTileSize;
+}
+
+// Returns the index of texel (x, y) in the tiled layout. The image is split into square
+// tiles of kInputTileSize texels, which are stored one after the other, row of tiles by
+// row of tiles, with the texels of a tile in row-major order. The taps of a filter
+// footprint then fall into one or a few tiles instead of as many rows as it is high.
+inline size_t tiledTexelIndex(int x, int y, int numTilesPerRow) {
+    // unsigned, so that the divisions by the tile size compile to shifts.
+    const unsigned tileSize = kInputTileSize;
+    const size_t tile = size_t(unsigned(y) / tileSize) * numTilesPerRow + unsigned(x) / tileSize;
+    return tile * (tileSize * tileSize) + (unsigned(y) % tileSize) * tileSize + unsigned(x) % tileSize;
+}
+
+// The kernels address the tiled layout as a single row of texels with int coordinates,
+// so it can hold at most this many texels, a cubemap strip with faces of about 18900 texels.
+const size_t kMaxTiledTexelCount = size_t(std::numeric_limits<int>::max());
+
+// Wraps a resampler to address a tiled input. The kernels see the tiled input as a
+// single row of texels, so they need no knowledge of the layout. Throws
+// std::invalid_argument if the tiled layout of the input has more than
+// kMaxTiledTexelCount texels.
+template <class Resampler>
+class TiledInputResampler {
+ public:
+  explicit TiledInputResampler(const Resampler& resampler)
+      : resampler_(resampler),
+        numTilesPerRow_(tilesPerRow(resampler.inputWidth())),
+        numTexels_(checkedTexelCount(resampler.inputWidth(), resampler.inputHeight())) {}
+
+  int inputWidth() const { return numTexels_; }
+  int inputHeight() const { return 1; }
+  int outputWidth() const { return resampler_.outputWidth(); }
+  int outputHeight() const { return resampler_.outputHeight(); }
+
+  int sampleCount() const { return resampler_.sampleCount(); }
+
+  template <typename TapFunc>
+  void operator()(int x, int y, TapFunc&& tap) const {
+    resampler_(x, y, [&](int inputPixX, int inputPixY, float weight) {
+      tap(int(tiledTexelIndex(inputPixX, inputPixY, numTilesPerRow_)), 0, weight);
+    });
+  }
+
+ private:
+  static int checkedTexelCount(int width, int height) {
+    const size_t numTexels = tiledTexelCount(width, height);
+    if (numTexels > kMaxTiledTexelCount) {
+      throw std::invalid_argument("the tiled input has more texels than the kernels can address");
+    }
+    return int(numTexels);
+  }
+
+  Resampler resampler_;
+  int numTilesPerRow_;
+  int numTexels_;
+};
+
+// Calls func with the resampler selected by settings. This is the only place where the
+// resample type, direction and input layout are looked at, everything called by func is
+// specialized for the resampler. faceSize is the face size of the cubemap and octMapSize
+// the size of the octmap, whichever of the two is the input.
+template <typename Func>
+void withResampler(const ResampleSettings& settings, int faceSize, int octMapSize, Func&& func) {
+    if (!settings.tiledInput) {
+        withRowMajorResampler(settings, faceSize, octMapSize, func);
+        return;
+    }
+    withRowMajorResampler(settings, faceSize, octMapSize, [&](const auto& resampler) {
+        func(TiledInputResampler<std::decay_t<decltype(resampler)>>(resampler));
+    });
+}
+
+// Returns the number of taps per output pixel of the resampler selected by settings.
+inline int resamplerSampleCount(const ResampleSettings& settings, int faceSize, int octMapSize) {
+    int sampleCount = 0;
+    withResampler(settings, faceSize, octMapSize, [&](const auto& resampler) {
+        sampleCount = resampler.sampleCount();
+    });
+    return sampleCount;
+}
+
+#endif  // RESAMPLER_H
@@ -0,0 +1,360 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef RESAMPLING_MATRIX_H
+#define RESAMPLING_MATRIX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "resampler.h"
+#include "threadpool.h"
+
+// Sparse matrix mapping the input image to the output image, the cubemap strip to the
+// octmap or the reverse. Row i (the output pixel y * outputWidth + x) consists of the
+// entries rowStart[i] .. rowStart[i + 1] - 1 of inputIndex and weight. inputIndex is the
+// texel index y * inputWidth + x in the input and the weights of a row sum up to one.
+// Since the matrix only depends on the geometry and the filter, it can be reused for
+// every image of the same size.
+struct ResamplingMatrix {
+    int inputWidth = 0;
+    int inputHeight = 0;
+    int outputWidth = 0;
+    int outputHeight = 0;
+    std::vector<uint64_t> rowStart;
+    std::vector<uint32_t> inputIndex;
+    std::vector<float> weight;
+
+    size_t memorySize() const {
+        return rowStart.size() * sizeof(uint64_t) +
+               inputIndex.size() * sizeof(uint32_t) +
+               weight.size() * sizeof(float);
+    }
+};
+
+// Returns a string uniquely identifying the resampling matrix for the given parameters.
+inline std::string resamplingMatrixKey(const ResampleSettings& resample, int faceSize, int octMapSize) {
+    return resample.description() + "_" + std::to_string(faceSize) + "_" + std::to_string(octMapSize);
+}
+
+// Computes the resampling matrix by enumerating the taps of every output pixel.
+// Taps hitting the same texel are merged and zero weights are dropped. Throws
+// std::invalid_argument if the input has more texels than inputIndex can address.
+template <class Resampler>
+std::shared_ptr<ResamplingMatrix> buildResamplingMatrix(
+    const Resampler& resampler,
+    ThreadPool& threadPool)
+{
+    if (uint64_t(resampler.inputWidth()) * uint64_t(resampler.inputHeight()) > uint64_t(UINT32_MAX) + 1) {
+        throw std::invalid_argument("resampling matrices address at most 2^32 input texels");
+    }
+    auto matrix = std::make_shared<ResamplingMatrix>();
+    matrix->inputWidth = resampler.inputWidth();
+    matrix->inputHeight = resampler.inputHeight();
+    matrix->outputWidth = resampler.outputWidth();
+    matrix->outputHeight = resampler.outputHeight();
+    const int outputWidth = matrix->outputWidth;
+    const int outputHeight = matrix->outputHeight;
+    const uint32_t inputWidth = matrix->inputWidth;
+
+    // Rows of the output are built independently and concatenated afterwards.
+    std::vector<std::vector<std::pair<uint32_t, float>>> rows(outputHeight);
+    std::vector<std::vector<uint32_t>> rowPixelStarts(outputHeight);
+    threadPool.ParallelFor(0, outputHeight, 8, [&](int yBegin, int yEnd) {
+        std::vector<std::pair<uint32_t, float>> taps;
+        for (int y = yBegin; y < yEnd; y++) {
+            std::vector<std::pair<uint32_t, float>>& row = rows[y];
+            std::vector<uint32_t>& pixelStarts = rowPixelStarts[y];
+            pixelStarts.resize(outputWidth);
+            for (int x = 0; x < outputWidth; x++) {
+                taps.clear();
+                float weightSum = 0.0f;
+                resampler(x, y, [&](int inputPixX, int inputPixY, float w) {
+                    taps.emplace_back(uint32_t(inputPixY) * inputWidth + uint32_t(inputPixX), w);
+                    weightSum += w;
+                });
+                std::sort(taps.begin(), taps.end(),
+                    [](const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
+                        return a.first < b.first;
+                    });
+                pixelStarts[x] = uint32_t(row.size());
+                for (size_t t = 0; t < taps.size(); t++) {
+                    if (row.size() > pixelStarts[x] && row.back().first == taps[t].first)
+                        row.back().second += taps[t].second;
+                    else
+                        row.push_back(taps[t]);
+                }
+                // normalize and drop taps that don't contribute.
+                size_t end = pixelStarts[x];
+                for (size_t t = pixelStarts[x]; t < row.size(); t++) {
+                    float w = row[t].second / weightSum;
+                    if (w != 0.0f)
+                        row[end++] = std::make_pair(row[t].first, w);
+                }
+                row.resize(end);
+            }
+        }
+    });
+
+    matrix->rowStart.resize(size_t(outputWidth) * outputHeight + 1);
+    size_t numEntries = 0;
+    for (int y = 0; y < outputHeight; y++)
+        numEntries += rows[y].size();
+    matrix->inputIndex.resize(numEntries);
+    matrix->weight.resize(numEntries);
+    size_t offset = 0;
+    for (int y = 0; y < outputHeight; y++) {
+        for (int x = 0; x < outputWidth; x++)
+            matrix->rowStart[size_t(y) * outputWidth + x] = offset + rowPixelStarts[y][x];
+        for (size_t t = 0; t < rows[y].size(); t++) {
+            matrix->inputIndex[offset + t] = rows[y][t].first;
+            matrix->weight[offset + t] = rows[y][t].second;
+        }
+        offset += rows[y].size();
+        std::vector<std::pair<uint32_t, float>>().swap(rows[y]);
+    }
+    matrix->rowStart.back() = offset;
+    return matrix;
+}
+
+// File format of persisted matrices: the magic, the key length and key, inputWidth,
+// inputHeight, outputWidth, outputHeight, the number of entries, followed by the
+// rowStart, inputIndex and weight arrays.
+static const char kResamplingMatrixMagic[8] = { 'O', 'C', 'T', 'M', 'T', 'X', '0', '2' };
+
+inline bool saveResamplingMatrix(const std::string& path, const std::string& key, const ResamplingMatrix& matrix) {
+    // Write to a temporary file first, so that concurrent readers never see partial files.
+    std::string tmpPath = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file(tmpPath, std::ios::binary);
+        if (!file)
+            return false;
+        uint32_t keyLength = uint32_t(key.size());
+        int32_t sizes[4] = { matrix.inputWidth, matrix.inputHeight, matrix.outputWidth, matrix.outputHeight };
+        uint64_t numEntries = matrix.inputIndex.size();
+        file.write(kResamplingMatrixMagic, sizeof(kResamplingMatrixMagic));
+        file.write((const char*)&keyLength, sizeof(keyLength));
+        file.write(key.data(), keyLength);
+        file.write((const char*)sizes, sizeof(sizes));
+        file.write((const char*)&numEntries, sizeof(numEntries));
+        file.write((const char*)matrix.rowStart.data(), matrix.rowStart.size() * sizeof(uint64_t));
+        file.write((const char*)matrix.inputIndex.data(), numEntries * sizeof(uint32_t));
+        file.write((const char*)matrix.weight.data(), numEntries * sizeof(float));
+        if (!file)
+            return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    if (error) {
+        std::filesystem::remove(tmpPath, error);
+        return false;
+    }
+    return true;
+}
+
+// Returns nullptr if the file does not exist, was written for another key, or is
+// truncated or otherwise damaged, so that the matrix gets rebuilt instead of being
+// gathered through out of bounds.
+inline std::shared_ptr<ResamplingMatrix> loadResamplingMatrix(const std::string& path, const std::string& key) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return nullptr;
+    char magic[sizeof(kResamplingMatrixMagic)];
+    uint32_t keyLength = 0;
+    file.read(magic, sizeof(magic));
+    file.read((char*)&keyLength, sizeof(keyLength));
+    if (!file || !std::equal(magic, magic + sizeof(magic), kResamplingMatrixMagic) || keyLength != key.size())
+        return nullptr;
+    std::string storedKey(keyLength, '\0');
+    file.read(&storedKey[0], keyLength);
+    if (storedKey != key)
+        return nullptr;
+    int32_t sizes[4] = { 0, 0, 0, 0 };
+    uint64_t numEntries = 0;
+    file.read((char*)sizes, sizeof(sizes));
+    file.read((char*)&numEntries, sizeof(numEntries));
+    if (!file || *std::min_element(sizes, sizes + 4) <= 0)
+        return nullptr;
+    // the arrays must fill the rest of the file exactly, which also keeps damaged sizes
+    // from being allocated.
+    const std::streamoff headerSize = file.tellg();
+    file.seekg(0, std::ios::end);
+    const uint64_t arraysSize = uint64_t(file.tellg() - headerSize);
+    file.seekg(headerSize);
+    const uint64_t numRows = uint64_t(sizes[2]) * uint64_t(sizes[3]) + 1;
+    if (!file || numRows > arraysSize / sizeof(uint64_t) ||
+        numEntries > (arraysSize - numRows * sizeof(uint64_t)) / (sizeof(uint32_t) + sizeof(float)) ||
+        arraysSize != numRows * sizeof(uint64_t) + numEntries * (sizeof(uint32_t) + sizeof(float)))
+        return nullptr;
+    auto matrix = std::make_shared<ResamplingMatrix>();
+    matrix->inputWidth = sizes[0];
+    matrix->inputHeight = sizes[1];
+    matrix->outputWidth = sizes[2];
+    matrix->outputHeight = sizes[3];
+    matrix->rowStart.resize(numRows);
+    matrix->inputIndex.resize(numEntries);
+    matrix->weight.resize(numEntries);
+    file.read((char*)matrix->rowStart.data(), matrix->rowStart.size() * sizeof(uint64_t));
+    file.read((char*)matrix->inputIndex.data(), numEntries * sizeof(uint32_t));
+    file.read((char*)matrix->weight.data(), numEntries * sizeof(float));
+    if (!file || matrix->rowStart.front() != 0 || matrix->rowStart.back() != numEntries ||
+        !std::is_sorted(matrix->rowStart.begin(), matrix->rowStart.end()))
+        return nullptr;
+    const uint64_t numInputTexels = uint64_t(matrix->inputWidth) * uint64_t(matrix->inputHeight);
+    if (std::any_of(matrix->inputIndex.begin(), matrix->inputIndex.end(),
+                    [&](uint32_t index) { return index >= numInputTexels; }))
+        return nullptr;
+    return matrix;
+}
+
+// Returns an upper bound of the memory of the resampling matrix for the given sizes,
+// taking every tap of every output pixel as an entry.
+inline size_t resamplingMatrixSizeBound(const ResampleSettings& resample, int faceSize, int octMapSize) {
+    const size_t numOutputPixels = resample.direction == OCTMAP_TO_CUBEMAP ? size_t(6) * faceSize * faceSize
+                                                                           : size_t(octMapSize) * octMapSize;
+    const size_t numEntries = numOutputPixels * resamplerSampleCount(resample, faceSize, octMapSize);
+    return (numOutputPixels + 1) * sizeof(uint64_t) + numEntries * (sizeof(uint32_t) + sizeof(float));
+}
+
+// Keeps resampling matrices in memory and optionally persists them in a directory.
+// Concurrent requests for the same matrix build it only once. If a capacity is given,
+// the least recently used matrices are dropped once the matrices kept take more than
+// capacity bytes. Dropped matrices stay alive as long as a conversion still uses them.
+// A failed build is not kept, the next request for the matrix builds it again.
+class ResamplingMatrixCache {
+ public:
+  // If directory is empty, matrices are only kept in memory. A capacity of 0 keeps all
+  // matrices.
+  explicit ResamplingMatrixCache(const std::string& directory = "", size_t capacity = 0)
+      : directory_(directory), capacity_(capacity), memorySize_(0) {}
+
+  ResamplingMatrixCache(const ResamplingMatrixCache&) = delete;
+  ResamplingMatrixCache& operator=(const ResamplingMatrixCache&) = delete;
+
+  // faceSize and octMapSize are the face size of the cubemap and the size of the
+  // octmap, whichever of the two is the input.
+  std::shared_ptr<const ResamplingMatrix> Get(const ResampleSettings& resample,
+                                              int faceSize,
+                                              int octMapSize,
+                                              ThreadPool& threadPool) {
+    const std::string key = resamplingMatrixKey(resample, faceSize, octMapSize);
+    std::promise<std::shared_ptr<const ResamplingMatrix>> promise;
+    std::shared_future<std::shared_ptr<const ResamplingMatrix>> entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        entry = it->second.matrix;
+        if (it->second.built) {
+          recentlyUsed_.splice(recentlyUsed_.begin(), recentlyUsed_, it->second.recentlyUsed);
+        }
+      } else {
+        entries_[key].matrix = promise.get_future().share();
+      }
+    }
+    if (entry.valid()) {
+      // Another thread is building or has built this matrix.
+      return entry.get();
+    }
+
+    std::shared_ptr<ResamplingMatrix> matrix;
+    std::string path;
+    if (!directory_.empty()) {
+      path = (std::filesystem::path(directory_) / ("octmap_" + key + ".matrix")).string();
+      matrix = loadResamplingMatrix(path, key);
+    }
+    if (!matrix) {
+      try {
+        withResampler(resample, faceSize, octMapSize, [&](const auto& resampler) {
+          matrix = buildResamplingMatrix(resampler, threadPool);
+        });
+      } catch (...) {
+        // the requests waiting for this build fail with it, later ones try again.
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          entries_.erase(key);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+      }
+      if (!path.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(directory_, error);
+        saveResamplingMatrix(path, key, *matrix);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Entry& built = entries_[key];
+      built.built = true;
+      built.memorySize = matrix->memorySize();
+      built.recentlyUsed = recentlyUsed_.insert(recentlyUsed_.begin(), key);
+      memorySize_ += built.memorySize;
+      while (capacity_ > 0 && memorySize_ > capacity_ && !recentlyUsed_.empty()) {
+        auto evicted = entries_.find(recentlyUsed_.back());
+        memorySize_ -= evicted->second.memorySize;
+        entries_.erase(evicted);
+        recentlyUsed_.pop_back();
+      }
+    }
+    promise.set_value(matrix);
+    return matrix;
+  }
+
+  // Returns whether a matrix of the given size is kept once built, see
+  // resamplingMatrixSizeBound.
+  bool Keeps(size_t memorySize) const { return capacity_ == 0 || memorySize <= capacity_; }
+
+  // Returns whether conversions that did not ask for a matrix, such as the jobs of the
+  // server, take one from the cache anyway: only if the resampling can be gathered
+  // through a matrix, which adaptive resampling can not, and the matrix would be kept.
+  bool Shares(const ResampleSettings& resample, int faceSize, int octMapSize) const {
+    return !resample.isAdaptive() && Keeps(resamplingMatrixSizeBound(resample, faceSize, octMapSize));
+  }
+
+  // Returns the memory of the matrices kept.
+  size_t GetMemorySize() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return memorySize_;
+  }
+
+  // Returns the number of matrices kept or being built.
+  size_t GetNumEntries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  struct Entry {
+    std::shared_future<std::shared_ptr<const ResamplingMatrix>> matrix;
+    // set once the matrix is built, only built matrices are counted and evicted.
+    bool built = false;
+    size_t memorySize = 0;
+    std::list<std::string>::iterator recentlyUsed;
+  };
+
+  const std::string directory_;
+  const size_t capacity_;
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  // the keys of the built matrices, the most recently used first.
+  std::list<std::string> recentlyUsed_;
+  size_t memorySize_;
+};
+
+#endif  // RESAMPLING_MATRIX_H
@@ -0,0 +1,239 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kFaceSize = 8;
+const int kOctMapSize = 8;
+
+std::shared_ptr<ResamplingMatrix> buildTestMatrix(const ResampleSettings& resample) {
+  ThreadPool threadPool(2);
+  std::shared_ptr<ResamplingMatrix> matrix;
+  withResampler(resample, kFaceSize, kOctMapSize, [&](const auto& resampler) {
+    matrix = buildResamplingMatrix(resampler, threadPool);
+  });
+  return matrix;
+}
+
+std::vector<char> readFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string& path, const std::vector<char>& bytes) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(bytes.data(), bytes.size());
+}
+
+class ResamplingMatrixFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    key_ = resamplingMatrixKey(resample_, kFaceSize, kOctMapSize);
+    path_ = (std::filesystem::temp_directory_path() /
+             ("resamplingmatrix_test_" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) +
+              ::testing::UnitTest::GetInstance()->current_test_info()->name() + ".matrix")).string();
+    matrix_ = buildTestMatrix(resample_);
+    ASSERT_TRUE(saveResamplingMatrix(path_, key_, *matrix_));
+    bytes_ = readFile(path_);
+    // the arrays follow the magic, the key, the four sizes and the number of entries.
+    arraysOffset_ = sizeof(kResamplingMatrixMagic) + sizeof(uint32_t) + key_.size() + 4 * sizeof(int32_t) +
+                    sizeof(uint64_t);
+  }
+
+  void TearDown() override {
+    std::error_code error;
+    std::filesystem::remove(path_, error);
+  }
+
+  size_t inputIndexOffset() const {
+    return arraysOffset_ + matrix_->rowStart.size() * sizeof(uint64_t);
+  }
+
+  ResampleSettings resample_;
+  std::string key_;
+  std::string path_;
+  std::shared_ptr<ResamplingMatrix> matrix_;
+  std::vector<char> bytes_;
+  size_t arraysOffset_ = 0;
+};
+
+TEST_F(ResamplingMatrixFileTest, LoadsSavedMatrix) {
+  std::shared_ptr<ResamplingMatrix> loaded = loadResamplingMatrix(path_, key_);
+  ASSERT_NE(loaded, nullptr);
+  EXPECT_EQ(loaded->inputWidth, matrix_->inputWidth);
+  EXPECT_EQ(loaded->inputHeight, matrix_->inputHeight);
+  EXPECT_EQ(loaded->outputWidth, matrix_->outputWidth);
+  EXPECT_EQ(loaded->outputHeight, matrix_->outputHeight);
+  EXPECT_EQ(loaded->rowStart, matrix_->rowStart);
+  EXPECT_EQ(loaded->inputIndex, matrix_->inputIndex);
+  EXPECT_EQ(loaded->weight, matrix_->weight);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsOtherKey) {
+  EXPECT_EQ(loadResamplingMatrix(path_, key_ + "x"), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsTruncatedFile) {
+  bytes_.resize(bytes_.size() - sizeof(float));
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsTrailingBytes) {
+  bytes_.push_back(0);
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsEntryCountBeyondFileSize) {
+  // would otherwise be allocated before the reads fail.
+  const uint64_t numEntries = uint64_t(1) << 60;
+  std::copy((const char*)&numEntries, (const char*)&numEntries + sizeof(numEntries),
+            bytes_.begin() + (arraysOffset_ - sizeof(uint64_t)));
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsOutputSizeBeyondFileSize) {
+  const int32_t outputHeight = 1 << 30;
+  std::copy((const char*)&outputHeight, (const char*)&outputHeight + sizeof(outputHeight),
+            bytes_.begin() + (arraysOffset_ - sizeof(uint64_t) - sizeof(int32_t)));
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsDecreasingRowStart) {
+  std::vector<uint64_t> rowStart = matrix_->rowStart;
+  std::swap(rowStart[1], rowStart[2]);
+  ASSERT_NE(rowStart[1], rowStart[2]);
+  std::copy((const char*)rowStart.data(), (const char*)(rowStart.data() + rowStart.size()),
+            bytes_.begin() + arraysOffset_);
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsNonZeroFirstRowStart) {
+  const uint64_t first = 1;
+  std::copy((const char*)&first, (const char*)&first + sizeof(first), bytes_.begin() + arraysOffset_);
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+TEST_F(ResamplingMatrixFileTest, RejectsInputIndexOutOfRange) {
+  const uint32_t index = uint32_t(matrix_->inputWidth) * uint32_t(matrix_->inputHeight);
+  std::copy((const char*)&index, (const char*)&index + sizeof(index), bytes_.begin() + inputIndexOffset());
+  writeFile(path_, bytes_);
+  EXPECT_EQ(loadResamplingMatrix(path_, key_), nullptr);
+}
+
+// The memory of the matrices the cache tests build, all of the same size.
+size_t testMatrixSize(const ResampleSettings& resample) {
+  return buildTestMatrix(resample)->memorySize();
+}
+
+ResampleSettings settingsOfType(ResampleType type) {
+  ResampleSettings resample;
+  resample.type = type;
+  return resample;
+}
+
+TEST(ResamplingMatrixCacheTest, ReturnsTheSameMatrixForTheSameKey) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  const ResampleSettings resample = settingsOfType(BILINEAR);
+  std::shared_ptr<const ResamplingMatrix> first = cache.Get(resample, kFaceSize, kOctMapSize, threadPool);
+  std::shared_ptr<const ResamplingMatrix> second = cache.Get(resample, kFaceSize, kOctMapSize, threadPool);
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(cache.GetNumEntries(), 1u);
+  EXPECT_EQ(cache.GetMemorySize(), first->memorySize());
+}
+
+TEST(ResamplingMatrixCacheTest, EvictsLeastRecentlyUsedBeyondCapacity) {
+  ThreadPool threadPool(2);
+  // nearest resampling takes one entry per pixel, so the three matrices take the same memory.
+  ResampleSettings first = settingsOfType(NEAREST);
+  ResampleSettings second = first;
+  second.tiledInput = true;
+  ResampleSettings third = first;
+  third.paddedInput = true;
+  const size_t matrixSize = testMatrixSize(first);
+  ASSERT_EQ(testMatrixSize(second), matrixSize);
+  ASSERT_EQ(testMatrixSize(third), matrixSize);
+  ResamplingMatrixCache cache("", 2 * matrixSize);
+
+  std::shared_ptr<const ResamplingMatrix> firstMatrix = cache.Get(first, kFaceSize, kOctMapSize, threadPool);
+  std::shared_ptr<const ResamplingMatrix> secondMatrix = cache.Get(second, kFaceSize, kOctMapSize, threadPool);
+  EXPECT_EQ(cache.GetNumEntries(), 2u);
+  EXPECT_EQ(cache.GetMemorySize(), 2 * matrixSize);
+  // the first matrix is now the most recently used, so the second one goes.
+  EXPECT_EQ(cache.Get(first, kFaceSize, kOctMapSize, threadPool), firstMatrix);
+  cache.Get(third, kFaceSize, kOctMapSize, threadPool);
+  EXPECT_EQ(cache.GetNumEntries(), 2u);
+  EXPECT_EQ(cache.GetMemorySize(), 2 * matrixSize);
+  EXPECT_EQ(cache.Get(first, kFaceSize, kOctMapSize, threadPool), firstMatrix);
+  // built again, the evicted matrix is still alive where it was in use.
+  EXPECT_NE(cache.Get(second, kFaceSize, kOctMapSize, threadPool), secondMatrix);
+  EXPECT_EQ(secondMatrix->outputWidth, kOctMapSize);
+}
+
+TEST(ResamplingMatrixCacheTest, DropsMatricesLargerThanCapacity) {
+  ThreadPool threadPool(2);
+  const ResampleSettings resample = settingsOfType(MITCHELL);
+  ResamplingMatrixCache cache("", testMatrixSize(resample) - 1);
+  EXPECT_FALSE(cache.Keeps(testMatrixSize(resample)));
+  // the caller still gets the matrix, it is just not kept.
+  std::shared_ptr<const ResamplingMatrix> matrix = cache.Get(resample, kFaceSize, kOctMapSize, threadPool);
+  ASSERT_NE(matrix, nullptr);
+  EXPECT_EQ(matrix->outputWidth, kOctMapSize);
+  EXPECT_EQ(cache.GetNumEntries(), 0u);
+  EXPECT_EQ(cache.GetMemorySize(), 0u);
+}
+
+TEST(ResamplingMatrixCacheTest, SizeBoundCoversBuiltMatrices) {
+  for (ResampleType type : { NEAREST, BILINEAR, GAUSSIAN, MITCHELL }) {
+    const ResampleSettings resample = settingsOfType(type);
+    EXPECT_GE(resamplingMatrixSizeBound(resample, kFaceSize, kOctMapSize), testMatrixSize(resample))
+        << resampleTypeName(type);
+  }
+}
+
+TEST(ResamplingMatrixCacheTest, DoesNotKeepFailedBuilds) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  // a strip of faces of 30000 texels has more texels than a matrix can address.
+  const ResampleSettings resample = settingsOfType(NEAREST);
+  EXPECT_THROW(cache.Get(resample, 30000, 4, threadPool), std::invalid_argument);
+  EXPECT_EQ(cache.GetNumEntries(), 0u);
+  EXPECT_THROW(cache.Get(resample, 30000, 4, threadPool), std::invalid_argument);
+  // other matrices are not affected.
+  EXPECT_NE(cache.Get(resample, kFaceSize, kOctMapSize, threadPool), nullptr);
+  EXPECT_EQ(cache.GetNumEntries(), 1u);
+}
+
+TEST(ResamplingMatrixCacheTest, RejectsTiledInputBeyondIntTexelIndices) {
+  ThreadPool threadPool(2);
+  ResamplingMatrixCache cache;
+  ResampleSettings resample = settingsOfType(NEAREST);
+  resample.tiledInput = true;
+  // the tiled layout of a strip of faces of 20000 texels has more than 2^31 texels.
+  ASSERT_GT(tiledTexelCount(6 * 20000, 20000), kMaxTiledTexelCount);
+  EXPECT_THROW(cache.Get(resample, 20000, 4, threadPool), std::invalid_argument);
+}
+
+}  // namespace
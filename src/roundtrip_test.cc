@@ -0,0 +1,120 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "cubemaputil.h"
+#include "octmap.h"
+#include "resampler.h"
+#include "resamplingmatrix.h"
+#include "threadpool.h"
+
+namespace {
+
+const int kNumChannels = 3;
+
+// Smooth content, a different mix of low frequencies in every channel.
+float smoothRadiance(const Imath::V3f& d, int channel) {
+  switch (channel) {
+    case 0: return 1.0f + 0.5f * d.x - 0.3f * d.y + 0.2f * d.z;
+    case 1: return 1.0f + 0.8f * d.z * d.z;
+    default: return 2.0f + std::sin(2.0f * d.x) * std::cos(d.y);
+  }
+}
+
+// A cubemap strip of faceSize whose texels hold smoothRadiance at their center.
+std::vector<float> smoothCubeMap(int faceSize) {
+  std::vector<float> pixels(size_t(6) * faceSize * faceSize * kNumChannels);
+  for (int face = 0; face < 6; face++) {
+    for (int y = 0; y < faceSize; y++) {
+      for (int x = 0; x < faceSize; x++) {
+        const Imath::V3f d =
+            cubeFaceDecode(face, ((x + 0.5f) / faceSize) * 2.0f - 1.0f, 1.0f - ((y + 0.5f) / faceSize) * 2.0f);
+        for (int c = 0; c < kNumChannels; c++)
+          pixels[(size_t(y) * 6 * faceSize + face * faceSize + x) * kNumChannels + c] = smoothRadiance(d, c);
+      }
+    }
+  }
+  return pixels;
+}
+
+ImageBuffer floatBuffer(std::vector<float>* pixels, int width, int height) {
+  ImageBuffer buffer;
+  buffer.data = pixels->data();
+  buffer.width = width;
+  buffer.height = height;
+  buffer.numChannels = kNumChannels;
+  return buffer;
+}
+
+// Converts the cubemap strip of faceSize to an octmap of octMapSize and back with type,
+// and returns the largest error of a channel relative to its range in the cubemap.
+float roundTripError(ResampleType type, int faceSize, int octMapSize) {
+  ThreadPool threadPool(4);
+  ResamplingMatrixCache cache;
+  OctMapConverter converter(threadPool, cache);
+  std::vector<float> cubemap = smoothCubeMap(faceSize);
+  std::vector<float> octmap(size_t(octMapSize) * octMapSize * kNumChannels);
+  std::vector<float> back(cubemap.size());
+  ConversionSettings settings;
+  settings.resample.type = type;
+  converter.Convert(floatBuffer(&cubemap, 6 * faceSize, faceSize), floatBuffer(&octmap, octMapSize, octMapSize),
+                    settings);
+  settings.resample.direction = OCTMAP_TO_CUBEMAP;
+  converter.Convert(floatBuffer(&octmap, octMapSize, octMapSize), floatBuffer(&back, 6 * faceSize, faceSize),
+                    settings);
+
+  float largest = 0.0f;
+  for (int c = 0; c < kNumChannels; c++) {
+    float low = cubemap[c], high = cubemap[c], error = 0.0f;
+    for (size_t i = c; i < cubemap.size(); i += kNumChannels) {
+      low = std::min(low, cubemap[i]);
+      high = std::max(high, cubemap[i]);
+      error = std::max(error, std::abs(back[i] - cubemap[i]));
+    }
+    largest = std::max(largest, error / (high - low));
+  }
+  return largest;
+}
+
+struct RoundTripCase {
+  ResampleType type;
+  int faceSize;
+  int octMapSize;
+  // the bound the README states for the case.
+  float maxError;
+};
+
+class RoundTripTest : public ::testing::TestWithParam<RoundTripCase> {};
+
+TEST_P(RoundTripTest, StaysWithinDocumentedBound) {
+  const RoundTripCase& c = GetParam();
+  EXPECT_LE(roundTripError(c.type, c.faceSize, c.octMapSize), c.maxError)
+      << resampleTypeName(c.type) << ", faces of " << c.faceSize << ", octmap of " << c.octMapSize;
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    DocumentedBounds, RoundTripTest,
+    ::testing::Values(RoundTripCase{ BILINEAR, 32, 32, 0.017f }, RoundTripCase{ BILINEAR, 128, 128, 0.0041f },
+                      RoundTripCase{ BILINEAR, 32, 64, 0.0052f }, RoundTripCase{ BILINEAR, 128, 256, 0.0013f },
+                      RoundTripCase{ GAUSSIAN, 32, 32, 0.053f }, RoundTripCase{ GAUSSIAN, 128, 128, 0.016f },
+                      RoundTripCase{ GAUSSIAN, 32, 64, 0.012f }, RoundTripCase{ GAUSSIAN, 128, 256, 0.0032f },
+                      RoundTripCase{ MITCHELL, 32, 32, 0.095f }, RoundTripCase{ MITCHELL, 128, 128, 0.024f },
+                      RoundTripCase{ MITCHELL, 32, 64, 0.026f }, RoundTripCase{ MITCHELL, 128, 256, 0.0074f }));
+
+TEST(RoundTripErrorTest, ShrinksWithSize) {
+  for (ResampleType type : { BILINEAR, GAUSSIAN, MITCHELL }) {
+    const float small = roundTripError(type, 32, 32);
+    const float large = roundTripError(type, 128, 128);
+    // about with the texel size, for both the bilinear lookups and the blur.
+    EXPECT_LT(large * 3.0f, small) << resampleTypeName(type);
+    EXPECT_LT(roundTripError(type, 32, 64), small) << resampleTypeName(type);
+  }
+}
+
+}  // namespace
@@ -0,0 +1,163 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef RUN_REPORT_H
+#define RUN_REPORT_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "json.h"
+
+// Timings and counters of one file of a batch. Every stage fills in its own fields.
+struct FileReport {
+    std::string input;
+    std::vector<std::string> outputs;
+
+    double readSeconds = 0.0;
+    // building or loading the resampling tables.
+    double mappingSeconds = 0.0;
+    // the conversion kernels, including the color transform and encoding when they run
+    // fused with the resampling.
+    double resampleSeconds = 0.0;
+    // color transform and encoding passes that run separately, when several outputs
+    // share one resampling.
+    double postProcessSeconds = 0.0;
+    double mipsSeconds = 0.0;
+    double writeSeconds = 0.0;
+
+    uint64_t pixelsProduced = 0;
+    uint64_t filterTaps = 0;
+    // the output pixels of adaptive resampling that took the full filter kernel and
+    // those that were resampled bilinearly.
+    uint64_t fullKernelPixels = 0;
+    uint64_t bilinearPixels = 0;
+    uint64_t bytesRead = 0;
+    uint64_t bytesWritten = 0;
+};
+
+// Adds the time between construction and destruction to *seconds.
+class ScopedTimer {
+ public:
+  explicit ScopedTimer(double* seconds) : seconds_(seconds), start_(std::chrono::steady_clock::now()) {}
+
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+  ~ScopedTimer() {
+    *seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+ private:
+  double* seconds_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Returns the peak resident memory of the process in bytes, or 0 if it is not known.
+inline uint64_t peakResidentBytes() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Returns the stage times of report as one line for the log.
+inline std::string describeTimings(const FileReport& report) {
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "read %.3fs, mapping %.3fs, resample %.3fs, post process %.3fs, mips %.3fs, write %.3fs",
+                  report.readSeconds, report.mappingSeconds, report.resampleSeconds,
+                  report.postProcessSeconds, report.mipsSeconds, report.writeSeconds);
+    return line;
+}
+
+namespace run_report_internal {
+
+inline void writeFields(std::ostream& out, const FileReport& report, const char* indent) {
+    out << indent << "\"read_seconds\": " << report.readSeconds << ",\n";
+    out << indent << "\"mapping_seconds\": " << report.mappingSeconds << ",\n";
+    out << indent << "\"resample_seconds\": " << report.resampleSeconds << ",\n";
+    out << indent << "\"post_process_seconds\": " << report.postProcessSeconds << ",\n";
+    out << indent << "\"mips_seconds\": " << report.mipsSeconds << ",\n";
+    out << indent << "\"write_seconds\": " << report.writeSeconds << ",\n";
+    out << indent << "\"pixels_produced\": " << report.pixelsProduced << ",\n";
+    out << indent << "\"filter_taps\": " << report.filterTaps << ",\n";
+    out << indent << "\"full_kernel_pixels\": " << report.fullKernelPixels << ",\n";
+    out << indent << "\"bilinear_pixels\": " << report.bilinearPixels << ",\n";
+    out << indent << "\"bytes_read\": " << report.bytesRead << ",\n";
+    out << indent << "\"bytes_written\": " << report.bytesWritten;
+}
+
+}  // namespace run_report_internal
+
+// Writes the reports of all files of a run and their sums as JSON to path.
+// peakEstimatedBytes is the peak of the memory estimates admitted by the batch.
+inline bool writeRunReport(const std::string& path,
+                           const std::vector<FileReport>& reports,
+                           double wallSeconds,
+                           uint64_t peakEstimatedBytes,
+                           std::string* error) {
+    FileReport total;
+    for (const FileReport& report : reports) {
+        total.readSeconds += report.readSeconds;
+        total.mappingSeconds += report.mappingSeconds;
+        total.resampleSeconds += report.resampleSeconds;
+        total.postProcessSeconds += report.postProcessSeconds;
+        total.mipsSeconds += report.mipsSeconds;
+        total.writeSeconds += report.writeSeconds;
+        total.pixelsProduced += report.pixelsProduced;
+        total.filterTaps += report.filterTaps;
+        total.fullKernelPixels += report.fullKernelPixels;
+        total.bilinearPixels += report.bilinearPixels;
+        total.bytesRead += report.bytesRead;
+        total.bytesWritten += report.bytesWritten;
+    }
+
+    std::ofstream out(path, std::ios::trunc);
+    out << "{\n";
+    out << "  \"wall_seconds\": " << wallSeconds << ",\n";
+    out << "  \"peak_resident_bytes\": " << peakResidentBytes() << ",\n";
+    out << "  \"peak_estimated_bytes\": " << peakEstimatedBytes << ",\n";
+    out << "  \"num_files\": " << reports.size() << ",\n";
+    out << "  \"total\": {\n";
+    run_report_internal::writeFields(out, total, "    ");
+    out << "\n  },\n";
+    out << "  \"files\": [\n";
+    for (size_t i = 0; i < reports.size(); i++) {
+        const FileReport& report = reports[i];
+        out << "    {\n";
+        out << "      \"input\": " << jsonQuote(report.input) << ",\n";
+        out << "      \"outputs\": [";
+        for (size_t k = 0; k < report.outputs.size(); k++)
+            out << (k > 0 ? ", " : "") << jsonQuote(report.outputs[k]);
+        out << "],\n";
+        run_report_internal::writeFields(out, report, "      ");
+        out << "\n    }" << (i + 1 < reports.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+    if (!out) {
+        *error = "could not write " + path;
+        return false;
+    }
+    return true;
+}
+
+#endif  // RUN_REPORT_H
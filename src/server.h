@@ -0,0 +1,305 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// keeps writes to a connection the peer already closed from raising SIGPIPE.
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+#endif
+
+// Serves jobs sent as line-delimited requests, over a stream such as stdin or over a
+// Unix domain socket. Every request line is passed to the handler on its own thread,
+// with at most maxJobs handlers running at the same time across all connections. The
+// handler returns the response, which is written as one line as soon as the job is
+// done, so responses come in completion order and clients match them by an id they put
+// into the request.
+class JobServer {
+ public:
+  typedef std::function<std::string(const std::string& request)> Handler;
+
+  JobServer(Handler handler, int maxJobs)
+      : handler_(std::move(handler)), maxJobs_(std::max(1, maxJobs)), runningJobs_(0) {}
+
+  JobServer(const JobServer&) = delete;
+  JobServer& operator=(const JobServer&) = delete;
+
+  // Serves the requests read from in until its end, writing the responses to out.
+  // Returns once all jobs of the stream are done.
+  void ServeStream(std::istream& in, std::ostream& out) {
+    auto connection = std::make_shared<Connection>();
+    std::string line;
+    while (std::getline(in, line)) {
+      Submit(connection, line, [&out](const std::string& response) {
+        out << response << "\n";
+        out.flush();
+      });
+    }
+    connection->WaitForJobs();
+  }
+
+  // Listens on a Unix domain socket at path and serves every connection like a stream.
+  // Only returns if the socket can not be set up.
+  bool ServeSocket(const std::string& path, std::string* error) {
+#ifdef _WIN32
+    *error = "unix domain sockets are not supported on this platform";
+    return false;
+#else
+    sockaddr_un address = {};
+    if (path.size() >= sizeof(address.sun_path)) {
+      *error = "socket path too long: " + path;
+      return false;
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+      *error = "could not create socket";
+      return false;
+    }
+    address.sun_family = AF_UNIX;
+    path.copy(address.sun_path, path.size());
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 16) != 0) {
+      close(listenFd);
+      *error = "could not listen on " + path;
+      return false;
+    }
+    while (true) {
+      int fd = accept(listenFd, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      std::thread([this, fd] { ServeConnection(fd); }).detach();
+    }
+#endif
+  }
+
+ private:
+  // Tracks the jobs of one stream or connection, so that it is only closed once all
+  // of its responses are written.
+  struct Connection {
+    std::mutex mutex;
+    std::condition_variable done;
+    int pendingJobs = 0;
+
+    void WaitForJobs() {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return pendingJobs == 0; });
+    }
+  };
+
+  void Submit(std::shared_ptr<Connection> connection, const std::string& request,
+              std::function<void(const std::string&)> respond) {
+    if (request.find_first_not_of(" \t\r") == std::string::npos) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(slotMutex_);
+      slotFree_.wait(lock, [this] { return runningJobs_ < maxJobs_; });
+      runningJobs_++;
+    }
+    {
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      connection->pendingJobs++;
+    }
+    std::thread([this, connection, request, respond] {
+      const std::string response = handler_(request);
+      {
+        std::lock_guard<std::mutex> lock(slotMutex_);
+        runningJobs_--;
+      }
+      slotFree_.notify_one();
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      respond(response);
+      connection->pendingJobs--;
+      connection->done.notify_all();
+    }).detach();
+  }
+
+#ifndef _WIN32
+  void ServeConnection(int fd) {
+    auto connection = std::make_shared<Connection>();
+    // responses are written under the connection mutex, see Submit.
+    auto respond = [fd](const std::string& response) {
+      const std::string line = response + "\n";
+      size_t written = 0;
+      while (written < line.size()) {
+        ssize_t n = send(fd, line.data() + written, line.size() - written, kSendFlags);
+        if (n <= 0) {
+          return;
+        }
+        written += size_t(n);
+      }
+    };
+    std::string buffer;
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+      buffer.append(chunk, size_t(n));
+      size_t newline;
+      while ((newline = buffer.find('\n')) != std::string::npos) {
+        Submit(connection, buffer.substr(0, newline), respond);
+        buffer.erase(0, newline + 1);
+      }
+    }
+    Submit(connection, buffer, respond);
+    connection->WaitForJobs();
+    close(fd);
+  }
+#endif
+
+  Handler handler_;
+  const int maxJobs_;
+  int runningJobs_;
+  std::mutex slotMutex_;
+  std::condition_variable slotFree_;
+};
+
+// Runs a job with the command-line arguments args, writing its log to log, and returns
+// its exit code. Jobs that can not run set error instead, exceptions count as failures.
+typedef std::function<int(const std::vector<std::string>& args, std::ostream& log, std::string* error)> JobRunner;
+
+// Returns the id of a job request as JSON text, so that it can be echoed in the response.
+inline std::string jobIdText(const JsonValue* id) {
+  if (id && id->type == JsonValue::JSON_STRING)
+    return jsonQuote(id->string);
+  if (id && id->type == JsonValue::JSON_NUMBER) {
+    std::ostringstream text;
+    text.precision(17);
+    text << id->number;
+    return text.str();
+  }
+  return "null";
+}
+
+// Answers one request of the job protocol of the server mode. A request is a JSON object
+// with the command-line arguments of the job in "args" and an optional "id", which is
+// echoed in the response, e.g. {"id": 7, "args": ["-i", "in_#.exr", "-o", "out_#.exr"]}.
+// The response is a JSON object with the id, the status, the exit code, the duration and
+// the log of the job, and the error if the request was malformed or the job could not
+// run.
+inline std::string answerJobRequest(const std::string& request, const JobRunner& run) {
+  const auto startTime = std::chrono::steady_clock::now();
+  JsonValue job;
+  std::string id = "null";
+  std::string error;
+  std::ostringstream log;
+  int exitCode = 1;
+  if (!parseJson(request, &job) || job.type != JsonValue::JSON_OBJECT) {
+    error = "request is not a JSON object";
+  } else {
+    id = jobIdText(job.find("id"));
+    const JsonValue* argsValue = job.find("args");
+    std::vector<std::string> args;
+    if (!argsValue || argsValue->type != JsonValue::JSON_ARRAY) {
+      error = "request has no args array";
+    } else {
+      for (const JsonValue& arg : argsValue->array) {
+        if (arg.type != JsonValue::JSON_STRING) {
+          error = "args must be strings";
+          break;
+        }
+        args.push_back(arg.string);
+      }
+    }
+    if (error.empty()) {
+      try {
+        exitCode = run(args, log, &error);
+      } catch (const std::exception& e) {
+        log << "error: " << e.what() << "\n";
+        exitCode = 1;
+      }
+      if (!error.empty())
+        exitCode = 1;
+    }
+  }
+
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  std::ostringstream response;
+  response << "{\"id\":" << id
+           << ",\"status\":" << (exitCode == 0 ? "\"ok\"" : "\"error\"")
+           << ",\"exit_code\":" << exitCode
+           << ",\"seconds\":" << seconds;
+  if (!error.empty())
+    response << ",\"error\":" << jsonQuote(error);
+  response << ",\"log\":" << jsonQuote(log.str()) << "}";
+  return response.str();
+}
+
+// A minimal client for the socket server, e.g. for tests: sends the request lines read
+// from in to the server listening at path and writes the response lines to out. Returns
+// false if the server can not be reached.
+inline bool runJobClient(const std::string& path, std::istream& in, std::ostream& out, std::string* error) {
+#ifdef _WIN32
+  *error = "unix domain sockets are not supported on this platform";
+  return false;
+#else
+  sockaddr_un address = {};
+  if (path.size() >= sizeof(address.sun_path)) {
+    *error = "socket path too long: " + path;
+    return false;
+  }
+  address.sun_family = AF_UNIX;
+  path.copy(address.sun_path, path.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    *error = "could not connect to " + path;
+    return false;
+  }
+  std::thread sender([fd, &in] {
+    std::string line;
+    while (std::getline(in, line)) {
+      line += "\n";
+      size_t written = 0;
+      while (written < line.size()) {
+        ssize_t n = send(fd, line.data() + written, line.size() - written, kSendFlags);
+        if (n <= 0) {
+          break;
+        }
+        written += size_t(n);
+      }
+    }
+    // the server answers all pending jobs and then closes the connection.
+    shutdown(fd, SHUT_WR);
+  });
+  char chunk[4096];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+    out.write(chunk, n);
+  }
+  out.flush();
+  sender.join();
+  close(fd);
+  return true;
+#endif
+}
+
+#endif  // SERVER_H
@@ -0,0 +1,191 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "json.h"
+#include "server.h"
+
+namespace {
+
+TEST(JobServerTest, AnswersEveryRequestLine) {
+  JobServer server([](const std::string& request) { return "done " + request; }, 2);
+  std::istringstream in("a\n\nb\n  \nc\n");
+  std::ostringstream out;
+  server.ServeStream(in, out);
+  std::set<std::string> responses;
+  std::istringstream lines(out.str());
+  std::string line;
+  while (std::getline(lines, line))
+    responses.insert(line);
+  // blank lines are skipped, the responses come in completion order.
+  EXPECT_EQ(responses, std::set<std::string>({ "done a", "done b", "done c" }));
+}
+
+// Runs jobs whose first argument says what they do, and counts how many run at once.
+struct FakeJobs {
+  std::atomic<int> runs{0};
+  std::atomic<int> running{0};
+  std::atomic<int> mostRunning{0};
+
+  int Run(const std::vector<std::string>& args, std::ostream& log, std::string* error) {
+    runs++;
+    const int nowRunning = ++running;
+    int most = mostRunning;
+    while (nowRunning > most && !mostRunning.compare_exchange_weak(most, nowRunning)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    --running;
+    if (args.empty() || args[0] == "reject") {
+      *error = "rejected";
+      return 1;
+    }
+    if (args[0] == "throw")
+      throw std::runtime_error("thrown");
+    for (const std::string& arg : args)
+      log << arg << "\n";
+    return args[0] == "fail" ? 2 : 0;
+  }
+};
+
+// Parses the response lines of out and returns them by the text of their ids.
+std::map<std::string, JsonValue> responsesById(const std::string& out) {
+  std::map<std::string, JsonValue> responses;
+  std::istringstream lines(out);
+  std::string line;
+  while (std::getline(lines, line)) {
+    JsonValue response;
+    EXPECT_TRUE(parseJson(line, &response)) << line;
+    responses[jobIdText(response.find("id"))] = response;
+  }
+  return responses;
+}
+
+TEST(JobServerTest, AnswersJobRequests) {
+  FakeJobs jobs;
+  auto run = [&](const std::vector<std::string>& args, std::ostream& log, std::string* error) {
+    return jobs.Run(args, log, error);
+  };
+  JsonValue response;
+  ASSERT_TRUE(parseJson(answerJobRequest("{\"id\": 7, \"args\": [\"a\", \"b\"]}", run), &response));
+  EXPECT_EQ(response.find("id")->number, 7.0);
+  EXPECT_EQ(response.find("status")->string, "ok");
+  EXPECT_EQ(response.find("exit_code")->number, 0.0);
+  EXPECT_EQ(response.find("seconds")->type, JsonValue::JSON_NUMBER);
+  EXPECT_EQ(response.find("log")->string, "a\nb\n");
+  EXPECT_EQ(response.find("error"), nullptr);
+
+  ASSERT_TRUE(parseJson(answerJobRequest("{\"id\": \"x\", \"args\": [\"fail\"]}", run), &response));
+  EXPECT_EQ(response.find("id")->string, "x");
+  EXPECT_EQ(response.find("status")->string, "error");
+  EXPECT_EQ(response.find("exit_code")->number, 2.0);
+
+  ASSERT_TRUE(parseJson(answerJobRequest("{\"args\": [\"throw\"]}", run), &response));
+  EXPECT_EQ(response.find("id")->type, JsonValue::JSON_NULL);
+  EXPECT_EQ(response.find("status")->string, "error");
+  EXPECT_EQ(response.find("log")->string, "error: thrown\n");
+
+  ASSERT_TRUE(parseJson(answerJobRequest("{\"id\": 1, \"args\": [\"reject\"]}", run), &response));
+  EXPECT_EQ(response.find("error")->string, "rejected");
+  EXPECT_EQ(response.find("exit_code")->number, 1.0);
+
+  // malformed requests are answered without running anything.
+  const int numRuns = jobs.runs;
+  const std::map<std::string, std::string> malformed = {
+    { "{\"id\": 2, \"args\": [1]}", "args must be strings" },
+    { "{\"id\": 2}", "request has no args array" },
+    { "[\"-i\", \"in.exr\"]", "request is not a JSON object" },
+    { "{\"id\": 2, \"args\": [", "request is not a JSON object" },
+  };
+  for (const auto& request : malformed) {
+    ASSERT_TRUE(parseJson(answerJobRequest(request.first, run), &response)) << request.first;
+    EXPECT_EQ(response.find("status")->string, "error") << request.first;
+    EXPECT_EQ(response.find("exit_code")->number, 1.0) << request.first;
+    EXPECT_EQ(response.find("error")->string, request.second) << request.first;
+  }
+  EXPECT_EQ(jobs.runs, numRuns);
+}
+
+#ifndef _WIN32
+// Returns a path for a socket of this test process. Socket paths are short, so deep
+// temporary directories, as test runners set up, fall back to /tmp.
+std::string socketPath(const std::string& name) {
+  const std::string file = "server_test_" + name + "_" + std::to_string(getpid()) + ".sock";
+  const std::string path = (std::filesystem::temp_directory_path() / file).string();
+  return path.size() < sizeof(sockaddr_un().sun_path) ? path : "/tmp/" + file;
+}
+
+TEST(JobServerTest, ServesJobsOverSocket) {
+  const std::string path = socketPath("jobs");
+  const int kMaxJobs = 2;
+  // ServeSocket does not return, so the server keeps listening until the test exits.
+  auto* jobs = new FakeJobs();
+  auto* server = new JobServer([jobs](const std::string& request) {
+    return answerJobRequest(request, [jobs](const std::vector<std::string>& args, std::ostream& log,
+                                            std::string* error) { return jobs->Run(args, log, error); });
+  }, kMaxJobs);
+  std::thread([server, path] {
+    std::string error;
+    server->ServeSocket(path, &error);
+  }).detach();
+
+  std::string requests;
+  for (int i = 0; i < 6; i++)
+    requests += "{\"id\": " + std::to_string(i) + ", \"args\": [\"job\", \"" + std::to_string(i) + "\"]}\n";
+  requests += "\n";
+  requests += "not json\n";
+  std::string out;
+  std::string error;
+  // the server may not be listening yet.
+  bool connected = false;
+  for (int attempt = 0; attempt < 200 && !connected; attempt++) {
+    std::istringstream in(requests);
+    std::ostringstream responses;
+    connected = runJobClient(path, in, responses, &error);
+    if (connected)
+      out = responses.str();
+    else
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(connected) << error;
+
+  const std::map<std::string, JsonValue> responses = responsesById(out);
+  // the blank line is skipped, the malformed one answered with a null id.
+  ASSERT_EQ(responses.size(), 7u) << out;
+  for (int i = 0; i < 6; i++) {
+    const JsonValue& response = responses.at(std::to_string(i));
+    EXPECT_EQ(response.find("status")->string, "ok");
+    EXPECT_EQ(response.find("log")->string, "job\n" + std::to_string(i) + "\n");
+  }
+  EXPECT_EQ(responses.at("null").find("error")->string, "request is not a JSON object");
+  EXPECT_LE(jobs->mostRunning, kMaxJobs);
+  EXPECT_GE(jobs->mostRunning, 1);
+
+  std::error_code removeError;
+  std::filesystem::remove(path, removeError);
+}
+
+TEST(JobServerTest, ClientReportsMissingServer) {
+  std::istringstream in("{\"args\": []}\n");
+  std::ostringstream out;
+  std::string error;
+  const std::string path = socketPath("nobody_listens");
+  std::error_code removeError;
+  std::filesystem::remove(path, removeError);
+  EXPECT_FALSE(runJobClient(path, in, out, &error));
+  EXPECT_EQ(error, "could not connect to " + path);
+}
+#endif
+
+}  // namespace
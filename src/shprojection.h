@@ -0,0 +1,154 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef SH_PROJECTION_H
+#define SH_PROJECTION_H
+
+#include <algorithm>
+#include <vector>
+
+#include "IlmBase/Half/half.h"
+
+#include "batchkernels.h"
+#include "octmaputil.h"
+#include "resampler.h"
+
+// Projection of octmaps onto real spherical harmonics, e.g. for diffuse lighting. The
+// order is the number of bands, order 3 gives the 9 coefficients of bands 0 to 2 that
+// are usually taken for irradiance. Coefficient k = l * (l + 1) + m is the integral of
+// the map times the orthonormal basis function Y_l^m over the sphere, taken as the sum
+// over the texels of their value times the basis function at their center times their
+// solid angle.
+
+const int kMaxSHOrder = 5;
+
+// Evaluates the order * order basis functions at the unit direction (x, y, z) into
+// basis. The constants include the Condon-Shortley phase.
+inline void evaluateSHBasis(int order, float x, float y, float z, float* basis) {
+    basis[0] = 0.282094792f;
+    if (order < 2)
+        return;
+    basis[1] = -0.488602512f * y;
+    basis[2] = 0.488602512f * z;
+    basis[3] = -0.488602512f * x;
+    if (order < 3)
+        return;
+    const float x2 = x * x, y2 = y * y, z2 = z * z;
+    basis[4] = 1.092548431f * x * y;
+    basis[5] = -1.092548431f * y * z;
+    basis[6] = 0.315391565f * (3.0f * z2 - 1.0f);
+    basis[7] = -1.092548431f * x * z;
+    basis[8] = 0.546274215f * (x2 - y2);
+    if (order < 4)
+        return;
+    basis[9] = -0.590043590f * y * (3.0f * x2 - y2);
+    basis[10] = 2.890611443f * x * y * z;
+    basis[11] = -0.457045799f * y * (5.0f * z2 - 1.0f);
+    basis[12] = 0.373176333f * z * (5.0f * z2 - 3.0f);
+    basis[13] = -0.457045799f * x * (5.0f * z2 - 1.0f);
+    basis[14] = 1.445305721f * z * (x2 - y2);
+    basis[15] = -0.590043590f * x * (x2 - 3.0f * y2);
+    if (order < 5)
+        return;
+    basis[16] = 2.503342942f * x * y * (x2 - y2);
+    basis[17] = -1.770130770f * y * z * (3.0f * x2 - y2);
+    basis[18] = 0.946174696f * x * y * (7.0f * z2 - 1.0f);
+    basis[19] = -0.669046544f * y * z * (7.0f * z2 - 3.0f);
+    basis[20] = 0.105785547f * (35.0f * z2 * z2 - 30.0f * z2 + 3.0f);
+    basis[21] = -0.669046544f * x * z * (7.0f * z2 - 3.0f);
+    basis[22] = 0.473087348f * (x2 - y2) * (7.0f * z2 - 1.0f);
+    basis[23] = -1.770130770f * x * z * (x2 - 3.0f * y2);
+    basis[24] = 0.625835735f * (x2 * (x2 - 3.0f * y2) - y2 * (3.0f * x2 - y2));
+}
+
+// The SH coefficients of an image with numChannels channels. Coefficient k of channel c
+// is at values[k * numChannels + c].
+struct SHCoefficients {
+    int order = 0;
+    int numChannels = 0;
+    std::vector<double> values;
+
+    // Returns the coefficients of the lower order, which are the first ones of these.
+    SHCoefficients truncated(int lowerOrder) const {
+        SHCoefficients result;
+        result.order = lowerOrder;
+        result.numChannels = numChannels;
+        result.values.assign(values.begin(), values.begin() + size_t(lowerOrder) * lowerOrder * numChannels);
+        return result;
+    }
+};
+
+// Accumulates the SH projection of a size x size octmap while its rows are produced,
+// so that the projection needs no pass of its own. The rows are added band by band, from
+// any thread. Every band of rowsPerBand rows has its own sums, which are only added up in
+// Result, so bands never contend and the result does not depend on which threads added
+// which bands.
+class SHAccumulator {
+ public:
+  SHAccumulator(int order, int size, int numChannels, int rowsPerBand)
+      : order_(order), size_(size), numChannels_(numChannels), rowsPerBand_(rowsPerBand),
+        numValues_(size_t(order) * order * numChannels),
+        sums_(size_t((size + rowsPerBand - 1) / rowsPerBand) * numValues_, 0.0) {}
+
+  int order() const { return order_; }
+  int size() const { return size_; }
+  int numChannels() const { return numChannels_; }
+
+  // Adds the rows [yBegin, yEnd) of the octmap, packed with numChannels interleaved
+  // channels, where pixels points to row yBegin. yBegin has to be the first row of a band,
+  // as it is for the chunks of a ParallelFor over the rows with rowsPerBand as grain
+  // size.
+  template <class T>
+  void AddRows(const T* pixels, int yBegin, int yEnd) {
+    const int numCoefficients = order_ * order_;
+    std::vector<float> u(size_), v(size_), x(size_), y(size_), z(size_);
+    std::vector<float> basis(numCoefficients);
+    std::vector<float> weighted(numCoefficients);
+    for (int row = yBegin; row < yEnd; row++) {
+      for (int column = 0; column < size_; column++) {
+        const Imath::V2f center = octMapPixelCenter(column, row, size_);
+        u[column] = center.x;
+        v[column] = center.y;
+      }
+      batchKernels().octDecode(u.data(), v.data(), x.data(), y.data(), z.data(), size_);
+      double* sums = sums_.data() + size_t(row / rowsPerBand_) * numValues_;
+      const T* rowPixels = pixels + size_t(row - yBegin) * size_ * numChannels_;
+      for (int column = 0; column < size_; column++) {
+        evaluateSHBasis(order_, x[column], y[column], z[column], basis.data());
+        const float solidAngle = octMapTexelSolidAngle(column, row, size_);
+        for (int k = 0; k < numCoefficients; k++)
+          weighted[k] = basis[k] * solidAngle;
+        const T* pixel = rowPixels + size_t(column) * numChannels_;
+        for (int c = 0; c < numChannels_; c++) {
+          const float value = float(pixel[c]);
+          for (int k = 0; k < numCoefficients; k++)
+            sums[k * numChannels_ + c] += double(weighted[k] * value);
+        }
+      }
+    }
+  }
+
+  // Returns the projection of all rows added so far.
+  SHCoefficients Result() const {
+    SHCoefficients result;
+    result.order = order_;
+    result.numChannels = numChannels_;
+    result.values.assign(numValues_, 0.0);
+    for (size_t offset = 0; offset < sums_.size(); offset += numValues_) {
+      for (size_t i = 0; i < numValues_; i++)
+        result.values[i] += sums_[offset + i];
+    }
+    return result;
+  }
+
+ private:
+  int order_;
+  int size_;
+  int numChannels_;
+  int rowsPerBand_;
+  size_t numValues_;
+  std::vector<double> sums_;
+};
+
+#endif  // SH_PROJECTION_H
@@ -0,0 +1,160 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "octmaputil.h"
+#include "resampler.h"
+#include "shprojection.h"
+
+namespace {
+
+const int kOctMapSize = 128;
+const double kPi = 3.14159265358979323846;
+
+typedef std::function<float(float x, float y, float z)> SphereFunction;
+
+// The basis function k of the highest order as a map.
+SphereFunction basisFunction(int k) {
+  return [k](float x, float y, float z) {
+    float basis[kMaxSHOrder * kMaxSHOrder];
+    evaluateSHBasis(kMaxSHOrder, x, y, z, basis);
+    return basis[k];
+  };
+}
+
+// A lobe around a direction off the axes, not band limited, with a kink at its rim.
+float clampedCosine(float x, float y, float z) {
+  return std::max(0.0f, 0.36f * x - 0.48f * y + 0.8f * z);
+}
+
+// Samples the functions at the pixel centers of a kOctMapSize octmap, one per channel.
+std::vector<float> octMapOf(const std::vector<SphereFunction>& channels) {
+  const int numChannels = int(channels.size());
+  std::vector<float> pixels(size_t(kOctMapSize) * kOctMapSize * numChannels);
+  for (int y = 0; y < kOctMapSize; y++) {
+    for (int x = 0; x < kOctMapSize; x++) {
+      const Imath::V3f d = octDecode(octMapPixelCenter(x, y, kOctMapSize));
+      for (int c = 0; c < numChannels; c++)
+        pixels[(size_t(y) * kOctMapSize + x) * numChannels + c] = channels[c](d.x, d.y, d.z);
+    }
+  }
+  return pixels;
+}
+
+// The projections of the functions onto the basis functions of order, by the midpoint
+// rule on a dense grid over polar and azimuth angle, independent of the octahedral
+// mapping. Coefficient k of function i is at [i][k].
+std::vector<std::vector<double>> quadratureProjections(const std::vector<SphereFunction>& functions, int order) {
+  const int numTheta = 512;
+  const int numPhi = 1024;
+  const int numCoefficients = order * order;
+  std::vector<std::vector<double>> result(functions.size(), std::vector<double>(numCoefficients, 0.0));
+  std::vector<float> basis(numCoefficients);
+  for (int i = 0; i < numTheta; i++) {
+    const double theta = (i + 0.5) * kPi / numTheta;
+    const double weight = std::sin(theta) * (kPi / numTheta) * (2.0 * kPi / numPhi);
+    for (int j = 0; j < numPhi; j++) {
+      const double phi = (j + 0.5) * 2.0 * kPi / numPhi;
+      const float x = float(std::sin(theta) * std::cos(phi));
+      const float y = float(std::sin(theta) * std::sin(phi));
+      const float z = float(std::cos(theta));
+      evaluateSHBasis(order, x, y, z, basis.data());
+      for (size_t f = 0; f < functions.size(); f++) {
+        const double value = functions[f](x, y, z);
+        for (int k = 0; k < numCoefficients; k++)
+          result[f][k] += value * basis[k] * weight;
+      }
+    }
+  }
+  return result;
+}
+
+// Projects pixels with rowsPerBand, adding the bands last to first.
+SHCoefficients accumulate(const std::vector<float>& pixels, int order, int numChannels, int rowsPerBand) {
+  SHAccumulator accumulator(order, kOctMapSize, numChannels, rowsPerBand);
+  const int numBands = (kOctMapSize + rowsPerBand - 1) / rowsPerBand;
+  for (int band = numBands - 1; band >= 0; band--) {
+    const int yBegin = band * rowsPerBand;
+    accumulator.AddRows(pixels.data() + size_t(yBegin) * kOctMapSize * numChannels, yBegin,
+                        std::min(kOctMapSize, yBegin + rowsPerBand));
+  }
+  return accumulator.Result();
+}
+
+const int kRowsPerBand[] = { 1, 5, 32, kOctMapSize };
+
+// Taking every texel at its center is off by up to about 6e-4 times the magnitude of the
+// map at kOctMapSize.
+const double kTolerance = 2e-3;
+
+void expectMatchesQuadrature(const SphereFunction& f, const std::vector<double>& reference, const std::string& name) {
+  const std::vector<float> pixels = octMapOf({ f });
+  for (int order = 2; order <= kMaxSHOrder; order++) {
+    for (int rowsPerBand : kRowsPerBand) {
+      const SHCoefficients result = accumulate(pixels, order, 1, rowsPerBand);
+      ASSERT_EQ(result.order, order);
+      ASSERT_EQ(result.values.size(), size_t(order) * order);
+      for (int k = 0; k < order * order; k++) {
+        EXPECT_NEAR(result.values[k], reference[k], kTolerance)
+            << name << ", order " << order << ", " << rowsPerBand << " rows per band, coefficient " << k;
+      }
+    }
+  }
+}
+
+TEST(SHAccumulatorTest, ProjectsConstantMap) {
+  const SphereFunction constant = [](float, float, float) { return 2.0f; };
+  const std::vector<double> reference = quadratureProjections({ constant }, kMaxSHOrder)[0];
+  // only the first coefficient is not zero.
+  EXPECT_NEAR(reference[0], 2.0 * std::sqrt(4.0 * kPi), 1e-4);
+  expectMatchesQuadrature(constant, reference, "constant");
+}
+
+TEST(SHAccumulatorTest, ProjectsBasisFunctions) {
+  std::vector<SphereFunction> basisFunctions;
+  for (int k = 0; k < kMaxSHOrder * kMaxSHOrder; k++)
+    basisFunctions.push_back(basisFunction(k));
+  const std::vector<std::vector<double>> references = quadratureProjections(basisFunctions, kMaxSHOrder);
+  for (int k = 0; k < kMaxSHOrder * kMaxSHOrder; k++) {
+    // the basis is orthonormal, so the reference is 1 at k and 0 elsewhere.
+    for (int j = 0; j < kMaxSHOrder * kMaxSHOrder; j++)
+      EXPECT_NEAR(references[k][j], j == k ? 1.0 : 0.0, 1e-4) << "Y_" << k << " onto Y_" << j;
+    expectMatchesQuadrature(basisFunctions[k], references[k], "Y_" + std::to_string(k));
+  }
+}
+
+TEST(SHAccumulatorTest, ProjectsClampedCosine) {
+  expectMatchesQuadrature(clampedCosine, quadratureProjections({ clampedCosine }, kMaxSHOrder)[0], "clamped cosine");
+}
+
+TEST(SHAccumulatorTest, KeepsChannelsApart) {
+  const std::vector<SphereFunction> channels = { basisFunction(2), [](float, float, float) { return 1.0f; },
+                                                 clampedCosine };
+  const SHCoefficients result = accumulate(octMapOf(channels), kMaxSHOrder, 3, 7);
+  for (int c = 0; c < 3; c++) {
+    const SHCoefficients single = accumulate(octMapOf({ channels[c] }), kMaxSHOrder, 1, 7);
+    for (int k = 0; k < kMaxSHOrder * kMaxSHOrder; k++)
+      EXPECT_EQ(result.values[k * 3 + c], single.values[k]) << "channel " << c << ", coefficient " << k;
+  }
+}
+
+TEST(SHAccumulatorTest, TruncatesToLowerOrders) {
+  const std::vector<float> pixels = octMapOf({ clampedCosine });
+  const SHCoefficients full = accumulate(pixels, kMaxSHOrder, 1, 16);
+  for (int order = 1; order < kMaxSHOrder; order++) {
+    const SHCoefficients truncated = full.truncated(order);
+    const SHCoefficients lower = accumulate(pixels, order, 1, 16);
+    EXPECT_EQ(truncated.order, order);
+    EXPECT_EQ(truncated.values, lower.values) << "order " << order;
+  }
+}
+
+}  // namespace
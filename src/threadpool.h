@@ -0,0 +1,214 @@
+/*
+ * Copyright(c) 2020 Matthias Bühlmann, Mabulous GmbH. http://www.mabulous.com
+*/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+// Every thread owns a task deque. A thread pushes the chunks of its own
+// ParallelFor calls to the back of its deque and pops from the back (LIFO),
+// while idle threads steal from the front of other deques (FIFO). Threads that
+// are not part of the pool share one injection deque.
+// A thread waiting for a ParallelFor to finish keeps executing pending tasks,
+// so ParallelFor can be nested (e.g. files on the outside, row bands on the
+// inside) without deadlocking or leaving cores idle.
+class ThreadPool {
+ public:
+  // Creates a pool that uses numThreads threads in total, including the thread
+  // calling ParallelFor. If numThreads <= 0, the number of hardware threads is
+  // used.
+  explicit ThreadPool(int numThreads = 0) : stop_(false), queuedTasks_(0) {
+    if (numThreads <= 0) {
+      numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    numThreads_ = numThreads;
+    // Queue 0 is the injection queue shared by threads outside the pool.
+    for (int i = 0; i < numThreads_; i++) {
+      queues_.push_back(std::make_unique<TaskQueue>());
+    }
+    for (int i = 1; i < numThreads_; i++) {
+      workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex_);
+      stop_ = true;
+    }
+    wakeCondition_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Returns the total number of threads work is distributed over.
+  int GetNumThreads() const { return numThreads_; }
+
+  // Calls body(chunkBegin, chunkEnd) for consecutive chunks of at most
+  // grainSize elements covering [begin, end) and blocks until all chunks are
+  // done. The first exception thrown by body is rethrown to the caller.
+  void ParallelFor(int begin, int end, int grainSize,
+                   const std::function<void(int, int)>& body) {
+    if (end <= begin) {
+      return;
+    }
+    grainSize = std::max(1, grainSize);
+    if (numThreads_ == 1 || end - begin <= grainSize) {
+      body(begin, end);
+      return;
+    }
+
+    Group group;
+    group.body = &body;
+    int numChunks = (end - begin + grainSize - 1) / grainSize;
+    group.pending = numChunks;
+
+    // The counter is raised before the tasks are published and under the wake
+    // mutex, so sleeping workers cannot miss them.
+    {
+      std::lock_guard<std::mutex> lock(wakeMutex_);
+      queuedTasks_ += numChunks;
+    }
+    TaskQueue& queue = *queues_[CurrentQueueIndex()];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      // Pushed in reverse so that the owner pops the chunks in order.
+      for (int chunk = numChunks - 1; chunk >= 0; chunk--) {
+        int chunkBegin = begin + chunk * grainSize;
+        queue.tasks.push_back(
+            Task{&group, chunkBegin, std::min(end, chunkBegin + grainSize)});
+      }
+    }
+    wakeCondition_.notify_all();
+
+    // Help out until every chunk of this group has been executed.
+    while (group.pending.load() > 0) {
+      Task task;
+      if (TryGetTask(CurrentQueueIndex(), &task)) {
+        RunTask(task);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+
+    if (group.error) {
+      std::rethrow_exception(group.error);
+    }
+  }
+
+ private:
+  // State shared by all chunks of one ParallelFor call.
+  struct Group {
+    const std::function<void(int, int)>* body;
+    std::atomic<int> pending;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+  };
+
+  struct Task {
+    Group* group;
+    int begin;
+    int end;
+  };
+
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // Index of the queue owned by the calling thread, 0 for foreign threads.
+  int CurrentQueueIndex() const {
+    return currentPool_ == this ? currentQueueIndex_ : 0;
+  }
+
+  // Pops from the back of the own queue, otherwise steals from the front of
+  // the other queues.
+  bool TryGetTask(int ownIndex, Task* task) {
+    if (queuedTasks_.load() == 0) {
+      return false;
+    }
+    {
+      TaskQueue& own = *queues_[ownIndex];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        *task = own.tasks.back();
+        own.tasks.pop_back();
+        queuedTasks_--;
+        return true;
+      }
+    }
+    for (int i = 1; i <= numThreads_; i++) {
+      TaskQueue& victim = *queues_[(ownIndex + i) % numThreads_];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        *task = victim.tasks.front();
+        victim.tasks.pop_front();
+        queuedTasks_--;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void RunTask(const Task& task) {
+    Group* group = task.group;
+    try {
+      (*group->body)(task.begin, task.end);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(group->errorMutex);
+      if (!group->error) {
+        group->error = std::current_exception();
+      }
+    }
+    group->pending--;
+  }
+
+  void WorkerLoop(int queueIndex) {
+    currentPool_ = this;
+    currentQueueIndex_ = queueIndex;
+    while (true) {
+      Task task;
+      if (TryGetTask(queueIndex, &task)) {
+        RunTask(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(wakeMutex_);
+      wakeCondition_.wait(lock,
+                          [this] { return stop_ || queuedTasks_.load() > 0; });
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  int numThreads_;
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+  std::vector<std::thread> workers_;
+
+  std::mutex wakeMutex_;
+  std::condition_variable wakeCondition_;
+  bool stop_;
+  std::atomic<int> queuedTasks_;
+
+  // The pool and queue owned by the calling thread, if it is a worker.
+  static inline thread_local ThreadPool* currentPool_ = nullptr;
+  static inline thread_local int currentQueueIndex_ = 0;
+};
+
+#endif  // THREAD_POOL_H